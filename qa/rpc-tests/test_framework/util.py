@@ -203,7 +203,7 @@ def initialize_chain(test_dir):
         for i in range(4):
             os.remove(log_filename("cache", i, "debug.log"))
             os.remove(log_filename("cache", i, "db.log"))
-            os.remove(log_filename("cache", i, "peers.dat"))
+            shutil.rmtree(log_filename("cache", i, "addrman"))
             os.remove(log_filename("cache", i, "fee_estimates.dat"))
 
     for i in range(4):
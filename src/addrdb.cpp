@@ -0,0 +1,133 @@
+// Copyright (c) 2009-2010 Satoshi Nakamoto
+// Copyright (c) 2009-2014 The Bitcoin Core developers
+// Copyright (c) 2017 The Zen Core developers
+// Distributed under the MIT software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#include "addrdb.h"
+
+#include "addrman.h"
+#include "chainparams.h"
+#include "clientversion.h"
+#include "hash.h"
+#include "streams.h"
+#include "util.h"
+
+#include <boost/filesystem.hpp>
+#include <boost/scoped_ptr.hpp>
+#include <boost/thread.hpp>
+
+using namespace std;
+
+static const char DB_ADDR_KEY = 'K';
+static const char DB_ADDR = 'a';
+
+CAddrDB::CAddrDB(size_t nCacheSize, bool fMemory, bool fWipe) : CLevelDBWrapper(GetDataDir() / "addrman", nCacheSize, fMemory, fWipe) {
+}
+
+bool CAddrDB::ReadKey(uint256& nKey) {
+    return Read(DB_ADDR_KEY, nKey);
+}
+
+bool CAddrDB::WriteKey(const uint256& nKey) {
+    return Write(DB_ADDR_KEY, nKey, true);
+}
+
+bool CAddrDB::WriteChanges(const vector<CAddrManEntry>& vChanged, const vector<CNetAddr>& vErased) {
+    CLevelDBBatch batch;
+    for (vector<CNetAddr>::const_iterator it = vErased.begin(); it != vErased.end(); it++)
+        batch.Erase(make_pair(DB_ADDR, *it));
+    for (vector<CAddrManEntry>::const_iterator it = vChanged.begin(); it != vChanged.end(); it++)
+        batch.Write(make_pair(DB_ADDR, CNetAddr(it->info)), *it);
+    return WriteBatch(batch);
+}
+
+bool CAddrDB::Load(CAddrMan& addr, size_t nBatch) {
+    boost::scoped_ptr<leveldb::Iterator> pcursor(NewIterator());
+
+    CDataStream ssKeySet(SER_DISK, CLIENT_VERSION);
+    ssKeySet << DB_ADDR;
+    pcursor->Seek(ssKeySet.str());
+
+    bool fOk = true;
+    vector<CAddrManEntry> vEntries;
+    vEntries.reserve(nBatch);
+    // the address manager is only locked for a batch at a time
+    while (pcursor->Valid()) {
+        boost::this_thread::interruption_point();
+        leveldb::Slice slKey = pcursor->key();
+        if (slKey.size() == 0 || slKey.data()[0] != DB_ADDR)
+            break;
+        try {
+            leveldb::Slice slValue = pcursor->value();
+            CDataStream ssValue(slValue.data(), slValue.data() + slValue.size(), SER_DISK, CLIENT_VERSION);
+            CAddrManEntry entry;
+            ssValue >> entry;
+            vEntries.push_back(entry);
+        } catch (const std::exception& e) {
+            fOk = error("%s: Deserialize or I/O error - %s", __func__, e.what());
+        }
+        if (vEntries.size() >= nBatch) {
+            addr.Load(vEntries);
+            vEntries.clear();
+        }
+        pcursor->Next();
+    }
+    addr.Load(vEntries);
+
+    return fOk;
+}
+
+bool ReadPeersFile(const boost::filesystem::path& pathAddr, CAddrMan& addr)
+{
+    // open input file, and associate with CAutoFile
+    FILE *file = fopen(pathAddr.string().c_str(), "rb");
+    CAutoFile filein(file, SER_DISK, CLIENT_VERSION);
+    if (filein.IsNull())
+        return error("%s: Failed to open file %s", __func__, pathAddr.string());
+
+    // use file size to size memory buffer
+    int fileSize = boost::filesystem::file_size(pathAddr);
+    int dataSize = fileSize - sizeof(uint256);
+    // Don't try to resize to a negative number if file is small
+    if (dataSize < 0)
+        dataSize = 0;
+    vector<unsigned char> vchData;
+    vchData.resize(dataSize);
+    uint256 hashIn;
+
+    // read data and checksum from file
+    try {
+        filein.read((char *)&vchData[0], dataSize);
+        filein >> hashIn;
+    }
+    catch (const std::exception& e) {
+        return error("%s: Deserialize or I/O error - %s", __func__, e.what());
+    }
+    filein.fclose();
+
+    CDataStream ssPeers(vchData, SER_DISK, CLIENT_VERSION);
+
+    // verify stored checksum matches input data
+    uint256 hashTmp = Hash(ssPeers.begin(), ssPeers.end());
+    if (hashIn != hashTmp)
+        return error("%s: Checksum mismatch, data corrupted", __func__);
+
+    unsigned char pchMsgTmp[4];
+    try {
+        // de-serialize file header (network specific magic number) and ..
+        ssPeers >> FLATDATA(pchMsgTmp);
+
+        // ... verify the network matches ours
+        if (memcmp(pchMsgTmp, Params().MessageStart(), sizeof(pchMsgTmp)))
+            return error("%s: Invalid network magic number", __func__);
+
+        // de-serialize address data into one CAddrMan object
+        ssPeers >> addr;
+    }
+    catch (const std::exception& e) {
+        return error("%s: Deserialize or I/O error - %s", __func__, e.what());
+    }
+
+    return true;
+}
@@ -0,0 +1,48 @@
+// Copyright (c) 2009-2010 Satoshi Nakamoto
+// Copyright (c) 2009-2014 The Bitcoin Core developers
+// Copyright (c) 2017 The Zen Core developers
+// Distributed under the MIT software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#ifndef BITCOIN_ADDRDB_H
+#define BITCOIN_ADDRDB_H
+
+#include "leveldbwrapper.h"
+
+#include <vector>
+
+#include <boost/filesystem/path.hpp>
+
+class CAddrMan;
+class CAddrManEntry;
+class CNetAddr;
+class uint256;
+
+/** Cache of the address database */
+static const size_t ADDRDB_CACHE_SIZE = 2 << 20;
+/** Entries of the address database added to the address manager at once */
+static const size_t ADDRDB_LOAD_BATCH = 1000;
+
+/**
+ * Access to the (IP) address database (addrman/), the entries of the
+ * address manager one by one: only the ones which changed are written, and
+ * they are loaded in batches with the address manager in use.
+ */
+class CAddrDB : public CLevelDBWrapper
+{
+public:
+    CAddrDB(size_t nCacheSize, bool fMemory = false, bool fWipe = false);
+
+    //! The key the entries were placed in the tables with, false if none was written
+    bool ReadKey(uint256& nKey);
+    bool WriteKey(const uint256& nKey);
+    //! Write the entries changed and erase the addresses deleted, in one batch
+    bool WriteChanges(const std::vector<CAddrManEntry>& vChanged, const std::vector<CNetAddr>& vErased);
+    //! Add all the entries to addr, nBatch at a time; false if some couldn't be read
+    bool Load(CAddrMan& addr, size_t nBatch = ADDRDB_LOAD_BATCH);
+};
+
+/** Read the address manager written whole to a file (peers.dat) by earlier versions. */
+bool ReadPeersFile(const boost::filesystem::path& pathAddr, CAddrMan& addr);
+
+#endif // BITCOIN_ADDRDB_H
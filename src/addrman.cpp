@@ -85,6 +85,9 @@ CAddrInfo* CAddrMan::Create(const CAddress& addr, const CNetAddr& addrSource, in
     mapAddr[addr] = nId;
     mapInfo[nId].nRandomPos = vRandom.size();
     vRandom.push_back(nId);
+    if (fTrackChanges)
+        setErased.erase(addr);
+    MarkChanged(nId);
     if (pnId)
         *pnId = nId;
     return &mapInfo[nId];
@@ -120,10 +123,20 @@ void CAddrMan::Delete(int nId)
     SwapRandom(info.nRandomPos, vRandom.size() - 1);
     vRandom.pop_back();
     mapAddr.erase(info);
+    if (fTrackChanges) {
+        setChanged.erase(nId);
+        setErased.insert(info);
+    }
     mapInfo.erase(nId);
     nNew--;
 }
 
+void CAddrMan::MarkChanged(int nId)
+{
+    if (fTrackChanges)
+        setChanged.insert(nId);
+}
+
 void CAddrMan::ClearNew(int nUBucket, int nUBucketPos)
 {
     // if there is an entry in the specified bucket, delete it.
@@ -135,6 +148,8 @@ void CAddrMan::ClearNew(int nUBucket, int nUBucketPos)
         vvNew[nUBucket][nUBucketPos] = -1;
         if (infoDelete.nRefCount == 0) {
             Delete(nIdDelete);
+        } else {
+            MarkChanged(nIdDelete);
         }
     }
 }
@@ -179,12 +194,14 @@ void CAddrMan::MakeTried(CAddrInfo& info, int nId)
         infoOld.nRefCount = 1;
         vvNew[nUBucket][nUBucketPos] = nIdEvict;
         nNew++;
+        MarkChanged(nIdEvict);
     }
     assert(vvTried[nKBucket][nKBucketPos] == -1);
 
     vvTried[nKBucket][nKBucketPos] = nId;
     nTried++;
     info.fInTried = true;
+    MarkChanged(nId);
 }
 
 void CAddrMan::Good_(const CService& addr, int64_t nTime)
@@ -206,6 +223,7 @@ void CAddrMan::Good_(const CService& addr, int64_t nTime)
     info.nLastSuccess = nTime;
     info.nLastTry = nTime;
     info.nAttempts = 0;
+    MarkChanged(nId);
     // nTime is not updated here, to avoid leaking information about
     // currently-connected peers.
 
@@ -249,11 +267,16 @@ bool CAddrMan::Add_(const CAddress& addr, const CNetAddr& source, int64_t nTimeP
         // periodically update nTime
         bool fCurrentlyOnline = (GetTime() - addr.nTime < 24 * 60 * 60);
         int64_t nUpdateInterval = (fCurrentlyOnline ? 60 * 60 : 24 * 60 * 60);
-        if (addr.nTime && (!pinfo->nTime || pinfo->nTime < addr.nTime - nUpdateInterval - nTimePenalty))
+        if (addr.nTime && (!pinfo->nTime || pinfo->nTime < addr.nTime - nUpdateInterval - nTimePenalty)) {
             pinfo->nTime = std::max((int64_t)0, addr.nTime - nTimePenalty);
+            MarkChanged(nId);
+        }
 
         // add services
-        pinfo->nServices |= addr.nServices;
+        if ((pinfo->nServices | addr.nServices) != pinfo->nServices) {
+            pinfo->nServices |= addr.nServices;
+            MarkChanged(nId);
+        }
 
         // do not update if no new information is present
         if (!addr.nTime || (pinfo->nTime && addr.nTime <= pinfo->nTime))
@@ -295,6 +318,7 @@ bool CAddrMan::Add_(const CAddress& addr, const CNetAddr& source, int64_t nTimeP
             ClearNew(nUBucket, nUBucketPos);
             pinfo->nRefCount++;
             vvNew[nUBucket][nUBucketPos] = nId;
+            MarkChanged(nId);
         } else {
             if (pinfo->nRefCount == 0) {
                 Delete(nId);
@@ -306,7 +330,8 @@ bool CAddrMan::Add_(const CAddress& addr, const CNetAddr& source, int64_t nTimeP
 
 void CAddrMan::Attempt_(const CService& addr, int64_t nTime)
 {
-    CAddrInfo* pinfo = Find(addr);
+    int nId;
+    CAddrInfo* pinfo = Find(addr, &nId);
 
     // if not found, bail out
     if (!pinfo)
@@ -321,6 +346,7 @@ void CAddrMan::Attempt_(const CService& addr, int64_t nTime)
     // update info
     info.nLastTry = nTime;
     info.nAttempts++;
+    MarkChanged(nId);
 }
 
 CAddrInfo CAddrMan::Select_(bool newOnly)
@@ -488,7 +514,8 @@ void CAddrMan::GetAddr_(std::vector<CAddress>& vAddr)
 
 void CAddrMan::Connected_(const CService& addr, int64_t nTime)
 {
-    CAddrInfo* pinfo = Find(addr);
+    int nId;
+    CAddrInfo* pinfo = Find(addr, &nId);
 
     // if not found, bail out
     if (!pinfo)
@@ -502,8 +529,92 @@ void CAddrMan::Connected_(const CService& addr, int64_t nTime)
 
     // update info
     int64_t nUpdateInterval = 20 * 60;
-    if (nTime - info.nTime > nUpdateInterval)
+    if (nTime - info.nTime > nUpdateInterval) {
         info.nTime = nTime;
+        MarkChanged(nId);
+    }
+}
+
+int CAddrMan::Load_(const std::vector<CAddrManEntry>& vEntries)
+{
+    int nLoaded = 0;
+    for (std::vector<CAddrManEntry>::const_iterator it = vEntries.begin(); it != vEntries.end(); it++) {
+        const CAddrInfo& info = it->info;
+        // learnt again since startup, what we know now is more recent
+        if (mapAddr.count(info))
+            continue;
+
+        int nId = nIdCount;
+        if (it->fInTried) {
+            int nKBucket = info.GetTriedBucket(nKey);
+            int nKBucketPos = info.GetBucketPosition(nKey, false, nKBucket);
+            if (vvTried[nKBucket][nKBucketPos] != -1) {
+                if (fTrackChanges)
+                    setErased.insert(info);
+                continue;
+            }
+            vvTried[nKBucket][nKBucketPos] = nId;
+            mapInfo[nId] = info;
+            mapInfo[nId].fInTried = true;
+            nTried++;
+        } else {
+            // the buckets are checked, the positions follow from the key
+            int nRefCount = 0;
+            for (std::vector<int>::const_iterator itBucket = it->vNewBuckets.begin(); itBucket != it->vNewBuckets.end(); itBucket++) {
+                int nUBucket = *itBucket;
+                if (nUBucket < 0 || nUBucket >= ADDRMAN_NEW_BUCKET_COUNT || nRefCount == ADDRMAN_NEW_BUCKETS_PER_ADDRESS)
+                    continue;
+                int nUBucketPos = info.GetBucketPosition(nKey, true, nUBucket);
+                if (vvNew[nUBucket][nUBucketPos] == -1) {
+                    vvNew[nUBucket][nUBucketPos] = nId;
+                    nRefCount++;
+                }
+            }
+            if (nRefCount == 0) {
+                if (fTrackChanges)
+                    setErased.insert(info);
+                continue;
+            }
+            mapInfo[nId] = info;
+            mapInfo[nId].nRefCount = nRefCount;
+            nNew++;
+        }
+
+        mapAddr[info] = nId;
+        mapInfo[nId].nRandomPos = vRandom.size();
+        vRandom.push_back(nId);
+        nIdCount++;
+        nLoaded++;
+    }
+    return nLoaded;
+}
+
+void CAddrMan::GetChanges_(std::vector<CAddrManEntry>& vChanged, std::vector<CNetAddr>& vErased)
+{
+    vChanged.clear();
+    vErased.assign(setErased.begin(), setErased.end());
+    setErased.clear();
+    if (setChanged.empty())
+        return;
+
+    // one pass over the new table rather than hashing every bucket position of every entry
+    std::map<int, std::vector<int> > mapNewBuckets;
+    for (int bucket = 0; bucket < ADDRMAN_NEW_BUCKET_COUNT; bucket++) {
+        for (int i = 0; i < ADDRMAN_BUCKET_SIZE; i++) {
+            int nId = vvNew[bucket][i];
+            if (nId != -1 && setChanged.count(nId))
+                mapNewBuckets[nId].push_back(bucket);
+        }
+    }
+
+    vChanged.reserve(setChanged.size());
+    for (std::set<int>::const_iterator it = setChanged.begin(); it != setChanged.end(); it++) {
+        const CAddrInfo& info = mapInfo[*it];
+        vChanged.push_back(CAddrManEntry(info, info.fInTried));
+        if (!info.fInTried)
+            vChanged.back().vNewBuckets.swap(mapNewBuckets[*it]);
+    }
+    setChanged.clear();
 }
 
 int CAddrMan::RandomInt(int nMax){
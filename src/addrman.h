@@ -104,10 +104,34 @@ public:
 
 };
 
+/**
+ * An entry of CAddrMan as it is stored in the address database, with the
+ * table it is in and, for the "new" table, the buckets referencing it.
+ */
+class CAddrManEntry
+{
+public:
+    CAddrInfo info;
+    bool fInTried;
+    std::vector<int> vNewBuckets;
+
+    CAddrManEntry() : fInTried(false) {}
+    CAddrManEntry(const CAddrInfo& infoIn, bool fInTriedIn) : info(infoIn), fInTried(fInTriedIn) {}
+
+    ADD_SERIALIZE_METHODS;
+
+    template <typename Stream, typename Operation>
+    inline void SerializationOp(Stream& s, Operation ser_action, int nType, int nVersion) {
+        READWRITE(info);
+        READWRITE(fInTried);
+        READWRITE(vNewBuckets);
+    }
+};
+
 /** Stochastic address manager
  *
  * Design goals:
- *  * Keep the address tables in-memory, and asynchronously dump the entire table to peers.dat.
+ *  * Keep the address tables in-memory, and asynchronously write the entries which changed to the address database.
  *  * Make sure no (localized) attacker can fill the entire table with his nodes/addresses.
  *
  * To that end:
@@ -199,6 +223,15 @@ private:
     //! list of "new" buckets
     int vvNew[ADDRMAN_NEW_BUCKET_COUNT][ADDRMAN_BUCKET_SIZE];
 
+    //! whether the changes are recorded for GetChanges()
+    bool fTrackChanges;
+
+    //! nIds of the entries changed since the last GetChanges()
+    std::set<int> setChanged;
+
+    //! addresses deleted since the last GetChanges()
+    std::set<CNetAddr> setErased;
+
 protected:
     //! secret key to randomize bucket select with
     uint256 nKey;
@@ -219,6 +252,9 @@ protected:
     //! Delete an entry. It must not be in tried, and have refcount 0.
     void Delete(int nId);
 
+    //! Record a change of an entry for GetChanges().
+    void MarkChanged(int nId);
+
     //! Clear a position in a "new" table. This is the only place where entries are actually deleted.
     void ClearNew(int nUBucket, int nUBucketPos);
 
@@ -248,6 +284,12 @@ protected:
     //! Mark an entry as currently-connected-to.
     void Connected_(const CService &addr, int64_t nTime);
 
+    //! Add entries read from the address database.
+    int Load_(const std::vector<CAddrManEntry> &vEntries);
+
+    //! Take the changes recorded since the last call.
+    void GetChanges_(std::vector<CAddrManEntry> &vChanged, std::vector<CNetAddr> &vErased);
+
 public:
     /**
      * serialized format:
@@ -457,9 +499,11 @@ public:
         nIdCount = 0;
         nTried = 0;
         nNew = 0;
+        setChanged.clear();
+        setErased.clear();
     }
 
-    CAddrMan()
+    CAddrMan() : fTrackChanges(false)
     {
         Clear();
     }
@@ -580,6 +624,71 @@ public:
         }
     }
 
+    //! The secret key of the bucket selection, to store the entries with.
+    uint256 GetBucketKey() const
+    {
+        LOCK(cs);
+        return nKey;
+    }
+
+    //! Use the key the stored entries were placed with, before any entry is added.
+    void SetBucketKey(const uint256 &nKeyIn)
+    {
+        LOCK(cs);
+        assert(vRandom.empty());
+        nKey = nKeyIn;
+    }
+
+    /**
+     * Record the changes to the entries from now on, to be taken by
+     * GetChanges(). With fAll the entries already there count as changed.
+     */
+    void TrackChanges(bool fAll)
+    {
+        LOCK(cs);
+        fTrackChanges = true;
+        if (fAll) {
+            for (std::map<int, CAddrInfo>::const_iterator it = mapInfo.begin(); it != mapInfo.end(); it++)
+                setChanged.insert(it->first);
+        }
+    }
+
+    /**
+     * Add a batch of entries read from the address database, keeping their
+     * place in the tables. Addresses known already are skipped, entries
+     * which no longer fit are dropped. Returns the number of entries added.
+     */
+    int Load(const std::vector<CAddrManEntry> &vEntries)
+    {
+        int nLoaded = 0;
+        {
+            LOCK(cs);
+            Check();
+            nLoaded = Load_(vEntries);
+            Check();
+        }
+        return nLoaded;
+    }
+
+    //! Take the entries changed and the addresses deleted since the last call.
+    void GetChanges(std::vector<CAddrManEntry> &vChanged, std::vector<CNetAddr> &vErased)
+    {
+        LOCK(cs);
+        GetChanges_(vChanged, vErased);
+    }
+
+    //! Record again the addresses deleted taken by GetChanges(), the ones not added back since.
+    void RestoreErased(const std::vector<CNetAddr> &vErased)
+    {
+        LOCK(cs);
+        if (!fTrackChanges)
+            return;
+        for (std::vector<CNetAddr>::const_iterator it = vErased.begin(); it != vErased.end(); it++) {
+            if (!mapAddr.count(*it))
+                setErased.insert(*it);
+        }
+    }
+
 };
 
 #endif // BITCOIN_ADDRMAN_H
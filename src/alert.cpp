@@ -133,7 +133,12 @@ bool CAlert::RelayTo(CNode* pnode) const
     if (pnode->nVersion == 0)
         return false;
     // returns true if wasn't already contained in the set
-    if (pnode->setKnown.insert(GetHash()).second)
+    bool fNew;
+    {
+        LOCK(pnode->cs_inventory);
+        fNew = pnode->setKnown.insert(GetHash()).second;
+    }
+    if (fNew)
     {
         if (AppliesTo(pnode->nVersion, pnode->strSubVer) ||
             AppliesToMe() ||
@@ -0,0 +1,219 @@
+// Copyright (c) 2016 The Bitcoin Core developers
+// Distributed under the MIT software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#include "blockencodings.h"
+#include "crypto/common.h"
+#include "crypto/sha256.h"
+#include "hash.h"
+#include "random.h"
+#include "streams.h"
+#include "txmempool.h"
+#include "util.h"
+#include "version.h"
+
+#include <limits>
+#include <unordered_map>
+#include <unordered_set>
+
+/** Smallest serialized transaction or certificate: version, two empty lists and a lock time. */
+static const size_t MIN_SERIALIZED_ENTRY_SIZE = 10;
+
+CBlockHeaderAndShortTxIDs::CBlockHeaderAndShortTxIDs(const CBlock& block) :
+        nonce(GetRand(std::numeric_limits<uint64_t>::max())),
+        shorttxids(block.vtx.size() - 1), prefilledtxn(1), shortcertids(block.vcert.size()),
+        header(block.GetBlockHeader()) {
+    FillShortTxIDSelector();
+    // the coinbase is never in the mempool of the receiver
+    prefilledtxn[0].index = 0;
+    prefilledtxn[0].tx = block.vtx[0];
+    for (size_t i = 1; i < block.vtx.size(); i++)
+        shorttxids[i - 1] = GetShortID(block.vtx[i].GetHash());
+    for (size_t i = 0; i < block.vcert.size(); i++)
+        shortcertids[i] = GetShortID(block.vcert[i].GetHash());
+}
+
+void CBlockHeaderAndShortTxIDs::FillShortTxIDSelector() const {
+    CDataStream stream(SER_NETWORK, PROTOCOL_VERSION);
+    stream << header << nonce;
+    CSHA256 hasher;
+    hasher.Write((unsigned char*)&(*stream.begin()), stream.end() - stream.begin());
+    uint256 shorttxidhash;
+    hasher.Finalize(shorttxidhash.begin());
+    shorttxidk0 = ReadLE64(shorttxidhash.begin());
+    shorttxidk1 = ReadLE64(shorttxidhash.begin() + 8);
+}
+
+uint64_t CBlockHeaderAndShortTxIDs::GetShortID(const uint256& hash) const {
+    static_assert(SHORTTXIDS_LENGTH == 6, "shorttxids calculation assumes 6-byte shorttxids");
+    return SipHashUint256(shorttxidk0, shorttxidk1, hash) & 0xffffffffffffULL;
+}
+
+// Map the short ids to their position in the block. Because well-formed
+// compact blocks have a (relatively) uniform distribution of short ids, any
+// highly uneven distribution of the entries is treated as a failure. The
+// short ids shared by several entries of the block are left out, so that
+// only those entries are requested.
+static bool MapShortIDs(const std::vector<uint64_t>& vShortIDs, const std::vector<size_t>& vPositions,
+                        std::unordered_map<uint64_t, size_t>& mapShortIDs)
+{
+    std::unordered_set<uint64_t> setCollided;
+    mapShortIDs.reserve(vShortIDs.size());
+    for (size_t i = 0; i < vShortIDs.size(); i++) {
+        if (!mapShortIDs.insert(std::make_pair(vShortIDs[i], vPositions[i])).second)
+            setCollided.insert(vShortIDs[i]);
+        // A buffer of 12 elements is safe: the chance that the number of
+        // entries in a bucket of a table with as many buckets as elements
+        // exceeds 12 is below 1 in 2**50 for a single block.
+        if (mapShortIDs.bucket_size(mapShortIDs.bucket(vShortIDs[i])) > 12)
+            return false;
+    }
+    for (std::unordered_set<uint64_t>::const_iterator it = setCollided.begin(); it != setCollided.end(); ++it)
+        mapShortIDs.erase(*it);
+    return true;
+}
+
+ReadStatus PartiallyDownloadedBlock::InitData(const CBlockHeaderAndShortTxIDs& cmpctblock) {
+    if (cmpctblock.header.IsNull() || (cmpctblock.shorttxids.empty() && cmpctblock.prefilledtxn.empty()))
+        return READ_STATUS_INVALID;
+    if (cmpctblock.BlockTxCount() + cmpctblock.BlockCertCount() > MAX_BLOCK_SIZE / MIN_SERIALIZED_ENTRY_SIZE)
+        return READ_STATUS_INVALID;
+    // only blocks supporting sidechains carry certificates
+    if (cmpctblock.header.nVersion != BLOCK_VERSION_SC_SUPPORT && !cmpctblock.shortcertids.empty())
+        return READ_STATUS_INVALID;
+
+    assert(header.IsNull() && txn_available.empty() && cert_available.empty());
+    header = cmpctblock.header;
+    txn_available.resize(cmpctblock.BlockTxCount());
+    cert_available.resize(cmpctblock.BlockCertCount());
+
+    int64_t lastprefilledindex = -1;
+    for (size_t i = 0; i < cmpctblock.prefilledtxn.size(); i++) {
+        if (cmpctblock.prefilledtxn[i].tx.IsNull())
+            return READ_STATUS_INVALID;
+
+        lastprefilledindex += (int64_t)cmpctblock.prefilledtxn[i].index + 1;
+        if ((uint64_t)lastprefilledindex > cmpctblock.shorttxids.size() + i) {
+            // If we are inserting a tx at an index greater than our full list of shorttxids
+            // plus the number of prefilled txn we've inserted, then we have txn for which we
+            // have neither a prefilled txn or a shorttxid!
+            return READ_STATUS_INVALID;
+        }
+        txn_available[lastprefilledindex] = std::make_shared<const CTransaction>(cmpctblock.prefilledtxn[i].tx);
+    }
+    prefilled_count = cmpctblock.prefilledtxn.size();
+
+    std::vector<size_t> vTxPositions;
+    vTxPositions.reserve(cmpctblock.shorttxids.size());
+    for (size_t i = 0; i < txn_available.size(); i++) {
+        if (!txn_available[i])
+            vTxPositions.push_back(i);
+    }
+    std::vector<size_t> vCertPositions(cert_available.size());
+    for (size_t i = 0; i < vCertPositions.size(); i++)
+        vCertPositions[i] = i;
+
+    std::unordered_map<uint64_t, size_t> shorttxids, shortcertids;
+    if (!MapShortIDs(cmpctblock.shorttxids, vTxPositions, shorttxids) ||
+        !MapShortIDs(cmpctblock.shortcertids, vCertPositions, shortcertids))
+        return READ_STATUS_FAILED;
+
+    // If two mempool entries match the same short id, neither is used and the
+    // entry gets requested.
+    std::vector<bool> have_txn(txn_available.size());
+    std::vector<bool> have_cert(cert_available.size());
+
+    LOCK(pool->cs);
+    for (std::map<uint256, CTxMemPoolEntry>::const_iterator it = pool->mapTx.begin();
+         it != pool->mapTx.end() && mempool_count < shorttxids.size(); ++it) {
+        std::unordered_map<uint64_t, size_t>::const_iterator idit = shorttxids.find(cmpctblock.GetShortID(it->first));
+        if (idit == shorttxids.end())
+            continue;
+        if (!have_txn[idit->second]) {
+            txn_available[idit->second] = std::make_shared<const CTransaction>(it->second.GetTx());
+            have_txn[idit->second] = true;
+            mempool_count++;
+        } else if (txn_available[idit->second]) {
+            txn_available[idit->second].reset();
+            mempool_count--;
+        }
+    }
+
+    size_t cert_count = 0;
+    for (std::map<uint256, CCertificateMemPoolEntry>::const_iterator it = pool->mapCertificate.begin();
+         it != pool->mapCertificate.end() && cert_count < shortcertids.size(); ++it) {
+        std::unordered_map<uint64_t, size_t>::const_iterator idit = shortcertids.find(cmpctblock.GetShortID(it->first));
+        if (idit == shortcertids.end())
+            continue;
+        if (!have_cert[idit->second]) {
+            cert_available[idit->second] = std::make_shared<const CScCertificate>(it->second.GetCertificate());
+            have_cert[idit->second] = true;
+            cert_count++;
+        } else if (cert_available[idit->second]) {
+            cert_available[idit->second].reset();
+            cert_count--;
+        }
+    }
+    mempool_count += cert_count;
+
+    LogPrint("cmpctblock", "Initialized PartiallyDownloadedBlock for block %s using a cmpctblock of size %lu\n",
+             cmpctblock.header.GetHash().ToString(), GetSerializeSize(cmpctblock, SER_NETWORK, PROTOCOL_VERSION));
+
+    return READ_STATUS_OK;
+}
+
+bool PartiallyDownloadedBlock::IsTxAvailable(size_t index) const {
+    assert(!header.IsNull());
+    if (index < txn_available.size())
+        return txn_available[index] ? true : false;
+    assert(index - txn_available.size() < cert_available.size());
+    return cert_available[index - txn_available.size()] ? true : false;
+}
+
+ReadStatus PartiallyDownloadedBlock::FillBlock(CBlock& block, const std::vector<CTransaction>& vtx_missing,
+                                               const std::vector<CScCertificate>& vcert_missing) {
+    assert(!header.IsNull());
+    block.SetNull();
+    block.SetBlockHeader(header);
+    block.vtx.resize(txn_available.size());
+    block.vcert.resize(cert_available.size());
+
+    size_t tx_missing_offset = 0;
+    for (size_t i = 0; i < txn_available.size(); i++) {
+        if (!txn_available[i]) {
+            if (vtx_missing.size() <= tx_missing_offset)
+                return READ_STATUS_INVALID;
+            block.vtx[i] = vtx_missing[tx_missing_offset++];
+        } else
+            block.vtx[i] = *txn_available[i];
+    }
+
+    size_t cert_missing_offset = 0;
+    for (size_t i = 0; i < cert_available.size(); i++) {
+        if (!cert_available[i]) {
+            if (vcert_missing.size() <= cert_missing_offset)
+                return READ_STATUS_INVALID;
+            block.vcert[i] = vcert_missing[cert_missing_offset++];
+        } else
+            block.vcert[i] = *cert_available[i];
+    }
+
+    // Make sure we can't call FillBlock again.
+    header.SetNull();
+    txn_available.clear();
+    cert_available.clear();
+
+    if (vtx_missing.size() != tx_missing_offset || vcert_missing.size() != cert_missing_offset)
+        return READ_STATUS_INVALID;
+
+    // A mismatching merkle root may just as well come from a short id that
+    // matched the wrong mempool entry, the full block has to be asked for.
+    bool mutated;
+    if (block.BuildMerkleTree(&mutated) != block.hashMerkleRoot || mutated)
+        return READ_STATUS_FAILED;
+
+    LogPrint("cmpctblock", "Successfully reconstructed block %s with %lu entries prefilled, %lu from mempool and %lu requested\n",
+             block.GetHash().ToString(), prefilled_count, mempool_count, vtx_missing.size() + vcert_missing.size());
+
+    return READ_STATUS_OK;
+}
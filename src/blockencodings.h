@@ -0,0 +1,221 @@
+// Copyright (c) 2016 The Bitcoin Core developers
+// Distributed under the MIT software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#ifndef BITCOIN_BLOCK_ENCODINGS_H
+#define BITCOIN_BLOCK_ENCODINGS_H
+
+#include "primitives/block.h"
+#include "serialize.h"
+#include "uint256.h"
+
+#include <algorithm>
+#include <memory>
+#include <vector>
+
+class CTxMemPool;
+
+/**
+ * Compact block relay (BIP 152), extended to the certificates of a block.
+ *
+ * A block is made of its transactions followed by its certificates, and the
+ * entries of a block are numbered in that order: index i < vtx.size() is
+ * vtx[i], the following ones are vcert[i - vtx.size()]. The indexes of
+ * getblocktxn use that numbering, blocktxn returns the transactions and the
+ * certificates asked for in two lists.
+ */
+
+/** Largest entry index a message may carry: an entry takes at least one byte. */
+static const uint32_t MAX_BLOCK_ENTRY_INDEX = MAX_BLOCK_SIZE;
+
+/** Wrapper serializing short ids in CBlockHeaderAndShortTxIDs::SHORTTXIDS_LENGTH bytes each. */
+class CShortIDs
+{
+protected:
+    std::vector<uint64_t>& v;
+public:
+    CShortIDs(std::vector<uint64_t>& vIn) : v(vIn) { }
+
+    unsigned int GetSerializeSize(int, int) const {
+        return GetSizeOfCompactSize(v.size()) + v.size() * 6;
+    }
+
+    template<typename Stream>
+    void Serialize(Stream& s, int, int) const {
+        WriteCompactSize(s, v.size());
+        for (size_t i = 0; i < v.size(); i++) {
+            uint32_t lsb = v[i] & 0xffffffff;
+            uint16_t msb = (v[i] >> 32) & 0xffff;
+            s << lsb << msb;
+        }
+    }
+
+    template<typename Stream>
+    void Unserialize(Stream& s, int, int) {
+        uint64_t nSize = ReadCompactSize(s);
+        v.clear();
+        // grow as the data comes in, the size is not checked yet
+        while (v.size() < nSize) {
+            size_t i = v.size();
+            v.resize(std::min((uint64_t)(1000 + v.size()), nSize));
+            for (; i < v.size(); i++) {
+                uint32_t lsb = 0;
+                uint16_t msb = 0;
+                s >> lsb >> msb;
+                v[i] = (uint64_t(msb) << 32) | uint64_t(lsb);
+            }
+        }
+    }
+};
+
+/** Request for the entries of a block that are missing from a compact block. */
+class BlockTransactionsRequest {
+public:
+    uint256 blockhash;
+    std::vector<uint32_t> indexes;
+
+    ADD_SERIALIZE_METHODS;
+
+    template <typename Stream, typename Operation>
+    inline void SerializationOp(Stream& s, Operation ser_action, int nType, int nVersion) {
+        READWRITE(blockhash);
+        uint64_t indexes_size = (uint64_t)indexes.size();
+        READWRITE(COMPACTSIZE(indexes_size));
+        if (ser_action.ForRead()) {
+            // indexes are sent as the difference from the previous one
+            indexes.clear();
+            uint64_t offset = 0;
+            while (indexes.size() < indexes_size) {
+                uint64_t index = 0;
+                READWRITE(COMPACTSIZE(index));
+                index += offset;
+                if (index > MAX_BLOCK_ENTRY_INDEX)
+                    throw std::ios_base::failure("index out of range");
+                indexes.push_back(index);
+                offset = index + 1;
+            }
+        } else {
+            for (size_t i = 0; i < indexes.size(); i++) {
+                uint64_t index = indexes[i] - (i == 0 ? 0 : (indexes[i - 1] + 1));
+                READWRITE(COMPACTSIZE(index));
+            }
+        }
+    }
+};
+
+/** Reply to a BlockTransactionsRequest. */
+class BlockTransactions {
+public:
+    uint256 blockhash;
+    std::vector<CTransaction> txn;
+    std::vector<CScCertificate> certs;
+
+    BlockTransactions() {}
+    BlockTransactions(const BlockTransactionsRequest& req) : blockhash(req.blockhash) {}
+
+    ADD_SERIALIZE_METHODS;
+
+    template <typename Stream, typename Operation>
+    inline void SerializationOp(Stream& s, Operation ser_action, int nType, int nVersion) {
+        READWRITE(blockhash);
+        READWRITE(txn);
+        READWRITE(certs);
+    }
+};
+
+/** A transaction sent along with a compact block, the coinbase at least. */
+struct PrefilledTransaction {
+    // Used as an offset since last prefilled tx in CBlockHeaderAndShortTxIDs,
+    // as a proper transaction-in-block-index in PartiallyDownloadedBlock
+    uint32_t index;
+    CTransaction tx;
+
+    ADD_SERIALIZE_METHODS;
+
+    template <typename Stream, typename Operation>
+    inline void SerializationOp(Stream& s, Operation ser_action, int nType, int nVersion) {
+        uint64_t idx = index;
+        READWRITE(COMPACTSIZE(idx));
+        if (idx > MAX_BLOCK_ENTRY_INDEX)
+            throw std::ios_base::failure("index out of range");
+        index = idx;
+        READWRITE(tx);
+    }
+};
+
+typedef enum ReadStatus_t
+{
+    READ_STATUS_OK,
+    READ_STATUS_INVALID, // Invalid object, peer is sending bogus crap
+    READ_STATUS_FAILED, // Failed to process object
+} ReadStatus;
+
+/**
+ * The header of a block with the short ids of its transactions and
+ * certificates, and the transactions the receiver is not expected to have.
+ */
+class CBlockHeaderAndShortTxIDs {
+private:
+    mutable uint64_t shorttxidk0, shorttxidk1;
+    uint64_t nonce;
+
+    void FillShortTxIDSelector() const;
+
+    friend class PartiallyDownloadedBlock;
+
+    static const int SHORTTXIDS_LENGTH = 6;
+protected:
+    std::vector<uint64_t> shorttxids;
+    std::vector<PrefilledTransaction> prefilledtxn;
+    std::vector<uint64_t> shortcertids;
+
+public:
+    CBlockHeader header;
+
+    // Dummy for deserialization
+    CBlockHeaderAndShortTxIDs() {}
+
+    CBlockHeaderAndShortTxIDs(const CBlock& block);
+
+    uint64_t GetShortID(const uint256& hash) const;
+
+    size_t BlockTxCount() const { return shorttxids.size() + prefilledtxn.size(); }
+    size_t BlockCertCount() const { return shortcertids.size(); }
+
+    ADD_SERIALIZE_METHODS;
+
+    template <typename Stream, typename Operation>
+    inline void SerializationOp(Stream& s, Operation ser_action, int nType, int nVersion) {
+        READWRITE(header);
+        READWRITE(nonce);
+        READWRITE(REF(CShortIDs(shorttxids)));
+        READWRITE(prefilledtxn);
+        READWRITE(REF(CShortIDs(shortcertids)));
+
+        if (ser_action.ForRead())
+            FillShortTxIDSelector();
+    }
+};
+
+/**
+ * A block being rebuilt from a compact block: the entries found in the
+ * mempool are filled in by InitData(), the missing ones by FillBlock().
+ */
+class PartiallyDownloadedBlock {
+protected:
+    std::vector<std::shared_ptr<const CTransaction> > txn_available;
+    std::vector<std::shared_ptr<const CScCertificate> > cert_available;
+    size_t prefilled_count, mempool_count;
+    CTxMemPool* pool;
+public:
+    CBlockHeader header;
+    PartiallyDownloadedBlock(CTxMemPool* poolIn) : prefilled_count(0), mempool_count(0), pool(poolIn) {}
+
+    ReadStatus InitData(const CBlockHeaderAndShortTxIDs& cmpctblock);
+    /** Whether the entry at index, in the numbering of the block, is known. */
+    bool IsTxAvailable(size_t index) const;
+    ReadStatus FillBlock(CBlock& block, const std::vector<CTransaction>& vtx_missing,
+                         const std::vector<CScCertificate>& vcert_missing);
+};
+
+#endif // BITCOIN_BLOCK_ENCODINGS_H
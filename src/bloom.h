@@ -53,10 +53,6 @@ private:
 
     unsigned int Hash(unsigned int nHashNum, const std::vector<unsigned char>& vDataToHash) const;
 
-    // Private constructor for CRollingBloomFilter, no restrictions on size
-    CBloomFilter(unsigned int nElements, double nFPRate, unsigned int nTweak);
-    friend class CRollingBloomFilter;
-
 public:
     /**
      * Creates a new bloom filter which will provide the given fp rate when filled with the given number of elements
@@ -129,9 +125,24 @@ public:
     void reset();
 
 private:
-    unsigned int nBloomSize;
-    unsigned int nInsertions;
-    CBloomFilter b1, b2;
+    void insert(const unsigned char* pKey, size_t nKeySize);
+    bool contains(const unsigned char* pKey, size_t nKeySize) const;
+
+    /**
+     * Entries are kept in generations of nEntriesPerGeneration, the filter
+     * holds the last two full generations plus the current one: once the
+     * current generation is full the oldest one is wiped. Each bit of the
+     * filter takes two bits of data, telling the generation (1 to 3) that
+     * last set it, or 0 if unset. Bit P is bit (P & 63) of the two words
+     * data[(P >> 6) * 2] and data[(P >> 6) * 2 + 1]. The memory used is fixed
+     * at construction, and neither insert() nor contains() allocate.
+     */
+    int nEntriesPerGeneration;
+    int nEntriesThisGeneration;
+    int nGeneration;
+    std::vector<uint64_t> data;
+    unsigned int nTweak;
+    int nHashFuncs;
 };
 
 
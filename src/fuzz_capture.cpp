@@ -0,0 +1,223 @@
+#include "chainparams.h"
+#include "clientversion.h"
+#include "net.h"
+#include "protocol.h"
+#include "serialize.h"
+#include "streams.h"
+#include "util.h"
+#include "version.h"
+
+#include <algorithm>
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <string>
+#include <vector>
+
+#include <boost/filesystem.hpp>
+
+/*
+ * Converts the files written by zend -capturemessages=<dir> into inputs for
+ * the fuzzer, whose format is
+ *     <number of connections> (<connection> <message>)...
+ * with one byte for the number of connections and for the connection a
+ * message goes to, and messages as they come from the wire.
+ *
+ *     fuzz_capture -out=<dir> [-maxmsgs=<n>] [-merge] [-network=main|test|regtest] <capture>...
+ *
+ * Each capture becomes one connection. By default every capture gives its own
+ * inputs; with -merge the captures are interleaved by receive time into
+ * inputs with one connection per capture, as the node saw them. Sessions are
+ * cut into inputs of at most -maxmsgs messages. -network rewrites the message
+ * start, so that mainnet and testnet traffic can be played to a regtest node.
+ *
+ * The last record of a capture may be cut short if the node was killed, it is
+ * dropped.
+ */
+
+static const int DEFAULT_MAX_MSGS = 1000;
+// connections are numbered with one byte
+static const size_t MAX_CONNECTIONS = 255;
+
+struct CapturedMessage {
+	int64_t nTime;
+	unsigned char nConn;
+	std::vector<char> vData;	// header and payload
+};
+
+static bool ReadCapture(const std::string &strFile, unsigned char nConn, std::vector<CapturedMessage> &vMsgs){
+
+	FILE *file = fopen(strFile.c_str(), "rb");
+	if(file == NULL){
+		perror(strFile.c_str());
+		return false;
+	}
+	CAutoFile filein(file, SER_DISK, CLIENT_VERSION);
+
+	CMessageHeader::MessageStartChars pchMessageStart;
+	try {
+		char pchMagic[sizeof(CAPTURE_FILE_MAGIC)];
+		unsigned char nVersion;
+		std::string strAddr;
+		bool fInbound;
+
+		filein.read(pchMagic, sizeof(pchMagic));
+		filein >> nVersion;
+		if(memcmp(pchMagic, CAPTURE_FILE_MAGIC, sizeof(pchMagic)) != 0 || nVersion != CAPTURE_FILE_VERSION){
+			fprintf(stderr, "%s: not a capture file\n", strFile.c_str());
+			return false;
+		}
+		filein >> FLATDATA(pchMessageStart) >> strAddr >> fInbound;
+		printf("%s: %s peer %s\n", strFile.c_str(), fInbound ? "inbound" : "outbound", strAddr.c_str());
+	} catch(const std::exception &e){
+		fprintf(stderr, "%s: %s\n", strFile.c_str(), e.what());
+		return false;
+	}
+
+	size_t nRead = 0;
+	int64_t nTime = 0;
+	while(true){
+		CapturedMessage msg;
+		CMessageHeader hdr(pchMessageStart);
+		try {
+			uint64_t nDelta;
+			filein >> VARINT(nDelta) >> hdr;
+			if(hdr.nMessageSize > MAX_PROTOCOL_MESSAGE_LENGTH){
+				fprintf(stderr, "%s: oversized message, rest of the file ignored\n", strFile.c_str());
+				break;
+			}
+
+			CDataStream ssHeader(SER_NETWORK, PROTOCOL_VERSION);
+			ssHeader << hdr;
+			msg.vData.assign(ssHeader.begin(), ssHeader.end());
+			msg.vData.resize(ssHeader.size() + hdr.nMessageSize);
+			if(hdr.nMessageSize > 0)
+				filein.read(&msg.vData[ssHeader.size()], hdr.nMessageSize);
+
+			nTime += nDelta;
+		} catch(const std::exception &e){
+			break;
+		}
+		msg.nTime = nTime;
+		msg.nConn = nConn;
+		vMsgs.push_back(msg);
+		nRead++;
+	}
+
+	printf("%s: %u messages\n", strFile.c_str(), (unsigned int) nRead);
+	return true;
+}
+
+static bool WriteInput(const boost::filesystem::path &path, unsigned int nConnections,
+		std::vector<CapturedMessage>::const_iterator begin, std::vector<CapturedMessage>::const_iterator end){
+
+	FILE *file = fopen(path.string().c_str(), "wb");
+	if(file == NULL){
+		perror(path.string().c_str());
+		return false;
+	}
+
+	bool fRet = fputc(nConnections, file) != EOF;
+	for(auto it = begin; fRet && it != end; it++){
+		fRet = fputc(it->nConn, file) != EOF &&
+			fwrite(it->vData.data(), 1, it->vData.size(), file) == it->vData.size();
+	}
+	if(fclose(file) != 0)
+		fRet = false;
+
+	if(!fRet)
+		fprintf(stderr, "%s: write failed\n", path.string().c_str());
+	return fRet;
+}
+
+// Cut vMsgs into inputs of at most nMaxMsgs messages, named <prefix>-<n>.
+static bool WriteInputs(const boost::filesystem::path &pathOut, const std::string &strPrefix, unsigned int nConnections,
+		const std::vector<CapturedMessage> &vMsgs, size_t nMaxMsgs){
+
+	for(size_t nStart = 0, n = 0; nStart < vMsgs.size(); nStart += nMaxMsgs, n++){
+		const size_t nEnd = std::min(vMsgs.size(), nStart + nMaxMsgs);
+		if(!WriteInput(pathOut / strprintf("%s-%u", strPrefix, n), nConnections, vMsgs.begin() + nStart, vMsgs.begin() + nEnd))
+			return false;
+	}
+	return true;
+}
+
+int main(int argc, char *argv[]){
+
+	SetupEnvironment();
+	ParseParameters(argc, argv);
+
+	// options come first, ParseParameters() stops at the first capture file
+	int nFirstFile = 1;
+	while(nFirstFile < argc && argv[nFirstFile][0] == '-')
+		nFirstFile++;
+	const std::vector<std::string> vFiles(argv + nFirstFile, argv + argc);
+
+	if(!mapArgs.count("-out") || vFiles.empty()){
+		fprintf(stderr,
+			"usage: %s -out=<dir> [-maxmsgs=<n>] [-merge] [-network=main|test|regtest] <capture>...\n",
+			argv[0]);
+		return 1;
+	}
+
+	const CMessageHeader::MessageStartChars *pchMessageStart = NULL;
+	if(mapArgs.count("-network")){
+		const std::string strNetwork = GetArg("-network", "");
+		if(strNetwork == "main")
+			pchMessageStart = &Params(CBaseChainParams::MAIN).MessageStart();
+		else if(strNetwork == "test")
+			pchMessageStart = &Params(CBaseChainParams::TESTNET).MessageStart();
+		else if(strNetwork == "regtest")
+			pchMessageStart = &Params(CBaseChainParams::REGTEST).MessageStart();
+		else {
+			fprintf(stderr, "unknown -network %s\n", strNetwork.c_str());
+			return 1;
+		}
+	}
+
+	const boost::filesystem::path pathOut(GetArg("-out", ""));
+	const size_t nMaxMsgs = std::max<int64_t>(1, GetArg("-maxmsgs", DEFAULT_MAX_MSGS));
+	const bool fMerge = GetBoolArg("-merge", false);
+
+	if(fMerge && vFiles.size() > MAX_CONNECTIONS){
+		fprintf(stderr, "at most %u captures can be merged\n", (unsigned int) MAX_CONNECTIONS);
+		return 1;
+	}
+
+	try {
+		boost::filesystem::create_directories(pathOut);
+	} catch(const boost::filesystem::filesystem_error &e){
+		fprintf(stderr, "%s\n", e.what());
+		return 1;
+	}
+
+	std::vector<CapturedMessage> vMerged;
+	for(size_t i = 0; i < vFiles.size(); i++){
+		std::vector<CapturedMessage> vMsgs;
+		if(!ReadCapture(vFiles[i], fMerge ? i : 0, vMsgs))
+			return 1;
+
+		if(pchMessageStart != NULL){
+			for(CapturedMessage &msg : vMsgs)
+				memcpy(msg.vData.data(), *pchMessageStart, MESSAGE_START_SIZE);
+		}
+
+		if(fMerge){
+			vMerged.insert(vMerged.end(), vMsgs.begin(), vMsgs.end());
+			continue;
+		}
+		if(!WriteInputs(pathOut, boost::filesystem::path(vFiles[i]).stem().string(), 1, vMsgs, nMaxMsgs))
+			return 1;
+	}
+
+	if(fMerge){
+		// stable, so that each connection keeps its own order on equal times
+		std::stable_sort(vMerged.begin(), vMerged.end(), [](const CapturedMessage &a, const CapturedMessage &b){
+			return a.nTime < b.nTime;
+		});
+		if(!WriteInputs(pathOut, "merged", vFiles.size(), vMerged, nMaxMsgs))
+			return 1;
+	}
+
+	return 0;
+}
@@ -0,0 +1,127 @@
+#include "fuzz_chain.h"
+
+#include "chainparams.h"
+#include "consensus/validation.h"
+#include "crypto/common.h"
+#include "key.h"
+#include "main.h"
+#include "miner.h"
+#include "pow.h"
+#include "txmempool.h"
+#include "txdb.h"
+#include "util.h"
+
+#include <cassert>
+#include <cstdlib>
+#include <memory>
+
+#include <boost/filesystem.hpp>
+
+CScript fuzzMinerScript = CScript() << OP_TRUE;
+CCoinsViewDB *fuzzCoinsDB = NULL;
+
+static boost::filesystem::path fuzzDataDir;
+
+static void FuzzChainCleanup(){
+	boost::system::error_code ec;
+	boost::filesystem::remove_all(fuzzDataDir, ec);
+}
+
+void FuzzChainSetup(){
+
+	static bool fInitialized = false;
+	if(fInitialized)
+		return;
+	fInitialized = true;
+
+	assert(init_and_check_sodium() != -1);
+	ECC_Start();
+	SetupEnvironment();
+
+	// nobody reads the log and buffering it until a file is opened would leak
+	fPrintToDebugLog = false;
+
+	SelectParams(CBaseChainParams::REGTEST);
+
+	ClearDatadirCache();
+	fuzzDataDir = GetTempPath() / strprintf("fuzz_zen_%lu_%i", (unsigned long)GetTime(), (int)(GetRand(100000)));
+	boost::filesystem::create_directories(fuzzDataDir);
+	mapArgs["-datadir"] = fuzzDataDir.string();
+	atexit(FuzzChainCleanup);
+
+	pblocktree = new CBlockTreeDB(1 << 20, true);
+	fuzzCoinsDB = new CCoinsViewDB(1 << 23, true);
+	pcoinsTip = new CCoinsViewCache(fuzzCoinsDB);
+
+	assert(InitBlockIndex());
+}
+
+bool FuzzMineBlocks(int nBlocks){
+
+	for(int i = 0; i < nBlocks; i++){
+
+		std::unique_ptr<CBlockTemplate> pblocktemplate(CreateNewBlock(fuzzMinerScript));
+		if(!pblocktemplate)
+			return false;
+
+		// a process wide nonce in the coinbase keeps blocks mined on the same
+		// parent distinct, also across fuzz inputs that rewind the chain
+		static unsigned int nExtraNonce = 0;
+		CBlock *pblock = &pblocktemplate->block;
+		CMutableTransaction txCoinbase(pblock->vtx[0]);
+		txCoinbase.vin[0].scriptSig = (CScript() << (chainActive.Height() + 1) << CScriptNum(++nExtraNonce)) + COINBASE_FLAGS;
+		pblock->vtx[0] = txCoinbase;
+		pblock->hashMerkleRoot = pblock->BuildMerkleTree();
+
+		generateEquihash(*pblock);
+
+		CValidationState state;
+		if(!ProcessNewBlock(state, NULL, pblock, true, NULL))
+			return false;
+	}
+
+	return true;
+}
+
+bool FuzzMineBlockWith(const std::vector<CTransaction> &vtx){
+
+	{
+		CCoinsViewCache view(pcoinsTip);
+		for(const CTransaction &tx : vtx){
+			const CAmount nFee = view.GetValueIn(tx) - tx.GetValueOut();
+			CTxMemPoolEntry entry(tx, nFee, GetTime(), 0, chainActive.Height());
+			mempool.addUnchecked(tx.GetHash(), entry);
+		}
+	}
+
+	if(!FuzzMineBlocks(1))
+		return false;
+
+	bool fAllMined = true;
+	for(const CTransaction &tx : vtx){
+		if(mempool.exists(tx.GetHash())){
+			std::list<CTransaction> removedTxs;
+			std::list<CScCertificate> removedCerts;
+			mempool.remove(tx, removedTxs, removedCerts, true);
+			fAllMined = false;
+		}
+	}
+
+	return fAllMined;
+}
+
+bool FuzzGetCoinbaseOutput(int nHeight, COutPoint &outpoint, CAmount &nValue){
+
+	const CBlockIndex *pindex = chainActive[nHeight];
+	if(pindex == NULL)
+		return false;
+
+	CBlock block;
+	if(!ReadBlockFromDisk(block, pindex))
+		return false;
+
+	const CTransaction &coinbase = block.vtx[0];
+	outpoint = COutPoint(coinbase.GetHash(), 0);
+	nValue = coinbase.GetVout()[0].nValue;
+	return true;
+}
@@ -0,0 +1,44 @@
+#ifndef FUZZ_CHAIN_H
+#define FUZZ_CHAIN_H
+
+#include "amount.h"
+#include "script/script.h"
+
+#include <vector>
+
+class CCoinsViewDB;
+class COutPoint;
+class CTransaction;
+
+/*
+ * In-memory regtest chain for the standalone fuzz targets that need chain
+ * state (see fuzz_target.h).
+ *
+ * The block index and the coins live in in-memory leveldb instances, block
+ * files go to a temporary datadir that is removed at exit. No network, no
+ * RPC server and no background threads are started.
+ */
+
+/** Script paying the coinbase of every block mined by FuzzMineBlocks(). */
+extern CScript fuzzMinerScript;
+
+/** The database view below pcoinsTip. */
+extern CCoinsViewDB *fuzzCoinsDB;
+
+/** Select regtest and initialise the chain up to the genesis block. Only the first call does anything. */
+void FuzzChainSetup();
+
+/** Mine nBlocks blocks with mempool contents on top of the active chain, the
+ *  same way the "generate" RPC does. Returns false if a block is rejected. */
+bool FuzzMineBlocks(int nBlocks);
+
+/** Mine one block containing vtx, bypassing the mempool acceptance checks so
+ *  that transactions spending the non-standard miner outputs can be included.
+ *  Returns false if the block is rejected or leaves any of vtx out. */
+bool FuzzMineBlockWith(const std::vector<CTransaction> &vtx);
+
+/** The miner output of the coinbase at nHeight, spendable with an empty
+ *  scriptSig once mature. Returns false if nHeight is not in the active chain. */
+bool FuzzGetCoinbaseOutput(int nHeight, COutPoint &outpoint, CAmount &nValue);
+
+#endif
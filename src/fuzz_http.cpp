@@ -0,0 +1,203 @@
+#include "fuzz_target.h"
+#include "fuzz_chain.h"
+#include "FuzzedDataProvider.h"
+
+#include "httprpc.h"
+#include "httpserver.h"
+#include "netbase.h"
+#include "rpc/protocol.h"
+#include "rpc/server.h"
+#include "univalue.h"
+#include "util.h"
+#include "utilstrencodings.h"
+
+#include <cassert>
+#include <cstdint>
+#include <map>
+#include <set>
+#include <string>
+
+/*
+ * HTTP RPC and REST target.
+ *
+ * Builds HTTP requests from the input and hands them to the handlers
+ * registered by StartHTTPRPC() and StartREST(), synchronously and without
+ * libevent: no HTTP server, work queue or RPC worker thread is started. The
+ * JSON-RPC requests go through the real command table against an in-memory
+ * regtest chain, except for the commands below, which are refused before
+ * they run.
+ *
+ * URIs, bodies and methods are either raw bytes or picked from the known
+ * prefixes and commands, so the fuzzer does not have to find those first.
+ */
+
+// wallet and mining, plus whatever leaves the process, stops it or changes the
+// chain and mempool state that the next inputs would run against
+static const std::set<std::string> fuzzDisabledCategories = {
+	"wallet", "disclosure", "mining", "generating"
+};
+
+static const std::set<std::string> fuzzDisabledCommands = {
+	"stop", "addnode", "disconnectnode", "setban", "clearbanned", "setmocktime",
+	"dbg_do", "dbg_log", "invalidateblock", "reconsiderblock", "sendrawtransaction"
+};
+
+static const char *fuzzRestPrefixes[] = {
+	"/rest/tx/", "/rest/block/notxdetails/", "/rest/block/", "/rest/chaininfo",
+	"/rest/mempool/info", "/rest/mempool/contents", "/rest/headers/", "/rest/getutxos"
+};
+
+static const char *fuzzRestFormats[] = {
+	".bin", ".hex", ".json", ""
+};
+
+static const char *fuzzRPCCommands[] = {
+	"getinfo", "help", "getblockchaininfo", "getbestblockhash", "getblockcount",
+	"getblock", "getblockexpanded", "getblockhash", "getblockheader", "getchaintips",
+	"getdifficulty", "getmempoolinfo", "getrawmempool", "gettxout", "gettxoutsetinfo",
+	"verifychain", "getscinfo", "getactivecertdatahash", "getceasingcumsccommtreehash",
+	"getscgenesisinfo", "getrawtransaction", "createrawtransaction", "decoderawtransaction",
+	"decodescript", "signrawtransaction", "createmultisig",
+	"validateaddress", "verifymessage", "estimatefee", "estimatepriority",
+	"z_validateaddress", "getpeerinfo", "listbanned"
+};
+
+static const HTTPRequest::RequestMethod fuzzMethods[] = {
+	HTTPRequest::GET, HTTPRequest::POST, HTTPRequest::HEAD, HTTPRequest::PUT, HTTPRequest::UNKNOWN
+};
+
+static const char *FUZZ_RPC_USER = "fuzz";
+static const char *FUZZ_RPC_PASSWORD = "fuzz";
+
+class FuzzHTTPRequest : public HTTPRequest
+{
+private:
+	std::string strURI;
+	RequestMethod method;
+	std::map<std::string, std::string> mapHeaders;
+	std::string strBody;
+
+public:
+	int nStatus;
+	std::string strReply;
+
+	FuzzHTTPRequest(const std::string &strURIIn, RequestMethod methodIn, const std::string &strBodyIn) :
+		HTTPRequest(nullptr), strURI(strURIIn), method(methodIn), strBody(strBodyIn), nStatus(0) {}
+
+	~FuzzHTTPRequest()
+	{
+		// a handler that does not reply gets a 500 from the server, nothing
+		// to send here
+		replySent = true;
+	}
+
+	void SetHeader(const std::string &hdr, const std::string &value)
+	{
+		mapHeaders[hdr] = value;
+	}
+
+	std::string GetURI() { return strURI; }
+	CService GetPeer() { return CService("127.0.0.1", 0); }
+	RequestMethod GetRequestMethod() { return method; }
+
+	std::pair<bool, std::string> GetHeader(const std::string &hdr)
+	{
+		std::map<std::string, std::string>::const_iterator it = mapHeaders.find(hdr);
+		if (it == mapHeaders.end())
+			return std::make_pair(false, "");
+		return std::make_pair(true, it->second);
+	}
+
+	std::string ReadBody()
+	{
+		std::string rv;
+		rv.swap(strBody);
+		return rv;
+	}
+
+	void WriteHeader(const std::string &hdr, const std::string &value) {}
+
+	void WriteReply(int nStatusIn, const std::string &strReplyIn)
+	{
+		assert(!replySent);
+		nStatus = nStatusIn;
+		strReply = strReplyIn;
+		replySent = true;
+	}
+};
+
+static void FuzzRPCPreCommand(const CRPCCommand &cmd){
+	if(fuzzDisabledCategories.count(cmd.category) || fuzzDisabledCommands.count(cmd.name))
+		throw JSONRPCError(RPC_METHOD_NOT_FOUND, "Method disabled for fuzzing");
+}
+
+static std::string ConsumeRPCBody(FuzzedDataProvider &provider){
+
+	const size_t len = provider.ConsumeIntegralInRange<size_t>(0, 4096);
+
+	if(provider.ConsumeBool())
+		return provider.ConsumeBytesAsString(len);
+
+	std::string method = provider.ConsumeBool() ? provider.PickValueInArray(fuzzRPCCommands) : provider.ConsumeRandomLengthString(64);
+	return "{\"jsonrpc\":\"1.0\",\"id\":" + std::to_string(provider.ConsumeIntegral<uint16_t>()) +
+		",\"method\":\"" + method + "\",\"params\":" + provider.ConsumeBytesAsString(len) + "}";
+}
+
+static std::string ConsumeRESTURI(FuzzedDataProvider &provider){
+
+	if(provider.ConsumeBool())
+		return provider.ConsumeRandomLengthString(256);
+
+	std::string uri = provider.PickValueInArray(fuzzRestPrefixes);
+	uri += provider.ConsumeRandomLengthString(256);
+	uri += provider.PickValueInArray(fuzzRestFormats);
+	return uri;
+}
+
+void fuzz_init(){
+
+	FuzzChainSetup();
+	assert(FuzzMineBlocks(20));
+
+	mapArgs["-rpcuser"] = FUZZ_RPC_USER;
+	mapArgs["-rpcpassword"] = FUZZ_RPC_PASSWORD;
+
+	RPCServer::OnPreCommand(&FuzzRPCPreCommand);
+	assert(StartHTTPRPC());
+	assert(StartREST());
+	SetRPCWarmupFinished();
+}
+
+void fuzz_target(const uint8_t *data, size_t size){
+
+	FuzzedDataProvider provider(data, size);
+
+	const HTTPRequest::RequestMethod method = provider.ConsumeBool() ? HTTPRequest::POST : provider.PickValueInArray(fuzzMethods);
+	const bool fRPC = provider.ConsumeBool();
+
+	std::string strURI = fRPC ? "/" : ConsumeRESTURI(provider);
+	std::string strBody = fRPC ? ConsumeRPCBody(provider) : provider.ConsumeRemainingBytesAsString();
+
+	FuzzHTTPRequest req(strURI, method, strBody);
+
+	// only the right password or none at all: a wrong one costs a 250ms sleep
+	if(provider.ConsumeBool())
+		req.SetHeader("authorization", "Basic " + EncodeBase64(std::string(FUZZ_RPC_USER) + ":" + FUZZ_RPC_PASSWORD));
+
+	// the server rejects unknown methods before looking for a handler
+	if(method == HTTPRequest::UNKNOWN)
+		return;
+
+	HTTPRequestHandler handler;
+	std::string path;
+	if(!FindHTTPHandler(req.GetURI(), handler, path))
+		return;
+
+	handler(&req, path);
+
+	// the JSON-RPC handler answers in JSON, unless it did not get to parse the request
+	if(fRPC && req.nStatus != HTTP_BAD_METHOD && req.nStatus != HTTP_UNAUTHORIZED){
+		UniValue reply;
+		assert(reply.read(req.strReply));
+	}
+}
@@ -0,0 +1,81 @@
+#include "fuzz_target.h"
+
+#include <cstdint>
+#include <cstdio>
+#include <fstream>
+#include <iterator>
+#include <vector>
+
+/*
+ * Driver shared by all standalone fuzz targets.
+ *
+ * Built with -DFUZZ_LIBFUZZER it only exports the libFuzzer entry points.
+ * Otherwise it is a plain executable reading one input from the file given on
+ * the command line (or from stdin), which is what afl-fuzz expects. When
+ * compiled with afl-clang-fast the input is read in a persistent loop, so the
+ * process is not restarted for every execution.
+ */
+
+#ifdef FUZZ_LIBFUZZER
+
+extern "C" int LLVMFuzzerInitialize(int *argc, char ***argv){
+	fuzz_init();
+	return 0;
+}
+
+extern "C" int LLVMFuzzerTestOneInput(const uint8_t *data, size_t size){
+	fuzz_target(data, size);
+	return 0;
+}
+
+#else
+
+static bool read_input(const char *filename, std::vector<uint8_t> &bytes){
+
+	bytes.clear();
+
+	if(filename == NULL){
+		int c;
+		clearerr(stdin);
+		while((c = getchar()) != EOF)
+			bytes.push_back((uint8_t) c);
+		return true;
+	}
+
+	std::ifstream fuzz_file(filename, std::ios::binary);
+	if(!fuzz_file.is_open()){
+		fprintf(stderr, "failed to open %s\n", filename);
+		return false;
+	}
+
+	bytes.assign(std::istreambuf_iterator<char>(fuzz_file), std::istreambuf_iterator<char>());
+	return true;
+}
+
+#ifndef __AFL_HAVE_MANUAL_CONTROL
+#define __AFL_INIT() do {} while(0)
+#define __AFL_LOOP(n) (first_run ? !(first_run = false) : false)
+#endif
+
+int main(int argc, char *argv[]){
+
+	const char *filename = argc > 1 ? argv[1] : NULL;
+	std::vector<uint8_t> bytes;
+	bool first_run = true;
+
+	fuzz_init();
+
+	__AFL_INIT();
+
+	while(__AFL_LOOP(10000)){
+		if(!read_input(filename, bytes))
+			return 1;
+		fuzz_target(bytes.data(), bytes.size());
+	}
+
+	(void) first_run;
+
+	return 0;
+}
+
+#endif
@@ -0,0 +1,253 @@
+#include "fuzz_target.h"
+#include "fuzz_chain.h"
+#include "fuzz_scgen.h"
+#include "FuzzedDataProvider.h"
+
+#include "coins.h"
+#include "consensus/consensus.h"
+#include "consensus/validation.h"
+#include "main.h"
+#include "sync.h"
+#include "txdb.h"
+#include "txmempool.h"
+#include "util.h"
+
+#include <algorithm>
+#include <cassert>
+#include <cstdint>
+#include <stdexcept>
+#include <utility>
+#include <vector>
+
+/*
+ * Mempool and reorg state machine target.
+ *
+ * The input is a sequence of operations on the in-memory regtest chain with
+ * sidechains set up by FuzzSetupSidechains(): transactions and certificates
+ * from the generator in fuzz_scgen.h, funded with real coins, are offered to
+ * the mempool; blocks are mined out of it, invalidated, reconsidered, the tip
+ * is disconnected and connected again and competing branches are mined.
+ * After every operation:
+ *  - the mempool is checked against the tip (CTxMemPool::check), which covers
+ *    the sidechain maps, CSW nullifiers and top quality certificates;
+ *  - the block index is checked (CheckBlockIndex);
+ *  - when the tip moved, the coins are flushed and the last blocks are
+ *    disconnected and connected again on a copy of the database (VerifyDB).
+ *
+ * Proofs are not verified, neither by the mempool nor when blocks are
+ * connected (-skipblockscproof). Blocks are still solved, so the number of
+ * blocks mined per input is bounded. Every input starts from the same tip:
+ * whatever it mined is invalidated and removed from the block index at the
+ * end, and the mempool is emptied.
+ */
+
+enum FuzzOperation {
+	FUZZ_MP_ACCEPT_TX,
+	FUZZ_MP_ACCEPT_CERT,
+	FUZZ_MP_MINE,
+	FUZZ_MP_INVALIDATE_TIP,
+	FUZZ_MP_RECONSIDER,
+	FUZZ_MP_RECONNECT_TIP,
+	FUZZ_MP_REORG,
+	FUZZ_MP_MAX_VALUE = FUZZ_MP_REORG
+};
+
+static const int FUZZ_MP_MAX_STEPS = 64;
+static const int FUZZ_MP_MAX_BLOCKS = 8;
+static const int FUZZ_MP_VERIFY_DEPTH = 3;
+
+typedef std::vector<std::pair<COutPoint, CAmount> > FuzzCoins;
+
+// tip at the end of fuzz_init(), which every input goes back to
+static CBlockIndex *pindexBase = NULL;
+// mature coinbase outputs of the base chain
+static FuzzCoins vBaseCoins;
+
+// Replace the inputs of a generated object with up to nMax coins, which may
+// well be spent already. Returns the value they carry.
+static CAmount ConsumeInputs(FuzzedDataProvider &provider, const FuzzCoins &vCoins, std::vector<CTxIn> &vin, size_t nMax){
+	vin.clear();
+	CAmount nValueIn = 0;
+	const size_t nInputs = provider.ConsumeIntegralInRange<size_t>(0, nMax);
+	for(size_t i = 0; i < nInputs && !vCoins.empty(); i++){
+		const auto &coin = vCoins[provider.ConsumeIntegralInRange<size_t>(0, vCoins.size() - 1)];
+		vin.push_back(CTxIn(coin.first));
+		nValueIn += coin.second;
+	}
+	return nValueIn;
+}
+
+static void AcceptTx(FuzzedDataProvider &provider, FuzzScGenerator &generator, FuzzCoins &vCoins){
+	CMutableTransaction mtx = generator.ConsumeTransaction();
+	const CAmount nValueIn = ConsumeInputs(provider, vCoins, mtx.vin, 3);
+	mtx.resizeOut(0);
+
+	CAmount nChange;
+	try {
+		const CTransaction txNoChange(mtx);
+		nChange = nValueIn + txNoChange.GetCSWValueIn() - txNoChange.GetValueOut() - generator.ConsumeFee();
+	} catch(const std::runtime_error &e){
+		return;
+	}
+	// without change the fee is whatever is left, the mempool decides
+	if(nChange > 0)
+		mtx.addOut(CTxOut(nChange, fuzzMinerScript));
+
+	const CTransaction tx(mtx);
+	CValidationState state;
+	if(AcceptTxToMemoryPool(mempool, state, tx, LimitFreeFlag::OFF, RejectAbsurdFeeFlag::OFF,
+	                        MempoolProofVerificationFlag::DISABLED) == MempoolReturnValue::VALID && nChange > 0)
+		vCoins.push_back(std::make_pair(COutPoint(tx.GetHash(), 0), nChange));
+}
+
+static void AcceptCert(FuzzedDataProvider &provider, FuzzScGenerator &generator, FuzzCoins &vCoins){
+	CMutableScCertificate mcert = generator.ConsumeCertificate();
+	const CAmount nValueIn = ConsumeInputs(provider, vCoins, mcert.vin, 1);
+	mcert.resizeOut(0);
+
+	// backward transfers are paid by the sidechain, the fee comes out of the inputs
+	const CAmount nChange = nValueIn - generator.ConsumeFee();
+	if(nChange > 0)
+		mcert.addOut(CTxOut(nChange, fuzzMinerScript));
+
+	const CScCertificate cert(mcert);
+	CValidationState state;
+	if(AcceptCertificateToMemoryPool(mempool, state, cert, LimitFreeFlag::OFF, RejectAbsurdFeeFlag::OFF,
+	                                 MempoolProofVerificationFlag::DISABLED) == MempoolReturnValue::VALID && nChange > 0)
+		vCoins.push_back(std::make_pair(COutPoint(cert.GetHash(), 0), nChange));
+}
+
+// Disconnect the tip, never below the base chain. Returns the block, or NULL.
+static CBlockIndex *InvalidateTip(std::vector<CBlockIndex*> &vInvalidated){
+	CBlockIndex *pindex = chainActive.Tip();
+	if(pindex->nHeight <= pindexBase->nHeight)
+		return NULL;
+
+	CValidationState state;
+	InvalidateBlock(state, pindex);
+	ActivateBestChain(state);
+	vInvalidated.push_back(pindex);
+	return pindex;
+}
+
+static void Reconsider(CBlockIndex *pindex){
+	CValidationState state;
+	ReconsiderBlock(state, pindex);
+	ActivateBestChain(state);
+}
+
+static void CheckInvariants(bool fTipChanged){
+	mempool.check(pcoinsTip);
+	CheckBlockIndex();
+	assert(pcoinsTip->GetBestBlock() == chainActive.Tip()->GetBlockHash());
+
+	if(!fTipChanged)
+		return;
+
+	FlushStateToDisk();
+	assert(fuzzCoinsDB->GetBestBlock() == chainActive.Tip()->GetBlockHash());
+	assert(CVerifyDB().VerifyDB(fuzzCoinsDB, 4, FUZZ_MP_VERIFY_DEPTH));
+}
+
+// Go back to the base tip. Branches mined by the input may still be
+// candidates after the first invalidation, hence the loop. The blocks of the
+// input are then forgotten, failure status included, so that the next input
+// starts from the same block index.
+static void Rewind(){
+	CValidationState state;
+	while(chainActive.Tip() != pindexBase){
+		InvalidateBlock(state, chainActive[pindexBase->nHeight + 1]);
+		ActivateBestChain(state);
+	}
+	UnloadBlocksOutsideActiveChain();
+	mempool.clear();
+	FlushStateToDisk();
+}
+
+void fuzz_init(){
+	mapArgs["-allownonstandardtx"] = "1";
+	mapArgs["-skipblockscproof"] = "1";
+
+	FuzzChainSetup();
+	assert(FuzzSetupSidechains());
+
+	LOCK(cs_main);
+	pindexBase = chainActive.Tip();
+	// height 1 funds the sidechain creation
+	for(int nHeight = 2; nHeight <= pindexBase->nHeight - COINBASE_MATURITY; nHeight++){
+		COutPoint outpoint;
+		CAmount nValue;
+		assert(FuzzGetCoinbaseOutput(nHeight, outpoint, nValue));
+		vBaseCoins.push_back(std::make_pair(outpoint, nValue));
+	}
+
+	mempool.setSanityCheck(true);
+	fCheckBlockIndex = true;
+}
+
+void fuzz_target(const uint8_t *data, size_t size){
+
+	FuzzedDataProvider provider(data, size);
+
+	LOCK(cs_main);
+
+	FuzzCoins vCoins = vBaseCoins;
+	std::vector<CBlockIndex*> vInvalidated;
+	int nBlocks = 0;
+
+	for(int nStep = 0; nStep < FUZZ_MP_MAX_STEPS && provider.remaining_bytes() > 0; nStep++){
+		const uint256 hashTip = chainActive.Tip()->GetBlockHash();
+
+		switch(provider.ConsumeIntegralInRange<int>(0, FUZZ_MP_MAX_VALUE)){
+		case FUZZ_MP_ACCEPT_TX: {
+			FuzzScGenerator generator(provider, *pcoinsTip);
+			AcceptTx(provider, generator, vCoins);
+			break;
+		}
+		case FUZZ_MP_ACCEPT_CERT: {
+			FuzzScGenerator generator(provider, *pcoinsTip);
+			AcceptCert(provider, generator, vCoins);
+			break;
+		}
+		case FUZZ_MP_MINE:
+			if(nBlocks < FUZZ_MP_MAX_BLOCKS){
+				nBlocks++;
+				FuzzMineBlocks(1);
+			}
+			break;
+		case FUZZ_MP_INVALIDATE_TIP:
+			InvalidateTip(vInvalidated);
+			break;
+		case FUZZ_MP_RECONSIDER:
+			if(!vInvalidated.empty())
+				Reconsider(vInvalidated[provider.ConsumeIntegralInRange<size_t>(0, vInvalidated.size() - 1)]);
+			break;
+		case FUZZ_MP_RECONNECT_TIP: {
+			CBlockIndex *pindex = InvalidateTip(vInvalidated);
+			if(pindex != NULL){
+				vInvalidated.pop_back();
+				Reconsider(pindex);
+			}
+			break;
+		}
+		case FUZZ_MP_REORG: {
+			// a competing branch, which wins only if it ends up with more work
+			if(nBlocks >= FUZZ_MP_MAX_BLOCKS)
+				break;
+			CBlockIndex *pindex = InvalidateTip(vInvalidated);
+			if(pindex == NULL)
+				break;
+			const int nBranch = provider.ConsumeIntegralInRange<int>(1, std::min(2, FUZZ_MP_MAX_BLOCKS - nBlocks));
+			nBlocks += nBranch;
+			FuzzMineBlocks(nBranch);
+			vInvalidated.pop_back();
+			Reconsider(pindex);
+			break;
+		}
+		}
+
+		CheckInvariants(chainActive.Tip()->GetBlockHash() != hashTip);
+	}
+
+	Rewind();
+}
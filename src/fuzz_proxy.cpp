@@ -0,0 +1,697 @@
+#include "chainparams.h"
+#include "hash.h"
+#include "net.h"
+#include "netbase.h"
+#include "primitives/block.h"
+#include "primitives/transaction.h"
+#include "protocol.h"
+#include "streams.h"
+#include "util.h"
+#include "utilstrencodings.h"
+#include "version.h"
+
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <fstream>
+#include <random>
+#include <set>
+#include <sstream>
+#include <string>
+#include <vector>
+
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <poll.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+#include <boost/algorithm/string.hpp>
+
+/*
+ * Mutating P2P proxy.
+ *
+ * Sits between two zend -regtest nodes: node A connects to -listen, the proxy
+ * opens a connection to node B at -connect for each of them and forwards the
+ * traffic in both directions. One message out of -rate of the commands in
+ * -commands is mutated on the way. Mutations know the message layout (inv
+ * vectors, headers, transactions, blocks, addresses) and fall back to byte
+ * level edits for anything else. Message size and checksum are fixed up
+ * afterwards, unless the mutation is about them.
+ *
+ * Each direction of each connection draws from its own generator seeded from
+ * -seed, and every forwarded message is written to -log with the mutation it
+ * got, so that
+ *     fuzz_proxy -replay=<log> -connect=<node> [-replayconn=<n>] [-replaydir=<dir>]
+ * can send one side of a logged connection to a node again.
+ *
+ * The proxy only speaks plaintext P2P. TLS handshakes are dropped, so the
+ * nodes fall back to non-TLS on their next attempt (-tlsfallbacknontls,
+ * enabled by default).
+ *
+ * This replaces the old -fuzzmessagestest option, which randomly edited the
+ * bytes of our own outgoing messages.
+ */
+
+static const int DEFAULT_PROXY_RATE = 10;
+static const int DEFAULT_REPLAY_DELAY = 10;
+static const char *DEFAULT_PROXY_LOG = "fuzz_proxy.log";
+
+// the handshake is left alone unless asked for explicitly
+static const char *DEFAULT_PROXY_COMMANDS =
+	"inv,getdata,notfound,getblocks,getheaders,headers,tx,block,addr,ping,pong,mempool,reject";
+
+enum ProxyDirection {
+	DIR_TO_NODE = 0,	// from the node connecting to us to the -connect node
+	DIR_FROM_NODE = 1
+};
+
+static const char *dirNames[] = { "c2s", "s2c" };
+
+class MutationContext
+{
+private:
+	std::mt19937_64 rng;
+
+public:
+	MutationContext(uint64_t seed) : rng(seed) {}
+
+	uint64_t Rand(uint64_t nMax)
+	{
+		if (nMax == 0)
+			return 0;
+		return rng() % nMax;
+	}
+
+	bool Chance(uint64_t n)
+	{
+		return Rand(n) == 0;
+	}
+
+	uint256 MutateHash(const uint256 &hash, std::string &desc)
+	{
+		uint256 ret = hash;
+		const unsigned int bit = Rand(256);
+		*(ret.begin() + bit / 8) ^= (1u << (bit % 8));
+		desc += strprintf(":bit%u", bit);
+		return ret;
+	}
+};
+
+static void MutateBytes(MutationContext &ctx, std::vector<char> &data, std::string &desc){
+
+	const size_t pos = ctx.Rand(data.size() + 1);
+	// a position of an existing byte, the one pos falls on
+	const size_t nPos = data.empty() ? 0 : pos % data.size();
+	const char ch = (char) ctx.Rand(256);
+
+	switch(ctx.Rand(4)){
+		case 0:
+			if(data.empty())
+				break;
+			data[nPos] ^= ch ? ch : 1;
+			desc = strprintf("xor@%u=%02x", nPos, (uint8_t) ch);
+			return;
+		case 1:
+			if(data.empty())
+				break;
+			data.erase(data.begin() + nPos);
+			desc = strprintf("del@%u", nPos);
+			return;
+		case 2:
+			if(data.empty())
+				break;
+			data.resize(nPos);
+			desc = strprintf("truncate@%u", data.size());
+			return;
+	}
+
+	data.insert(data.begin() + pos, ch);
+	desc = strprintf("ins@%u=%02x", pos, (uint8_t) ch);
+}
+
+static void MutateHeader(MutationContext &ctx, CBlockHeader &header, std::string &desc){
+
+	switch(ctx.Rand(7)){
+		case 0:
+			header.nVersion = (int32_t) ctx.Rand(UINT32_MAX);
+			desc = "hdr-version";
+			break;
+		case 1:
+			desc = "hdr-prev";
+			header.hashPrevBlock = ctx.MutateHash(header.hashPrevBlock, desc);
+			break;
+		case 2:
+			desc = "hdr-merkle";
+			header.hashMerkleRoot = ctx.MutateHash(header.hashMerkleRoot, desc);
+			break;
+		case 3:
+			desc = "hdr-sccommitment";
+			header.hashScTxsCommitment = ctx.MutateHash(header.hashScTxsCommitment, desc);
+			break;
+		case 4:
+			header.nTime += (uint32_t) ctx.Rand(2 * 60 * 60 * 4) - 2 * 60 * 60 * 2;
+			desc = "hdr-time";
+			break;
+		case 5:
+			header.nBits ^= 1u << ctx.Rand(32);
+			desc = "hdr-bits";
+			break;
+		default:
+			if(!header.nSolution.empty() && ctx.Chance(2)){
+				header.nSolution[ctx.Rand(header.nSolution.size())] ^= 1u << ctx.Rand(8);
+				desc = "hdr-solution";
+			}else{
+				desc = "hdr-nonce";
+				header.nNonce = ctx.MutateHash(header.nNonce, desc);
+			}
+			break;
+	}
+}
+
+static void MutateTransaction(MutationContext &ctx, CMutableTransaction &tx, std::string &desc){
+
+	switch(ctx.Rand(7)){
+		case 0:
+			if(tx.vin.empty())
+				break;
+			tx.vin[ctx.Rand(tx.vin.size())].prevout.n ^= 1u << ctx.Rand(32);
+			desc = "tx-prevout-n";
+			return;
+		case 1:
+			if(tx.vin.empty())
+				break;
+			desc = "tx-prevout-hash";
+			{
+				CTxIn &in = tx.vin[ctx.Rand(tx.vin.size())];
+				in.prevout.hash = ctx.MutateHash(in.prevout.hash, desc);
+			}
+			return;
+		case 2:
+			if(tx.vin.empty())
+				break;
+			tx.vin.push_back(tx.vin[ctx.Rand(tx.vin.size())]);
+			desc = "tx-dup-vin";
+			return;
+		case 3:
+			if(tx.vin.empty())
+				break;
+			tx.vin.erase(tx.vin.begin() + ctx.Rand(tx.vin.size()));
+			desc = "tx-drop-vin";
+			return;
+		case 4:
+			{
+				CTxIn &in = tx.vin.empty() ? *tx.vin.insert(tx.vin.end(), CTxIn()) : tx.vin[ctx.Rand(tx.vin.size())];
+				if(in.scriptSig.empty())
+					in.scriptSig << OP_0;
+				in.scriptSig[ctx.Rand(in.scriptSig.size())] ^= 1u << ctx.Rand(8);
+			}
+			desc = "tx-scriptsig";
+			return;
+		case 5:
+			if(tx.getVout().empty())
+				break;
+			{
+				CTxOut &out = tx.getOut(ctx.Rand(tx.getVout().size()));
+				out.nValue = ctx.Chance(2) ? out.nValue + 1 : (CAmount) ctx.Rand(2 * MAX_MONEY) - 1;
+			}
+			desc = "tx-value";
+			return;
+	}
+
+	tx.nLockTime ^= 1u << ctx.Rand(32);
+	desc = "tx-locktime";
+}
+
+static bool MutateStructured(MutationContext &ctx, const std::string &strCommand, CDataStream &ssIn, CDataStream &ssOut, std::string &desc){
+
+	if(strCommand == "inv" || strCommand == "getdata" || strCommand == "notfound"){
+		std::vector<CInv> vInv;
+		ssIn >> vInv;
+		if(vInv.empty())
+			return false;
+		CInv &inv = vInv[ctx.Rand(vInv.size())];
+		switch(ctx.Rand(4)){
+			case 0:
+				inv.type = (int) ctx.Rand(8);
+				desc = strprintf("inv-type=%d", inv.type);
+				break;
+			case 1:
+				desc = "inv-hash";
+				inv.hash = ctx.MutateHash(inv.hash, desc);
+				break;
+			case 2:
+				vInv.push_back(inv);
+				desc = "inv-dup";
+				break;
+			default:
+				vInv.erase(vInv.begin() + ctx.Rand(vInv.size()));
+				desc = "inv-drop";
+				break;
+		}
+		ssOut << vInv;
+		return true;
+	}
+
+	if(strCommand == "headers"){
+		std::vector<CBlockHeaderForNetwork> vHeaders;
+		ssIn >> vHeaders;
+		if(vHeaders.empty())
+			return false;
+		const size_t n = ctx.Rand(vHeaders.size());
+		if(vHeaders.size() > 1 && ctx.Chance(4)){
+			std::swap(vHeaders[n], vHeaders[(n + 1) % vHeaders.size()]);
+			desc = strprintf("headers-swap@%u", n);
+		}else{
+			MutateHeader(ctx, vHeaders[n], desc);
+			desc += strprintf("@%u", n);
+		}
+		ssOut << vHeaders;
+		return true;
+	}
+
+	if(strCommand == "tx"){
+		CTransaction tx;
+		ssIn >> tx;
+		CMutableTransaction mtx(tx);
+		MutateTransaction(ctx, mtx, desc);
+		ssOut << mtx;
+		return true;
+	}
+
+	if(strCommand == "block"){
+		CBlock block;
+		ssIn >> block;
+		if(block.vtx.empty() || ctx.Chance(2)){
+			MutateHeader(ctx, block, desc);
+		}else if(ctx.Chance(3)){
+			const size_t n = ctx.Rand(block.vtx.size());
+			block.vtx.push_back(block.vtx[n]);
+			desc = strprintf("block-dup-tx@%u", n);
+		}else{
+			const size_t n = ctx.Rand(block.vtx.size());
+			CMutableTransaction mtx(block.vtx[n]);
+			MutateTransaction(ctx, mtx, desc);
+			block.vtx[n] = CTransaction(mtx);
+			desc = strprintf("block-%s@%u", desc, n);
+		}
+		ssOut << block;
+		return true;
+	}
+
+	if(strCommand == "addr"){
+		std::vector<CAddress> vAddr;
+		ssIn >> vAddr;
+		if(vAddr.empty())
+			return false;
+		CAddress &addr = vAddr[ctx.Rand(vAddr.size())];
+		switch(ctx.Rand(3)){
+			case 0:
+				addr.nTime ^= 1u << ctx.Rand(32);
+				desc = "addr-time";
+				break;
+			case 1:
+				addr.SetPort((unsigned short) ctx.Rand(65536));
+				desc = "addr-port";
+				break;
+			default:
+				vAddr.push_back(addr);
+				desc = "addr-dup";
+				break;
+		}
+		ssOut << vAddr;
+		return true;
+	}
+
+	if(strCommand == "ping" || strCommand == "pong"){
+		uint64_t nonce;
+		ssIn >> nonce;
+		nonce ^= 1ULL << ctx.Rand(64);
+		desc = "nonce";
+		ssOut << nonce;
+		return true;
+	}
+
+	return false;
+}
+
+// Mutate the complete message msg (header included). Returns the description
+// of the mutation for the log.
+static std::string MutateMessage(MutationContext &ctx, const std::string &strCommand, std::vector<char> &msg){
+
+	const int nHeaderSize = CMessageHeader::HEADER_SIZE;
+	std::vector<char> payload(msg.begin() + nHeaderSize, msg.end());
+	std::string desc;
+	bool fFixChecksum = true;
+	bool fFixSize = true;
+
+	if(ctx.Chance(50)){
+		fFixChecksum = false;
+		desc = "bad-checksum";
+		msg[CMessageHeader::CHECKSUM_OFFSET] ^= 1u << ctx.Rand(8);
+	}else if(ctx.Chance(50)){
+		fFixSize = false;
+		desc = "bad-size";
+		msg[CMessageHeader::MESSAGE_SIZE_OFFSET + ctx.Rand(2)] ^= 1u << ctx.Rand(8);
+	}else{
+		CDataStream ssIn(payload.data(), payload.data() + payload.size(), SER_NETWORK, PROTOCOL_VERSION);
+		CDataStream ssOut(SER_NETWORK, PROTOCOL_VERSION);
+		bool fStructured = false;
+
+		if(!ctx.Chance(4)){
+			try {
+				fStructured = MutateStructured(ctx, strCommand, ssIn, ssOut, desc);
+			} catch (const std::exception &) {
+				fStructured = false;
+			}
+		}
+
+		if(fStructured){
+			// keep whatever followed the object we know about
+			ssOut.write(&ssIn[0], ssIn.size());
+			payload.assign(ssOut.begin(), ssOut.end());
+		}else{
+			MutateBytes(ctx, payload, desc);
+		}
+	}
+
+	msg.resize(nHeaderSize);
+	msg.insert(msg.end(), payload.begin(), payload.end());
+
+	if(fFixSize)
+		WriteLE32((uint8_t *) &msg[CMessageHeader::MESSAGE_SIZE_OFFSET], payload.size());
+
+	if(fFixChecksum){
+		uint256 hash = Hash(payload.begin(), payload.end());
+		memcpy(&msg[CMessageHeader::CHECKSUM_OFFSET], hash.begin(), CMessageHeader::CHECKSUM_SIZE);
+	}
+
+	return desc;
+}
+
+struct ProxyStream {
+	int fdFrom;
+	int fdTo;
+	std::vector<char> vRecv;
+	unsigned int nMessages;
+	MutationContext ctx;
+
+	ProxyStream(int fdFromIn, int fdToIn, uint64_t seed) : fdFrom(fdFromIn), fdTo(fdToIn), nMessages(0), ctx(seed) {}
+};
+
+struct ProxyConnection {
+	unsigned int id;
+	ProxyStream streams[2];
+	bool fClosed;
+
+	ProxyConnection(unsigned int idIn, int fdClient, int fdNode, uint64_t seed) :
+		id(idIn),
+		streams{ProxyStream(fdClient, fdNode, seed ^ (0x9e3779b97f4a7c15ULL * (2 * idIn + 1))),
+		        ProxyStream(fdNode, fdClient, seed ^ (0x9e3779b97f4a7c15ULL * (2 * idIn + 2)))},
+		fClosed(false) {}
+};
+
+static std::set<std::string> setMutateCommands;
+static int nMutateRate = DEFAULT_PROXY_RATE;
+static FILE *logFile = NULL;
+
+static bool SendAll(int fd, const char *data, size_t size){
+	while(size > 0){
+		ssize_t n = send(fd, data, size, MSG_NOSIGNAL);
+		if(n <= 0)
+			return false;
+		data += n;
+		size -= n;
+	}
+	return true;
+}
+
+static int ConnectTo(const CService &addr){
+
+	struct sockaddr_storage sockaddr;
+	socklen_t len = sizeof(sockaddr);
+	if(!addr.GetSockAddr((struct sockaddr *) &sockaddr, &len)){
+		fprintf(stderr, "cannot connect to %s: unsupported address\n", addr.ToString().c_str());
+		return -1;
+	}
+
+	int fd = socket(((struct sockaddr *) &sockaddr)->sa_family, SOCK_STREAM, IPPROTO_TCP);
+	if(fd < 0){
+		perror("socket");
+		return -1;
+	}
+
+	if(connect(fd, (struct sockaddr *) &sockaddr, len) != 0){
+		perror("connect");
+		close(fd);
+		return -1;
+	}
+
+	return fd;
+}
+
+static int ListenOn(int port){
+
+	int fd = socket(AF_INET, SOCK_STREAM, IPPROTO_TCP);
+	if(fd < 0){
+		perror("socket");
+		return -1;
+	}
+
+	int one = 1;
+	setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+
+	struct sockaddr_in sin;
+	memset(&sin, 0, sizeof(sin));
+	sin.sin_family = AF_INET;
+	sin.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+	sin.sin_port = htons(port);
+
+	if(bind(fd, (struct sockaddr *) &sin, sizeof(sin)) != 0 || listen(fd, 8) != 0){
+		perror("bind/listen");
+		close(fd);
+		return -1;
+	}
+
+	return fd;
+}
+
+// Forward the complete messages buffered in stream. Returns false if the
+// connection has to be closed.
+static bool ForwardMessages(ProxyConnection &conn, int dir){
+
+	ProxyStream &stream = conn.streams[dir];
+	const int nHeaderSize = CMessageHeader::HEADER_SIZE;
+
+	while(stream.vRecv.size() >= (size_t) nHeaderSize){
+
+		if(memcmp(&stream.vRecv[0], Params().MessageStart(), MESSAGE_START_SIZE) != 0){
+			printf("conn %u %s: not a P2P message (TLS?), closing\n", conn.id, dirNames[dir]);
+			return false;
+		}
+
+		CMessageHeader hdr(Params().MessageStart());
+		CDataStream ssHeader(&stream.vRecv[0], &stream.vRecv[0] + nHeaderSize, SER_NETWORK, PROTOCOL_VERSION);
+		ssHeader >> hdr;
+
+		if(hdr.nMessageSize > MAX_PROTOCOL_MESSAGE_LENGTH){
+			printf("conn %u %s: oversized message, closing\n", conn.id, dirNames[dir]);
+			return false;
+		}
+
+		if(stream.vRecv.size() < nHeaderSize + hdr.nMessageSize)
+			return true;
+
+		std::vector<char> msg(stream.vRecv.begin(), stream.vRecv.begin() + nHeaderSize + hdr.nMessageSize);
+		stream.vRecv.erase(stream.vRecv.begin(), stream.vRecv.begin() + msg.size());
+
+		const std::string strCommand = hdr.GetCommand();
+		std::string desc = "-";
+
+		if(setMutateCommands.count(strCommand) && stream.ctx.Chance(nMutateRate))
+			desc = MutateMessage(stream.ctx, strCommand, msg);
+
+		fprintf(logFile, "%u %s %u %s %s %s\n", conn.id, dirNames[dir], stream.nMessages++,
+			strCommand.c_str(), desc.c_str(), HexStr(msg.begin(), msg.end()).c_str());
+		fflush(logFile);
+
+		if(!SendAll(stream.fdTo, msg.data(), msg.size()))
+			return false;
+	}
+
+	return true;
+}
+
+static void CloseConnection(ProxyConnection &conn){
+	if(conn.fClosed)
+		return;
+	printf("conn %u closed\n", conn.id);
+	close(conn.streams[DIR_TO_NODE].fdFrom);
+	close(conn.streams[DIR_FROM_NODE].fdFrom);
+	conn.fClosed = true;
+}
+
+static int RunProxy(const CService &addrNode, int nListenPort, uint64_t seed){
+
+	int fdListen = ListenOn(nListenPort);
+	if(fdListen < 0)
+		return 1;
+
+	printf("proxy listening on %d, forwarding to %s, seed %lu\n", nListenPort, addrNode.ToString().c_str(), (unsigned long) seed);
+	fprintf(logFile, "# seed=%lu rate=%d\n", (unsigned long) seed, nMutateRate);
+
+	std::vector<ProxyConnection> vConns;
+	unsigned int nNextId = 0;
+
+	while(true){
+
+		std::vector<struct pollfd> vPoll;
+		std::vector<std::pair<size_t, int> > vPollStream;
+
+		vPoll.push_back({fdListen, POLLIN, 0});
+		vPollStream.push_back(std::make_pair(0, -1));
+
+		for(size_t i = 0; i < vConns.size(); i++){
+			if(vConns[i].fClosed)
+				continue;
+			for(int dir = 0; dir < 2; dir++){
+				vPoll.push_back({vConns[i].streams[dir].fdFrom, POLLIN, 0});
+				vPollStream.push_back(std::make_pair(i, dir));
+			}
+		}
+
+		if(poll(vPoll.data(), vPoll.size(), -1) < 0){
+			perror("poll");
+			return 1;
+		}
+
+		for(size_t p = 0; p < vPoll.size(); p++){
+
+			if(!(vPoll[p].revents & (POLLIN | POLLHUP | POLLERR)))
+				continue;
+
+			if(vPollStream[p].second < 0){
+				int fdClient = accept(fdListen, NULL, NULL);
+				if(fdClient < 0)
+					continue;
+				int fdNode = ConnectTo(addrNode);
+				if(fdNode < 0){
+					close(fdClient);
+					continue;
+				}
+				printf("conn %u opened\n", nNextId);
+				vConns.push_back(ProxyConnection(nNextId++, fdClient, fdNode, seed));
+				continue;
+			}
+
+			ProxyConnection &conn = vConns[vPollStream[p].first];
+			const int dir = vPollStream[p].second;
+			if(conn.fClosed)
+				continue;
+
+			char buf[0x10000];
+			ssize_t n = recv(conn.streams[dir].fdFrom, buf, sizeof(buf), 0);
+			if(n <= 0){
+				CloseConnection(conn);
+				continue;
+			}
+
+			conn.streams[dir].vRecv.insert(conn.streams[dir].vRecv.end(), buf, buf + n);
+			if(!ForwardMessages(conn, dir))
+				CloseConnection(conn);
+		}
+	}
+
+	return 0;
+}
+
+// Send one side of a logged connection to the node at addrNode again.
+static int RunReplay(const CService &addrNode, const std::string &strLog, unsigned int nConn, const std::string &strDir, int nDelay){
+
+	std::ifstream log(strLog);
+	if(!log.is_open()){
+		fprintf(stderr, "failed to open %s\n", strLog.c_str());
+		return 1;
+	}
+
+	int fd = ConnectTo(addrNode);
+	if(fd < 0)
+		return 1;
+
+	unsigned int nSent = 0;
+	std::string line;
+	while(std::getline(log, line)){
+
+		if(line.empty() || line[0] == '#')
+			continue;
+
+		std::istringstream ss(line);
+		unsigned int id, nMsg;
+		std::string dir, strCommand, desc, hex;
+		if(!(ss >> id >> dir >> nMsg >> strCommand >> desc >> hex))
+			continue;
+		if(id != nConn || dir != strDir)
+			continue;
+
+		std::vector<unsigned char> msg = ParseHex(hex);
+		printf("replay %u %s %s\n", nMsg, strCommand.c_str(), desc.c_str());
+		if(!SendAll(fd, (const char *) msg.data(), msg.size())){
+			printf("node closed the connection after %u messages\n", nSent);
+			close(fd);
+			return 0;
+		}
+		nSent++;
+
+		// keep the node's answers from filling up the socket
+		char buf[0x10000];
+		while(recv(fd, buf, sizeof(buf), MSG_DONTWAIT) > 0);
+
+		MilliSleep(nDelay);
+	}
+
+	printf("replayed %u messages\n", nSent);
+	close(fd);
+	return 0;
+}
+
+int main(int argc, char *argv[]){
+
+	SetupEnvironment();
+	ParseParameters(argc, argv);
+
+	if(!mapArgs.count("-connect") || (!mapArgs.count("-listen") && !mapArgs.count("-replay"))){
+		fprintf(stderr,
+			"usage: %s -connect=<host:port> -listen=<port> [-seed=<n>] [-rate=<n>] [-commands=<cmd,...>] [-log=<file>]\n"
+			"       %s -connect=<host:port> -replay=<log> [-replayconn=<n>] [-replaydir=c2s|s2c] [-replaydelay=<ms>]\n",
+			argv[0], argv[0]);
+		return 1;
+	}
+
+	SelectParams(CBaseChainParams::REGTEST);
+
+	CService addrNode;
+	if(!Lookup(GetArg("-connect", "").c_str(), addrNode, Params().GetDefaultPort(), false)){
+		fprintf(stderr, "invalid -connect address\n");
+		return 1;
+	}
+
+	if(mapArgs.count("-replay"))
+		return RunReplay(addrNode, GetArg("-replay", ""), GetArg("-replayconn", 0), GetArg("-replaydir", dirNames[DIR_TO_NODE]),
+			GetArg("-replaydelay", DEFAULT_REPLAY_DELAY));
+
+	std::vector<std::string> vCommands;
+	boost::split(vCommands, GetArg("-commands", DEFAULT_PROXY_COMMANDS), boost::is_any_of(","));
+	setMutateCommands.insert(vCommands.begin(), vCommands.end());
+
+	nMutateRate = std::max<int64_t>(1, GetArg("-rate", DEFAULT_PROXY_RATE));
+
+	const uint64_t seed = mapArgs.count("-seed") ? (uint64_t) GetArg("-seed", 0) : (uint64_t) GetTime();
+
+	logFile = fopen(GetArg("-log", DEFAULT_PROXY_LOG).c_str(), "a");
+	if(logFile == NULL){
+		perror("cannot open log");
+		return 1;
+	}
+
+	return RunProxy(addrNode, GetArg("-listen", 0), seed);
+}
@@ -0,0 +1,596 @@
+#include "fuzz_scgen.h"
+#include "fuzz_chain.h"
+
+#include "coins.h"
+#include "key.h"
+#include "main.h"
+#include "script/standard.h"
+#include "utilstrencodings.h"
+#include "zen/forkmanager.h"
+
+#include <algorithm>
+#include <cassert>
+#include <set>
+#include <string>
+#include <vector>
+
+#include "gtest/libzendoo_test_files.h"
+
+// Keys and proofs that deserialize, one set per proving system. None of the
+// proofs verifies against the objects built here, the targets using this
+// generator do not get as far as proof verification.
+struct FuzzScSample {
+	Sidechain::ProvingSystemType type;
+	const std::vector<unsigned char> *certVk;
+	const std::vector<unsigned char> *cswVk;
+	const std::vector<unsigned char> *certProof;
+	const std::vector<unsigned char> *cswProof;
+};
+
+static const FuzzScSample fuzzScSamples[] = {
+	{Sidechain::ProvingSystemType::Darlin,
+		&SAMPLE_CERT_DARLIN_VK, &SAMPLE_CSW_DARLIN_VK, &SAMPLE_CERT_DARLIN_PROOF, &SAMPLE_CSW_DARLIN_PROOF},
+	{Sidechain::ProvingSystemType::CoboundaryMarlin,
+		&SAMPLE_CERT_COBMARLIN_VK, &SAMPLE_CSW_COBMARLIN_VK, &SAMPLE_CERT_COBMARLIN_PROOF, &SAMPLE_CSW_COBMARLIN_PROOF},
+};
+
+static const FuzzScSample &SampleFor(Sidechain::ProvingSystemType type){
+	for(const FuzzScSample &sample : fuzzScSamples)
+		if(sample.type == type)
+			return sample;
+	return fuzzScSamples[0];
+}
+
+CScVKey FuzzSampleVKey(Sidechain::ProvingSystemType type, bool fCsw){
+	const FuzzScSample &sample = SampleFor(type);
+	return CScVKey(fCsw ? *sample.cswVk : *sample.certVk);
+}
+
+// Bit vector sizes accepted by BitVectorCertificateFieldConfig::IsValid():
+// multiples of 254 and 8 spanning a power-of-two number of leaves.
+static const int32_t fuzzBitVectorSizes[] = {
+	254 * 8, 254 * 8 * 2, 254 * 8 * 4, 254 * 8 * 8
+};
+
+FuzzScGenerator::FuzzScGenerator(FuzzedDataProvider &providerIn, const CCoinsViewCache &viewIn) :
+	provider(providerIn), view(viewIn) {}
+
+bool FuzzScGenerator::Break()
+{
+	return provider.ConsumeIntegralInRange<uint8_t>(0, 15) == 15;
+}
+
+uint256 FuzzScGenerator::ConsumeUint256()
+{
+	std::vector<unsigned char> bytes = provider.ConsumeBytes<unsigned char>(32);
+	bytes.resize(32);
+	return uint256(bytes);
+}
+
+uint160 FuzzScGenerator::ConsumeUint160()
+{
+	std::vector<unsigned char> bytes = provider.ConsumeBytes<unsigned char>(20);
+	bytes.resize(20);
+	return uint160(bytes);
+}
+
+bool FuzzScGenerator::PickSidechain(CSidechain::State state, uint256 &scId)
+{
+	std::set<uint256> sScIds;
+	view.GetScIds(sScIds);
+
+	std::vector<uint256> vMatching;
+	for(const uint256 &id : sScIds)
+		if(view.GetSidechainState(id) == state)
+			vMatching.push_back(id);
+
+	if(vMatching.empty())
+		return false;
+
+	scId = vMatching[provider.ConsumeIntegralInRange<size_t>(0, vMatching.size() - 1)];
+	return true;
+}
+
+uint256 FuzzScGenerator::ConsumeScId(CSidechain::State state)
+{
+	uint256 scId;
+	if(Break()){
+		// a sidechain in some other state, or none at all
+		const CSidechain::State other = provider.PickValueInArray({
+			CSidechain::State::UNCONFIRMED, CSidechain::State::ALIVE, CSidechain::State::CEASED});
+		if(!PickSidechain(other, scId))
+			scId = ConsumeUint256();
+		return scId;
+	}
+
+	if(!PickSidechain(state, scId))
+		scId = ConsumeUint256();
+	return scId;
+}
+
+CAmount FuzzScGenerator::ConsumeAmount(CAmount nMax)
+{
+	if(Break())
+		return provider.PickValueInArray({CAmount(0), CAmount(-1), MAX_MONEY, MAX_MONEY + 1, nMax + 1});
+
+	if(nMax < 1)
+		return nMax;
+
+	switch(provider.ConsumeIntegralInRange<int>(0, 2)){
+		case 0:
+			return 1;
+		case 1:
+			return nMax;
+		default:
+			return provider.ConsumeIntegralInRange<CAmount>(1, nMax);
+	}
+}
+
+CAmount FuzzScGenerator::ConsumeFee()
+{
+	if(Break())
+		return provider.PickValueInArray({CAmount(-1), MAX_MONEY, MAX_MONEY + 1});
+
+	return provider.ConsumeBool() ? 0 : provider.ConsumeIntegralInRange<CAmount>(0, COIN);
+}
+
+CFieldElement FuzzScGenerator::ConsumeFieldElement()
+{
+	std::vector<unsigned char> bytes = provider.ConsumeBytes<unsigned char>(CFieldElement::ByteSize());
+	bytes.resize(CFieldElement::ByteSize());
+
+	// little endian, clearing the two top bits keeps it below the modulus
+	if(!Break())
+		bytes.back() &= 0x3f;
+
+	return CFieldElement(bytes);
+}
+
+std::vector<unsigned char> FuzzScGenerator::ConsumeBlob(const std::vector<unsigned char> &sample)
+{
+	std::vector<unsigned char> blob = sample;
+	if(!Break() || blob.empty())
+		return blob;
+
+	switch(provider.ConsumeIntegralInRange<int>(0, 3)){
+		case 0: {
+			const size_t pos = provider.ConsumeIntegralInRange<size_t>(0, blob.size() - 1);
+			blob[pos] ^= provider.ConsumeIntegralInRange<uint8_t>(1, 255);
+			break;
+		}
+		case 1:
+			blob.resize(provider.ConsumeIntegralInRange<size_t>(0, blob.size() - 1));
+			break;
+		case 2: {
+			// up to just past the proof plus key limit
+			const size_t len = provider.ConsumeIntegralInRange<size_t>(1, Sidechain::MAX_PROOF_PLUS_VK_SIZE + 1);
+			const std::vector<unsigned char> tail = provider.ConsumeBytes<unsigned char>(len);
+			blob.insert(blob.end(), tail.begin(), tail.end());
+			blob.resize(std::max(blob.size(), sample.size() + len));
+			break;
+		}
+		default:
+			blob = provider.ConsumeBytes<unsigned char>(provider.ConsumeIntegralInRange<size_t>(0, sample.size()));
+			break;
+	}
+
+	return blob;
+}
+
+CScVKey FuzzScGenerator::ConsumeVKey(Sidechain::ProvingSystemType type, bool fCsw)
+{
+	const FuzzScSample *sample = &SampleFor(type);
+	if(Break()){
+		// the key of the other proving system, or of the other circuit
+		sample = &fuzzScSamples[provider.ConsumeIntegralInRange<size_t>(0, ARRAYLEN(fuzzScSamples) - 1)];
+		fCsw = provider.ConsumeBool();
+	}
+
+	return CScVKey(ConsumeBlob(fCsw ? *sample->cswVk : *sample->certVk));
+}
+
+CScProof FuzzScGenerator::ConsumeProof(Sidechain::ProvingSystemType type, bool fCsw)
+{
+	const FuzzScSample *sample = &SampleFor(type);
+	if(Break()){
+		sample = &fuzzScSamples[provider.ConsumeIntegralInRange<size_t>(0, ARRAYLEN(fuzzScSamples) - 1)];
+		fCsw = provider.ConsumeBool();
+	}
+
+	return CScProof(ConsumeBlob(fCsw ? *sample->cswProof : *sample->certProof));
+}
+
+CTxIn FuzzScGenerator::ConsumeTxIn()
+{
+	// inputs are not looked up by the checks the generated objects go through
+	return CTxIn(COutPoint(ConsumeUint256(), provider.ConsumeIntegralInRange<uint32_t>(0, 3)));
+}
+
+CTxOut FuzzScGenerator::ConsumeTxOut()
+{
+	const CScript script = GetScriptForDestination(CKeyID(ConsumeUint160()), provider.ConsumeBool());
+	return CTxOut(ConsumeAmount(COIN), script);
+}
+
+CTxScCreationOut FuzzScGenerator::ConsumeScCreation()
+{
+	CTxScCreationOut sc;
+
+	const int nHeight = chainActive.Height() + 1;
+	const uint8_t nMaxVersion = zen::ForkManager::getInstance().getMaxSidechainVersion(nHeight);
+	sc.version = Break() ? provider.ConsumeIntegral<uint8_t>() : provider.ConsumeIntegralInRange<uint8_t>(0, nMaxVersion);
+
+	const int nMinEpoch = getScMinWithdrawalEpochLength();
+	const int nMaxEpoch = getScMaxWithdrawalEpochLength();
+	if(Break()){
+		const int nRandom = provider.ConsumeIntegral<int>();
+		sc.withdrawalEpochLength = provider.PickValueInArray({nMinEpoch - 1, nMaxEpoch + 1, 0, nRandom});
+	} else {
+		const int nInRange = provider.ConsumeIntegralInRange<int>(nMinEpoch, nMaxEpoch);
+		sc.withdrawalEpochLength = provider.PickValueInArray({nMinEpoch, nMinEpoch + 1, nMaxEpoch, nInRange});
+	}
+
+	sc.nValue = ConsumeAmount();
+	sc.address = ConsumeUint256();
+
+	const size_t nMaxCustomData = Sidechain::MAX_SC_CUSTOM_DATA_LEN + (Break() ? 1 : 0);
+	sc.customData = provider.ConsumeBytes<unsigned char>(provider.ConsumeIntegralInRange<size_t>(0, nMaxCustomData));
+
+	if(provider.ConsumeBool())
+		sc.constant = ConsumeFieldElement();
+
+	const Sidechain::ProvingSystemType type = provider.PickValueInArray(fuzzScSamples).type;
+	sc.wCertVk = ConsumeVKey(type, false);
+	if(provider.ConsumeBool())
+		sc.wCeasedVk = ConsumeVKey(type, true);
+
+	const size_t nFieldElementConfigs = provider.ConsumeIntegralInRange<size_t>(0, 4);
+	for(size_t i = 0; i < nFieldElementConfigs; i++){
+		const uint8_t nBits = Break() ? 0 : provider.ConsumeIntegralInRange<uint8_t>(1, 255);
+		sc.vFieldElementCertificateFieldConfig.push_back(FieldElementCertificateFieldConfig(nBits));
+	}
+
+	const size_t nBitVectorConfigs = provider.ConsumeIntegralInRange<size_t>(0, 2);
+	for(size_t i = 0; i < nBitVectorConfigs; i++){
+		int32_t nSizeBits = provider.PickValueInArray(fuzzBitVectorSizes);
+		int32_t nMaxCompressed = provider.ConsumeIntegralInRange<int32_t>(nSizeBits / 8 + 1,
+			BitVectorCertificateFieldConfig::MAX_COMPRESSED_SIZE_BYTES);
+		if(Break()){
+			nSizeBits = provider.ConsumeIntegralInRange<int32_t>(-1, BitVectorCertificateFieldConfig::MAX_BIT_VECTOR_SIZE_BITS + 1);
+			nMaxCompressed = provider.ConsumeIntegralInRange<int32_t>(-1, BitVectorCertificateFieldConfig::MAX_COMPRESSED_SIZE_BYTES + 1);
+		}
+		sc.vBitVectorCertificateFieldConfig.push_back(BitVectorCertificateFieldConfig(nSizeBits, nMaxCompressed));
+	}
+
+	sc.forwardTransferScFee = ConsumeFee();
+	sc.mainchainBackwardTransferRequestScFee = ConsumeFee();
+	sc.mainchainBackwardTransferRequestDataLength = Break() ? provider.ConsumeIntegral<uint8_t>() :
+		provider.ConsumeIntegralInRange<uint8_t>(0, Sidechain::MAX_SC_MBTR_DATA_LEN);
+
+	return sc;
+}
+
+CTxForwardTransferOut FuzzScGenerator::ConsumeForwardTransfer()
+{
+	CTxForwardTransferOut ft;
+	ft.scId = ConsumeScId(CSidechain::State::ALIVE);
+
+	// the amount has to be strictly above the current fee
+	const CAmount nFee = view.GetActiveCertView(ft.scId).forwardTransferScFee;
+	ft.nValue = std::max<CAmount>(nFee, 0) + ConsumeAmount(COIN);
+	if(Break())
+		ft.nValue = nFee;
+
+	ft.address = ConsumeUint256();
+	ft.mcReturnAddress = ConsumeUint160();
+	return ft;
+}
+
+CBwtRequestOut FuzzScGenerator::ConsumeBwtRequest()
+{
+	CBwtRequestOut mbtr;
+	mbtr.scId = ConsumeScId(CSidechain::State::ALIVE);
+
+	CSidechain sidechain;
+	view.GetSidechain(mbtr.scId, sidechain);
+
+	size_t nData = sidechain.fixedParams.mainchainBackwardTransferRequestDataLength;
+	if(Break())
+		nData = provider.ConsumeIntegralInRange<size_t>(0, Sidechain::MAX_SC_MBTR_DATA_LEN + 1);
+	for(size_t i = 0; i < nData; i++)
+		mbtr.vScRequestData.push_back(ConsumeFieldElement());
+
+	mbtr.mcDestinationAddress = ConsumeUint160();
+
+	const CAmount nFee = view.GetActiveCertView(mbtr.scId).mainchainBackwardTransferRequestScFee;
+	mbtr.scFee = Break() ? ConsumeFee() : std::max<CAmount>(nFee, 0) + provider.ConsumeIntegralInRange<CAmount>(0, 1);
+	return mbtr;
+}
+
+CTxCeasedSidechainWithdrawalInput FuzzScGenerator::ConsumeCswInput()
+{
+	CTxCeasedSidechainWithdrawalInput csw;
+	csw.scId = ConsumeScId(CSidechain::State::CEASED);
+
+	CSidechain sidechain;
+	view.GetSidechain(csw.scId, sidechain);
+
+	csw.nValue = ConsumeAmount(sidechain.balance);
+	csw.nullifier = ConsumeFieldElement();
+	csw.pubKeyHash = ConsumeUint160();
+
+	Sidechain::ProvingSystemType type = Sidechain::ProvingSystemType::Darlin;
+	if(sidechain.fixedParams.wCeasedVk.is_initialized())
+		type = sidechain.fixedParams.wCeasedVk->getProvingSystemType();
+	csw.scProof = ConsumeProof(type, true);
+
+	csw.actCertDataHash = Break() ? ConsumeFieldElement() : view.GetActiveCertView(csw.scId).certDataHash;
+	csw.ceasingCumScTxCommTree = Break() ? ConsumeFieldElement() : view.GetCeasingCumTreeHash(csw.scId);
+
+	if(Break()){
+		const std::vector<unsigned char> bytes = provider.ConsumeBytes<unsigned char>(provider.ConsumeIntegralInRange<size_t>(0, 64));
+		csw.redeemScript = CScript(bytes.begin(), bytes.end());
+	}
+
+	return csw;
+}
+
+CMutableTransaction FuzzScGenerator::ConsumeTransaction()
+{
+	CMutableTransaction mtx;
+	mtx.nVersion = Break() ? provider.PickValueInArray({TRANSPARENT_TX_VERSION, GROTH_TX_VERSION, PHGR_TX_VERSION}) : SC_TX_VERSION;
+
+	const size_t nInputs = provider.ConsumeIntegralInRange<size_t>(0, 2);
+	for(size_t i = 0; i < nInputs; i++)
+		mtx.vin.push_back(ConsumeTxIn());
+
+	const size_t nOutputs = provider.ConsumeIntegralInRange<size_t>(0, 2);
+	for(size_t i = 0; i < nOutputs; i++)
+		mtx.addOut(ConsumeTxOut());
+
+	const size_t nParts = provider.ConsumeIntegralInRange<size_t>(1, 4);
+	for(size_t i = 0; i < nParts; i++){
+		switch(provider.ConsumeIntegralInRange<int>(0, 3)){
+			case 0:
+				mtx.vsc_ccout.push_back(ConsumeScCreation());
+				break;
+			case 1:
+				mtx.vft_ccout.push_back(ConsumeForwardTransfer());
+				break;
+			case 2:
+				mtx.vmbtr_out.push_back(ConsumeBwtRequest());
+				break;
+			default:
+				mtx.vcsw_ccin.push_back(ConsumeCswInput());
+				break;
+		}
+	}
+
+	// the same output or input twice
+	if(Break() && !mtx.vcsw_ccin.empty())
+		mtx.vcsw_ccin.push_back(mtx.vcsw_ccin.back());
+	if(Break() && !mtx.vft_ccout.empty())
+		mtx.vft_ccout.push_back(mtx.vft_ccout.back());
+
+	mtx.nLockTime = Break() ? provider.ConsumeIntegral<uint32_t>() : 0;
+	return mtx;
+}
+
+FieldElementCertificateField FuzzScGenerator::ConsumeFieldElementField(const FieldElementCertificateFieldConfig &cfg, uint8_t version)
+{
+	const int nBits = cfg.getBitSize();
+	const int rem = nBits % 8;
+	std::vector<unsigned char> bytes = provider.ConsumeBytes<unsigned char>((nBits + 7) / 8);
+	bytes.resize((nBits + 7) / 8);
+
+	if(Break()){
+		bytes.resize(provider.ConsumeIntegralInRange<size_t>(0, CFieldElement::ByteSize() + 1));
+		return FieldElementCertificateField(bytes);
+	}
+
+	// the unused bits of the last byte must be zero: the low ones for
+	// version 0 sidechains, the high ones after the endianness fix
+	if(rem != 0 && !bytes.empty()){
+		if(version == 0)
+			bytes.back() &= (unsigned char)(0xff << (8 - rem));
+		else
+			bytes.back() &= (unsigned char)(0xff >> (8 - rem));
+	}
+
+	// with all 32 bytes in use the last one is the most significant in
+	// either layout and may take the value above the modulus
+	if(bytes.size() == CFieldElement::ByteSize())
+		bytes.back() &= 0x3f;
+
+	return FieldElementCertificateField(bytes);
+}
+
+BitVectorCertificateField FuzzScGenerator::ConsumeBitVectorField(const BitVectorCertificateFieldConfig &cfg)
+{
+	if(Break()){
+		const size_t len = provider.ConsumeIntegralInRange<size_t>(0, std::max(cfg.getMaxCompressedSizeBytes(), 1) + 1);
+		return BitVectorCertificateField(provider.ConsumeBytes<unsigned char>(len));
+	}
+
+	// stored uncompressed: the algorithm tag followed by the raw bits
+	std::vector<unsigned char> bytes = provider.ConsumeBytes<unsigned char>(cfg.getBitVectorSizeBits() / 8);
+	bytes.resize(cfg.getBitVectorSizeBits() / 8);
+	bytes.insert(bytes.begin(), (unsigned char)CompressionAlgorithm::Uncompressed);
+	return BitVectorCertificateField(bytes);
+}
+
+CMutableScCertificate FuzzScGenerator::ConsumeCertificate()
+{
+	return ConsumeCertificate(ConsumeScId(CSidechain::State::ALIVE));
+}
+
+CMutableScCertificate FuzzScGenerator::ConsumeCertificate(const uint256 &scId)
+{
+	CMutableScCertificate cert;
+	cert.nVersion = SC_CERT_VERSION;
+	cert.scId = scId;
+
+	CSidechain sidechain;
+	view.GetSidechain(scId, sidechain);
+
+	const int nHeight = chainActive.Height() + 1;
+	const int32_t nLastEpoch = sidechain.lastTopQualityCertReferencedEpoch;
+
+	// the epoch still open for certificates, the one of the last top quality
+	// certificate or the next one, as CheckCertTiming expects
+	const bool fRandomEpoch = Break();
+	if(fRandomEpoch){
+		cert.epochNumber = provider.ConsumeIntegral<int32_t>();
+	} else {
+		const int32_t nCurrent = sidechain.isCreationConfirmed() ? sidechain.EpochFor(nHeight) - 1 : 0;
+		cert.epochNumber = provider.PickValueInArray({nLastEpoch, nLastEpoch + 1, nCurrent, nCurrent + 1});
+		if(cert.epochNumber < 0)
+			cert.epochNumber = 0;
+	}
+
+	if(Break()){
+		cert.quality = provider.ConsumeIntegral<int64_t>();
+	} else if(cert.epochNumber == nLastEpoch){
+		// has to beat the quality already in the chain, probe the boundary
+		const int64_t nLastQuality = sidechain.lastTopQualityCertQuality;
+		cert.quality = nLastQuality + provider.ConsumeIntegralInRange<int64_t>(-1, 2);
+	} else {
+		cert.quality = provider.ConsumeIntegralInRange<int64_t>(0, 16);
+	}
+
+	// an arbitrary epoch would overflow the height computation
+	const CBlockIndex *pindexEnd = fRandomEpoch ? NULL : chainActive[sidechain.GetEndHeightForEpoch(cert.epochNumber)];
+	if(pindexEnd != NULL && !Break())
+		cert.endEpochCumScTxCommTreeRoot = pindexEnd->scCumTreeHash;
+	else
+		cert.endEpochCumScTxCommTreeRoot = ConsumeFieldElement();
+
+	cert.scProof = ConsumeProof(sidechain.fixedParams.wCertVk.IsNull() ?
+		Sidechain::ProvingSystemType::Darlin : sidechain.fixedParams.wCertVk.getProvingSystemType(), false);
+
+	// one field per configuration, occasionally one too many or too few
+	const uint8_t version = sidechain.fixedParams.version;
+	for(const FieldElementCertificateFieldConfig &cfg : sidechain.fixedParams.vFieldElementCertificateFieldConfig)
+		cert.vFieldElementCertificateField.push_back(ConsumeFieldElementField(cfg, version));
+	for(const BitVectorCertificateFieldConfig &cfg : sidechain.fixedParams.vBitVectorCertificateFieldConfig)
+		cert.vBitVectorCertificateField.push_back(ConsumeBitVectorField(cfg));
+	if(Break()){
+		if(!cert.vFieldElementCertificateField.empty() && provider.ConsumeBool())
+			cert.vFieldElementCertificateField.pop_back();
+		else
+			cert.vFieldElementCertificateField.push_back(FieldElementCertificateField(
+				provider.ConsumeBytes<unsigned char>(provider.ConsumeIntegralInRange<size_t>(0, 32))));
+	}
+
+	cert.forwardTransferScFee = ConsumeFee();
+	cert.mainchainBackwardTransferRequestScFee = ConsumeFee();
+
+	if(!Break())
+		cert.vin.push_back(ConsumeTxIn());
+
+	const size_t nChange = provider.ConsumeIntegralInRange<size_t>(0, 2);
+	for(size_t i = 0; i < nChange; i++)
+		cert.addOut(ConsumeTxOut());
+
+	// backward transfers within what the sidechain can pay out
+	CAmount nAvailable = sidechain.balance;
+	if(cert.epochNumber == nLastEpoch)
+		nAvailable += sidechain.lastTopQualityCertBwtAmount;
+
+	const size_t nBwt = provider.ConsumeIntegralInRange<size_t>(0, 3);
+	for(size_t i = 0; i < nBwt; i++){
+		const CAmount nValue = Break() ? ConsumeAmount() :
+			provider.ConsumeIntegralInRange<CAmount>(0, std::max<CAmount>(nAvailable, 0));
+		nAvailable -= nValue;
+		const CScript script = GetScriptForDestination(CKeyID(ConsumeUint160()), false);
+		cert.addBwt(CTxOut(nValue, script));
+	}
+
+	return cert;
+}
+
+// the chain is mined past the sidechain version fork before the sidechains
+// are created
+static const int FUZZ_SC_CREATION_HEIGHT = 461;
+
+// epoch length of the sidechains that have their first certificate window
+// open at the tip
+static const int FUZZ_SC_EPOCH_LENGTH = 20;
+
+static const CAmount FUZZ_SC_TX_FEE = 10000;
+
+static CTxScCreationOut FuzzScCreation(uint8_t version, int nEpochLength, Sidechain::ProvingSystemType type, bool fCsw){
+	CTxScCreationOut sc;
+	sc.version = version;
+	sc.withdrawalEpochLength = nEpochLength;
+	sc.nValue = COIN;
+	sc.address = uint256S("fa");
+	sc.wCertVk = FuzzSampleVKey(type, false);
+	if(fCsw)
+		sc.wCeasedVk = FuzzSampleVKey(type, true);
+	sc.forwardTransferScFee = 0;
+	sc.mainchainBackwardTransferRequestScFee = 0;
+	sc.mainchainBackwardTransferRequestDataLength = 0;
+	return sc;
+}
+
+// One transaction creating sidechains in every state the generator can
+// target once FUZZ_SC_EPOCH_LENGTH more blocks are mined:
+//   - ceased, with CSW support,
+//   - alive in the window for the epoch 0 certificate, version 0 and 1,
+//     with custom fields, a constant and mainchain backward transfer requests,
+//   - alive and far from any certificate window.
+static CTransaction FuzzScCreationTx(){
+
+	COutPoint prevout;
+	CAmount nValue;
+	assert(FuzzGetCoinbaseOutput(1, prevout, nValue));
+
+	std::vector<CTxScCreationOut> vSc;
+
+	vSc.push_back(FuzzScCreation(0, getScMinWithdrawalEpochLength(), Sidechain::ProvingSystemType::Darlin, true));
+
+	CTxScCreationOut sc = FuzzScCreation(0, FUZZ_SC_EPOCH_LENGTH, Sidechain::ProvingSystemType::Darlin, false);
+	sc.vFieldElementCertificateFieldConfig.push_back(FieldElementCertificateFieldConfig(4));
+	sc.vFieldElementCertificateFieldConfig.push_back(FieldElementCertificateFieldConfig(255));
+	vSc.push_back(sc);
+
+	sc = FuzzScCreation(1, FUZZ_SC_EPOCH_LENGTH, Sidechain::ProvingSystemType::CoboundaryMarlin, true);
+	sc.constant = CFieldElement(std::vector<unsigned char>(CFieldElement::ByteSize(), 0x01));
+	sc.vFieldElementCertificateFieldConfig.push_back(FieldElementCertificateFieldConfig(31));
+	sc.vBitVectorCertificateFieldConfig.push_back(BitVectorCertificateFieldConfig(254 * 8 * 2, 1024));
+	sc.forwardTransferScFee = 1000;
+	sc.mainchainBackwardTransferRequestScFee = 1000;
+	sc.mainchainBackwardTransferRequestDataLength = 2;
+	vSc.push_back(sc);
+
+	sc = FuzzScCreation(1, getScMaxWithdrawalEpochLength(), Sidechain::ProvingSystemType::Darlin, true);
+	sc.mainchainBackwardTransferRequestDataLength = Sidechain::MAX_SC_MBTR_DATA_LEN;
+	vSc.push_back(sc);
+
+	CMutableTransaction mtx;
+	mtx.nVersion = SC_TX_VERSION;
+	mtx.vin.push_back(CTxIn(prevout));
+
+	CAmount nChange = nValue - FUZZ_SC_TX_FEE;
+	for(const CTxScCreationOut &out : vSc){
+		mtx.vsc_ccout.push_back(out);
+		nChange -= out.nValue;
+	}
+	mtx.addOut(CTxOut(nChange, fuzzMinerScript));
+
+	return mtx;
+}
+
+bool FuzzSetupSidechains(){
+
+	if(chainActive.Height() < FUZZ_SC_CREATION_HEIGHT - 1 && !FuzzMineBlocks(FUZZ_SC_CREATION_HEIGHT - 1 - chainActive.Height()))
+		return false;
+
+	std::vector<CTransaction> vtx;
+	vtx.push_back(FuzzScCreationTx());
+	if(!FuzzMineBlockWith(vtx))
+		return false;
+
+	return FuzzMineBlocks(FUZZ_SC_EPOCH_LENGTH);
+}
@@ -0,0 +1,82 @@
+#ifndef FUZZ_SCGEN_H
+#define FUZZ_SCGEN_H
+
+#include "FuzzedDataProvider.h"
+#include "primitives/certificate.h"
+#include "primitives/transaction.h"
+#include "sc/sidechain.h"
+#include "sc/sidechaintypes.h"
+
+#include <vector>
+
+class CCoinsViewCache;
+
+/*
+ * Structure-aware generator of sidechain objects for the fuzz targets.
+ *
+ * Random bytes practically never decode into a creation output with a usable
+ * verification key, a transfer to a sidechain that exists, or a certificate
+ * whose epoch, quality and end-epoch cumulative tree match its sidechain. The
+ * generator reads the sidechains from a view and builds objects that are
+ * valid by construction, then lets the input break single fields (bounds,
+ * off-by-one epochs and qualities, mismatching proving systems, corrupted
+ * keys and proofs, ...). Most executions thus get through parsing and into
+ * the semantic and contextual checks.
+ *
+ * chainActive is read to fill in the cumulative trees, so cs_main must be
+ * held while generating.
+ */
+class FuzzScGenerator
+{
+public:
+	FuzzScGenerator(FuzzedDataProvider &providerIn, const CCoinsViewCache &viewIn);
+
+	/** Pick a known sidechain in the given state. Returns false if there is none. */
+	bool PickSidechain(CSidechain::State state, uint256 &scId);
+
+	CAmount ConsumeAmount(CAmount nMax = MAX_MONEY);
+	CAmount ConsumeFee();
+	CFieldElement ConsumeFieldElement();
+
+	CTxScCreationOut ConsumeScCreation();
+	CTxForwardTransferOut ConsumeForwardTransfer();
+	CBwtRequestOut ConsumeBwtRequest();
+	CTxCeasedSidechainWithdrawalInput ConsumeCswInput();
+
+	/** A sidechain transaction with a mix of the outputs and inputs above. */
+	CMutableTransaction ConsumeTransaction();
+
+	/** A certificate for one of the alive sidechains. */
+	CMutableScCertificate ConsumeCertificate();
+	CMutableScCertificate ConsumeCertificate(const uint256 &scId);
+
+private:
+	FuzzedDataProvider &provider;
+	const CCoinsViewCache &view;
+
+	// True once in a while; false when the input is exhausted, so that short
+	// inputs produce valid objects.
+	bool Break();
+
+	uint256 ConsumeUint256();
+	uint160 ConsumeUint160();
+	uint256 ConsumeScId(CSidechain::State state);
+	std::vector<unsigned char> ConsumeBlob(const std::vector<unsigned char> &sample);
+	CScVKey ConsumeVKey(Sidechain::ProvingSystemType type, bool fCsw);
+	CScProof ConsumeProof(Sidechain::ProvingSystemType type, bool fCsw);
+	FieldElementCertificateField ConsumeFieldElementField(const FieldElementCertificateFieldConfig &cfg, uint8_t version);
+	BitVectorCertificateField ConsumeBitVectorField(const BitVectorCertificateFieldConfig &cfg);
+	CTxIn ConsumeTxIn();
+	CTxOut ConsumeTxOut();
+};
+
+/** A verification key of the given proving system that deserializes, for
+ *  setting up sidechains outside of the generator. */
+CScVKey FuzzSampleVKey(Sidechain::ProvingSystemType type, bool fCsw);
+
+/** Extend the chain set up by FuzzChainSetup() with sidechains in all the
+ *  states the generator targets: ceased, alive with the window for the first
+ *  certificate open at the tip, alive with no window in sight. */
+bool FuzzSetupSidechains();
+
+#endif
@@ -0,0 +1,115 @@
+#include "fuzz_target.h"
+#include "FuzzedDataProvider.h"
+
+#include "pubkey.h"
+#include "script/interpreter.h"
+#include "script/script.h"
+#include "script/script_error.h"
+#include "util.h"
+
+#include <cassert>
+#include <cstdint>
+#include <vector>
+
+/*
+ * Script interpreter target.
+ *
+ * Runs EvalScript/VerifyScript on fuzzed scripts and flags, without building
+ * a transaction around them. Signatures, lock times and the block hashes
+ * referenced by OP_CHECKBLOCKATHEIGHT are not checked for real: the checker
+ * below answers from a pool of bits taken from the input, so every branch
+ * after a signature or replay-protection check is reachable and no time is
+ * spent in secp256k1.
+ */
+
+class FuzzSignatureChecker : public BaseSignatureChecker
+{
+private:
+	std::vector<uint8_t> vBits;
+	mutable size_t nNext;
+
+	bool NextBit() const
+	{
+		if (vBits.empty())
+			return false;
+		const size_t bit = nNext++ % (vBits.size() * 8);
+		return (vBits[bit / 8] >> (bit % 8)) & 1;
+	}
+
+public:
+	FuzzSignatureChecker(const std::vector<uint8_t> &vBitsIn) : vBits(vBitsIn), nNext(0) {}
+
+	bool CheckSig(const std::vector<unsigned char>& scriptSig, const std::vector<unsigned char>& vchPubKey, const CScript& scriptCode) const
+	{
+		return NextBit();
+	}
+
+	bool CheckLockTime(const CScriptNum& nLockTime) const
+	{
+		return NextBit();
+	}
+
+	bool CheckBlockHash(const int32_t nHeight, const std::vector<unsigned char>& nBlockHash) const
+	{
+		// the interpreter has already rejected anything longer than a hash
+		assert(nBlockHash.size() <= 32);
+		return NextBit();
+	}
+};
+
+static CScript ConsumeScript(FuzzedDataProvider &provider){
+	const size_t len = provider.ConsumeIntegralInRange<size_t>(0, MAX_SCRIPT_SIZE + 1);
+	const std::vector<unsigned char> bytes = provider.ConsumeBytes<unsigned char>(len);
+	return CScript(bytes.begin(), bytes.end());
+}
+
+// Append the <block hash> <height> OP_CHECKBLOCKATHEIGHT suffix that the
+// replay-protected output templates end with.
+static void AppendReplayProtection(FuzzedDataProvider &provider, CScript &script){
+	const std::vector<unsigned char> blockHash = provider.ConsumeBytes<unsigned char>(provider.ConsumeIntegralInRange<size_t>(0, 33));
+	script << blockHash << CScriptNum(provider.ConsumeIntegral<int32_t>()) << OP_CHECKBLOCKATHEIGHT;
+}
+
+void fuzz_init(){
+	static ECCVerifyHandle verifyHandle;
+
+	// the interpreter logs failed OP_CHECKBLOCKATHEIGHT checks; with no debug
+	// log open those messages would pile up in memory
+	fPrintToDebugLog = false;
+}
+
+void fuzz_target(const uint8_t *data, size_t size){
+
+	FuzzedDataProvider provider(data, size);
+
+	unsigned int flags = provider.ConsumeIntegral<unsigned int>();
+	const bool fVerify = provider.ConsumeBool();
+	const bool fReplayProtection = provider.ConsumeBool();
+
+	FuzzSignatureChecker checker(provider.ConsumeBytes<uint8_t>(provider.ConsumeIntegralInRange<size_t>(0, 8)));
+
+	ScriptError serror;
+
+	if(!fVerify){
+		CScript script = ConsumeScript(provider);
+		if(fReplayProtection)
+			AppendReplayProtection(provider, script);
+
+		std::vector<std::vector<unsigned char> > stack;
+		const bool fResult = EvalScript(stack, script, flags, checker, &serror);
+		assert(fResult == (serror == SCRIPT_ERR_OK));
+		return;
+	}
+
+	// VerifyScript refuses CLEANSTACK without P2SH by assertion
+	if(flags & SCRIPT_VERIFY_CLEANSTACK)
+		flags |= SCRIPT_VERIFY_P2SH;
+
+	const CScript scriptSig = ConsumeScript(provider);
+	CScript scriptPubKey = ConsumeScript(provider);
+	if(fReplayProtection)
+		AppendReplayProtection(provider, scriptPubKey);
+
+	const bool fResult = VerifyScript(scriptSig, scriptPubKey, flags, checker, &serror);
+	assert(fResult == (serror == SCRIPT_ERR_OK));
+}
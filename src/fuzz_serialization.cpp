@@ -0,0 +1,176 @@
+#include "fuzz_target.h"
+#include "FuzzedDataProvider.h"
+
+#include "consensus/consensus.h"
+#include "primitives/block.h"
+#include "primitives/certificate.h"
+#include "primitives/transaction.h"
+#include "serialize.h"
+#include "streams.h"
+#include "version.h"
+
+#include <cassert>
+#include <cstdint>
+#include <cstring>
+#include <exception>
+#include <vector>
+
+/*
+ * Differential round-trip target for the consensus objects.
+ *
+ * The input is deserialized as one of the objects below and serialized
+ * again. For every object that parses we require that
+ *   - the new encoding is byte-identical to the consumed input,
+ *   - GetSerializeSize() agrees with the size of the new encoding,
+ *   - the hash survives the round-trip (and matches the hash computed on the
+ *     fly by the mutable counterpart, for transactions and certificates).
+ * Any difference means that two encodings map onto the same object, i.e. a
+ * malleability bug.
+ */
+
+enum FuzzSerializationObject : uint8_t {
+	FUZZ_SER_TRANSACTION = 0,
+	FUZZ_SER_CERTIFICATE,
+	FUZZ_SER_BLOCK,
+	FUZZ_SER_SC_CREATION_OUT,
+	FUZZ_SER_FORWARD_TRANSFER_OUT,
+	FUZZ_SER_BWT_REQUEST_OUT,
+	FUZZ_SER_CSW_INPUT,
+	FUZZ_SER_BACKWARD_TRANSFER_OUT,
+	FUZZ_SER_MAX_VALUE = FUZZ_SER_BACKWARD_TRANSFER_OUT
+};
+
+// Sidechain fields are only (de)serialized for some versions, so the fuzzer
+// may ask for the version to be forced instead of having to guess it.
+static const int32_t fuzzTxVersions[] = {
+	SC_TX_VERSION, GROTH_TX_VERSION, PHGR_TX_VERSION, TRANSPARENT_TX_VERSION
+};
+
+static const int32_t fuzzBlockVersions[] = {
+	BLOCK_VERSION_SC_SUPPORT, 4
+};
+
+static const int fuzzSerTypes[] = {
+	SER_NETWORK, SER_DISK, SER_GETHASH
+};
+
+// Objects without a hash of their own only get the byte and size checks.
+template <typename T>
+static void CheckHash(const T &original, const T &reparsed){}
+
+static void CheckHash(const CTransaction &original, const CTransaction &reparsed){
+	assert(original.GetHash() == reparsed.GetHash());
+	assert(original.GetHash() == CMutableTransaction(original).GetHash());
+}
+
+static void CheckHash(const CScCertificate &original, const CScCertificate &reparsed){
+	assert(original.GetHash() == reparsed.GetHash());
+	assert(original.GetHash() == CMutableScCertificate(original).GetHash());
+}
+
+static void CheckHash(const CBlock &original, const CBlock &reparsed){
+	assert(original.GetHash() == reparsed.GetHash());
+	assert(original.BuildMerkleTree() == reparsed.BuildMerkleTree());
+}
+
+static void CheckHash(const CTxScCreationOut &original, const CTxScCreationOut &reparsed){
+	assert(original.GetHash() == reparsed.GetHash());
+}
+
+static void CheckHash(const CTxForwardTransferOut &original, const CTxForwardTransferOut &reparsed){
+	assert(original.GetHash() == reparsed.GetHash());
+}
+
+static bool SameBytes(const CDataStream &ss, const std::vector<unsigned char> &input){
+	return ss.size() <= input.size() && (ss.empty() || memcmp(&ss[0], input.data(), ss.size()) == 0);
+}
+
+template <typename T>
+static void RoundTrip(const std::vector<unsigned char> &input, int nType, int nVersion){
+
+	T original;
+	CDataStream ssIn(input, nType, nVersion);
+
+	try {
+		ssIn >> original;
+	} catch (const std::exception &) {
+		// not a valid encoding, nothing to compare
+		return;
+	}
+
+	const size_t consumed = input.size() - ssIn.size();
+
+	CDataStream ssOut(nType, nVersion);
+	ssOut << original;
+
+	assert(ssOut.size() == consumed);
+	assert(SameBytes(ssOut, input));
+	assert(::GetSerializeSize(original, nType, nVersion) == ssOut.size());
+
+	T reparsed;
+	ssOut >> reparsed;
+	assert(ssOut.empty());
+
+	CDataStream ssAgain(nType, nVersion);
+	ssAgain << reparsed;
+	assert(ssAgain.size() == consumed);
+	assert(SameBytes(ssAgain, input));
+
+	CheckHash(original, reparsed);
+}
+
+static void ForceVersion(std::vector<unsigned char> &input, int32_t nVersion){
+	CDataStream ss(SER_NETWORK, PROTOCOL_VERSION);
+	ss << nVersion;
+	if(input.size() < ss.size())
+		input.resize(ss.size());
+	std::copy(ss.begin(), ss.end(), input.begin());
+}
+
+void fuzz_init(){
+}
+
+void fuzz_target(const uint8_t *data, size_t size){
+
+	FuzzedDataProvider provider(data, size);
+
+	const uint8_t object = provider.ConsumeIntegralInRange<uint8_t>(0, FUZZ_SER_MAX_VALUE);
+	const bool forceVersion = provider.ConsumeBool();
+	const int nType = provider.PickValueInArray(fuzzSerTypes);
+	const int nVersion = provider.ConsumeBool() ? PROTOCOL_VERSION : provider.ConsumeIntegral<int>();
+
+	std::vector<unsigned char> input = provider.ConsumeRemainingBytes<unsigned char>();
+
+	switch(object){
+		case FUZZ_SER_TRANSACTION:
+			if(forceVersion)
+				ForceVersion(input, fuzzTxVersions[input.empty() ? 0 : input.back() % 4]);
+			RoundTrip<CTransaction>(input, nType, nVersion);
+			break;
+		case FUZZ_SER_CERTIFICATE:
+			if(forceVersion)
+				ForceVersion(input, SC_CERT_VERSION);
+			RoundTrip<CScCertificate>(input, nType, nVersion);
+			break;
+		case FUZZ_SER_BLOCK:
+			if(forceVersion)
+				ForceVersion(input, fuzzBlockVersions[input.empty() ? 0 : input.back() % 2]);
+			RoundTrip<CBlock>(input, nType, nVersion);
+			break;
+		case FUZZ_SER_SC_CREATION_OUT:
+			RoundTrip<CTxScCreationOut>(input, nType, nVersion);
+			break;
+		case FUZZ_SER_FORWARD_TRANSFER_OUT:
+			RoundTrip<CTxForwardTransferOut>(input, nType, nVersion);
+			break;
+		case FUZZ_SER_BWT_REQUEST_OUT:
+			RoundTrip<CBwtRequestOut>(input, nType, nVersion);
+			break;
+		case FUZZ_SER_CSW_INPUT:
+			RoundTrip<CTxCeasedSidechainWithdrawalInput>(input, nType, nVersion);
+			break;
+		case FUZZ_SER_BACKWARD_TRANSFER_OUT:
+			RoundTrip<CBackwardTransferOut>(input, nType, nVersion);
+			break;
+	}
+}
@@ -0,0 +1,151 @@
+#include "fuzz_target.h"
+#include "fuzz_chain.h"
+#include "fuzz_scgen.h"
+#include "FuzzedDataProvider.h"
+
+#include "coins.h"
+#include "consensus/validation.h"
+#include "main.h"
+#include "sync.h"
+
+#include <cassert>
+#include <cstdint>
+#include <map>
+#include <utility>
+#include <vector>
+
+/*
+ * Sidechain validation target.
+ *
+ * Transactions, certificates and CSW inputs come from the generator in
+ * fuzz_scgen.h, which builds them against the sidechains of an in-memory
+ * regtest chain. They go through the context free checks
+ * (checkTxSemanticValidity via CheckTransaction, CheckCertificate), the
+ * contextual ones and the checks against the sidechain state
+ * (IsScTxApplicableToState, IsCertApplicableToState with its quality
+ * check) and, for batches of certificates, CheckCertificatesOrdering.
+ * Its verdict isn't compared with a copy of its rule but checked by
+ * properties every verdict has to have, and on lists made ordered, then
+ * broken on purpose.
+ *
+ * Proofs are never verified.
+ */
+
+static bool IsOrdered(const std::vector<CScCertificate> &vCerts){
+	CValidationState state;
+	return CheckCertificatesOrdering(vCerts, state);
+}
+
+static CScCertificate WithEpochAndQuality(const CScCertificate &cert, int32_t epochNumber, int64_t quality){
+	CMutableScCertificate mcert(cert);
+	mcert.epochNumber = epochNumber;
+	mcert.quality = quality;
+	return CScCertificate(mcert);
+}
+
+static void CheckOrdering(FuzzedDataProvider &provider, const std::vector<CScCertificate> &vCerts){
+
+	const bool fOrdered = IsOrdered(vCerts);
+
+	// the certificates left once the last ones are removed are still ordered
+	for(size_t n = 0; fOrdered && n < vCerts.size(); n++)
+		assert(IsOrdered(std::vector<CScCertificate>(vCerts.begin(), vCerts.begin() + n)));
+
+	// the certificates of different sidechains don't interfere
+	std::map<uint256, std::vector<CScCertificate> > mCertsBySc;
+	for(const CScCertificate &cert : vCerts)
+		mCertsBySc[cert.GetScId()].push_back(cert);
+	bool fAllOrdered = true;
+	for(const auto &entry : mCertsBySc){
+		// a single certificate is always in order
+		assert(entry.second.size() > 1 || IsOrdered(entry.second));
+		fAllOrdered = fAllOrdered && IsOrdered(entry.second);
+	}
+	assert(fOrdered == fAllOrdered);
+
+	// the same certificates with the epoch of the first one for their sidechain
+	// and qualities increasing along the list are in order
+	std::vector<CScCertificate> vGood;
+	std::map<uint256, int32_t> mEpochs;
+	for(size_t i = 0; i < vCerts.size(); i++){
+		const int32_t epochNumber = mEpochs.emplace(vCerts[i].GetScId(), vCerts[i].epochNumber).first->second;
+		vGood.push_back(WithEpochAndQuality(vCerts[i], epochNumber, (int64_t) i + 1));
+	}
+	assert(IsOrdered(vGood));
+
+	// breaking the order of two certificates for the same sidechain is caught
+	for(size_t j = 1; j < vGood.size(); j++){
+		for(size_t i = 0; i < j; i++){
+			if(vGood[i].GetScId() != vGood[j].GetScId())
+				continue;
+			std::vector<CScCertificate> vBad(vGood);
+			switch(provider.ConsumeIntegralInRange<int>(0, 2)){
+				case 0:
+					// quality not increasing
+					vBad[j] = WithEpochAndQuality(vGood[j], vGood[j].epochNumber, vGood[i].quality - provider.ConsumeIntegralInRange<int64_t>(0, 1));
+					break;
+				case 1:
+					// another epoch
+					vBad[j] = WithEpochAndQuality(vGood[j], vGood[i].epochNumber ^ provider.ConsumeIntegralInRange<int32_t>(1, 2), vGood[j].quality);
+					break;
+				default:
+					std::swap(vBad[i], vBad[j]);
+					break;
+			}
+			assert(!IsOrdered(vBad));
+			return;
+		}
+	}
+}
+
+void fuzz_init(){
+	FuzzChainSetup();
+	assert(FuzzSetupSidechains());
+}
+
+void fuzz_target(const uint8_t *data, size_t size){
+
+	FuzzedDataProvider provider(data, size);
+
+	LOCK(cs_main);
+	CCoinsViewCache view(pcoinsTip);
+	FuzzScGenerator generator(provider, view);
+
+	const int nHeight = chainActive.Height() + 1;
+
+	if(provider.ConsumeBool()){
+		const CTransaction tx(generator.ConsumeTransaction());
+
+		CValidationState state;
+		if(!CheckTransactionWithoutProofVerification(tx, state))
+			return;
+		if(!tx.ContextualCheck(state, nHeight, 100))
+			return;
+
+		const Sidechain::ScFeeCheckFlag flag = provider.ConsumeBool() ?
+			Sidechain::ScFeeCheckFlag::LATEST_VALUE : Sidechain::ScFeeCheckFlag::MINIMUM_IN_A_RANGE;
+		view.IsScTxApplicableToState(tx, flag);
+		return;
+	}
+
+	// a batch of certificates, mostly for one sidechain, as a block would carry them
+	uint256 scId;
+	const bool fSameSc = generator.PickSidechain(CSidechain::State::ALIVE, scId) && provider.ConsumeBool();
+
+	std::vector<CScCertificate> vCerts;
+	const size_t nCerts = provider.ConsumeIntegralInRange<size_t>(1, 4);
+	for(size_t i = 0; i < nCerts; i++){
+		const CScCertificate cert(fSameSc ? generator.ConsumeCertificate(scId) : generator.ConsumeCertificate());
+		vCerts.push_back(cert);
+
+		CValidationState state;
+		if(!CheckCertificate(cert, state))
+			continue;
+		if(!cert.ContextualCheck(state, nHeight, 100))
+			continue;
+
+		view.IsCertApplicableToState(cert);
+	}
+
+	CheckOrdering(provider, vCerts);
+}
@@ -0,0 +1,21 @@
+#ifndef FUZZ_TARGET_H
+#define FUZZ_TARGET_H
+
+#include <cstddef>
+#include <cstdint>
+
+/*
+ * Standalone fuzz targets.
+ *
+ * Unlike the network fuzzer (fuzzer.cpp), which boots a whole node and feeds
+ * it through socket pairs, a standalone target only links the libraries it
+ * needs and is driven one input at a time by fuzz_main.cpp. Each target
+ * provides these two functions:
+ *
+ *   fuzz_init()   - one-time setup, run before the first input
+ *   fuzz_target() - run a single input; a crash or a failed assert is a finding
+ */
+void fuzz_init();
+void fuzz_target(const uint8_t *data, size_t size);
+
+#endif
@@ -0,0 +1,71 @@
+#include "fuzz_target.h"
+#include "fuzz_chain.h"
+#include "FuzzedDataProvider.h"
+
+#include "univalue.h"
+#include "zen/websocket_server.h"
+
+#include <cassert>
+#include <cstdint>
+#include <string>
+#include <vector>
+
+/*
+ * Websocket request target.
+ *
+ * Feeds frames straight into the request handler of the websocket server, as
+ * if a client had sent them, against an in-memory regtest chain. No socket is
+ * opened and no thread is started: the replies the session would have written
+ * back are collected from its queue and checked to be valid JSON.
+ *
+ * An input is a sequence of frames. Each frame is either raw bytes or a
+ * fuzzed payload wrapped in a well formed request envelope, so the handlers
+ * behind the JSON parser are reached without the fuzzer having to find the
+ * envelope on its own.
+ */
+
+// height of the chain the requests are run against
+static const int FUZZ_WS_CHAIN_HEIGHT = 20;
+
+// one past the last request type, to also exercise the unknown ones
+static const int FUZZ_WS_MAX_REQUEST_TYPE = 7;
+
+static std::string ConsumeFrame(FuzzedDataProvider &provider){
+
+	const size_t len = provider.ConsumeIntegralInRange<size_t>(0, 4096);
+
+	if(provider.ConsumeBool())
+		return provider.ConsumeBytesAsString(len);
+
+	std::string frame = "{\"msgType\":1";
+	if(provider.ConsumeBool())
+		frame += ",\"requestId\":\"" + std::to_string(provider.ConsumeIntegral<uint16_t>()) + "\"";
+	frame += ",\"requestType\":" + std::to_string(provider.ConsumeIntegralInRange<int>(0, FUZZ_WS_MAX_REQUEST_TYPE));
+	frame += ",\"requestPayload\":" + provider.ConsumeBytesAsString(len) + "}";
+	return frame;
+}
+
+void fuzz_init(){
+	FuzzChainSetup();
+	assert(FuzzMineBlocks(FUZZ_WS_CHAIN_HEIGHT));
+}
+
+void fuzz_target(const uint8_t *data, size_t size){
+
+	FuzzedDataProvider provider(data, size);
+
+	while(provider.remaining_bytes() > 0){
+
+		std::vector<std::string> vReplies;
+		const bool fKeepOpen = WsProcessClientMessage(ConsumeFrame(provider), vReplies);
+
+		for(const std::string &reply : vReplies){
+			UniValue v;
+			assert(v.read(reply));
+		}
+
+		// the server would have dropped the session here
+		if(!fKeepOpen)
+			break;
+	}
+}
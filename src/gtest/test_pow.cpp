@@ -1,8 +1,10 @@
 #include <gtest/gtest.h>
 
+#include "arith_uint256.h"
 #include "chain.h"
 #include "chainparams.h"
 #include "pow.h"
+#include "primitives/block.h"
 #include "random.h"
 
 TEST(PoW, DifficultyAveraging) {
@@ -68,3 +70,31 @@ TEST(PoW, DifficultyAveraging) {
                                         params),
               GetNextWorkRequired(&blocks[lastBlk], nullptr, params));
 }
+
+TEST(PoW, EquihashSolutionCache) {
+    SelectParams(CBaseChainParams::REGTEST);
+
+    CBlock block;
+    block.nVersion = 4;
+    block.nTime = 1269211443;
+    block.nBits = UintToArith256(Params().GetConsensus().powLimit).GetCompact();
+    block.hashPrevBlock = GetRandHash();
+    generateEquihash(block);
+
+    uint256 hash = block.GetHash();
+    EXPECT_FALSE(IsEquihashSolutionCached(hash));
+    EXPECT_TRUE(CheckEquihashSolutionCached(&block, hash, Params()));
+    EXPECT_TRUE(IsEquihashSolutionCached(hash));
+    EXPECT_TRUE(CheckEquihashSolutionCached(&block, hash, Params()));
+
+    // another solution is another header, with a verdict of its own
+    block.nSolution[0] ^= 1;
+    uint256 hashBad = block.GetHash();
+    EXPECT_NE(hash, hashBad);
+    EXPECT_FALSE(CheckEquihashSolutionCached(&block, hashBad, Params()));
+    EXPECT_TRUE(IsEquihashSolutionCached(hashBad));
+    EXPECT_FALSE(CheckEquihashSolutionCached(&block, hashBad, Params()));
+    EXPECT_FALSE(CheckEquihashSolution(&block, Params()));
+
+    SelectParams(CBaseChainParams::MAIN);
+}
@@ -162,10 +162,31 @@ uint256 SerializeHash(const T& obj, int nType=SER_GETHASH, int nVersion=PROTOCOL
     return ss.GetHash();
 }
 
+unsigned int MurmurHash3(unsigned int nHashSeed, const unsigned char* pDataToHash, size_t nDataSize);
 unsigned int MurmurHash3(unsigned int nHashSeed, const std::vector<unsigned char>& vDataToHash);
 
 void BIP32Hash(const ChainCode &chainCode, unsigned int nChild, unsigned char header, const unsigned char data[32], unsigned char output[64]);
 
+/** SipHash-2-4, only for data that comes in multiples of 8 bytes. */
+class CSipHasher
+{
+private:
+    uint64_t v[4];
+    int count;
+
+public:
+    /** Construct a SipHash calculator initialized with 128-bit key (k0, k1) */
+    CSipHasher(uint64_t k0, uint64_t k1);
+    /** Hash a 64-bit integer worth of data, read as the little-endian
+     *  interpretation of 8 bytes. */
+    CSipHasher& Write(uint64_t data);
+    /** Compute the 64-bit SipHash-2-4 of the data written so far. The object remains untouched. */
+    uint64_t Finalize() const;
+};
+
+/** SipHash-2-4 of a uint256, same as writing its four 64-bit words to a CSipHasher. */
+uint64_t SipHashUint256(uint64_t k0, uint64_t k1, const uint256& val);
+
 struct ObjectHasher
 {
     size_t operator()(const uint256& hash) const { return hash.GetCheapHash(); }
@@ -175,9 +175,12 @@ bool StartHTTPRPC()
 
     RegisterHTTPHandler("/", true, HTTPReq_JSONRPC);
 
-    assert(EventBase());
-    httpRPCTimerInterface = new HTTPRPCTimerInterface(EventBase());
-    RPCRegisterTimerInterface(httpRPCTimerInterface);
+    // Without an event base the handlers are being called in-process, with no
+    // HTTP server around: there is nothing to drive the timers then
+    if (EventBase()) {
+        httpRPCTimerInterface = new HTTPRPCTimerInterface(EventBase());
+        RPCRegisterTimerInterface(httpRPCTimerInterface);
+    }
     return true;
 }
 
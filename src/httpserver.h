@@ -43,6 +43,10 @@ typedef boost::function<void(HTTPRequest* req, const std::string &)> HTTPRequest
 void RegisterHTTPHandler(const std::string &prefix, bool exactMatch, const HTTPRequestHandler &handler);
 /** Unregister handler for prefix */
 void UnregisterHTTPHandler(const std::string &prefix, bool exactMatch);
+/** Find the handler registered for strURI.
+ * On success path is set to the part of strURI following the matched prefix.
+ */
+bool FindHTTPHandler(const std::string &strURI, HTTPRequestHandler &handler, std::string &path);
 
 /** Return evhttp event base. This can be used by submodules to
  * queue timers or custom events.
@@ -75,7 +79,7 @@ public:
 
     /** Get requested URI.
      */
-    std::string GetURI();
+    virtual std::string GetURI();
 
     /** Get CService (address:ip) for the origin of the http request.
      */
@@ -97,7 +101,7 @@ public:
      * @note As this consumes the underlying buffer, call this only once.
      * Repeated calls will return an empty string.
      */
-    std::string ReadBody();
+    virtual std::string ReadBody();
 
     /**
      * Write output header.
@@ -10,6 +10,7 @@
 #include "addrman.h"
 #include "alert.h"
 #include "arith_uint256.h"
+#include "blockencodings.h"
 #include "checkpoints.h"
 #include "checkqueue.h"
 #include "consensus/validation.h"
@@ -19,6 +20,7 @@
 #include "metrics.h"
 #include "pow.h"
 #include "txdb.h"
+#include "txreconciliation.h"
 #include "ui_interface.h"
 #include "undo.h"
 #include "util.h"
@@ -103,13 +105,16 @@ CFeeRate minRelayTxFee = CFeeRate(DEFAULT_MIN_RELAY_TX_FEE);
 
 CTxMemPool mempool(::minRelayTxFee);
 
-map<uint256, COrphanTx> mapOrphanTransactions GUARDED_BY(cs_main);;
-map<uint256, set<uint256> > mapOrphanTransactionsByPrev GUARDED_BY(cs_main);;
+map<uint256, COrphanTx> mapOrphanTransactions GUARDED_BY(cs_main);
+map<COutPoint, set<uint256> > mapOrphanTransactionsByPrev GUARDED_BY(cs_main);
+/** Orphan hashes in insertion order, hence in expiry order */
+list<uint256> lOrphanTransactionsExpiry GUARDED_BY(cs_main);
+/** Serialized size of the orphans, in total and by the peer they came from */
+size_t nOrphanTransactionsSize GUARDED_BY(cs_main) = 0;
+map<NodeId, size_t> mapOrphanTransactionsSizeByPeer GUARDED_BY(cs_main);
 
 void EraseOrphansFor(NodeId peer) EXCLUSIVE_LOCKS_REQUIRED(cs_main);
 
-static void CheckBlockIndex();
-
 /** Constant stuff for coinbase transactions we create: */
 CScript COINBASE_FLAGS;
 
@@ -234,6 +239,7 @@ namespace {
         int64_t nTime;  //! Time of "getdata" request in microseconds.
         bool fValidatedHeaders;  //! Whether this block has validated headers at the time of request.
         int64_t nTimeDisconnect; //! The timeout for this block request (for disconnecting a slow peer)
+        std::shared_ptr<PartiallyDownloadedBlock> partialBlock;  //! Optional, the block being rebuilt from a compact block.
     };
     map<uint256, pair<NodeId, list<QueuedBlock>::iterator> > mapBlocksInFlight;
 
@@ -243,6 +249,9 @@ namespace {
     /** Number of preferable block download peers. */
     int nPreferredDownload = 0;
 
+    /** Number of outbound peers reconciling transactions which are still flooded to. */
+    int nTxFloodOutboundPeers = 0;
+
     /** Dirty block index entries. */
     set<CBlockIndex*> setDirtyBlockIndex;
 
@@ -297,6 +306,16 @@ struct CNodeState {
     int nBlocksInFlightValidHeaders;
     //! Whether we consider this a preferred download peer.
     bool fPreferredDownload;
+    //! Whether this peer can serve us compact blocks.
+    bool fProvidesCmpctBlocks;
+    //! Whether this is one of the nTxFloodOutboundPeers.
+    bool fTxFloodOutbound;
+    //! Average time between two blocks delivered by this peer while busy (in microseconds), or 0.
+    int64_t nBlockServiceTime;
+    //! Average time a block takes to arrive once requested from this peer (in microseconds), or 0.
+    int64_t nBlockLatency;
+    //! When the last block requested from this peer arrived (in microseconds), or 0.
+    int64_t nLastBlockReceived;
 
     CNodeState() {
         fCurrentlyConnected = false;
@@ -310,6 +329,11 @@ struct CNodeState {
         nBlocksInFlight = 0;
         nBlocksInFlightValidHeaders = 0;
         fPreferredDownload = false;
+        fProvidesCmpctBlocks = false;
+        fTxFloodOutbound = false;
+        nBlockServiceTime = 0;
+        nBlockLatency = 0;
+        nLastBlockReceived = 0;
     }
 };
 
@@ -368,10 +392,30 @@ void FinalizeNode(NodeId nodeid) {
         mapBlocksInFlight.erase(entry.hash);
     EraseOrphansFor(nodeid);
     nPreferredDownload -= state->fPreferredDownload;
+    nTxFloodOutboundPeers -= state->fTxFloodOutbound;
 
     mapNodeState.erase(nodeid);
 }
 
+// Requires cs_main.
+// Update the download rate of a peer with a block it was asked for and just delivered.
+void UpdateBlockDownloadStats(NodeId nodeid, const uint256& hash) {
+    map<uint256, pair<NodeId, list<QueuedBlock>::iterator> >::iterator itInFlight = mapBlocksInFlight.find(hash);
+    if (itInFlight == mapBlocksInFlight.end() || itInFlight->second.first != nodeid)
+        return;
+
+    CNodeState *state = State(nodeid);
+    int64_t nNow = GetTimeMicros();
+    int64_t nLatency = nNow - itInFlight->second.second->nTime;
+    // the time the peer was idle, with nothing requested, does not count
+    int64_t nServiceTime = nNow - std::max(itInFlight->second.second->nTime, state->nLastBlockReceived);
+    state->nLastBlockReceived = nNow;
+
+    // moving averages, over the last 8 blocks or so
+    state->nBlockLatency = state->nBlockLatency ? state->nBlockLatency + (nLatency - state->nBlockLatency) / 8 : nLatency;
+    state->nBlockServiceTime = state->nBlockServiceTime ? state->nBlockServiceTime + (nServiceTime - state->nBlockServiceTime) / 8 : nServiceTime;
+}
+
 // Requires cs_main.
 // Returns a bool indicating whether we requested this block.
 bool MarkBlockAsReceived(const uint256& hash) {
@@ -398,7 +442,8 @@ void MarkBlockAsInFlight(NodeId nodeid, const uint256& hash, const Consensus::Pa
     MarkBlockAsReceived(hash);
 
     int64_t nNow = GetTimeMicros();
-    QueuedBlock newentry = {hash, pindex, nNow, pindex != NULL, GetBlockTimeout(nNow, nQueuedValidatedHeaders, consensusParams)};
+    QueuedBlock newentry = {hash, pindex, nNow, pindex != NULL, GetBlockTimeout(nNow, nQueuedValidatedHeaders, consensusParams),
+                            std::shared_ptr<PartiallyDownloadedBlock>()};
     nQueuedValidatedHeaders += newentry.fValidatedHeaders;
     list<QueuedBlock>::iterator it = state->vBlocksInFlight.insert(state->vBlocksInFlight.end(), newentry);
     state->nBlocksInFlight++;
@@ -546,8 +591,64 @@ void FindNextBlocksToDownload(NodeId nodeid, unsigned int count, std::vector<CBl
     }
 }
 
+/** Add to vBlocks, until it has at most count entries, the blocks that have been in flight from other peers
+ *  for much longer than those peers usually take and that this peer, with a lower latency, can deliver.
+ *  The lowest blocks come first, as they are the ones holding up the download window. */
+void FindStalledBlocksToDownload(NodeId nodeid, unsigned int count, std::vector<CBlockIndex*>& vBlocks, int64_t nNow) {
+    CNodeState *state = State(nodeid);
+    assert(state != NULL);
+
+    // Only peers whose latency is known take over the blocks of others.
+    if (vBlocks.size() >= count || state->nBlockLatency == 0 || state->pindexBestKnownBlock == NULL)
+        return;
+
+    std::vector<std::pair<int, CBlockIndex*> > vStalled;
+    for (map<uint256, pair<NodeId, list<QueuedBlock>::iterator> >::const_iterator it = mapBlocksInFlight.begin();
+         it != mapBlocksInFlight.end(); ++it) {
+        const QueuedBlock &queuedBlock = *it->second.second;
+        // blocks without headers and blocks being rebuilt from a compact block are left to their peer
+        if (it->second.first == nodeid || queuedBlock.pindex == NULL || queuedBlock.partialBlock)
+            continue;
+        const CNodeState *stateFrom = State(it->second.first);
+        if (!IsBlockStalled(nNow - queuedBlock.nTime, stateFrom->nBlockLatency, state->nBlockLatency))
+            continue;
+        if (state->pindexBestKnownBlock->GetAncestor(queuedBlock.pindex->nHeight) != queuedBlock.pindex)
+            continue;
+        vStalled.push_back(std::make_pair(queuedBlock.pindex->nHeight, queuedBlock.pindex));
+    }
+
+    std::sort(vStalled.begin(), vStalled.end());
+    for (size_t i = 0; i < vStalled.size() && vBlocks.size() < count; i++) {
+        CBlockIndex *pindex = vStalled[i].second;
+        // The peer it was asked from gets the time it has been waiting for as its
+        // service time, which shrinks its share of the download window, and as a
+        // latency sample, since the block it may still deliver isn't counted.
+        const pair<NodeId, list<QueuedBlock>::iterator> &inFlight = mapBlocksInFlight[pindex->GetBlockHash()];
+        CNodeState *stateFrom = State(inFlight.first);
+        int64_t nStalled = nNow - inFlight.second->nTime;
+        stateFrom->nBlockServiceTime = std::max(stateFrom->nBlockServiceTime, nStalled);
+        stateFrom->nBlockLatency = stateFrom->nBlockLatency ? stateFrom->nBlockLatency + (nStalled - stateFrom->nBlockLatency) / 8 : nStalled;
+        LogPrint("net", "%s():%d - block %s (%d) stalled at peer=%d, requesting it from peer=%d\n",
+            __func__, __LINE__, pindex->GetBlockHash().ToString(), pindex->nHeight, inFlight.first, nodeid);
+        vBlocks.push_back(pindex);
+    }
+}
+
 } // anon namespace
 
+int GetBlocksInTransitLimit(int64_t nBlockServiceTime) {
+    if (nBlockServiceTime == 0)
+        return MAX_BLOCKS_IN_TRANSIT_PER_PEER;
+    int64_t nBlocks = 1000000LL * BLOCK_DOWNLOAD_TARGET_TIME / std::max<int64_t>(nBlockServiceTime, 1);
+    return std::max<int64_t>(MIN_BLOCKS_IN_TRANSIT_PER_PEER, std::min<int64_t>(MAX_BLOCKS_IN_TRANSIT_PER_FAST_PEER, nBlocks));
+}
+
+bool IsBlockStalled(int64_t nInTransit, int64_t nLatencyFrom, int64_t nLatencyTo) {
+    if (nLatencyTo == 0 || (nLatencyFrom != 0 && nLatencyFrom <= nLatencyTo))
+        return false;
+    return nInTransit >= std::max<int64_t>(1000000LL * BLOCK_REREQUEST_MIN_TIME, BLOCK_REREQUEST_LATENCY_FACTOR * nLatencyFrom);
+}
+
 bool GetNodeStateStats(NodeId nodeid, CNodeStateStats &stats) {
     LOCK(cs_main);
     CNodeState *state = State(nodeid);
@@ -560,6 +661,8 @@ bool GetNodeStateStats(NodeId nodeid, CNodeStateStats &stats) {
         if (queue.pindex)
             stats.vHeightInFlight.push_back(queue.pindex->nHeight);
     }
+    stats.nBlockServiceTime = state->nBlockServiceTime;
+    stats.nBlockLatency = state->nBlockLatency;
     return true;
 }
 
@@ -604,7 +707,7 @@ CBlockTreeDB *pblocktree = NULL;
 // mapOrphanTransactions
 //
 
-bool AddOrphanTx(const CTransactionBase& txObj, NodeId peer) EXCLUSIVE_LOCKS_REQUIRED(cs_main)
+bool AddOrphanTx(const CTransactionBase& txObj, NodeId peer, size_t nMaxPeerSize) EXCLUSIVE_LOCKS_REQUIRED(cs_main)
 {
     uint256 hash = txObj.GetHash();
     if (mapOrphanTransactions.count(hash))
@@ -615,22 +718,36 @@ bool AddOrphanTx(const CTransactionBase& txObj, NodeId peer) EXCLUSIVE_LOCKS_REQ
     // large transaction with a missing parent then we assume
     // it will rebroadcast it later, after the parent transaction(s)
     // have been mined or received.
-    // 10,000 orphans, each of which is at most 5,000 bytes big is
-    // at most 500 megabytes of orphans:
     unsigned int sz = txObj.GetSerializeSize(SER_NETWORK, PROTOCOL_VERSION);
-    if (sz > 5000)
+    if (sz > MAX_ORPHAN_TX_SIZE)
     {
         LogPrint("mempool", "ignoring large orphan tx (size: %u, hash: %s)\n", sz, hash.ToString());
         return false;
     }
 
-    mapOrphanTransactions[hash].tx = txObj.MakeShared();
-    mapOrphanTransactions[hash].fromPeer = peer;
+    // A single peer can't push out the orphans of all the others
+    size_t& nPeerSize = mapOrphanTransactionsSizeByPeer[peer];
+    if (nPeerSize + sz > nMaxPeerSize)
+    {
+        LogPrint("mempool", "ignoring orphan tx %s, peer=%d is over its quota (%u bytes)\n", hash.ToString(), peer, nPeerSize);
+        if (nPeerSize == 0)
+            mapOrphanTransactionsSizeByPeer.erase(peer);
+        return false;
+    }
+
+    COrphanTx& orphan = mapOrphanTransactions[hash];
+    orphan.tx = txObj.MakeShared();
+    orphan.fromPeer = peer;
+    orphan.nSize = sz;
+    orphan.nTimeExpire = GetTime() + ORPHAN_TX_EXPIRE_TIME;
+    orphan.itExpire = lOrphanTransactionsExpiry.insert(lOrphanTransactionsExpiry.end(), hash);
     BOOST_FOREACH(const CTxIn& txin, txObj.GetVin())
-        mapOrphanTransactionsByPrev[txin.prevout.hash].insert(hash);
+        mapOrphanTransactionsByPrev[txin.prevout].insert(hash);
+    nOrphanTransactionsSize += sz;
+    nPeerSize += sz;
 
-    LogPrint("mempool", "stored orphan tx %s (mapsz %u prevsz %u)\n", hash.ToString(),
-             mapOrphanTransactions.size(), mapOrphanTransactionsByPrev.size());
+    LogPrint("mempool", "stored orphan tx %s (mapsz %u prevsz %u bytes %u)\n", hash.ToString(),
+             mapOrphanTransactions.size(), mapOrphanTransactionsByPrev.size(), nOrphanTransactionsSize);
     return true;
 }
 
@@ -641,18 +758,28 @@ void static EraseOrphanTx(uint256 hash) EXCLUSIVE_LOCKS_REQUIRED(cs_main)
         return;
     BOOST_FOREACH(const CTxIn& txin, it->second.tx->GetVin())
     {
-        map<uint256, set<uint256> >::iterator itPrev = mapOrphanTransactionsByPrev.find(txin.prevout.hash);
+        map<COutPoint, set<uint256> >::iterator itPrev = mapOrphanTransactionsByPrev.find(txin.prevout);
         if (itPrev == mapOrphanTransactionsByPrev.end())
             continue;
         itPrev->second.erase(hash);
         if (itPrev->second.empty())
             mapOrphanTransactionsByPrev.erase(itPrev);
     }
+    lOrphanTransactionsExpiry.erase(it->second.itExpire);
+    nOrphanTransactionsSize -= it->second.nSize;
+    map<NodeId, size_t>::iterator itPeer = mapOrphanTransactionsSizeByPeer.find(it->second.fromPeer);
+    assert(itPeer != mapOrphanTransactionsSizeByPeer.end() && itPeer->second >= it->second.nSize);
+    itPeer->second -= it->second.nSize;
+    if (itPeer->second == 0)
+        mapOrphanTransactionsSizeByPeer.erase(itPeer);
     mapOrphanTransactions.erase(it);
 }
 
 void EraseOrphansFor(NodeId peer)
 {
+    if (!mapOrphanTransactionsSizeByPeer.count(peer))
+        return;
+
     int nErased = 0;
     map<uint256, COrphanTx>::iterator iter = mapOrphanTransactions.begin();
     while (iter != mapOrphanTransactions.end())
@@ -667,11 +794,28 @@ void EraseOrphansFor(NodeId peer)
     if (nErased > 0) LogPrint("mempool", "Erased %d orphan tx from peer %d\n", nErased, peer);
 }
 
+/** Drop the orphans that waited too long for their parents. */
+unsigned int static ExpireOrphanTx(int64_t nNow) EXCLUSIVE_LOCKS_REQUIRED(cs_main)
+{
+    unsigned int nExpired = 0;
+    while (!lOrphanTransactionsExpiry.empty())
+    {
+        const uint256 hash = lOrphanTransactionsExpiry.front();
+        if (mapOrphanTransactions.find(hash)->second.nTimeExpire > nNow)
+            break;
+        EraseOrphanTx(hash);
+        ++nExpired;
+    }
+    if (nExpired > 0) LogPrint("mempool", "Erased %u expired orphan tx\n", nExpired);
+    return nExpired;
+}
 
-unsigned int LimitOrphanTxSize(unsigned int nMaxOrphans) EXCLUSIVE_LOCKS_REQUIRED(cs_main)
+unsigned int LimitOrphanTxSize(unsigned int nMaxOrphans, size_t nMaxOrphansSize) EXCLUSIVE_LOCKS_REQUIRED(cs_main)
 {
+    ExpireOrphanTx(GetTime());
+
     unsigned int nEvicted = 0;
-    while (mapOrphanTransactions.size() > nMaxOrphans)
+    while (mapOrphanTransactions.size() > nMaxOrphans || nOrphanTransactionsSize > nMaxOrphansSize)
     {
         // Evict a random orphan:
         uint256 randomhash = GetRandHash();
@@ -684,6 +828,18 @@ unsigned int LimitOrphanTxSize(unsigned int nMaxOrphans) EXCLUSIVE_LOCKS_REQUIRE
     return nEvicted;
 }
 
+/** Queue the orphans spending the outputs of txBase to be reconsidered with the messages of pfrom. */
+void static AddOrphanWork(const CTransactionBase& txBase, CNode* pfrom) EXCLUSIVE_LOCKS_REQUIRED(cs_main)
+{
+    const uint256& hash = txBase.GetHash();
+    for (map<COutPoint, set<uint256> >::iterator it = mapOrphanTransactionsByPrev.lower_bound(COutPoint(hash, 0));
+         it != mapOrphanTransactionsByPrev.end() && it->first.hash == hash; ++it)
+    {
+        pfrom->setOrphanWork.insert(it->second.begin(), it->second.end());
+        pfrom->fOrphanWork = true;
+    }
+}
+
 
 bool IsStandardTx(const CTransactionBase& txBase, string& reason, const int nHeight)
 {
@@ -2042,6 +2198,51 @@ bool ReadBlockFromDisk(CBlock& block, const CBlockIndex* pindex)
     return true;
 }
 
+bool ReadRawBlockFromDisk(CDataStream& ss, const CDiskBlockPos& pos, const uint256& hash)
+{
+    // The block is preceded by the message start and its size, see WriteBlockToDisk()
+    const unsigned int nIndexHeaderSize = MESSAGE_START_SIZE + sizeof(unsigned int);
+    if (pos.nPos < nIndexHeaderSize)
+        return error("%s: invalid block position %s", __func__, pos.ToString());
+
+    // Open history file to read
+    CAutoFile filein(OpenBlockFile(CDiskBlockPos(pos.nFile, pos.nPos - nIndexHeaderSize), true), SER_DISK, CLIENT_VERSION);
+    if (filein.IsNull())
+        return error("%s: OpenBlockFile failed for %s", __func__, pos.ToString());
+
+    const size_t nStart = ss.size();
+    try {
+        CMessageHeader::MessageStartChars messageStart;
+        unsigned int nSize;
+        filein >> FLATDATA(messageStart) >> nSize;
+        if (memcmp(messageStart, Params().MessageStart(), MESSAGE_START_SIZE) != 0 || nSize > MAX_BLOCK_SIZE)
+            return error("%s: Errors in block index header at %s", __func__, pos.ToString());
+
+        // The serialization of the header is the same on disk and on the network,
+        // the rest is copied as it is
+        CBlockHeader header;
+        filein >> header;
+        if (header.GetHash() != hash)
+            return error("%s: GetHash() doesn't match %s at %s", __func__, hash.ToString(), pos.ToString());
+        ss << header;
+
+        const size_t nHeaderSize = ss.size() - nStart;
+        if (nHeaderSize >= nSize)
+        {
+            ss.resize(nStart);
+            return error("%s: Errors in block size at %s", __func__, pos.ToString());
+        }
+        ss.resize(nStart + nSize);
+        filein.read(&ss[nStart + nHeaderSize], nSize - nHeaderSize);
+    }
+    catch (const std::exception& e) {
+        ss.resize(nStart);
+        return error("%s: Deserialize or I/O error - %s at %s", __func__, e.what(), pos.ToString());
+    }
+
+    return true;
+}
+
 CAmount GetBlockSubsidy(int nHeight, const Consensus::Params& consensusParams)
 {
     CAmount nSubsidy = 12.5 * COIN;
@@ -2173,12 +2374,13 @@ void CheckForkWarningConditionsOnNewFork(CBlockIndex* pindexNewForkTip)
     CheckForkWarningConditions();
 }
 
-// Requires cs_main.
 void Misbehaving(NodeId pnode, int howmuch)
 {
     if (howmuch == 0)
         return;
 
+    // also called by the message handler threads without cs_main
+    LOCK(cs_main);
     CNodeState *state = State(pnode);
     if (state == NULL)
         return;
@@ -2370,6 +2572,16 @@ void CScriptCheck::swap(CScriptCheck &check) {
 
 ScriptError CScriptCheck::GetScriptError() const { return error; }
 
+bool CEquihashCheck::operator()() {
+    CheckEquihashSolutionCached(pheader, hash, Params());
+    return true;
+}
+
+void CEquihashCheck::swap(CEquihashCheck &check) {
+    std::swap(pheader, check.pheader);
+    std::swap(hash, check.hash);
+}
+
 bool IsCommunityFund(const CCoins *coins, int nIn)
 {
     if(coins != NULL &&
@@ -3142,6 +3354,15 @@ void ThreadScriptCheck() {
     scriptcheckqueue.Thread();
 }
 
+static CCheckQueue<CEquihashCheck> headercheckqueue(8);
+// CCheckQueueControl wants the queue for itself, while headers come in on every message handler thread
+static CCriticalSection cs_headercheckqueue;
+
+void ThreadHeaderCheck() {
+    RenameThread("horizen-headerch");
+    headercheckqueue.Thread();
+}
+
 //
 // Called periodically asynchronously; alerts if it smells like
 // we're being fed a bad chain (blocks being generated much
@@ -3236,6 +3457,13 @@ bool ConnectBlock(const CBlock& block, CValidationState& state, CBlockIndex* pin
         fScRelatedChecks = flagScRelatedChecks::OFF;
     }
 
+    // CODE USED FOR UNIT TEST ONLY [Start]
+    if (BOOST_UNLIKELY(Params().NetworkIDString() == "regtest" && GetBoolArg("-skipblockscproof", false)))
+    {
+        fScProofVerification = flagScProofVerification::OFF;
+    }
+    // CODE USED FOR UNIT TEST ONLY [End]
+
     bool fExpensiveChecks = true;
     if (fCheckpointsEnabled) {
         CBlockIndex *pindexLastCheckpoint = Checkpoints::GetLastCheckpoint(chainparams.Checkpoints());
@@ -4929,13 +5157,15 @@ bool CheckBlockHeader(const CBlockHeader& block, CValidationState& state, flagCh
         return state.DoS(100, error("CheckBlockHeader(): block version not valid"),
                          CValidationState::Code::INVALID, "version-invalid");
 
+    const uint256 hash = fCheckPOW == flagCheckPow::ON ? block.GetHash() : uint256();
+
     // Check Equihash solution is valid
-    if (fCheckPOW == flagCheckPow::ON && !CheckEquihashSolution(&block, Params()))
+    if (fCheckPOW == flagCheckPow::ON && !CheckEquihashSolutionCached(&block, hash, Params()))
         return state.DoS(100, error("CheckBlockHeader(): Equihash solution invalid"),
                          CValidationState::Code::INVALID, "invalid-solution");
 
     // Check proof of work matches claimed amount
-    if (fCheckPOW == flagCheckPow::ON && !CheckProofOfWork(block.GetHash(), block.nBits, Params().GetConsensus()))
+    if (fCheckPOW == flagCheckPow::ON && !CheckProofOfWork(hash, block.nBits, Params().GetConsensus()))
         return state.DoS(50, error("CheckBlockHeader(): proof of work failed"),
                          CValidationState::Code::INVALID, "high-hash");
 
@@ -5184,6 +5414,41 @@ bool ContextualCheckBlock(const CBlock& block, CValidationState& state, CBlockIn
     return true;
 }
 
+/**
+ * Check the Equihash solutions of a batch of headers in parallel, without
+ * cs_main, ahead of AcceptBlockHeader(): their verdicts are cached, so that
+ * CheckBlockHeader() does not have to check them again under the lock.
+ */
+static void PreCheckBlockHeaders(const std::vector<CBlockHeader>& headers)
+{
+    std::vector<uint256> vHashes;
+    vHashes.reserve(headers.size());
+    BOOST_FOREACH(const CBlockHeader& header, headers)
+        vHashes.push_back(header.GetHash());
+
+    std::vector<CEquihashCheck> vChecks;
+    {
+        LOCK(cs_main);
+        for (size_t i = 0; i < headers.size(); i++)
+            if (!mapBlockIndex.count(vHashes[i]) && !IsEquihashSolutionCached(vHashes[i]))
+                vChecks.push_back(CEquihashCheck(headers[i], vHashes[i]));
+    }
+    if (vChecks.empty())
+        return;
+
+    if (nScriptCheckThreads == 0)
+    {
+        BOOST_FOREACH(CEquihashCheck& check, vChecks)
+            check();
+        return;
+    }
+
+    LOCK(cs_headercheckqueue);
+    CCheckQueueControl<CEquihashCheck> control(&headercheckqueue);
+    control.Add(vChecks);
+    control.Wait();
+}
+
 bool AcceptBlockHeader(const CBlockHeader& block, CValidationState& state, CBlockIndex** ppindex, bool lookForwardTips)
 {
     dump_global_tips(10);
@@ -5315,6 +5580,8 @@ bool ProcessNewBlock(CValidationState &state, CNode* pfrom, CBlock* pblock, bool
     {
         LOCK(cs_main);
 
+        if (pfrom)
+            UpdateBlockDownloadStats(pfrom->GetId(), pblock->GetHash());
         bool fRequested = MarkBlockAsReceived(pblock->GetHash());
         fRequested |= fForceProcessing;
 
@@ -5325,12 +5592,16 @@ bool ProcessNewBlock(CValidationState &state, CNode* pfrom, CBlock* pblock, bool
 
         // Store to disk
         CBlockIndex *pindex = NULL;
+        BlockMap::iterator mi = mapBlockIndex.find(pblock->GetHash());
+        bool fAlreadyHave = mi != mapBlockIndex.end() && (mi->second->nStatus & BLOCK_HAVE_DATA);
 
         bool ret = AcceptBlock(*pblock, state, &pindex, fRequested, dbp, &sForkTips);
 
         if (pindex && pfrom)
         {
             mapBlockSource[pindex->GetBlockHash()] = pfrom->GetId();
+            if (ret && !fAlreadyHave && (pindex->nStatus & BLOCK_HAVE_DATA))
+                pfrom->nLastBlockTime = GetTime();
         }
 
         CheckBlockIndex();
@@ -5840,6 +6111,9 @@ void UnloadBlockIndex()
     mempool.clear();
     mapOrphanTransactions.clear();
     mapOrphanTransactionsByPrev.clear();
+    lOrphanTransactionsExpiry.clear();
+    nOrphanTransactionsSize = 0;
+    mapOrphanTransactionsSizeByPeer.clear();
     nSyncStarted = 0;
     mapBlocksUnlinked.clear();
     vinfoBlockFile.clear();
@@ -5861,6 +6135,49 @@ void UnloadBlockIndex()
     fHavePruned = false;
 }
 
+void UnloadBlocksOutsideActiveChain()
+{
+    LOCK(cs_main);
+    assert(mapBlocksInFlight.empty());
+
+    std::set<CBlockIndex*> setUnload;
+    BOOST_FOREACH(const BlockMap::value_type& entry, mapBlockIndex) {
+        if (!chainActive.Contains(entry.second))
+            setUnload.insert(entry.second);
+    }
+    if (setUnload.empty())
+        return;
+
+    for (multimap<CBlockIndex*, CBlockIndex*>::iterator it = mapBlocksUnlinked.begin(); it != mapBlocksUnlinked.end(); ) {
+        if (setUnload.count(it->first) || setUnload.count(it->second))
+            mapBlocksUnlinked.erase(it++);
+        else
+            it++;
+    }
+    BOOST_FOREACH(CBlockIndex* pindex, setUnload) {
+        setBlockIndexCandidates.erase(pindex);
+        setDirtyBlockIndex.erase(pindex);
+        mGlobalForkTips.erase(pindex);
+    }
+    // the tip of the active chain is the only one left
+    if (!mGlobalForkTips.count(chainActive.Tip()))
+        addToGlobalForkTips(chainActive.Tip());
+
+    if (setUnload.count(pindexBestInvalid))
+        pindexBestInvalid = NULL;
+    if (setUnload.count(pindexBestHeader))
+        pindexBestHeader = chainActive.Tip();
+    if (setUnload.count(pindexBestForkTip) || setUnload.count(pindexBestForkBase)) {
+        pindexBestForkTip = NULL;
+        pindexBestForkBase = NULL;
+    }
+
+    BOOST_FOREACH(CBlockIndex* pindex, setUnload) {
+        mapBlockIndex.erase(pindex->GetBlockHash());
+        delete pindex;
+    }
+}
+
 bool LoadBlockIndex()
 {
     // Load block index from databases
@@ -6127,7 +6444,7 @@ bool LoadBlocksFromExternalFile(FILE* fileIn, CDiskBlockPos *dbp, bool loadHeade
     return (loadHeadersOnly && (nLoadedHeaders > 0)) || (!loadHeadersOnly && (nLoadedBlocks > 0));
 }
 
-void static CheckBlockIndex()
+void CheckBlockIndex()
 {
     const Consensus::Params& consensusParams = Params().GetConsensus();
     if (!fCheckBlockIndex) {
@@ -6428,8 +6745,6 @@ void static ProcessGetData(CNode* pfrom)
 
     vector<CInv> vNotFound;
 
-    LOCK(cs_main);
-
     while (it != pfrom->vRecvGetData.end()) {
         // Don't bother if send buffer is too full to respond anyway
         if (pfrom->nSendSize >= SendBufferSize())
@@ -6440,61 +6755,104 @@ void static ProcessGetData(CNode* pfrom)
             boost::this_thread::interruption_point();
             it++;
 
-            if (inv.type == MSG_BLOCK || inv.type == MSG_FILTERED_BLOCK)
+            if (inv.type == MSG_BLOCK || inv.type == MSG_FILTERED_BLOCK || inv.type == MSG_CMPCT_BLOCK)
             {
                 bool send = false;
-                BlockMap::iterator mi = mapBlockIndex.find(inv.hash);
-                if (mi != mapBlockIndex.end())
+                // compact blocks are only worth it for the blocks the peer may
+                // have most of the transactions of, older ones are sent in full
+                bool fCompact = false;
+                CDiskBlockPos blockPos;
                 {
-                    if (chainActive.Contains(mi->second)) {
-                        send = true;
-                    } else {
-                        static const int nOneMonth = 30 * 24 * 60 * 60;
-                        // To prevent fingerprinting attacks, only send blocks outside of the active
-                        // chain if they are valid, and no more than a month older (both in time, and in
-                        // best equivalent proof of work) than the best header chain we know about.
-
-                        // this is set by ConnectBlock method, when a new tip is added to the main chain
-                        bool b1 = mi->second->IsValid(BLOCK_VALID_SCRIPTS);
-                        bool b2 = (pindexBestHeader != NULL) &&
-                                  (pindexBestHeader->GetBlockTime() - mi->second->GetBlockTime() < nOneMonth) &&
-                                  (GetBlockProofEquivalentTime(*pindexBestHeader, *mi->second, *pindexBestHeader, Params().GetConsensus()) < nOneMonth);
-
-                        send = b1 && b2;
-                        if (!send)
-                        {
-                            if (b2)
-                            {
-                                // BLOCK_VALID_SCRIPTS is set when connecting block on main chain, but we must
-                                // propagate also when relevant blocks are on a fork. Consider that a further check
-                                // on BLOCK_HAVE_DATA is performed below
-                                LogPrint("forks", "%s():%d: request from peer=%i: status[0x%x]\n",
-                                    __func__, __LINE__, pfrom->GetId(), mi->second->nStatus);
-                                send = true;
-                            }
-                            else
+                    LOCK(cs_main);
+                    BlockMap::iterator mi = mapBlockIndex.find(inv.hash);
+                    if (mi != mapBlockIndex.end())
+                    {
+                        if (chainActive.Contains(mi->second)) {
+                            send = true;
+                        } else {
+                            static const int nOneMonth = 30 * 24 * 60 * 60;
+                            // To prevent fingerprinting attacks, only send blocks outside of the active
+                            // chain if they are valid, and no more than a month older (both in time, and in
+                            // best equivalent proof of work) than the best header chain we know about.
+
+                            // this is set by ConnectBlock method, when a new tip is added to the main chain
+                            bool b1 = mi->second->IsValid(BLOCK_VALID_SCRIPTS);
+                            bool b2 = (pindexBestHeader != NULL) &&
+                                      (pindexBestHeader->GetBlockTime() - mi->second->GetBlockTime() < nOneMonth) &&
+                                      (GetBlockProofEquivalentTime(*pindexBestHeader, *mi->second, *pindexBestHeader, Params().GetConsensus()) < nOneMonth);
+
+                            send = b1 && b2;
+                            if (!send)
                             {
-                                LogPrint("forks", "%s():%d: ignoring request from peer=%i: %s status[0x%x]\n",
-                                    __func__, __LINE__, pfrom->GetId(), inv.hash.ToString(), mi->second->nStatus);
+                                if (b2)
+                                {
+                                    // BLOCK_VALID_SCRIPTS is set when connecting block on main chain, but we must
+                                    // propagate also when relevant blocks are on a fork. Consider that a further check
+                                    // on BLOCK_HAVE_DATA is performed below
+                                    LogPrint("forks", "%s():%d: request from peer=%i: status[0x%x]\n",
+                                        __func__, __LINE__, pfrom->GetId(), mi->second->nStatus);
+                                    send = true;
+                                }
+                                else
+                                {
+                                    LogPrint("forks", "%s():%d: ignoring request from peer=%i: %s status[0x%x]\n",
+                                        __func__, __LINE__, pfrom->GetId(), inv.hash.ToString(), mi->second->nStatus);
+                                }
                             }
                         }
                     }
+                    // Pruned nodes may have deleted the block, so check whether
+                    // it's available before trying to send.
+                    if (send && (mi->second->nStatus & BLOCK_HAVE_DATA))
+                    {
+                        blockPos = mi->second->GetBlockPos();
+                        fCompact = inv.type == MSG_CMPCT_BLOCK && mi->second->nHeight >= chainActive.Height() - MAX_CMPCTBLOCK_DEPTH;
+                    }
+                    else if (send)
+                        LogPrint("forks", "%s():%d - NOT Pushing incomplete block [%s]\n", __func__, __LINE__, inv.hash.ToString() );
                 }
-                // Pruned nodes may have deleted the block, so check whether
-                // it's available before trying to send.
-                if (send && (mi->second->nStatus & BLOCK_HAVE_DATA))
+                // Reading, checking and serializing the block are done without cs_main,
+                // so that the other message handler threads can serve their peers meanwhile
+                if (!blockPos.IsNull())
                 {
                     // Send block from disk
                     CBlock block;
-                    if (!ReadBlockFromDisk(block, (*mi).second))
-                        assert(!"cannot load block from disk");
-                    if (inv.type == MSG_BLOCK)
+                    bool fRead;
+                    if (inv.type == MSG_BLOCK || (inv.type == MSG_CMPCT_BLOCK && !fCompact))
+                    {
+                        // The block goes from the file to the message as it is, without
+                        // being deserialized and serialized again. It is read after room
+                        // for the message header, before cs_vSend is taken so that the
+                        // socket thread can send meanwhile, then swapped in, not copied
+                        CDataStream ssBlock(SER_NETWORK, PROTOCOL_VERSION);
+                        ssBlock << CMessageHeader(Params().MessageStart(), "block", 0);
+                        fRead = ReadRawBlockFromDisk(ssBlock, blockPos, inv.hash);
+                        if (fRead)
+                        {
+                            LogPrint("forks", "%s():%d - Pushing block [%s]\n", __func__, __LINE__, inv.hash.ToString() );
+                            CSerializeData vMsg;
+                            ssBlock.SwapData(vMsg);
+                            pfrom->BeginMessage("block");
+                            pfrom->ssSend.SwapData(vMsg);
+                            pfrom->EndMessage();
+                        }
+                    }
+                    else
+                        fRead = ReadBlockFromDisk(block, blockPos) && block.GetHash() == inv.hash;
+                    if (!fRead)
+                    {
+                        // the file may have been pruned since the lookup
+                        LOCK(cs_main);
+                        if (mapBlockIndex.find(inv.hash)->second->nStatus & BLOCK_HAVE_DATA)
+                            assert(!"cannot load block from disk");
+                        continue;
+                    }
+                    if (fCompact)
                     {
-                        LogPrint("forks", "%s():%d - Pushing block [%s]\n", __func__, __LINE__, block.GetHash().ToString() );
-                        pfrom->PushMessage("block", block);
+                        LogPrint("cmpctblock", "%s():%d - Pushing compact block [%s]\n", __func__, __LINE__, inv.hash.ToString() );
+                        pfrom->PushMessage("cmpctblock", CBlockHeaderAndShortTxIDs(block));
                     }
-                    else // MSG_FILTERED_BLOCK)
-                    if (inv.type == MSG_FILTERED_BLOCK)
+                    else if (inv.type == MSG_FILTERED_BLOCK)
                     {
                         LOCK(pfrom->cs_filter);
                         if (pfrom->pfilter)
@@ -6508,18 +6866,19 @@ void static ProcessGetData(CNode* pfrom)
                             // Thus, the protocol spec specified allows for us to provide duplicate txn here,
                             // however we MUST always provide at least what the remote peer needs
                             typedef std::pair<unsigned int, uint256> PairType;
+                            LOCK(pfrom->cs_inventory);
                             BOOST_FOREACH(PairType& pair, merkleBlock.vMatchedTxn)
                             {
                                 unsigned int pos = pair.first;
                                 if (pos < block.vtx.size() )
                                 {
-                                    if (!pfrom->setInventoryKnown.count(CInv(MSG_TX, pair.second)))
+                                    if (!pfrom->filterInventoryKnown.contains(pair.second))
                                         pfrom->PushMessage("tx", block.vtx[pos]);
                                 }
                                 else
                                 if ( pos < (block.vcert.size() + block.vtx.size()) )
                                 {
-                                    if (!pfrom->setInventoryKnown.count(CInv(MSG_TX, pair.second)))
+                                    if (!pfrom->filterInventoryKnown.contains(pair.second))
                                     {
                                         unsigned int offset = pos - block.vtx.size();
                                         pfrom->PushMessage("tx", block.vcert[offset]);
@@ -6534,10 +6893,6 @@ void static ProcessGetData(CNode* pfrom)
                         // else
                             // no response
                     }
-                    else
-                    {
-                        LogPrint("cert", "%s():%d - inv.type=%d\n", __func__, __LINE__, inv.type);
-                    }
 
                     // Trigger the peer node to send a getblocks request for the next batch of inventory
                     if (inv.hash == pfrom->hashContinue)
@@ -6546,19 +6901,15 @@ void static ProcessGetData(CNode* pfrom)
                         // and we want it right after the last block so they don't
                         // wait for other stuff first.
                         vector<CInv> vInv;
-                        vInv.push_back(CInv(MSG_BLOCK, chainActive.Tip()->GetBlockHash()));
+                        {
+                            LOCK(cs_main);
+                            vInv.push_back(CInv(MSG_BLOCK, chainActive.Tip()->GetBlockHash()));
+                        }
                         LogPrint("forks", "%s():%d - Pushing inv\n", __func__, __LINE__);
                         pfrom->PushMessage("inv", vInv);
                         pfrom->hashContinue.SetNull();
                     }
                 }
-                else
-                {
-                    if (send && !(mi->second->nStatus & BLOCK_HAVE_DATA) )
-                    {
-                        LogPrint("forks", "%s():%d - NOT Pushing incomplete block [%s]\n", __func__, __LINE__, inv.hash.ToString() );
-                    }
-                }
             }
             else if (inv.IsKnownType())
             {
@@ -6603,7 +6954,7 @@ void static ProcessGetData(CNode* pfrom)
             // Track requests for our stuff.
             GetMainSignals().Inventory(inv.hash);
 
-            if (inv.type == MSG_BLOCK || inv.type == MSG_FILTERED_BLOCK)
+            if (inv.type == MSG_BLOCK || inv.type == MSG_FILTERED_BLOCK || inv.type == MSG_CMPCT_BLOCK)
                 break;
         }
     }
@@ -6667,6 +7018,79 @@ void ProcessMempoolMsg(const CTxMemPool& pool, CNode* pfrom)
     return;
 }
 
+/**
+ * Reconsider at most MAX_ORPHAN_TX_PER_BATCH of the orphans queued by
+ * AddOrphanWork(), so that a long chain of orphans doesn't hold cs_main for
+ * the time of its whole resolution. The orphans accepted queue their own
+ * children, the ones still missing inputs stay in the pool.
+ */
+void static ProcessOrphanWork(CNode* pfrom) EXCLUSIVE_LOCKS_REQUIRED(cs_main)
+{
+    set<NodeId> setMisbehaving;
+    for (unsigned int n = 0; n < MAX_ORPHAN_TX_PER_BATCH && !pfrom->setOrphanWork.empty(); n++)
+    {
+        const uint256 orphanHash = *pfrom->setOrphanWork.begin();
+        pfrom->setOrphanWork.erase(pfrom->setOrphanWork.begin());
+
+        map<uint256, COrphanTx>::iterator itOrphan = mapOrphanTransactions.find(orphanHash);
+        if (itOrphan == mapOrphanTransactions.end())
+            continue;
+        // keep the transaction alive, EraseOrphanTx() releases the pool's reference
+        std::shared_ptr<const CTransactionBase> orphanTx = itOrphan->second.tx;
+        NodeId fromPeer = itOrphan->second.fromPeer;
+        if (setMisbehaving.count(fromPeer))
+            continue;
+
+        // Use a dummy CValidationState so someone can't setup nodes to counter-DoS based on orphan
+        // resolution (that is, feeding people an invalid transaction based on LegitTxX in order to get
+        // anyone relaying LegitTxX banned)
+        CValidationState stateDummy;
+        MempoolReturnValue resOrphan = AcceptTxBaseToMemoryPool(mempool, stateDummy, *orphanTx,
+                    LimitFreeFlag::ON, RejectAbsurdFeeFlag::OFF, MempoolProofVerificationFlag::ASYNC, pfrom);
+        if (resOrphan == MempoolReturnValue::VALID)
+        {
+            LogPrint("mempool", "   accepted orphan tx %s\n", orphanHash.ToString());
+            orphanTx->Relay();
+            // the peer the orphan came from delivered a new transaction
+            if (fromPeer == pfrom->GetId())
+                pfrom->nLastTxTime = GetTime();
+            else
+            {
+                LOCK(cs_vNodes);
+                BOOST_FOREACH(CNode* pnode, vNodes)
+                {
+                    if (pnode->GetId() == fromPeer)
+                        pnode->nLastTxTime = GetTime();
+                }
+            }
+            AddOrphanWork(*orphanTx, pfrom);
+            EraseOrphanTx(orphanHash);
+        }
+        else if (resOrphan == MempoolReturnValue::INVALID)
+        {
+            if (stateDummy.IsInvalid() && stateDummy.GetDoS() > 0)
+            {
+                // Punish peer that gave us an invalid orphan tx
+                Misbehaving(fromPeer, stateDummy.GetDoS());
+                setMisbehaving.insert(fromPeer);
+                LogPrint("mempool", "   invalid orphan tx %s\n", orphanHash.ToString());
+            }
+            // Has inputs but not accepted to mempool
+            // Probably non-standard or insufficient fee/priority
+            LogPrint("mempool", "   removed orphan tx %s\n", orphanHash.ToString());
+            EraseOrphanTx(orphanHash);
+            assert(recentRejects);
+            recentRejects->insert(orphanHash);
+        }
+        else if (resOrphan == MempoolReturnValue::PARTIALLY_VALIDATED)
+        {
+            EraseOrphanTx(orphanHash);
+        }
+        mempool.check(pcoinsTip);
+    }
+    pfrom->fOrphanWork = !pfrom->setOrphanWork.empty();
+}
+
 void ProcessTxBaseAcceptToMemoryPool(const CTransactionBase& txBase, CNode* pfrom, BatchVerificationStateFlag proofVerificationState, CValidationState& state)
 {
     if (proofVerificationState == BatchVerificationStateFlag::FAILED)
@@ -6694,78 +7118,26 @@ void ProcessTxBaseAcceptToMemoryPool(const CTransactionBase& txBase, CNode* pfro
     {
         mempool.check(pcoinsTip);
         txBase.Relay();
-        std::vector<uint256> vWorkQueue{txBase.GetHash()};
-        std::vector<uint256> vEraseQueue;
+        pfrom->nLastTxTime = GetTime();
 
         LogPrint("mempool", "%s(): peer=%d %s: accepted %s (poolsz %u)\n", __func__,
             pfrom->id, pfrom->cleanSubVer,
             txBase.GetHash().ToString(),
             mempool.size());
 
-        // Recursively process any orphan transactions that depended on this one
-        set<NodeId> setMisbehaving;
-        for (unsigned int i = 0; i < vWorkQueue.size(); i++)
-        {
-            map<uint256, set<uint256> >::iterator itByPrev = mapOrphanTransactionsByPrev.find(vWorkQueue[i]);
-            if (itByPrev == mapOrphanTransactionsByPrev.end())
-                continue;
-            for (const uint256& orphanHash: itByPrev->second)
-            {
-                const CTransactionBase& orphanTx = *mapOrphanTransactions[orphanHash].tx;
-                NodeId fromPeer = mapOrphanTransactions[orphanHash].fromPeer;
-                bool fMissingInputs2 = false;
-                // Use a dummy CValidationState so someone can't setup nodes to counter-DoS based on orphan
-                // resolution (that is, feeding people an invalid transaction based on LegitTxX in order to get
-                // anyone relaying LegitTxX banned)
-                CValidationState stateDummy;
-
-                if (setMisbehaving.count(fromPeer))
-                    continue;
-
-                MempoolReturnValue resOrphan = AcceptTxBaseToMemoryPool(mempool, stateDummy, orphanTx,
-                            LimitFreeFlag::ON,RejectAbsurdFeeFlag::OFF, MempoolProofVerificationFlag::ASYNC, pfrom);
-                if (resOrphan == MempoolReturnValue::VALID)
-                {
-                    LogPrint("mempool", "   accepted orphan tx %s\n", orphanHash.ToString());
-                    orphanTx.Relay();
-                    vWorkQueue.push_back(orphanHash);
-                    vEraseQueue.push_back(orphanHash);
-                }
-                else if (resOrphan == MempoolReturnValue::INVALID)
-                {
-                    if (stateDummy.IsInvalid() && stateDummy.GetDoS() > 0)
-                    {
-                        // Punish peer that gave us an invalid orphan tx
-                        Misbehaving(fromPeer, stateDummy.GetDoS());
-                        setMisbehaving.insert(fromPeer);
-                        LogPrint("mempool", "   invalid orphan tx %s\n", orphanHash.ToString());
-                    }
-                    // Has inputs but not accepted to mempool
-                    // Probably non-standard or insufficient fee/priority
-                    LogPrint("mempool", "   removed orphan tx %s\n", orphanHash.ToString());
-                    vEraseQueue.push_back(orphanHash);
-                    assert(recentRejects);
-                    recentRejects->insert(orphanHash);
-                }
-                else if (resOrphan == MempoolReturnValue::PARTIALLY_VALIDATED)
-                {
-                    vEraseQueue.push_back(orphanHash);
-                }
-                mempool.check(pcoinsTip);
-            }
-        }
-
-            for(const uint256& hash: vEraseQueue)
-            EraseOrphanTx(hash);
+        // The orphans that depended on this one are reconsidered in batches
+        // along with the messages of the peer, see ProcessOrphanWork()
+        AddOrphanWork(txBase, pfrom);
     }
     // TODO: currently, prohibit joinsplits from entering mapOrphans
     else if (res == MempoolReturnValue::MISSING_INPUT && txBase.GetVjoinsplit().size() == 0)
     {
-        AddOrphanTx(txBase, pfrom->GetId());
-
         // DoS prevention: do not allow mapOrphanTransactions to grow unbounded
         unsigned int nMaxOrphanTx = (unsigned int)std::max((int64_t)0, GetArg("-maxorphantx", DEFAULT_MAX_ORPHAN_TRANSACTIONS));
-        unsigned int nEvicted = LimitOrphanTxSize(nMaxOrphanTx);
+        size_t nMaxOrphanTxSize = (size_t)std::max((int64_t)0, GetArg("-maxorphantxsize", DEFAULT_MAX_ORPHAN_TRANSACTIONS_SIZE)) * 1000;
+        AddOrphanTx(txBase, pfrom->GetId(), nMaxOrphanTxSize / ORPHAN_TX_PEER_SHARE);
+
+        unsigned int nEvicted = LimitOrphanTxSize(nMaxOrphanTx, nMaxOrphanTxSize);
         if (nEvicted > 0)
             LogPrint("mempool", "mapOrphan overflow, removed %u tx\n", nEvicted);
     }
@@ -6831,6 +7203,46 @@ void ProcessTxBaseMsg(const CTransactionBase& txBase, CNode* pfrom)
     }
 }
 
+// Hand a block received from pfrom, in full or rebuilt from a compact block,
+// to validation and tell the peer if it was rejected. Called without cs_main.
+void static ProcessReceivedBlock(CNode* pfrom, const string& strCommand, CBlock& block)
+{
+    const uint256 hash = block.GetHash();
+    CValidationState state;
+    // Process all blocks from whitelisted peers, even if not requested,
+    // unless we're still syncing with the network.
+    // Such an unrequested block may still be processed, subject to the
+    // conditions in AcceptBlock().
+    bool forceProcessing = pfrom->fWhitelisted && !IsInitialBlockDownload();
+    ProcessNewBlock(state, pfrom, &block, forceProcessing, NULL);
+    if (state.IsInvalid())
+    {
+        LogPrint("forks", "%s():%d - Pushing reject, DoS[%d]\n", __func__, __LINE__, state.GetDoS());
+        pfrom->PushMessage("reject", strCommand, CValidationState::CodeToChar(state.GetRejectCode()),
+                           state.GetRejectReason().substr(0, MAX_REJECT_MESSAGE_LENGTH), hash);
+        if (state.GetDoS() > 0)
+            Misbehaving(pfrom->GetId(), state.GetDoS());
+    }
+}
+
+/** Announce with invs the transactions a reconciliation found the peer is missing. */
+void static PushReconciledInvs(CNode* pnode, const vector<uint256>& vHashes)
+{
+    vector<CInv> vInv;
+    vInv.reserve(std::min(vHashes.size(), (size_t)MAX_INV_SZ));
+    BOOST_FOREACH(const uint256& hash, vHashes)
+    {
+        vInv.push_back(CInv(MSG_TX, hash));
+        if (vInv.size() == MAX_INV_SZ)
+        {
+            pnode->PushMessage("inv", vInv);
+            vInv.clear();
+        }
+    }
+    if (!vInv.empty())
+        pnode->PushMessage("inv", vInv);
+}
+
 bool static ProcessMessage(CNode* pfrom, string strCommand, CDataStream& vRecv, int64_t nTimeReceived)
 {
     const CChainParams& chainparams = Params();
@@ -6902,7 +7314,22 @@ bool static ProcessMessage(CNode* pfrom, string strCommand, CDataStream& vRecv,
         pfrom->fClient = !(pfrom->nServices & NODE_NETWORK);
 
         // Potentially mark this peer as a preferred download peer.
-        UpdatePreferredDownload(pfrom, State(pfrom->GetId()));
+        {
+            LOCK(cs_main);
+            UpdatePreferredDownload(pfrom, State(pfrom->GetId()));
+        }
+
+        // Set reconciliation has to be offered before verack
+        if (pfrom->nVersion >= TXRECONCILIATION_PROTO_VERSION && pfrom->fRelayTxes &&
+            GetBoolArg("-txreconciliation", DEFAULT_TXRECONCILIATION))
+        {
+            uint64_t nSalt = GetRand(std::numeric_limits<uint64_t>::max()) + 1;
+            {
+                LOCK(pfrom->cs_inventory);
+                pfrom->recon.nLocalSalt = nSalt;
+            }
+            pfrom->PushMessage("sendrecon", TXRECONCILIATION_VERSION, nSalt);
+        }
 
         // Change version
         pfrom->PushMessage("verack");
@@ -6979,6 +7406,33 @@ bool static ProcessMessage(CNode* pfrom, string strCommand, CDataStream& vRecv,
             LOCK(cs_main);
             State(pfrom->GetId())->fCurrentlyConnected = true;
         }
+
+        if (pfrom->nVersion >= SHORT_IDS_BLOCKS_VERSION) {
+            // We ask for compact blocks in getdata but keep announcing blocks
+            // with invs (low-bandwidth mode), version 1 of the encoding.
+            bool fAnnounceUsingCMPCTBLOCK = false;
+            uint64_t nCMPCTBLOCKVersion = 1;
+            pfrom->PushMessage("sendcmpct", fAnnounceUsingCMPCTBLOCK, nCMPCTBLOCKVersion);
+        }
+
+        // Both sides offered set reconciliation, the one which opened the
+        // connection asks for it. Transactions are still flooded to the first
+        // outbound peers.
+        {
+            LOCK2(cs_main, pfrom->cs_inventory);
+            CTxReconciliationState& recon = pfrom->recon;
+            if (!recon.fEnabled && recon.nLocalSalt != 0 && recon.nRemoteSalt != 0)
+            {
+                CNodeState* state = State(pfrom->GetId());
+                if (!pfrom->fInbound && nTxFloodOutboundPeers < MAX_TX_FLOOD_OUTBOUND_PEERS)
+                {
+                    state->fTxFloodOutbound = true;
+                    nTxFloodOutboundPeers++;
+                }
+                recon.Enable(!pfrom->fInbound, state->fTxFloodOutbound, GetTime());
+                LogPrint("net", "reconciling transactions with peer=%d%s\n", pfrom->id, recon.fFlood ? " (flooding)" : "");
+            }
+        }
     }
 
 
@@ -7107,8 +7561,9 @@ bool static ProcessMessage(CNode* pfrom, string strCommand, CDataStream& vRecv,
                     pfrom->PushMessage("getheaders", bl, inv.hash);
                     CNodeState *nodestate = State(pfrom->GetId());
                     if (chainActive.Tip()->GetBlockTime() > GetTime() - chainparams.GetConsensus().nPowTargetSpacing * 20 &&
-                        nodestate->nBlocksInFlight < MAX_BLOCKS_IN_TRANSIT_PER_PEER) {
-                        vToFetch.push_back(inv);
+                        nodestate->nBlocksInFlight < GetBlocksInTransitLimit(nodestate->nBlockServiceTime)) {
+                        // the peer sends most of a new block as short ids when it can
+                        vToFetch.push_back(nodestate->fProvidesCmpctBlocks ? CInv(MSG_CMPCT_BLOCK, inv.hash) : inv);
                         // Mark block as in flight already, even though the actual "getdata" message only goes out
                         // later (within the same cs_main lock, though).
                         MarkBlockAsInFlight(pfrom->GetId(), inv.hash, chainparams.GetConsensus());
@@ -7211,196 +7666,197 @@ bool static ProcessMessage(CNode* pfrom, string strCommand, CDataStream& vRecv,
         uint256 hashStop;
         vRecv >> locator >> hashStop;
 
-        LOCK(cs_main);
+        // we cannot use CBlockHeaders since it won't include the 0x00 nTx count at the end
+        // we cannot use CBlock, since we added Certificates and its serialization is not backward compatible
+        // We must use CBlockHeaderForNetwork, and ad-hoc class for this task.
+        // The headers are collected under cs_main, serializing them for the peer does not need it
+        vector<CBlockHeaderForNetwork> vHeaders;
+        {
+            LOCK(cs_main);
 
-        if (IsInitialBlockDownload())
-            return true;
+            if (IsInitialBlockDownload())
+                return true;
 
-        CBlockIndex* pindexReference = NULL;
-        bool onMain = getHeadersIsOnMain(locator, hashStop, &pindexReference);
+            CBlockIndex* pindexReference = NULL;
+            bool onMain = getHeadersIsOnMain(locator, hashStop, &pindexReference);
 
-        if (onMain)
-        {
-            CBlockIndex* pindex = NULL;
-            if (locator.IsNull())
-            {
-                // If locator is null, return the hashStop block
-                BlockMap::iterator mi = mapBlockIndex.find(hashStop);
-                if (mi == mapBlockIndex.end())
-                    return true;
-                pindex = (*mi).second;
-            }
-            else
+            if (onMain)
             {
-                // Find the last block the caller has in the main chain
-                pindex = FindForkInGlobalIndex(chainActive, locator);
-                if (pindex)
-                    pindex = chainActive.Next(pindex);
-            }
+                CBlockIndex* pindex = NULL;
+                if (locator.IsNull())
+                {
+                    // If locator is null, return the hashStop block
+                    BlockMap::iterator mi = mapBlockIndex.find(hashStop);
+                    if (mi == mapBlockIndex.end())
+                        return true;
+                    pindex = (*mi).second;
+                }
+                else
+                {
+                    // Find the last block the caller has in the main chain
+                    pindex = FindForkInGlobalIndex(chainActive, locator);
+                    if (pindex)
+                        pindex = chainActive.Next(pindex);
+                }
  
-            // we cannot use CBlockHeaders since it won't include the 0x00 nTx count at the end
-            // we cannot use CBlock, since we added Certificates and its serialization is not backward compatible
-            // We must use CBlockHeaderForNetwork, and ad-hoc class for this task
-            vector<CBlockHeaderForNetwork> vHeaders;
-            int nLimit = MAX_HEADERS_RESULTS;
-            LogPrint("net", "getheaders from h(%d) to %s from peer=%d\n", (pindex ? pindex->nHeight : -1), hashStop.ToString(), pfrom->id);
-            for (; pindex; pindex = chainActive.Next(pindex))
-            {
-                vHeaders.push_back(CBlockHeaderForNetwork(pindex->GetBlockHeader()) );
-                if (--nLimit <= 0 || pindex->GetBlockHash() == hashStop)
-                    break;
-            }
-            LogPrint("forks", "%s():%d - Pushing %d headers to node[%s]\n", __func__, __LINE__, vHeaders.size(), pfrom->addrName);
-            pfrom->PushMessage("headers", vHeaders);
-        }
-        else
-        {
-            if(!pindexReference)
-            {
-                // should never happen
-                LogPrint("forks", "%s():%d - reference not found\n", __func__, __LINE__ );
-                return true;
+                int nLimit = MAX_HEADERS_RESULTS;
+                LogPrint("net", "getheaders from h(%d) to %s from peer=%d\n", (pindex ? pindex->nHeight : -1), hashStop.ToString(), pfrom->id);
+                for (; pindex; pindex = chainActive.Next(pindex))
+                {
+                    vHeaders.push_back(CBlockHeaderForNetwork(pindex->GetBlockHeader()) );
+                    if (--nLimit <= 0 || pindex->GetBlockHash() == hashStop)
+                        break;
+                }
+                LogPrint("forks", "%s():%d - Pushing %d headers to node[%s]\n", __func__, __LINE__, vHeaders.size(), pfrom->addrName);
             }
-
-            if (hashStop != uint256() )
+            else
             {
-                BlockMap::iterator mi = mapBlockIndex.find(hashStop);
-                if (mi == mapBlockIndex.end() )
+                if(!pindexReference)
                 {
                     // should never happen
-                    LogPrint("forks", "%s():%d - block [%s] not found\n", __func__, __LINE__, hashStop.ToString() );
+                    LogPrint("forks", "%s():%d - reference not found\n", __func__, __LINE__ );
                     return true;
                 }
 
-                LogPrint("forks", "%s():%d - peer is not using chain active! Starting from %s at h(%d)\n",
-                    __func__, __LINE__, pindexReference->GetBlockHash().ToString(), pindexReference->nHeight );
+                if (hashStop != uint256() )
+                {
+                    BlockMap::iterator mi = mapBlockIndex.find(hashStop);
+                    if (mi == mapBlockIndex.end() )
+                    {
+                        // should never happen
+                        LogPrint("forks", "%s():%d - block [%s] not found\n", __func__, __LINE__, hashStop.ToString() );
+                        return true;
+                    }
 
-                std::deque<CBlockHeaderForNetwork> dHeadersAlternative;
+                    LogPrint("forks", "%s():%d - peer is not using chain active! Starting from %s at h(%d)\n",
+                        __func__, __LINE__, pindexReference->GetBlockHash().ToString(), pindexReference->nHeight );
 
-                bool found = false;
+                    std::deque<CBlockHeaderForNetwork> dHeadersAlternative;
 
-                // the reference is the block which triggered the getheader request (the hashStop)
-                while ( pindexReference )
-                {
-                    dHeadersAlternative.push_front(CBlockHeaderForNetwork(pindexReference->GetBlockHeader()));
+                    bool found = false;
 
-                    BOOST_FOREACH(const uint256& hash, locator.vHave)
+                    // the reference is the block which triggered the getheader request (the hashStop)
+                    while ( pindexReference )
                     {
-                        if (hash == pindexReference->GetBlockHash() )
+                        dHeadersAlternative.push_front(CBlockHeaderForNetwork(pindexReference->GetBlockHeader()));
+
+                        BOOST_FOREACH(const uint256& hash, locator.vHave)
+                        {
+                            if (hash == pindexReference->GetBlockHash() )
+                            {
+                                // we found the tip passed along in locator, we must stop here
+                                LogPrint("forks", "%s():%d - matched fork tip in locator [%s]\n",
+                                    __func__, __LINE__, hash.ToString() );
+                                found = true;
+                                break;
+                            }
+                        }
+
+                        if (found || pindexReference->pprev == chainActive.Genesis() )
                         {
-                            // we found the tip passed along in locator, we must stop here
-                            LogPrint("forks", "%s():%d - matched fork tip in locator [%s]\n",
-                                __func__, __LINE__, hash.ToString() );
-                            found = true;
                             break;
                         }
-                    }
 
-                    if (found || pindexReference->pprev == chainActive.Genesis() )
-                    {
-                        break;
+                        pindexReference = pindexReference->pprev;
                     }
 
-                    pindexReference = pindexReference->pprev;
-                }
-
-                vector<CBlockHeaderForNetwork> vHeaders;
-                int nLimit = MAX_HEADERS_RESULTS;
-                // we are on a fork: fill the vector rewinding the deque so that we have the correct ordering
-                LogPrint("forks", "%s():%d - Found %d headers to push to node[%s]:\n", __func__, __LINE__, dHeadersAlternative.size(), pfrom->addrName);
-                for(const auto& cb : dHeadersAlternative) {
-                    LogPrint("forks", "%s():%d -- [%s]\n", __func__, __LINE__, cb.GetHash().ToString() );
-                    vHeaders.push_back(cb);
-                    if (--nLimit <= 0)
-                        break;
+                    int nLimit = MAX_HEADERS_RESULTS;
+                    // we are on a fork: fill the vector rewinding the deque so that we have the correct ordering
+                    LogPrint("forks", "%s():%d - Found %d headers to push to node[%s]:\n", __func__, __LINE__, dHeadersAlternative.size(), pfrom->addrName);
+                    for(const auto& cb : dHeadersAlternative) {
+                        LogPrint("forks", "%s():%d -- [%s]\n", __func__, __LINE__, cb.GetHash().ToString() );
+                        vHeaders.push_back(cb);
+                        if (--nLimit <= 0)
+                            break;
+                    }
+                    LogPrint("forks", "%s():%d - Pushing %d headers to node[%s]\n", __func__, __LINE__, vHeaders.size(), pfrom->addrName);
                 }
-                LogPrint("forks", "%s():%d - Pushing %d headers to node[%s]\n", __func__, __LINE__, vHeaders.size(), pfrom->addrName);
-                pfrom->PushMessage("headers", vHeaders);
-            }
-            else
-            {
-                LogPrint("forks", "%s():%d - hashStop block is null\n", __func__, __LINE__);
+                else
+                {
+                    LogPrint("forks", "%s():%d - hashStop block is null\n", __func__, __LINE__);
 
-                // this is the case when we just sent 160 headers, reference is the header which the last getheader
-                // request has reached: more must be sent starting from this one
-                std::set<const CBlockIndex*> sProcessed;
-                std::vector<CBlockHeaderForNetwork> vHeadersMulti;
-                int nLimit = MAX_HEADERS_RESULTS;
+                    // this is the case when we just sent 160 headers, reference is the header which the last getheader
+                    // request has reached: more must be sent starting from this one
+                    std::set<const CBlockIndex*> sProcessed;
+                    std::vector<CBlockHeaderForNetwork> vHeadersMulti;
+                    int nLimit = MAX_HEADERS_RESULTS;
 
-                int h = pindexReference->nHeight;
+                    int h = pindexReference->nHeight;
 
-                LogPrint("forks", "%s():%d - Searching up to %s h(%d) from tips backwards\n",
-                    __func__, __LINE__, pindexReference->GetBlockHash().ToString(), pindexReference->nHeight);
+                    LogPrint("forks", "%s():%d - Searching up to %s h(%d) from tips backwards\n",
+                        __func__, __LINE__, pindexReference->GetBlockHash().ToString(), pindexReference->nHeight);
 
-                // we must follow all forks backwards because we can not tell which is the concerned one
-                // peer will discard headers already known if any
-                BOOST_FOREACH(auto mapPair, mGlobalForkTips)
-                {
-                    const CBlockIndex* block = mapPair.first;
-                    if (block == chainActive.Tip() || block == pindexBestHeader )
+                    // we must follow all forks backwards because we can not tell which is the concerned one
+                    // peer will discard headers already known if any
+                    BOOST_FOREACH(auto mapPair, mGlobalForkTips)
                     {
-                        LogPrint("forks", "%s():%d - skipping tips\n", __func__, __LINE__);
-                        continue;
-                    }
+                        const CBlockIndex* block = mapPair.first;
+                        if (block == chainActive.Tip() || block == pindexBestHeader )
+                        {
+                            LogPrint("forks", "%s():%d - skipping tips\n", __func__, __LINE__);
+                            continue;
+                        }
 
-                    std::deque<CBlockHeaderForNetwork> dHeadersAlternativeMulti;
+                        std::deque<CBlockHeaderForNetwork> dHeadersAlternativeMulti;
 
-                    LogPrint("forks", "%s():%d - tips %s h(%d)\n",
-                        __func__, __LINE__, block->GetBlockHash().ToString(), block->nHeight);
+                        LogPrint("forks", "%s():%d - tips %s h(%d)\n",
+                            __func__, __LINE__, block->GetBlockHash().ToString(), block->nHeight);
 
-                    while (block &&
-                           block != pindexReference &&
-                           block->nHeight >= h)
-                    {
-                        if (!sProcessed.count(block) )
+                        while (block &&
+                               block != pindexReference &&
+                               block->nHeight >= h)
                         {
-                            LogPrint("forks", "%s():%d - adding %s h(%d)\n",
-                                __func__, __LINE__, block->GetBlockHash().ToString(), block->nHeight);
-                            dHeadersAlternativeMulti.push_front(CBlockHeaderForNetwork(block->GetBlockHeader()));
-                            sProcessed.insert(block);
+                            if (!sProcessed.count(block) )
+                            {
+                                LogPrint("forks", "%s():%d - adding %s h(%d)\n",
+                                    __func__, __LINE__, block->GetBlockHash().ToString(), block->nHeight);
+                                dHeadersAlternativeMulti.push_front(CBlockHeaderForNetwork(block->GetBlockHeader()));
+                                sProcessed.insert(block);
+                            }
+                            block = block->pprev;
                         }
-                        block = block->pprev;
-                    }
-
-                    if (block == pindexReference)
-                    {
-                        // we exited from the while loop with the right condition, therefore we must take this branch into account
-                        LogPrint("forks", "%s():%d - found reference %s h(%d)\n",
-                            __func__, __LINE__, block->GetBlockHash().ToString(), block->nHeight);
 
-                        // we must process each deque in order to have a resulting vector with headers in the correct order
-                        // for all possible forks
-                        for(const auto& cb : dHeadersAlternativeMulti)
+                        if (block == pindexReference)
                         {
-                            if (--nLimit > 0)
+                            // we exited from the while loop with the right condition, therefore we must take this branch into account
+                            LogPrint("forks", "%s():%d - found reference %s h(%d)\n",
+                                __func__, __LINE__, block->GetBlockHash().ToString(), block->nHeight);
+
+                            // we must process each deque in order to have a resulting vector with headers in the correct order
+                            // for all possible forks
+                            for(const auto& cb : dHeadersAlternativeMulti)
                             {
-                                LogPrint("forks", "%s():%d -- [%s]\n", __func__, __LINE__, cb.GetHash().ToString() );
-                                vHeadersMulti.push_back(cb);
+                                if (--nLimit > 0)
+                                {
+                                    LogPrint("forks", "%s():%d -- [%s]\n", __func__, __LINE__, cb.GetHash().ToString() );
+                                    vHeadersMulti.push_back(cb);
+                                }
                             }
                         }
+                        else
+                        if (block->nHeight < h)
+                        {
+                            // we must neglect this branch since not linked to the reference
+                            LogPrint("forks", "%s():%d - could not find reference, stopped at %s h(%d)\n",
+                                __func__, __LINE__, block->GetBlockHash().ToString(), block->nHeight);
+                        }
+                        else
+                        {
+                            // should never happen
+                            LogPrint("forks", "%s():%d - block ptr is null\n", __func__, __LINE__);
+                        }
                     }
-                    else
-                    if (block->nHeight < h)
-                    {
-                        // we must neglect this branch since not linked to the reference
-                        LogPrint("forks", "%s():%d - could not find reference, stopped at %s h(%d)\n",
-                            __func__, __LINE__, block->GetBlockHash().ToString(), block->nHeight);
-                    }
-                    else
-                    {
-                        // should never happen
-                        LogPrint("forks", "%s():%d - block ptr is null\n", __func__, __LINE__);
-                    }
-                }
 
-                LogPrint("forks", "%s():%d - Pushing %d headers to node[%s]\n",
-                    __func__, __LINE__, vHeadersMulti.size(), pfrom->addrName);
-                pfrom->PushMessage("headers", vHeadersMulti);
+                    LogPrint("forks", "%s():%d - Pushing %d headers to node[%s]\n",
+                        __func__, __LINE__, vHeadersMulti.size(), pfrom->addrName);
+                    vHeaders.swap(vHeadersMulti);
 
-            } // end of hashstop is null
+                } // end of hashstop is null
 
-        } // end of is on main
+            } // end of is on main
+        }
 
+        pfrom->PushMessage("headers", vHeaders);
     } // end of command getheaders
 
 
@@ -7442,6 +7898,8 @@ bool static ProcessMessage(CNode* pfrom, string strCommand, CDataStream& vRecv,
             ReadCompactSize(vRecv); // ignore tx count; assume it is 0.
         }
 
+        PreCheckBlockHeaders(headers);
+
         LOCK(cs_main);
 
         if (nCount == 0) {
@@ -7505,24 +7963,298 @@ bool static ProcessMessage(CNode* pfrom, string strCommand, CDataStream& vRecv,
 
         pfrom->AddInventoryKnown(inv);
 
-        CValidationState state;
-        // Process all blocks from whitelisted peers, even if not requested,
-        // unless we're still syncing with the network.
-        // Such an unrequested block may still be processed, subject to the
-        // conditions in AcceptBlock().
-        bool forceProcessing = pfrom->fWhitelisted && !IsInitialBlockDownload();
-        ProcessNewBlock(state, pfrom, &block, forceProcessing, NULL);
-        if (state.IsInvalid())
-        {
-            LogPrint("forks", "%s():%d - Pushing reject, DoS[%d]\n", __func__, __LINE__, state.GetDoS());
-            pfrom->PushMessage("reject", strCommand, CValidationState::CodeToChar(state.GetRejectCode()),
-                               state.GetRejectReason().substr(0, MAX_REJECT_MESSAGE_LENGTH), inv.hash);
-            if (state.GetDoS() > 0)
+        ProcessReceivedBlock(pfrom, strCommand, block);
+    }
+
+
+    else if (strCommand == "sendrecon")
+    {
+        uint32_t nReconVersion = 0;
+        uint64_t nSalt = 0;
+        vRecv >> nReconVersion >> nSalt;
+        // Agreed on at verack, later offers are ignored
+        if (nReconVersion == TXRECONCILIATION_VERSION && nSalt != 0)
+        {
+            LOCK(pfrom->cs_inventory);
+            if (!pfrom->recon.fEnabled)
+                pfrom->recon.nRemoteSalt = nSalt;
+        }
+    }
+
+
+    else if (strCommand == "reqrecon")
+    {
+        uint16_t nRemoteSize = 0;
+        uint16_t nRemoteQ = 0;
+        vRecv >> nRemoteSize >> nRemoteQ;
+
+        vector<uint256> vAnnounce;
+        uint16_t nLocalSize = 0;
+        CShortIdSketch sketch;
+        {
+            LOCK(pfrom->cs_inventory);
+            CTxReconciliationState& recon = pfrom->recon;
+            if (!recon.fEnabled || recon.fInitiator)
+            {
+                LogPrint("net", "unexpected reqrecon from peer=%d\n", pfrom->id);
+                return true;
+            }
+            // the initiator gave up the previous reconciliation, announce what it had
+            recon.FinishResponse(false, vector<uint32_t>(), vAnnounce);
+            nLocalSize = std::min(recon.setToAnnounce.size(), (size_t)std::numeric_limits<uint16_t>::max());
+            sketch = recon.Respond(nRemoteSize, nRemoteQ);
+        }
+        PushReconciledInvs(pfrom, vAnnounce);
+        pfrom->PushMessage("sketch", nLocalSize, sketch);
+    }
+
+
+    else if (strCommand == "sketch")
+    {
+        uint16_t nRemoteSize = 0;
+        CShortIdSketch sketch;
+        vRecv >> nRemoteSize >> sketch;
+
+        vector<uint256> vAnnounce;
+        vector<uint32_t> vAsk;
+        bool fSuccess = false;
+        {
+            LOCK(pfrom->cs_inventory);
+            CTxReconciliationState& recon = pfrom->recon;
+            if (!recon.fEnabled || !recon.fInitiator || !recon.fReconciling)
+            {
+                LogPrint("net", "unexpected sketch from peer=%d\n", pfrom->id);
+                return true;
+            }
+            fSuccess = recon.FinishRequest(sketch, nRemoteSize, vAnnounce, vAsk);
+        }
+        LogPrint("net", "reconciliation with peer=%d %s: announcing %u, asking for %u\n", pfrom->id,
+                 fSuccess ? "succeeded" : "failed", vAnnounce.size(), vAsk.size());
+        PushReconciledInvs(pfrom, vAnnounce);
+        pfrom->PushMessage("reconcildiff", fSuccess, vAsk);
+    }
+
+
+    else if (strCommand == "reconcildiff")
+    {
+        bool fSuccess = false;
+        vector<uint32_t> vAsk;
+        vRecv >> fSuccess >> vAsk;
+
+        vector<uint256> vAnnounce;
+        {
+            LOCK(pfrom->cs_inventory);
+            if (!pfrom->recon.fEnabled || pfrom->recon.fInitiator)
+            {
+                LogPrint("net", "unexpected reconcildiff from peer=%d\n", pfrom->id);
+                return true;
+            }
+            pfrom->recon.FinishResponse(fSuccess, vAsk, vAnnounce);
+        }
+        PushReconciledInvs(pfrom, vAnnounce);
+    }
+
+
+    else if (strCommand == "sendcmpct")
+    {
+        bool fAnnounceUsingCMPCTBLOCK = false;
+        uint64_t nCMPCTBLOCKVersion = 0;
+        vRecv >> fAnnounceUsingCMPCTBLOCK >> nCMPCTBLOCKVersion;
+        // Blocks are announced with invs only, whatever the peer prefers
+        if (nCMPCTBLOCKVersion == 1)
+        {
+            LOCK(cs_main);
+            State(pfrom->GetId())->fProvidesCmpctBlocks = true;
+        }
+    }
+
+
+    else if (strCommand == "cmpctblock" && !fImporting && !fReindex && !fReindexFast) // Ignore blocks received while importing
+    {
+        CBlockHeaderAndShortTxIDs cmpctblock;
+        vRecv >> cmpctblock;
+
+        const uint256 hash = cmpctblock.header.GetHash();
+        LogPrint("cmpctblock", "%s():%d - received compact block %s peer=%d\n", __func__, __LINE__, hash.ToString(), pfrom->id);
+
+        pfrom->AddInventoryKnown(CInv(MSG_BLOCK, hash));
+
+        CBlock block;
+        {
+            LOCK(cs_main);
+
+            if (mapBlockIndex.find(cmpctblock.header.hashPrevBlock) == mapBlockIndex.end())
+            {
+                // Doesn't connect, instead of DoSing in AcceptBlockHeader, request deeper headers
+                if (!IsInitialBlockDownload())
+                    pfrom->PushMessage("getheaders", chainActive.GetLocator(pindexBestHeader), uint256());
+                return true;
+            }
+
+            CBlockIndex *pindex = NULL;
+            CValidationState state;
+            if (!AcceptBlockHeader(cmpctblock.header, state, &pindex))
+            {
+                if (state.IsInvalid())
+                {
+                    if (state.GetDoS() > 0)
+                        Misbehaving(pfrom->GetId(), state.GetDoS());
+                    return error("invalid header received in cmpctblock");
+                }
+            }
+            if (pindex == NULL || (pindex->nStatus & BLOCK_HAVE_DATA))
+                return true;
+
+            UpdateBlockAvailability(pfrom->GetId(), hash);
+
+            // Compact blocks are only asked for in getdata, so anything but a
+            // block in flight from this peer is unrequested
+            map<uint256, pair<NodeId, list<QueuedBlock>::iterator> >::iterator itInFlight = mapBlocksInFlight.find(hash);
+            if (itInFlight == mapBlocksInFlight.end() || itInFlight->second.first != pfrom->GetId() ||
+                itInFlight->second.second->partialBlock)
+            {
+                LogPrint("cmpctblock", "%s():%d - ignoring unrequested compact block %s peer=%d\n",
+                    __func__, __LINE__, hash.ToString(), pfrom->id);
+                return true;
+            }
+
+            std::shared_ptr<PartiallyDownloadedBlock> partialBlock(new PartiallyDownloadedBlock(&mempool));
+            ReadStatus status = partialBlock->InitData(cmpctblock);
+            if (status == READ_STATUS_OK)
+            {
+                BlockTransactionsRequest req;
+                for (size_t i = 0; i < cmpctblock.BlockTxCount() + cmpctblock.BlockCertCount(); i++)
+                {
+                    if (!partialBlock->IsTxAvailable(i))
+                        req.indexes.push_back(i);
+                }
+                if (!req.indexes.empty())
+                {
+                    req.blockhash = hash;
+                    itInFlight->second.second->partialBlock = partialBlock;
+                    pfrom->PushMessage("getblocktxn", req);
+                    return true;
+                }
+                // everything was in the mempool
+                status = partialBlock->FillBlock(block, std::vector<CTransaction>(), std::vector<CScCertificate>());
+            }
+            if (status == READ_STATUS_INVALID)
+            {
+                MarkBlockAsReceived(hash); // Reset in-flight state in case of whitelist
+                Misbehaving(pfrom->GetId(), 100);
+                return error("peer=%d sent us an invalid compact block", pfrom->id);
+            }
+            if (status == READ_STATUS_FAILED)
+            {
+                // Short id collision, the block stays in flight and is asked for in full
+                vector<CInv> vInv(1, CInv(MSG_BLOCK, hash));
+                pfrom->PushMessage("getdata", vInv);
+                return true;
+            }
+        }
+
+        ProcessReceivedBlock(pfrom, strCommand, block);
+    }
+
+
+    else if (strCommand == "getblocktxn")
+    {
+        BlockTransactionsRequest req;
+        vRecv >> req;
+
+        CDiskBlockPos blockPos;
+        bool fSendBlock = false;
+        {
+            LOCK(cs_main);
+
+            BlockMap::iterator mi = mapBlockIndex.find(req.blockhash);
+            if (mi == mapBlockIndex.end() || !(mi->second->nStatus & BLOCK_HAVE_DATA))
+            {
+                LogPrint("cmpctblock", "%s():%d - getblocktxn for unknown block %s peer=%d\n",
+                    __func__, __LINE__, req.blockhash.ToString(), pfrom->id);
+                return true;
+            }
+
+            if (mi->second->nHeight < chainActive.Height() - MAX_BLOCKTXN_DEPTH)
+            {
+                // Older blocks, which we never sent as compact blocks, are sent in
+                // full: a peer asking for lots of them to have us read the disk
+                // has to receive all that data as well.
+                LogPrint("cmpctblock", "%s():%d - getblocktxn for a block more than %d deep, sending it in full peer=%d\n",
+                    __func__, __LINE__, MAX_BLOCKTXN_DEPTH, pfrom->id);
+                fSendBlock = true;
+            }
+            else
+                blockPos = mi->second->GetBlockPos();
+        }
+
+        if (fSendBlock)
+        {
+            // ProcessGetData reads the block from disk, which is done without cs_main
+            pfrom->vRecvGetData.push_back(CInv(MSG_BLOCK, req.blockhash));
+            ProcessGetData(pfrom);
+            return true;
+        }
+
+        CBlock block;
+        if (!ReadBlockFromDisk(block, blockPos) || block.GetHash() != req.blockhash)
+            return error("%s: cannot load block %s from disk", __func__, req.blockhash.ToString());
+
+        BlockTransactions resp(req);
+        for (size_t i = 0; i < req.indexes.size(); i++)
+        {
+            if (req.indexes[i] < block.vtx.size())
+                resp.txn.push_back(block.vtx[req.indexes[i]]);
+            else if (req.indexes[i] - block.vtx.size() < block.vcert.size())
+                resp.certs.push_back(block.vcert[req.indexes[i] - block.vtx.size()]);
+            else
             {
-                LOCK(cs_main);
-                Misbehaving(pfrom->GetId(), state.GetDoS());
+                Misbehaving(pfrom->GetId(), 100);
+                return error("peer=%d sent us a getblocktxn with out-of-bounds indexes", pfrom->id);
             }
         }
+        pfrom->PushMessage("blocktxn", resp);
+    }
+
+
+    else if (strCommand == "blocktxn" && !fImporting && !fReindex && !fReindexFast) // Ignore blocks received while importing
+    {
+        BlockTransactions resp;
+        vRecv >> resp;
+
+        CBlock block;
+        {
+            LOCK(cs_main);
+
+            map<uint256, pair<NodeId, list<QueuedBlock>::iterator> >::iterator itInFlight = mapBlocksInFlight.find(resp.blockhash);
+            if (itInFlight == mapBlocksInFlight.end() || itInFlight->second.first != pfrom->GetId() ||
+                !itInFlight->second.second->partialBlock)
+            {
+                LogPrint("cmpctblock", "%s():%d - ignoring unexpected blocktxn for %s peer=%d\n",
+                    __func__, __LINE__, resp.blockhash.ToString(), pfrom->id);
+                return true;
+            }
+
+            // the partial block cannot be filled twice
+            std::shared_ptr<PartiallyDownloadedBlock> partialBlock;
+            partialBlock.swap(itInFlight->second.second->partialBlock);
+            ReadStatus status = partialBlock->FillBlock(block, resp.txn, resp.certs);
+            if (status == READ_STATUS_INVALID)
+            {
+                MarkBlockAsReceived(resp.blockhash); // Reset in-flight state in case of whitelist
+                Misbehaving(pfrom->GetId(), 100);
+                return error("peer=%d sent us a blocktxn that does not match the compact block", pfrom->id);
+            }
+            if (status == READ_STATUS_FAILED)
+            {
+                // Might have collided, the block stays in flight and is asked for in full
+                vector<CInv> vInv(1, CInv(MSG_BLOCK, resp.blockhash));
+                pfrom->PushMessage("getdata", vInv);
+                return true;
+            }
+        }
+
+        ProcessReceivedBlock(pfrom, strCommand, block);
     }
 
 
@@ -7541,7 +8273,10 @@ bool static ProcessMessage(CNode* pfrom, string strCommand, CDataStream& vRecv,
         }
         pfrom->fSentAddr = true;
 
-        pfrom->vAddrToSend.clear();
+        {
+            LOCK(pfrom->cs_vAddrToSend);
+            pfrom->vAddrToSend.clear();
+        }
         vector<CAddress> vAddr = addrman.GetAddr();
         BOOST_FOREACH(const CAddress &addr, vAddr)
             pfrom->PushAddress(addr);
@@ -7640,12 +8375,20 @@ bool static ProcessMessage(CNode* pfrom, string strCommand, CDataStream& vRecv,
         vRecv >> alert;
 
         uint256 alertHash = alert.GetHash();
-        if (pfrom->setKnown.count(alertHash) == 0)
+        bool fKnown;
+        {
+            LOCK(pfrom->cs_inventory);
+            fKnown = pfrom->setKnown.count(alertHash) != 0;
+        }
+        if (!fKnown)
         {
             if (alert.ProcessAlert(Params().AlertKey()))
             {
                 // Relay
-                pfrom->setKnown.insert(alertHash);
+                {
+                    LOCK(pfrom->cs_inventory);
+                    pfrom->setKnown.insert(alertHash);
+                }
                 {
                     LOCK(cs_vNodes);
                     BOOST_FOREACH(CNode* pnode, vNodes)
@@ -7774,6 +8517,16 @@ bool ProcessMessages(CNode* pfrom)
     // this maintains the order of responses
     if (!pfrom->vRecvGetData.empty()) return fOk;
 
+    // setOrphanWork is filled by the proof verifier thread as well, under cs_main
+    if (pfrom->fOrphanWork)
+    {
+        LOCK(cs_main);
+        ProcessOrphanWork(pfrom);
+    }
+
+    // the orphans made valid by this peer are reconsidered before its next messages
+    if (pfrom->fOrphanWork) return fOk;
+
     std::deque<CNetMessage>::iterator it = pfrom->vRecvMsg.begin();
     while (!pfrom->fDisconnect && it != pfrom->vRecvMsg.end()) {
         // Don't bother if send buffer is too full to respond anyway
@@ -7827,6 +8580,7 @@ bool ProcessMessages(CNode* pfrom)
 
         // Process message
         bool fRet = false;
+        int64_t nProcessStart = GetTimeMicros();
         try
         {
             fRet = ProcessMessage(pfrom, strCommand, vRecv, msg.nTime);
@@ -7858,6 +8612,7 @@ bool ProcessMessages(CNode* pfrom)
         } catch (...) {
             PrintExceptionContinue(NULL, "ProcessMessages()");
         }
+        pfrom->RecordMsgRecv(strCommand, CMessageHeader::HEADER_SIZE + nMessageSize, GetTimeMicros() - nProcessStart);
 
         if (!fRet)
             LogPrintf("%s(%s, %u bytes) FAILED peer=%d\n", __func__, SanitizeString(strCommand), nMessageSize, pfrom->id);
@@ -7923,7 +8678,10 @@ bool SendMessages(CNode* pto, bool fSendTrickle)
             {
                 // Periodically clear addrKnown to allow refresh broadcasts
                 if (nLastRebroadcast)
+                {
+                    LOCK(pnode->cs_vAddrToSend);
                     pnode->addrKnown.reset();
+                }
 
                 // Rebroadcast our address
                 AdvertizeLocal(pnode);
@@ -7938,22 +8696,25 @@ bool SendMessages(CNode* pto, bool fSendTrickle)
         if (fSendTrickle)
         {
             vector<CAddress> vAddr;
-            vAddr.reserve(pto->vAddrToSend.size());
-            BOOST_FOREACH(const CAddress& addr, pto->vAddrToSend)
             {
-                if (!pto->addrKnown.contains(addr.GetKey()))
+                LOCK(pto->cs_vAddrToSend);
+                vAddr.reserve(pto->vAddrToSend.size());
+                BOOST_FOREACH(const CAddress& addr, pto->vAddrToSend)
                 {
-                    pto->addrKnown.insert(addr.GetKey());
-                    vAddr.push_back(addr);
-                    // receiver rejects addr messages larger than 1000
-                    if (vAddr.size() >= 1000)
+                    if (!pto->addrKnown.contains(addr.GetKey()))
                     {
-                        pto->PushMessage("addr", vAddr);
-                        vAddr.clear();
+                        pto->addrKnown.insert(addr.GetKey());
+                        vAddr.push_back(addr);
+                        // receiver rejects addr messages larger than 1000
+                        if (vAddr.size() >= 1000)
+                        {
+                            pto->PushMessage("addr", vAddr);
+                            vAddr.clear();
+                        }
                     }
                 }
+                pto->vAddrToSend.clear();
             }
-            pto->vAddrToSend.clear();
             if (!vAddr.empty())
                 pto->PushMessage("addr", vAddr);
         }
@@ -8029,27 +8790,37 @@ bool SendMessages(CNode* pto, bool fSendTrickle)
         //
         // Message: inventory
         //
+        // The announcements are collected under cs_inventory and sent after
+        // it is released, in as few messages as the protocol allows.
         vector<CInv> vInv;
-        vector<CInv> vInvWait;
+        bool fRequestRecon = false;
+        uint16_t nReconSize = 0;
+        uint16_t nReconQ = 0;
         {
             LOCK(pto->cs_inventory);
+            vector<CInv> vInvWait;
             vInv.reserve(pto->vInventoryToSend.size());
-            vInvWait.reserve(pto->vInventoryToSend.size());
             BOOST_FOREACH(const CInv& inv, pto->vInventoryToSend)
             {
-                if (pto->setInventoryKnown.count(inv))
+                if (pto->filterInventoryKnown.contains(inv.hash))
+                    continue;
+
+                // announced by the next reconciliation instead, unless too many are waiting
+                if (inv.type == MSG_TX && pto->recon.fEnabled && !pto->recon.fFlood &&
+                    pto->recon.setToAnnounce.size() < MAX_RECON_SET_SIZE)
+                {
+                    pto->filterInventoryKnown.insert(inv.hash);
+                    pto->recon.setToAnnounce.insert(inv.hash);
                     continue;
+                }
 
                 // trickle out tx inv to protect privacy
                 if (inv.type == MSG_TX && !fSendTrickle)
                 {
                     // 1/4 of tx invs blast to all immediately
-                    static uint256 hashSalt;
-                    if (hashSalt.IsNull())
-                        hashSalt = GetRandHash();
-                    uint256 hashRand = ArithToUint256(UintToArith256(inv.hash) ^ UintToArith256(hashSalt));
-                    hashRand = Hash(BEGIN(hashRand), END(hashRand));
-                    bool fTrickleWait = ((UintToArith256(hashRand) & 3) != 0);
+                    static const uint64_t nTrickleK0 = GetRand(std::numeric_limits<uint64_t>::max());
+                    static const uint64_t nTrickleK1 = GetRand(std::numeric_limits<uint64_t>::max());
+                    bool fTrickleWait = (SipHashUint256(nTrickleK0, nTrickleK1, inv.hash) & 3) != 0;
 
                     if (fTrickleWait)
                     {
@@ -8058,25 +8829,44 @@ bool SendMessages(CNode* pto, bool fSendTrickle)
                     }
                 }
 
-                // returns true if wasn't already contained in the set
-                if (pto->setInventoryKnown.insert(inv).second)
+                // also drops the duplicates queued by PushInventory before the first was sent
+                pto->filterInventoryKnown.insert(inv.hash);
+                vInv.push_back(inv);
+            }
+            pto->vInventoryToSend.swap(vInvWait);
+
+            // Ask for a reconciliation, the one left without reply is announced
+            CTxReconciliationState& recon = pto->recon;
+            if (recon.fEnabled && recon.fInitiator)
+            {
+                int64_t nNowRecon = GetTime();
+                if (recon.fReconciling && nNowRecon > recon.nRequestTime + RECON_RESPONSE_TIMEOUT)
                 {
-                    vInv.push_back(inv);
-                    if (vInv.size() >= 1000)
-                    {
-                        LogPrint("forks", "%s():%d - Pushing inv\n", __func__, __LINE__);
-                        pto->PushMessage("inv", vInv);
-                        vInv.clear();
-                    }
+                    LogPrint("net", "reconciliation with peer=%d timed out\n", pto->id);
+                    vector<uint256> vAnnounce;
+                    recon.AbortRequest(vAnnounce);
+                    BOOST_FOREACH(const uint256& hash, vAnnounce)
+                        vInv.push_back(CInv(MSG_TX, hash));
+                }
+                if (!recon.fReconciling && nNowRecon >= recon.nNextRequest)
+                {
+                    nReconSize = std::min(recon.setToAnnounce.size(), (size_t)std::numeric_limits<uint16_t>::max());
+                    nReconQ = recon.nQ;
+                    recon.StartRequest(nNowRecon);
+                    fRequestRecon = true;
                 }
             }
-            pto->vInventoryToSend = vInvWait;
         }
-        if (!vInv.empty())
+        for (size_t nStart = 0; nStart < vInv.size(); nStart += MAX_INV_SZ)
         {
             LogPrint("forks", "%s():%d - Pushing inv\n", __func__, __LINE__);
-            pto->PushMessage("inv", vInv);
+            if (nStart == 0 && vInv.size() <= MAX_INV_SZ)
+                pto->PushMessage("inv", vInv);
+            else
+                pto->PushMessage("inv", vector<CInv>(vInv.begin() + nStart, vInv.begin() + min(vInv.size(), nStart + MAX_INV_SZ)));
         }
+        if (fRequestRecon)
+            pto->PushMessage("reqrecon", nReconSize, nReconQ);
 
         // Detect whether we're stalling
         int64_t nNow = GetTimeMicros();
@@ -8114,10 +8904,13 @@ bool SendMessages(CNode* pto, bool fSendTrickle)
         // Message: getdata (blocks)
         //
         vector<CInv> vGetData;
-        if (!pto->fDisconnect && !pto->fClient && (fFetch || !IsInitialBlockDownload()) && state.nBlocksInFlight < MAX_BLOCKS_IN_TRANSIT_PER_PEER) {
+        int nBlocksInTransitLimit = GetBlocksInTransitLimit(state.nBlockServiceTime);
+        if (!pto->fDisconnect && !pto->fClient && (fFetch || !IsInitialBlockDownload()) && state.nBlocksInFlight < nBlocksInTransitLimit) {
             vector<CBlockIndex*> vToDownload;
             NodeId staller = -1;
-            FindNextBlocksToDownload(pto->GetId(), MAX_BLOCKS_IN_TRANSIT_PER_PEER - state.nBlocksInFlight, vToDownload, staller);
+            FindNextBlocksToDownload(pto->GetId(), nBlocksInTransitLimit - state.nBlocksInFlight, vToDownload, staller);
+            // what is left of the window goes to the blocks other peers are slow to deliver
+            FindStalledBlocksToDownload(pto->GetId(), nBlocksInTransitLimit - state.nBlocksInFlight, vToDownload, nNow);
             BOOST_FOREACH(CBlockIndex *pindex, vToDownload) {
                 vGetData.push_back(CInv(MSG_BLOCK, pindex->GetBlockHash()));
                 MarkBlockAsInFlight(pto->GetId(), pindex->GetBlockHash(), consensusParams, pindex);
@@ -8181,6 +8974,9 @@ public:
         // orphan transactions
         mapOrphanTransactions.clear();
         mapOrphanTransactionsByPrev.clear();
+        lOrphanTransactionsExpiry.clear();
+        nOrphanTransactionsSize = 0;
+        mapOrphanTransactionsSizeByPeer.clear();
     }
 } instance_of_cmaincleanup;
 
@@ -27,6 +27,7 @@
 
 #include <algorithm>
 #include <exception>
+#include <list>
 #include <map>
 #include <set>
 #include <stdint.h>
@@ -75,6 +76,16 @@ static const unsigned int MAX_STANDARD_TX_SIGOPS = MAX_BLOCK_SIGOPS/5;
 static const unsigned int DEFAULT_MIN_RELAY_TX_FEE = 100;
 /** Default for -maxorphantx, maximum number of orphan transactions kept in memory */
 static const unsigned int DEFAULT_MAX_ORPHAN_TRANSACTIONS = 100;
+/** Largest orphan transaction kept, in bytes */
+static const unsigned int MAX_ORPHAN_TX_SIZE = 5000;
+/** Default for -maxorphantxsize, maximum size of the orphan transactions kept in memory, in kilobytes */
+static const unsigned int DEFAULT_MAX_ORPHAN_TRANSACTIONS_SIZE = DEFAULT_MAX_ORPHAN_TRANSACTIONS * MAX_ORPHAN_TX_SIZE / 1000;
+/** A single peer may fill at most this fraction (1/n) of the orphan pool */
+static const unsigned int ORPHAN_TX_PEER_SHARE = 4;
+/** Time in seconds after which an orphan transaction is dropped */
+static const int64_t ORPHAN_TX_EXPIRE_TIME = 20 * 60;
+/** Maximum number of orphan transactions reconsidered per peer each time its messages are processed */
+static const unsigned int MAX_ORPHAN_TX_PER_BATCH = 20;
 /** The maximum size of a blk?????.dat file (since 0.8) */
 static const unsigned int MAX_BLOCKFILE_SIZE = 0x8000000; // 128 MiB
 /** The pre-allocation chunk size for blk?????.dat files (since 0.8) */
@@ -85,8 +96,17 @@ static const unsigned int UNDOFILE_CHUNK_SIZE = 0x100000; // 1 MiB
 static const int MAX_SCRIPTCHECK_THREADS = 16;
 /** -par default (number of script-checking threads, 0 = auto) */
 static const int DEFAULT_SCRIPTCHECK_THREADS = 0;
-/** Number of blocks that can be requested at any given time from a single peer. */
+/** Number of blocks that can be requested at any given time from a single peer, until its download rate is known. */
 static const int MAX_BLOCKS_IN_TRANSIT_PER_PEER = 16;
+/** Bounds of the number of blocks in transit from a peer whose download rate is known. */
+static const int MIN_BLOCKS_IN_TRANSIT_PER_PEER = 2;
+static const int MAX_BLOCKS_IN_TRANSIT_PER_FAST_PEER = 64;
+/** Time in seconds a peer should take to deliver the blocks in transit from it, at its download rate. */
+static const unsigned int BLOCK_DOWNLOAD_TARGET_TIME = 4;
+/** A block in transit for that many times the usual latency of its peer, and at least
+ *  BLOCK_REREQUEST_MIN_TIME seconds, is requested from a peer with a lower latency instead. */
+static const int BLOCK_REREQUEST_LATENCY_FACTOR = 4;
+static const unsigned int BLOCK_REREQUEST_MIN_TIME = 2;
 /** Timeout in seconds during which a peer must stall block download progress before being disconnected. */
 static const unsigned int BLOCK_STALLING_TIMEOUT = 2;
 /** Number of headers sent in one getheaders result. We rely on the assumption that if a peer sends
@@ -97,6 +117,11 @@ static const unsigned int MAX_HEADERS_RESULTS = 160;
  *  degree of disordering of blocks on disk (which make reindexing and in the future perhaps pruning
  *  harder). We'll probably want to make this a per-peer adaptive value at some point. */
 static const unsigned int BLOCK_DOWNLOAD_WINDOW = 1024;
+/** Maximum depth of blocks we're willing to serve as compact blocks to peers
+ *  when requested. For older blocks, a regular block response will be sent. */
+static const int MAX_CMPCTBLOCK_DEPTH = 5;
+/** Maximum depth of blocks we're willing to respond to getblocktxn requests for. */
+static const int MAX_BLOCKTXN_DEPTH = 10;
 /** Time to wait (in seconds) between writing blocks/block index to disk. */
 static const unsigned int DATABASE_WRITE_INTERVAL = 60 * 60;
 /** Time to wait (in seconds) between flushing chainstate to disk. */
@@ -247,6 +272,12 @@ bool InitBlockIndex();
 bool LoadBlockIndex();
 /** Unload database information */
 void UnloadBlockIndex();
+/**
+ * Forget the blocks which aren't in the active chain, as if they had never been
+ * received. For the fuzz targets, which go back to the same chain for every input.
+ * No block may be in flight from a peer.
+ */
+void UnloadBlocksOutsideActiveChain();
 // Utilities refactored out of ProcessMessages
 void ProcessMempoolMsg(const CTxMemPool& pool, CNode* pfrom);
 
@@ -283,6 +314,8 @@ bool ProcessMessages(CNode* pfrom);
 bool SendMessages(CNode* pto, bool fSendTrickle);
 /** Run an instance of the script checking thread */
 void ThreadScriptCheck();
+/** Run an instance of the header checking thread */
+void ThreadHeaderCheck();
 /** Try to detect Partition (network isolation) attacks against us */
 void PartitionCheck(bool (*initialDownloadCheck)(), CCriticalSection& cs, const CBlockIndex *const &bestHeader, int64_t nPowTargetSpacing);
 /** Check whether we are doing an initial block download (synchronizing from disk or network) */
@@ -340,6 +373,17 @@ void UnlinkPrunedFiles(std::set<int>& setFilesToPrune);
 
 /** Create a new block index entry for a given block hash */
 CBlockIndex * InsertBlockIndex(uint256 hash);
+/**
+ * Number of blocks that may be in transit from a peer which delivers one every
+ * nBlockServiceTime microseconds (0 if unknown): as many as it delivers in
+ * BLOCK_DOWNLOAD_TARGET_TIME, so that a slow peer does not hold up the download window.
+ */
+int GetBlocksInTransitLimit(int64_t nBlockServiceTime);
+/**
+ * Whether a block in transit for nInTransit microseconds from a peer with latency
+ * nLatencyFrom is to be requested from a peer with the lower latency nLatencyTo.
+ */
+bool IsBlockStalled(int64_t nInTransit, int64_t nLatencyFrom, int64_t nLatencyTo);
 /** Get statistics from node state */
 bool GetNodeStateStats(NodeId nodeid, CNodeStateStats &stats);
 /** Increase a node's misbehavior score. */
@@ -392,11 +436,17 @@ struct CNodeStateStats {
     int nSyncHeight;
     int nCommonHeight;
     std::vector<int> vHeightInFlight;
+    int64_t nBlockServiceTime;
+    int64_t nBlockLatency;
 };
 
 struct COrphanTx {
     std::shared_ptr<const CTransactionBase> tx;
     NodeId fromPeer;
+    unsigned int nSize;
+    int64_t nTimeExpire;
+    /** Position in the expiry queue, which is in insertion order */
+    std::list<uint256>::iterator itExpire;
 };
 
 CAmount GetMinRelayFee(const CTransactionBase& tx, unsigned int nBytes, bool fAllowFree, unsigned int block_priority_size);
@@ -519,6 +569,25 @@ public:
     ScriptError GetScriptError() const;
 };
 
+/**
+ * Closure representing the check of the Equihash solution of one header, whose
+ * verdict goes to the cache of CheckEquihashSolutionCached(). It never fails, so
+ * that the other headers of the batch get checked all the same.
+ * Note that this stores a reference to the header
+ */
+class CEquihashCheck
+{
+private:
+    const CBlockHeader *pheader;
+    uint256 hash;
+
+public:
+    CEquihashCheck(): pheader(NULL) {}
+    CEquihashCheck(const CBlockHeader& headerIn, const uint256& hashIn): pheader(&headerIn), hash(hashIn) {}
+    bool operator()();
+    void swap(CEquihashCheck &check);
+};
+
 #ifdef ENABLE_ADDRESS_INDEXING
 bool GetTimestampIndex(const unsigned int &high, const unsigned int &low, const bool fActiveOnly, std::vector<std::pair<uint256, unsigned int> > &hashes);
 bool GetSpentIndex(CSpentIndexKey &key, CSpentIndexValue &value);
@@ -533,6 +602,9 @@ bool GetAddressUnspent(uint160 addressHash, int type,
 bool WriteBlockToDisk(CBlock& block, CDiskBlockPos& pos, const CMessageHeader::MessageStartChars& messageStart);
 bool ReadBlockFromDisk(CBlock& block, const CDiskBlockPos& pos);
 bool ReadBlockFromDisk(CBlock& block, const CBlockIndex* pindex);
+/** Append the block at pos, serialized as it is on disk, to ss. Only the header is
+ *  deserialized, to check that it is the block with the given hash. */
+bool ReadRawBlockFromDisk(CDataStream& ss, const CDiskBlockPos& pos, const uint256& hash);
 CBlock LoadBlockFrom(CBufferedFile& blkdat, CDiskBlockPos* pLastLoadedBlkPos);
 
 /** Functions for validating blocks and updating the block tree */
@@ -675,6 +747,9 @@ bool InvalidateBlock(CValidationState& state, CBlockIndex *pindex);
 /** Remove invalidity status from a block and its descendants. */
 bool ReconsiderBlock(CValidationState& state, CBlockIndex *pindex);
 
+/** Check the consistency of the block index and of the chain state built on it (only if -checkblockindex is set). */
+void CheckBlockIndex();
+
 /** The currently-connected chain of blocks. */
 extern CChain chainActive;
 
@@ -3,6 +3,7 @@
 // Distributed under the MIT software license, see the accompanying
 // file COPYING or http://www.opensource.org/licenses/mit-license.php.
 
+#include <atomic>
 #include <cstdio>
 #include <string>
 #if defined(HAVE_CONFIG_H)
@@ -11,6 +12,7 @@
 
 #include "net.h"
 
+#include "addrdb.h"
 #include "addrman.h"
 #include "chainparams.h"
 #include "clientversion.h"
@@ -29,6 +31,11 @@
 #include <string.h>
 #else
 #include <fcntl.h>
+#include <sys/uio.h>
+#endif
+
+#ifdef HAVE_SYS_EPOLL_H
+#include <sys/epoll.h>
 #endif
 
 #include <boost/filesystem.hpp>
@@ -40,8 +47,17 @@
 #include <zen/tlsmanager.cpp>
 using namespace zen;
 
-// Dump addresses to peers.dat every 15 minutes (900s)
-#define DUMP_ADDRESSES_INTERVAL 900
+// Write the addresses changed to the address database every minute
+#define DUMP_ADDRESSES_INTERVAL 60
+
+// Frequency to poll pnode->vSend, in milliseconds
+#define SOCKET_EVENTS_TIMEOUT 50
+
+// Events taken by one epoll_wait() call
+#define MAX_EPOLL_EVENTS 256
+
+// Queued messages written by one sendmsg() call
+#define MAX_SEND_IOV 64
 
 #if !defined(HAVE_MSG_NOSIGNAL) && !defined(MSG_NOSIGNAL)
 #define MSG_NOSIGNAL 0
@@ -92,8 +108,21 @@ static CNode* pnodeLocalHost = NULL;
 uint64_t nLocalHostNonce = 0;
 static std::vector<ListenSocket> vhListenSocket;
 CAddrMan addrman;
+static CAddrDB* paddrdb = NULL;
 int nMaxConnections = DEFAULT_MAX_PEER_CONNECTIONS;
+#ifdef HAVE_SYS_EPOLL_H
+SocketEventsMode socketEventsMode = SocketEventsMode::EPOLL;
+#else
+SocketEventsMode socketEventsMode = SocketEventsMode::SELECT;
+#endif
+int nMessageHandlerThreads = 1;
+// the node the inventory is trickled to in this round of the message handlers, -1 once done
+static std::atomic<NodeId> nodeIdTrickle(-1);
+// epoll instance the listening sockets and the sockets of the nodes are registered with, -1 unless -socketevents=epoll
+static int hEpoll = -1;
 bool fAddressesInitialized = false;
+// the address database was read, addrman.size() tells whether addresses are needed
+static std::atomic<bool> fAddressesLoaded(false);
 TLSManager tlsmanager = TLSManager();
 vector<CNode*> vNodes;
 CCriticalSection cs_vNodes;
@@ -115,7 +144,8 @@ NodeId nLastNodeId = 0;
 CCriticalSection cs_nLastNodeId;
 
 static CSemaphore *semOutbound = NULL;
-boost::condition_variable messageHandlerCondition;
+// one per message handler thread, notified when a message for one of its peers is complete
+boost::condition_variable messageHandlerCondition[MAX_MSGHAND_THREADS];
 
 // Signals for message handling
 static CNodeSignals g_signals;
@@ -135,6 +165,34 @@ static CCriticalSection cs_vNonTLSNodesInbound;
 static std::vector<NODE_ADDR> vNonTLSNodesOutbound;
 static CCriticalSection cs_vNonTLSNodesOutbound;
 
+// Whether the socket thread can wait on hSocket
+static bool IsUsableSocket(SOCKET hSocket)
+{
+    // unlike select(), epoll takes any socket
+    return socketEventsMode == SocketEventsMode::EPOLL || IsSelectableSocket(hSocket);
+}
+
+#ifdef HAVE_SYS_EPOLL_H
+static bool EpollAdd(SOCKET hSocket, void *ptr, uint32_t events)
+{
+    struct epoll_event event;
+    event.events = events;
+    event.data.ptr = ptr;
+    if (epoll_ctl(hEpoll, EPOLL_CTL_ADD, hSocket, &event) == SOCKET_ERROR) {
+        LogPrintf("epoll_ctl(EPOLL_CTL_ADD) failed: %s\n", NetworkErrorString(errno));
+        return false;
+    }
+    return true;
+}
+
+static void EpollDel(SOCKET hSocket)
+{
+    struct epoll_event event; // ignored, but kernels before 2.6.9 want it
+    if (epoll_ctl(hEpoll, EPOLL_CTL_DEL, hSocket, &event) == SOCKET_ERROR)
+        LogPrint("net", "epoll_ctl(EPOLL_CTL_DEL) failed: %s\n", NetworkErrorString(errno));
+}
+#endif
+
 
 void AddOneShot(const std::string& strDest)
 {
@@ -354,6 +412,8 @@ uint64_t CNode::nTotalBytesRecv = 0;
 uint64_t CNode::nTotalBytesSent = 0;
 CCriticalSection CNode::cs_totalBytesRecv;
 CCriticalSection CNode::cs_totalBytesSent;
+NetMsgStatsMap CNode::mapMsgStatsDisconnected;
+CCriticalSection CNode::cs_msgStatsDisconnected;
 
 CNode* FindNode(const CNetAddr& ip)
 {
@@ -419,7 +479,7 @@ CNode* ConnectNode(CAddress addrConnect, const char *pszDest)
     if (pszDest ? ConnectSocketByName(addrConnect, hSocket, pszDest, Params().GetDefaultPort(), nConnectTimeout, &proxyConnectionFailed) :
                   ConnectSocket(addrConnect, hSocket, nConnectTimeout, &proxyConnectionFailed))
     {
-        if (!IsSelectableSocket(hSocket)) {
+        if (!IsUsableSocket(hSocket)) {
             LogPrintf("Cannot create connection: non-selectable socket created (fd >= FD_SETSIZE ?)\n");
             CloseSocket(hSocket);
             return NULL;
@@ -449,20 +509,6 @@ CNode* ConnectNode(CAddress addrConnect, const char *pszDest)
                     ssl = tlsmanager.connect(hSocket, addrConnect, err_code);
                     if (!ssl)
                     {
-                        if (err_code == TLSManager::SELECT_TIMEDOUT)
-                        {
-                            // can fail for timeout in select on fd, that is not a ssl error and we should not
-                            // consider this node as non TLS
-                            LogPrint("tls", "%s():%d - Connection to %s timedout\n",
-                                __func__, __LINE__, addrConnect.ToStringIP());
-                        }
-                        else
-                        {
-                            // Further reconnection will be made in non-TLS (unencrypted) mode
-                            vNonTLSNodesOutbound.push_back(NODE_ADDR(addrConnect.ToStringIP(), GetTimeMillis()));
-                            LogPrint("tls", "%s():%d - err_code %x, adding connection to %s vNonTLSNodesOutbound list (sz=%d)\n",
-                                __func__, __LINE__, err_code, addrConnect.ToStringIP(), vNonTLSNodesOutbound.size());
-                        }
                         CloseSocket(hSocket);
                         return NULL;
                     }
@@ -492,20 +538,8 @@ CNode* ConnectNode(CAddress addrConnect, const char *pszDest)
                 return NULL;
             }
         }
-        
-        // certificate validation is disabled by default    
-        if (CNode::GetTlsValidate())
-        {
-            if (ssl && !ValidatePeerCertificate(ssl))
-            {
-                LogPrintf ("TLS: ERROR: Wrong server certificate from %s. Connection will be closed.\n", addrConnect.ToString());
-        
-                SSL_shutdown(ssl);
-                CloseSocket(hSocket);
-                SSL_free(ssl);
-                return NULL;
-            }
-        }
+
+        // the handshake is done by the socket thread, see ProcessTLSHandshake()
 #endif  // USE_TLS
 
         // Add node
@@ -552,10 +586,16 @@ void CNode::CloseSocketDisconnect()
             if (ssl)
             {
                 unsigned long err_code = 0;
-                tlsmanager.waitFor(SSL_SHUTDOWN, hSocket, ssl, (DEFAULT_CONNECT_TIMEOUT / 1000), err_code);
+                // no close_notify for a session that was never established
+                if (!fTLSHandshake)
+                    tlsmanager.waitFor(SSL_SHUTDOWN, hSocket, ssl, (DEFAULT_CONNECT_TIMEOUT / 1000), err_code);
                 SSL_free(ssl);
                 ssl = NULL;
             }
+#ifdef HAVE_SYS_EPOLL_H
+            if (hEpoll != -1)
+                EpollDel(hSocket);
+#endif
             CloseSocket(hSocket);
         }
     }
@@ -679,6 +719,54 @@ void CNode::AddWhitelistedRange(const CSubNet &subnet) {
     vWhitelistedRange.push_back(subnet);
 }
 
+boost::filesystem::path CNode::pathCaptureMessages;
+
+void CNode::SetCaptureMessagesDir(const boost::filesystem::path &path) {
+    pathCaptureMessages = path;
+}
+
+void CNode::OpenCaptureFile()
+{
+    // named after the connection time too, node ids start again from 0 at every restart
+    boost::filesystem::path path = pathCaptureMessages / strprintf("%d-%d.cap", nTimeConnected, id);
+    FILE *file = fopen(path.string().c_str(), "ab");
+    if (file == NULL) {
+        LogPrintf("%s: cannot open %s, not capturing peer=%d\n", __func__, path.string(), id);
+        return;
+    }
+    setvbuf(file, NULL, _IOFBF, CAPTURE_FILE_BUFFER_SIZE);
+
+    pcaptureFile = new CAutoFile(file, SER_DISK, CLIENT_VERSION);
+    try {
+        pcaptureFile->write(CAPTURE_FILE_MAGIC, sizeof(CAPTURE_FILE_MAGIC));
+        *pcaptureFile << CAPTURE_FILE_VERSION << FLATDATA(Params().MessageStart()) << addrName << fInbound;
+    } catch (const std::exception& e) {
+        LogPrintf("%s: %s, not capturing peer=%d\n", __func__, e.what(), id);
+        CloseCaptureFile();
+    }
+}
+
+void CNode::CaptureMessage(const CNetMessage &msg)
+{
+    try {
+        uint64_t nDelta = std::max<int64_t>(0, msg.nTime - nLastCaptureTime);
+        nLastCaptureTime = msg.nTime;
+        *pcaptureFile << VARINT(nDelta) << msg.hdr;
+        if (!msg.vRecv.empty())
+            pcaptureFile->write(&msg.vRecv[0], msg.vRecv.size());
+    } catch (const std::exception& e) {
+        LogPrintf("%s: %s, not capturing peer=%d anymore\n", __func__, e.what(), id);
+        CloseCaptureFile();
+    }
+}
+
+void CNode::CloseCaptureFile()
+{
+    // flushes and closes the file
+    delete pcaptureFile;
+    pcaptureFile = NULL;
+}
+
 #undef X
 #define X(name) stats.name = name
 void CNode::copyStats(CNodeStats &stats)
@@ -722,6 +810,11 @@ void CNode::copyStats(CNodeStats &stats)
         stats.fTLSEstablished = (ssl != NULL) && (SSL_get_state(ssl) == TLS_ST_OK);
         stats.fTLSVerified = (ssl != NULL) && ValidatePeerCertificate(ssl);
     }
+
+    {
+        LOCK(cs_msgStats);
+        X(mapMsgStats);
+    }
 }
 #undef X
 
@@ -757,13 +850,77 @@ bool CNode::ReceiveMsgBytes(const char *pch, unsigned int nBytes)
 
         if (msg.complete()) {
             msg.nTime = GetTimeMicros();
-            messageHandlerCondition.notify_one();
+            if (pcaptureFile)
+                CaptureMessage(msg);
+            messageHandlerCondition[id % nMessageHandlerThreads].notify_one();
         }
     }
 
     return true;
 }
 
+namespace {
+    // free receive buffers, by size class
+    std::vector<CSerializeData> vRecvBufferPool[RECV_BUFFER_POOL_CLASSES];
+    CCriticalSection cs_vRecvBufferPool;
+
+    // smallest class with buffers of nSize bytes
+    int RecvBufferClass(size_t nSize)
+    {
+        int nClass = 0;
+        while (nClass < RECV_BUFFER_POOL_CLASSES - 1 && (RECV_BUFFER_POOL_MIN_SIZE << nClass) < nSize)
+            nClass++;
+        return nClass;
+    }
+}
+
+size_t CRecvBufferPool::ClassSize(size_t nSize)
+{
+    return RECV_BUFFER_POOL_MIN_SIZE << RecvBufferClass(nSize);
+}
+
+void CRecvBufferPool::Get(CDataStream& s, size_t nSize)
+{
+    // small messages are not worth it
+    if (nSize < RECV_BUFFER_POOL_MIN_SIZE)
+        return;
+
+    CSerializeData data;
+    int nClass = RecvBufferClass(nSize);
+    {
+        LOCK(cs_vRecvBufferPool);
+        if (!vRecvBufferPool[nClass].empty())
+        {
+            data.swap(vRecvBufferPool[nClass].back());
+            vRecvBufferPool[nClass].pop_back();
+        }
+    }
+    if (data.capacity() == 0)
+        data.reserve(std::min(ClassSize(nSize), RECV_BUFFER_AHEAD));
+    s.SwapData(data);
+}
+
+void CRecvBufferPool::Put(CDataStream& s)
+{
+    CSerializeData data;
+    s.SwapData(data);
+    if (data.capacity() < RECV_BUFFER_POOL_MIN_SIZE)
+        return;
+
+    // a buffer goes to the largest class it can take the messages of
+    int nClass = RecvBufferClass(data.capacity());
+    if ((RECV_BUFFER_POOL_MIN_SIZE << nClass) > data.capacity())
+        nClass--;
+    data.clear();
+
+    LOCK(cs_vRecvBufferPool);
+    if (vRecvBufferPool[nClass].size() < std::max<size_t>(2, RECV_BUFFER_POOL_CLASS_BYTES / (RECV_BUFFER_POOL_MIN_SIZE << nClass)))
+    {
+        vRecvBufferPool[nClass].push_back(CSerializeData());
+        vRecvBufferPool[nClass].back().swap(data);
+    }
+}
+
 int CNetMessage::readHeader(const char *pch, unsigned int nBytes)
 {
     // copy data to temporary parsing buffer
@@ -801,8 +958,14 @@ int CNetMessage::readData(const char *pch, unsigned int nBytes)
     unsigned int nCopy = std::min(nRemaining, nBytes);
 
     if (vRecv.size() < nDataPos + nCopy) {
+        if (nDataPos == 0)
+            CRecvBufferPool::Get(vRecv, hdr.nMessageSize);
         // Allocate up to 256 KiB ahead, but never more than the total message size.
-        vRecv.resize(std::min(hdr.nMessageSize, nDataPos + nCopy + 256 * 1024));
+        unsigned int nSize = std::min(hdr.nMessageSize, nDataPos + nCopy + (unsigned int)RECV_BUFFER_AHEAD);
+        // Once that much came, the buffer is grown at once for the whole message
+        if (nSize > vRecv.capacity() && nDataPos + nCopy > RECV_BUFFER_AHEAD)
+            vRecv.reserve(CRecvBufferPool::ClassSize(hdr.nMessageSize));
+        vRecv.resize(nSize);
     }
 
     memcpy(&vRecv[nDataPos], pch, nCopy);
@@ -819,9 +982,40 @@ int CNetMessage::readData(const char *pch, unsigned int nBytes)
 
 
 
+// Merge the messages queued after the first one into it, up to the size of a TLS
+// record, so that a burst of small messages takes one SSL_write() and one record.
 // requires LOCK(cs_vSend)
-void SocketSendData(CNode *pnode)
+static void CoalesceSendMsg(CNode *pnode)
 {
+    // a write to retry must be given the same buffer again
+    if (pnode->vSendMsg.size() < 2 || pnode->nSendOffset != 0 || pnode->fSendRetry)
+        return;
+
+    CSerializeData &first = pnode->vSendMsg.front();
+    std::deque<CSerializeData>::iterator it = pnode->vSendMsg.begin() + 1;
+    while (it != pnode->vSendMsg.end() && first.size() + it->size() <= SSL3_RT_MAX_PLAIN_LENGTH)
+    {
+        first.insert(first.end(), it->begin(), it->end());
+        it++;
+    }
+    pnode->vSendMsg.erase(pnode->vSendMsg.begin() + 1, it);
+}
+
+// requires LOCK(cs_vSend)
+bool SocketSendData(CNode *pnode)
+{
+    bool fWouldBlock = false;
+
+    {
+        // the messages are kept until the TLS handshake is done
+        LOCK(pnode->cs_hSocket);
+        if (pnode->fTLSHandshake)
+            return false;
+    }
+
+    if (pnode->ssl != NULL)
+        CoalesceSendMsg(pnode);
+
     std::deque<CSerializeData>::iterator it = pnode->vSendMsg.begin();
 
     while (it != pnode->vSendMsg.end())
@@ -847,10 +1041,27 @@ void SocketSendData(CNode *pnode)
                 ERR_clear_error(); // clear the error queue, otherwise we may be reading an old error that occurred previously in the current thread
                 nBytes = SSL_write(pnode->ssl, &data[pnode->nSendOffset], data.size() - pnode->nSendOffset);
                 nRet = SSL_get_error(pnode->ssl, nBytes);
+                pnode->fSendRetry = (nRet == SSL_ERROR_WANT_READ || nRet == SSL_ERROR_WANT_WRITE);
             }
             else
             {
+#ifndef WIN32
+                // as many queued messages as possible with one call
+                struct iovec iov[MAX_SEND_IOV];
+                struct msghdr msg = {};
+                size_t nOffset = pnode->nSendOffset;
+                for (std::deque<CSerializeData>::iterator itMsg = it; itMsg != pnode->vSendMsg.end() && msg.msg_iovlen < MAX_SEND_IOV; itMsg++)
+                {
+                    iov[msg.msg_iovlen].iov_base = (void*)&(*itMsg)[nOffset];
+                    iov[msg.msg_iovlen].iov_len = itMsg->size() - nOffset;
+                    msg.msg_iovlen++;
+                    nOffset = 0;
+                }
+                msg.msg_iov = iov;
+                nBytes = sendmsg(pnode->hSocket, &msg, MSG_NOSIGNAL | MSG_DONTWAIT);
+#else
                 nBytes = send(pnode->hSocket, &data[pnode->nSendOffset], data.size() - pnode->nSendOffset, MSG_NOSIGNAL | MSG_DONTWAIT);
+#endif
                 nRet = WSAGetLastError();
             }
         }
@@ -858,18 +1069,28 @@ void SocketSendData(CNode *pnode)
         {
             pnode->nLastSend = GetTime();
             pnode->nSendBytes += nBytes;
-            pnode->nSendOffset += nBytes;
             pnode->RecordBytesSent(nBytes);
 
-            if (pnode->nSendOffset == data.size())
+            // the bytes sent may span several messages
+            size_t nSent = nBytes;
+            while (nSent > 0)
             {
+                size_t nLeft = it->size() - pnode->nSendOffset;
+                if (nSent < nLeft)
+                {
+                    pnode->nSendOffset += nSent;
+                    break;
+                }
+                nSent -= nLeft;
                 pnode->nSendOffset = 0;
-                pnode->nSendSize -= data.size();
+                pnode->nSendSize -= it->size();
                 it++;
             }
-            else
+
+            if (pnode->nSendOffset != 0)
             {
                 // could not send full message; stop sending more
+                fWouldBlock = true;
                 break;
             }
         }
@@ -888,9 +1109,11 @@ void SocketSendData(CNode *pnode)
                     }
                     else
                     {
-                        // preventive measure from exhausting CPU usage
+                        fWouldBlock = true;
+                        // preventive measure from exhausting CPU usage, epoll waits for the socket instead
                         //
-                        MilliSleep(1);    // 1 msec
+                        if (socketEventsMode == SocketEventsMode::SELECT)
+                            MilliSleep(1);    // 1 msec
                     }
                 }
                 else
@@ -900,6 +1123,8 @@ void SocketSendData(CNode *pnode)
                         LogPrintf("ERROR: send %s; closing connection\n", NetworkErrorString(nRet));
                         pnode->CloseSocketDisconnect();
                     }
+                    else if (nRet == WSAEWOULDBLOCK)
+                        fWouldBlock = true;
                 }
             }
 
@@ -914,6 +1139,7 @@ void SocketSendData(CNode *pnode)
         assert(pnode->nSendSize == 0);
     }
     pnode->vSendMsg.erase(pnode->vSendMsg.begin(), it);
+    return !fWouldBlock;
 }
 
 static list<CNode*> vNodesDisconnected;
@@ -965,6 +1191,20 @@ static bool ReverseCompareNodeTimeConnected(const CNodeRef &a, const CNodeRef &b
     return a->nTimeConnected > b->nTimeConnected;
 }
 
+static bool CompareNodeBlockTime(const CNodeRef &a, const CNodeRef &b)
+{
+    if (a->nLastBlockTime != b->nLastBlockTime)
+        return a->nLastBlockTime < b->nLastBlockTime;
+    return a->nTimeConnected > b->nTimeConnected;
+}
+
+static bool CompareNodeTxTime(const CNodeRef &a, const CNodeRef &b)
+{
+    if (a->nLastTxTime != b->nLastTxTime)
+        return a->nLastTxTime < b->nLastTxTime;
+    return a->nTimeConnected > b->nTimeConnected;
+}
+
 class CompareNetGroupKeyed
 {
     std::vector<unsigned char> vchSecretKey;
@@ -1032,6 +1272,20 @@ static bool AttemptToEvictConnection(bool fPreferNewConnection) {
 
     if (vEvictionCandidates.empty()) return false;
 
+    // Protect the 4 nodes which most recently sent us transactions or certificates we didn't have.
+    // An attacker cannot manipulate this metric without performing useful work.
+    std::sort(vEvictionCandidates.begin(), vEvictionCandidates.end(), CompareNodeTxTime);
+    vEvictionCandidates.erase(vEvictionCandidates.end() - std::min(4, static_cast<int>(vEvictionCandidates.size())), vEvictionCandidates.end());
+
+    if (vEvictionCandidates.empty()) return false;
+
+    // Protect the 4 nodes which most recently sent us blocks we didn't have.
+    // An attacker cannot manipulate this metric without performing useful work.
+    std::sort(vEvictionCandidates.begin(), vEvictionCandidates.end(), CompareNodeBlockTime);
+    vEvictionCandidates.erase(vEvictionCandidates.end() - std::min(4, static_cast<int>(vEvictionCandidates.size())), vEvictionCandidates.end());
+
+    if (vEvictionCandidates.empty()) return false;
+
     // Protect the half of the remaining nodes which have been connected the longest.
     // This replicates the existing implicit behavior.
     std::sort(vEvictionCandidates.begin(), vEvictionCandidates.end(), ReverseCompareNodeTimeConnected);
@@ -1101,7 +1355,7 @@ static void AcceptConnection(const ListenSocket& hListenSocket) {
         return;
     }
 
-    if (!IsSelectableSocket(hSocket))
+    if (!IsUsableSocket(hSocket))
     {
         LogPrintf("connection from %s dropped: non-selectable socket\n", addr.ToString());
         CloseSocket(hSocket);
@@ -1158,19 +1412,6 @@ static void AcceptConnection(const ListenSocket& hListenSocket) {
             ssl = tlsmanager.accept( hSocket, addr, err_code);
             if(!ssl)
             {
-                if (err_code == TLSManager::SELECT_TIMEDOUT)
-                {
-                    // can fail also for timeout in select on fd, that is not a ssl error and we should not
-                    // consider this node as non TLS
-                    LogPrint("tls", "%s():%d - Connection from %s timedout\n", __func__, __LINE__, addr.ToStringIP());
-                }
-                else
-                {
-                    // Further reconnection will be made in non-TLS (unencrypted) mode
-                    vNonTLSNodesInbound.push_back(NODE_ADDR(addr.ToStringIP(), GetTimeMillis()));
-                    LogPrint("tls", "%s():%d - err_code %x, adding connection from %s vNonTLSNodesInbound list (sz=%d)\n",
-                        __func__, __LINE__, err_code, addr.ToStringIP(), vNonTLSNodesInbound.size());
-                }
                 CloseSocket(hSocket);
                 return;
             }
@@ -1200,20 +1441,8 @@ static void AcceptConnection(const ListenSocket& hListenSocket) {
             return;
         }
     }
-    
-    // certificate validation is disabled by default    
-    if (CNode::GetTlsValidate())
-    {
-        if (ssl && !ValidatePeerCertificate(ssl))
-        {
-            LogPrintf ("TLS: ERROR: Wrong client certificate from %s. Connection will be closed.\n", addr.ToString());
-        
-            SSL_shutdown(ssl);
-            CloseSocket(hSocket);
-            SSL_free(ssl);
-            return;
-        }
-    }
+
+    // the handshake is done by the socket thread, see ProcessTLSHandshake()
 #endif // USE_TLS
 
     CNode* pnode = new CNode(hSocket, addr, "", true, ssl);
@@ -1240,9 +1469,160 @@ void ThreadNonTLSPoolsCleaner()
 #endif // USE_TLS 
 
 
+#ifdef HAVE_SYS_EPOLL_H
+/**
+ * Wait at most nTimeout milliseconds for the sockets registered with hEpoll
+ * and latch their events in the nodes. The listening sockets with connections
+ * to accept are returned in setListenReady.
+ */
+static void WaitForSocketEvents(int nTimeout, std::set<SOCKET>& setListenReady)
+{
+    struct epoll_event events[MAX_EPOLL_EVENTS];
+    int nEvents = epoll_wait(hEpoll, events, MAX_EPOLL_EVENTS, nTimeout);
+    boost::this_thread::interruption_point();
+
+    if (nEvents == SOCKET_ERROR)
+    {
+        if (errno != EINTR)
+        {
+            LogPrintf("socket epoll error %s\n", NetworkErrorString(errno));
+            MilliSleep(nTimeout);
+        }
+        return;
+    }
+
+    for (int i = 0; i < nEvents; i++)
+    {
+        const struct epoll_event& event = events[i];
+
+        // a few listening sockets at most, registered with a pointer to their entry
+        bool fListen = false;
+        BOOST_FOREACH(const ListenSocket& hListenSocket, vhListenSocket)
+        {
+            if (event.data.ptr == &hListenSocket)
+            {
+                setListenReady.insert(hListenSocket.socket);
+                fListen = true;
+                break;
+            }
+        }
+        if (fListen)
+            continue;
+
+        // nodes are only deleted by this thread, after CloseSocketDisconnect() took them off hEpoll
+        CNode* pnode = static_cast<CNode*>(event.data.ptr);
+        if (event.events & (EPOLLIN | EPOLLRDHUP))
+            pnode->fSocketRecvReady = true;
+        // SSL_read() may be waiting for the socket to be writable too
+        if (event.events & EPOLLOUT)
+            pnode->fSocketSendReady = pnode->fSocketRecvReady = true;
+        if (event.events & (EPOLLERR | EPOLLHUP))
+            pnode->fSocketError = true;
+    }
+}
+#endif
+
+/**
+ * What to do with the socket of a node that epoll reported ready, following
+ * the same rules as the select() loop in ThreadSocketHandler.
+ */
+static void GetSocketWork(CNode* pnode, bool& fRecv, bool& fSend)
+{
+    fRecv = fSend = false;
+    {
+        TRY_LOCK(pnode->cs_vSend, lockSend);
+        if (lockSend && !pnode->vSendMsg.empty()) {
+            fSend = pnode->fSocketSendReady;
+            return;
+        }
+    }
+    if (pnode->fSocketRecvReady)
+    {
+        TRY_LOCK(pnode->cs_vRecvMsg, lockRecv);
+        fRecv = lockRecv && (
+            pnode->vRecvMsg.empty() || !pnode->vRecvMsg.front().complete() ||
+            pnode->GetTotalRecvSize() <= ReceiveFloodSize());
+    }
+}
+
+/**
+ * Go on with the TLS handshake of a node, if its socket is ready for it, and
+ * disconnect the node once the handshake failed or took longer than
+ * DEFAULT_CONNECT_TIMEOUT. In fallback mode a peer failing the handshake is
+ * put in the non-TLS pool, so that the next connection with it is unencrypted.
+ */
+static void ProcessTLSHandshake(CNode* pnode, bool fReady)
+{
+    // on its way out already, possibly with its socket closed
+    if (pnode->fDisconnect)
+        return;
+
+    unsigned long err_code = 0;
+    int ret = fReady ? tlsmanager.handshake(pnode, err_code) : 0;
+
+    if (ret == 0)
+    {
+        if (GetTimeMillis() <= pnode->nTLSHandshakeDeadline)
+            return;
+        err_code = TLSManager::SELECT_TIMEDOUT;
+        ret = -1;
+    }
+
+    if (ret == 1)
+    {
+        // certificate validation is disabled by default
+        if (CNode::GetTlsValidate())
+        {
+            LOCK(pnode->cs_hSocket);
+            if (pnode->ssl && !ValidatePeerCertificate(pnode->ssl))
+            {
+                LogPrintf ("TLS: ERROR: Wrong %s certificate from %s. Connection will be closed.\n",
+                    pnode->fInbound ? "client" : "server", pnode->addr.ToString());
+                pnode->CloseSocketDisconnect();
+            }
+        }
+        return;
+    }
+
+    if (!CNode::GetTlsFallbackNonTls())
+    {
+        LogPrint("tls", "%s():%d - err_code %x, TLS handshake with %s failed\n",
+            __func__, __LINE__, err_code, pnode->addr.ToStringIP());
+    }
+    else if (err_code == TLSManager::SELECT_TIMEDOUT)
+    {
+        // a slow peer is not a sign of a peer without TLS, we should not
+        // consider this node as non TLS
+        LogPrint("tls", "%s():%d - TLS handshake with %s timedout\n",
+            __func__, __LINE__, pnode->addr.ToStringIP());
+    }
+    else if (pnode->fInbound)
+    {
+        // Further reconnection will be made in non-TLS (unencrypted) mode
+        LOCK(cs_vNonTLSNodesInbound);
+        vNonTLSNodesInbound.push_back(NODE_ADDR(pnode->addr.ToStringIP(), GetTimeMillis()));
+        LogPrint("tls", "%s():%d - err_code %x, adding connection from %s vNonTLSNodesInbound list (sz=%d)\n",
+            __func__, __LINE__, err_code, pnode->addr.ToStringIP(), vNonTLSNodesInbound.size());
+    }
+    else
+    {
+        // Further reconnection will be made in non-TLS (unencrypted) mode
+        LOCK(cs_vNonTLSNodesOutbound);
+        vNonTLSNodesOutbound.push_back(NODE_ADDR(pnode->addr.ToStringIP(), GetTimeMillis()));
+        LogPrint("tls", "%s():%d - err_code %x, adding connection to %s vNonTLSNodesOutbound list (sz=%d)\n",
+            __func__, __LINE__, err_code, pnode->addr.ToStringIP(), vNonTLSNodesOutbound.size());
+    }
+
+    pnode->CloseSocketDisconnect();
+}
+
 void ThreadSocketHandler()
 {
     unsigned int nPrevNodeCount = 0;
+#ifdef HAVE_SYS_EPOLL_H
+    // with epoll, whether some socket was not drained in the last round
+    bool fMoreWork = false;
+#endif
     while (true)
     {
         //
@@ -1313,7 +1693,7 @@ void ThreadSocketHandler()
         //
         struct timeval timeout;
         timeout.tv_sec  = 0;
-        timeout.tv_usec = 50000; // frequency to poll pnode->vSend
+        timeout.tv_usec = SOCKET_EVENTS_TIMEOUT * 1000;
 
         fd_set fdsetRecv;
         fd_set fdsetSend;
@@ -1323,75 +1703,99 @@ void ThreadSocketHandler()
         FD_ZERO(&fdsetError);
         SOCKET hSocketMax = 0;
         bool have_fds = false;
+        std::set<SOCKET> setListenReady;
 
-        BOOST_FOREACH(const ListenSocket& hListenSocket, vhListenSocket) {
-            FD_SET(hListenSocket.socket, &fdsetRecv);
-            hSocketMax = max(hSocketMax, hListenSocket.socket);
-            have_fds = true;
+#ifdef HAVE_SYS_EPOLL_H
+        if (socketEventsMode == SocketEventsMode::EPOLL)
+        {
+            // the sockets are registered once, no need to go through the nodes
+            WaitForSocketEvents(fMoreWork ? 0 : SOCKET_EVENTS_TIMEOUT, setListenReady);
+            fMoreWork = false;
         }
-
+        else
+#endif
         {
-            LOCK(cs_vNodes);
-            BOOST_FOREACH(CNode* pnode, vNodes)
+            BOOST_FOREACH(const ListenSocket& hListenSocket, vhListenSocket) {
+                FD_SET(hListenSocket.socket, &fdsetRecv);
+                hSocketMax = max(hSocketMax, hListenSocket.socket);
+                have_fds = true;
+            }
+
             {
-                LOCK(pnode->cs_hSocket);
+                LOCK(cs_vNodes);
+                BOOST_FOREACH(CNode* pnode, vNodes)
+                {
+                    LOCK(pnode->cs_hSocket);
                 
-                if (pnode->hSocket == INVALID_SOCKET)
-                    continue;
+                    if (pnode->hSocket == INVALID_SOCKET)
+                        continue;
                 
-                FD_SET(pnode->hSocket, &fdsetError);
-                hSocketMax = max(hSocketMax, pnode->hSocket);
-                have_fds = true;
-
-                // Implement the following logic:
-                // * If there is data to send, select() for sending data. As this only
-                //   happens when optimistic write failed, we choose to first drain the
-                //   write buffer in this case before receiving more. This avoids
-                //   needlessly queueing received data, if the remote peer is not themselves
-                //   receiving data. This means properly utilizing TCP flow control signalling.
-                // * Otherwise, if there is no (complete) message in the receive buffer,
-                //   or there is space left in the buffer, select() for receiving data.
-                // * (if neither of the above applies, there is certainly one message
-                //   in the receiver buffer ready to be processed).
-                // Together, that means that at least one of the following is always possible,
-                // so we don't deadlock:
-                // * We send some data.
-                // * We wait for data to be received (and disconnect after timeout).
-                // * We process a message in the buffer (message handler thread).
+                    FD_SET(pnode->hSocket, &fdsetError);
+                    hSocketMax = max(hSocketMax, pnode->hSocket);
+                    have_fds = true;
 
-                {
-                    TRY_LOCK(pnode->cs_vSend, lockSend);
-                    if (lockSend && !pnode->vSendMsg.empty()) {
-                        FD_SET(pnode->hSocket, &fdsetSend);
+                    // a TLS handshake waits for the direction OpenSSL asked for
+                    if (pnode->fTLSHandshake)
+                    {
+                        FD_SET(pnode->hSocket, pnode->fTLSHandshakeWantWrite ? &fdsetSend : &fdsetRecv);
                         continue;
                     }
-                }
-                {
-                    TRY_LOCK(pnode->cs_vRecvMsg, lockRecv);
-                    if (lockRecv && (
-                        pnode->vRecvMsg.empty() || !pnode->vRecvMsg.front().complete() ||
-                        pnode->GetTotalRecvSize() <= ReceiveFloodSize()))
-                        FD_SET(pnode->hSocket, &fdsetRecv);
+
+                    // Implement the following logic:
+                    // * If there is data to send, select() for sending data. As this only
+                    //   happens when optimistic write failed, we choose to first drain the
+                    //   write buffer in this case before receiving more. This avoids
+                    //   needlessly queueing received data, if the remote peer is not themselves
+                    //   receiving data. This means properly utilizing TCP flow control signalling.
+                    // * Otherwise, if there is no (complete) message in the receive buffer,
+                    //   or there is space left in the buffer, select() for receiving data.
+                    // * (if neither of the above applies, there is certainly one message
+                    //   in the receiver buffer ready to be processed).
+                    // Together, that means that at least one of the following is always possible,
+                    // so we don't deadlock:
+                    // * We send some data.
+                    // * We wait for data to be received (and disconnect after timeout).
+                    // * We process a message in the buffer (message handler thread).
+
+                    {
+                        TRY_LOCK(pnode->cs_vSend, lockSend);
+                        if (lockSend && !pnode->vSendMsg.empty()) {
+                            FD_SET(pnode->hSocket, &fdsetSend);
+                            continue;
+                        }
+                    }
+                    {
+                        TRY_LOCK(pnode->cs_vRecvMsg, lockRecv);
+                        if (lockRecv && (
+                            pnode->vRecvMsg.empty() || !pnode->vRecvMsg.front().complete() ||
+                            pnode->GetTotalRecvSize() <= ReceiveFloodSize()))
+                        {
+                            FD_SET(pnode->hSocket, &fdsetRecv);
+                            // no need to wait for data OpenSSL has already decrypted
+                            if (pnode->ssl && SSL_pending(pnode->ssl) > 0)
+                                timeout.tv_usec = 0;
+                        }
+                    }
                 }
             }
-        }
 
-        int nSelect = select(have_fds ? hSocketMax + 1 : 0,
-                             &fdsetRecv, &fdsetSend, &fdsetError, &timeout);
-        boost::this_thread::interruption_point();
+            int nSelect = select(have_fds ? hSocketMax + 1 : 0,
+                                 &fdsetRecv, &fdsetSend, &fdsetError, &timeout);
+            boost::this_thread::interruption_point();
 
-        if (nSelect == SOCKET_ERROR)
-        {
-            if (have_fds)
+            if (nSelect == SOCKET_ERROR)
             {
-                int nErr = WSAGetLastError();
-                LogPrintf("socket select error %s\n", NetworkErrorString(nErr));
-                for (unsigned int i = 0; i <= hSocketMax; i++)
-                    FD_SET(i, &fdsetRecv);
+                if (have_fds)
+                {
+                    int nErr = WSAGetLastError();
+                    LogPrintf("socket select error %s\n", NetworkErrorString(nErr));
+                    for (unsigned int i = 0; i <= hSocketMax; i++)
+                        FD_SET(i, &fdsetRecv);
+                }
+                FD_ZERO(&fdsetSend);
+                FD_ZERO(&fdsetError);
+                MilliSleep(timeout.tv_usec/1000);
             }
-            FD_ZERO(&fdsetSend);
-            FD_ZERO(&fdsetError);
-            MilliSleep(timeout.tv_usec/1000);
         }
 
         //
@@ -1399,7 +1803,11 @@ void ThreadSocketHandler()
         //
         BOOST_FOREACH(const ListenSocket& hListenSocket, vhListenSocket)
         {
-            if (hListenSocket.socket != INVALID_SOCKET && FD_ISSET(hListenSocket.socket, &fdsetRecv))
+            if (hListenSocket.socket == INVALID_SOCKET)
+                continue;
+            bool fReady = (socketEventsMode == SocketEventsMode::EPOLL) ?
+                setListenReady.count(hListenSocket.socket) > 0 : FD_ISSET(hListenSocket.socket, &fdsetRecv);
+            if (fReady)
             {
                 AcceptConnection(hListenSocket);
             }
@@ -1419,6 +1827,43 @@ void ThreadSocketHandler()
         {
             boost::this_thread::interruption_point();
 
+            // only the socket thread clears fTLSHandshake
+            if (pnode->fTLSHandshake)
+            {
+                bool fReady = false;
+                if (socketEventsMode == SocketEventsMode::EPOLL)
+                    fReady = pnode->fSocketError ||
+                        (pnode->fTLSHandshakeWantWrite ? pnode->fSocketSendReady : pnode->fSocketRecvReady);
+                else
+                {
+                    LOCK(pnode->cs_hSocket);
+                    fReady = pnode->hSocket != INVALID_SOCKET && (FD_ISSET(pnode->hSocket, &fdsetError) ||
+                        FD_ISSET(pnode->hSocket, pnode->fTLSHandshakeWantWrite ? &fdsetSend : &fdsetRecv));
+                }
+                ProcessTLSHandshake(pnode, fReady);
+#ifdef HAVE_SYS_EPOLL_H
+                // the first messages may be waiting already
+                if (!pnode->fTLSHandshake)
+                    fMoreWork = true;
+#endif
+                continue;
+            }
+
+#ifdef HAVE_SYS_EPOLL_H
+            if (socketEventsMode == SocketEventsMode::EPOLL)
+            {
+                bool fRecv, fSend;
+                GetSocketWork(pnode, fRecv, fSend);
+                int nRet = tlsmanager.threadSocketHandler(pnode, fRecv, fSend, pnode->fSocketError);
+                if (nRet == -1)
+                    continue;
+                // edge triggered: a socket that did not block yet will not be reported again. A node
+                // whose buffers are in use by a message handler is left for the next timeout, not polled
+                if (nRet == 1 && ((fRecv && pnode->fSocketRecvReady) || (fSend && pnode->fSocketSendReady)))
+                    fMoreWork = true;
+            }
+            else
+#endif
             if (tlsmanager.threadSocketHandler(pnode,fdsetRecv,fdsetSend,fdsetError)==-1){
                 continue;
             }
@@ -1460,8 +1905,30 @@ void ThreadSocketHandler()
 }
 
 
+static void LookupDNSSeed(const CDNSSeedData& seed, int* pnFound)
+{
+    vector<CNetAddr> vIPs;
+    vector<CAddress> vAdd;
+    if (LookupHost(seed.host.c_str(), vIPs))
+    {
+        BOOST_FOREACH(const CNetAddr& ip, vIPs)
+        {
+            int nOneDay = 24*3600;
+            CAddress addr = CAddress(CService(ip, Params().GetDefaultPort()));
+            addr.nTime = GetTime() - 3*nOneDay - GetRand(4*nOneDay); // use a random age between 3 and 7 days old
+            vAdd.push_back(addr);
+        }
+    }
+    addrman.Add(vAdd, CNetAddr(seed.name, true));
+    *pnFound = vAdd.size();
+}
+
 void ThreadDNSAddressSeed()
 {
+    // the address database is loaded in the background
+    while (!fAddressesLoaded)
+        MilliSleep(100);
+
     // goal: only query DNS seeds if address need is acute
     if ((addrman.size() > 0) &&
         (!GetBoolArg("-forcednsseed", false))) {
@@ -1479,25 +1946,24 @@ void ThreadDNSAddressSeed()
 
     LogPrintf("Loading addresses from DNS seeds (could take a while)\n");
 
-    BOOST_FOREACH(const CDNSSeedData &seed, vSeeds) {
-        if (HaveNameProxy()) {
+    if (HaveNameProxy()) {
+        BOOST_FOREACH(const CDNSSeedData &seed, vSeeds)
             AddOneShot(seed.host);
-        } else {
-            vector<CNetAddr> vIPs;
-            vector<CAddress> vAdd;
-            if (LookupHost(seed.host.c_str(), vIPs))
-            {
-                BOOST_FOREACH(const CNetAddr& ip, vIPs)
-                {
-                    int nOneDay = 24*3600;
-                    CAddress addr = CAddress(CService(ip, Params().GetDefaultPort()));
-                    addr.nTime = GetTime() - 3*nOneDay - GetRand(4*nOneDay); // use a random age between 3 and 7 days old
-                    vAdd.push_back(addr);
-                    found++;
-                }
-            }
-            addrman.Add(vAdd, CNetAddr(seed.name, true));
+    } else {
+        // the seeds are resolved at the same time, a slow one doesn't hold up the others
+        vector<int> vFound(vSeeds.size(), 0);
+        boost::thread_group lookupThreads;
+        for (size_t i = 0; i < vSeeds.size(); i++)
+            lookupThreads.create_thread(boost::bind(&LookupDNSSeed, boost::cref(vSeeds[i]), &vFound[i]));
+        try {
+            lookupThreads.join_all();
+        } catch (const boost::thread_interrupted&) {
+            lookupThreads.interrupt_all();
+            lookupThreads.join_all();
+            throw;
         }
+        BOOST_FOREACH(int n, vFound)
+            found += n;
     }
 
     LogPrintf("%d addresses found from DNS seeds\n", found);
@@ -1518,11 +1984,33 @@ void DumpAddresses()
 {
     int64_t nStart = GetTimeMillis();
 
-    CAddrDB adb;
-    adb.Write(addrman);
+    // only the address manager lock is taken to collect the changes, not the write
+    std::vector<CAddrManEntry> vChanged;
+    std::vector<CNetAddr> vErased;
+    addrman.GetChanges(vChanged, vErased);
+    if (vChanged.empty() && vErased.empty())
+        return;
+
+    if (!paddrdb->WriteChanges(vChanged, vErased)) {
+        // write them all again next time
+        LogPrintf("%s: Failed to write the address database\n", __func__);
+        addrman.TrackChanges(true);
+        addrman.RestoreErased(vErased);
+        return;
+    }
+
+    LogPrint("net", "Flushed %d changed and %d deleted addresses to the address database  %dms\n",
+           vChanged.size(), vErased.size(), GetTimeMillis() - nStart);
+}
 
-    LogPrint("net", "Flushed %d addresses to peers.dat  %dms\n",
+void static ThreadLoadAddresses()
+{
+    int64_t nStart = GetTimeMillis();
+    if (!paddrdb->Load(addrman))
+        LogPrintf("Some entries of the address database couldn't be read\n");
+    LogPrintf("Loaded %i addresses from the address database  %dms\n",
            addrman.size(), GetTimeMillis() - nStart);
+    fAddressesLoaded = true;
 }
 
 void static ProcessOneShot()
@@ -1543,33 +2031,17 @@ void static ProcessOneShot()
     }
 }
 
-void ThreadOpenConnections()
-{
-    // Connect to specific addresses
-    if (mapArgs.count("-connect") && mapMultiArgs["-connect"].size() > 0)
-    {
-        for (int64_t nLoop = 0;; nLoop++)
-        {
-            ProcessOneShot();
-            BOOST_FOREACH(const std::string& strAddr, mapMultiArgs["-connect"])
-            {
-                CAddress addr;
-                OpenNetworkConnection(addr, NULL, strAddr.c_str());
-                
-                for (int i = 0; i < 10 && i < nLoop; i++)
-                {
-                    MilliSleep(500);
-                }
-            }
-            MilliSleep(500);
-        }
-    }
+// Network groups the outbound connection threads are connecting to
+static CCriticalSection cs_setConnectingGroups;
+static set<vector<unsigned char> > setConnectingGroups;
 
-    // Initiate network connections
+void static ThreadOpenOutboundConnections(int nThread)
+{
     int64_t nStart = GetTime();
     while (true)
     {
-        ProcessOneShot();
+        if (nThread == 0)
+            ProcessOneShot();
 
         MilliSleep(500);
 
@@ -1577,7 +2049,7 @@ void ThreadOpenConnections()
         boost::this_thread::interruption_point();
 
         // Add seed nodes if DNS seeds are all down (an infrastructure attack?).
-        if (addrman.size() == 0 && (GetTime() - nStart > 60)) {
+        if (nThread == 0 && addrman.size() == 0 && (GetTime() - nStart > 60)) {
             static bool done = false;
             if (!done) {
                 LogPrintf("Adding fixed seed nodes as DNS doesn't seem to be available.\n");
@@ -1604,6 +2076,10 @@ void ThreadOpenConnections()
                 }
             }
         }
+        {
+            LOCK(cs_setConnectingGroups);
+            setConnected.insert(setConnectingGroups.begin(), setConnectingGroups.end());
+        }
 
         int64_t nANow = GetTime();
 
@@ -1638,8 +2114,58 @@ void ThreadOpenConnections()
             break;
         }
 
-        if (addrConnect.IsValid())
+        if (addrConnect.IsValid()) {
+            // another thread may have picked the same group meanwhile
+            vector<unsigned char> vchGroup = addrConnect.GetGroup();
+            {
+                LOCK(cs_setConnectingGroups);
+                if (!setConnectingGroups.insert(vchGroup).second)
+                    continue;
+            }
             OpenNetworkConnection(addrConnect, &grant);
+            {
+                LOCK(cs_setConnectingGroups);
+                setConnectingGroups.erase(vchGroup);
+            }
+        }
+    }
+}
+
+void ThreadOpenConnections()
+{
+    // Connect to specific addresses
+    if (mapArgs.count("-connect") && mapMultiArgs["-connect"].size() > 0)
+    {
+        for (int64_t nLoop = 0;; nLoop++)
+        {
+            ProcessOneShot();
+            BOOST_FOREACH(const std::string& strAddr, mapMultiArgs["-connect"])
+            {
+                CAddress addr;
+                OpenNetworkConnection(addr, NULL, strAddr.c_str());
+                
+                for (int i = 0; i < 10 && i < nLoop; i++)
+                {
+                    MilliSleep(500);
+                }
+            }
+            MilliSleep(500);
+        }
+    }
+
+    // Initiate network connections, one thread per outbound slot: a peer slow
+    // to answer or not answering only holds up its own slot, and the slots
+    // are filled by the peers which answer first
+    int nThreads = min(MAX_OUTBOUND_CONNECTIONS, nMaxConnections);
+    boost::thread_group connectThreads;
+    for (int i = 0; i < nThreads; i++)
+        connectThreads.create_thread(boost::bind(&TraceThread<boost::function<void()> >, "opencon", boost::function<void()>(boost::bind(&ThreadOpenOutboundConnections, i))));
+    try {
+        connectThreads.join_all();
+    } catch (const boost::thread_interrupted&) {
+        connectThreads.interrupt_all();
+        connectThreads.join_all();
+        throw;
     }
 }
 
@@ -1780,7 +2306,9 @@ bool OpenNetworkConnection(const CAddress& addrConnect, CSemaphoreGrant *grantOu
 }
 
 
-void ThreadMessageHandler()
+// Handles the messages of the nodes whose id is nShard modulo nMessageHandlerThreads,
+// so that the messages of a node are still processed in order by a single thread.
+void ThreadMessageHandler(int nShard)
 {
     boost::mutex condition_mutex;
     boost::unique_lock<boost::mutex> lock(condition_mutex);
@@ -1791,17 +2319,17 @@ void ThreadMessageHandler()
         vector<CNode*> vNodesCopy;
         {
             LOCK(cs_vNodes);
-            vNodesCopy = vNodes;
-            BOOST_FOREACH(CNode* pnode, vNodesCopy) {
-                pnode->AddRef();
+            BOOST_FOREACH(CNode* pnode, vNodes) {
+                if (pnode->GetId() % nMessageHandlerThreads == nShard)
+                    vNodesCopy.push_back(pnode->AddRef());
             }
+            // the rounds of the first shard pick one node among all of them,
+            // its own shard trickles to it once
+            if (nShard == 0 && !vNodes.empty())
+                nodeIdTrickle = vNodes[GetRand(vNodes.size())]->GetId();
         }
 
         // Poll the connected nodes for messages
-        CNode* pnodeTrickle = nullptr;
-        if (!vNodesCopy.empty())
-            pnodeTrickle = vNodesCopy[GetRand(vNodesCopy.size())];
-
         bool fSleep = true;
 
         for(CNode* pnode: vNodesCopy)
@@ -1819,7 +2347,8 @@ void ThreadMessageHandler()
 
                     if (pnode->nSendSize < SendBufferSize())
                     {
-                        if (!pnode->vRecvGetData.empty() || (!pnode->vRecvMsg.empty() && pnode->vRecvMsg[0].complete()))
+                        if (!pnode->vRecvGetData.empty() || pnode->fOrphanWork ||
+                            (!pnode->vRecvMsg.empty() && pnode->vRecvMsg[0].complete()))
                         {
                             fSleep = false;
                         }
@@ -1832,7 +2361,11 @@ void ThreadMessageHandler()
             {
                 TRY_LOCK(pnode->cs_vSend, lockSend);
                 if (lockSend)
-                    g_signals.SendMessages(pnode, pnode == pnodeTrickle || pnode->fWhitelisted);
+                {
+                    NodeId nodeId = pnode->GetId();
+                    bool fSendTrickle = nodeIdTrickle.compare_exchange_strong(nodeId, -1);
+                    g_signals.SendMessages(pnode, fSendTrickle || pnode->fWhitelisted);
+                }
             }
             boost::this_thread::interruption_point();
         }
@@ -1844,7 +2377,7 @@ void ThreadMessageHandler()
         }
 
         if (fSleep)
-            messageHandlerCondition.timed_wait(lock, boost::posix_time::microsec_clock::universal_time() + boost::posix_time::milliseconds(100));
+            messageHandlerCondition[nShard].timed_wait(lock, boost::posix_time::microsec_clock::universal_time() + boost::posix_time::milliseconds(100));
     }
 }
 
@@ -1876,7 +2409,7 @@ bool BindListenPort(const CService &addrBind, string& strError, bool fWhiteliste
         LogPrintf("%s\n", strError);
         return false;
     }
-    if (!IsSelectableSocket(hListenSocket))
+    if (!IsUsableSocket(hListenSocket))
     {
         strError = "Error: Couldn't create a listenable socket for incoming connections";
         LogPrintf("%s\n", strError);
@@ -2012,15 +2545,49 @@ void static Discover()
 void StartNode(boost::thread_group& threadGroup, CScheduler& scheduler)
 {
     uiInterface.InitMessage(_("Loading addresses..."));
-    // Load addresses for peers.dat
-    int64_t nStart = GetTimeMillis();
-    {
-        CAddrDB adb;
-        if (!adb.Read(addrman))
-            LogPrintf("Invalid or missing peers.dat; recreating\n");
+    try {
+        paddrdb = new CAddrDB(ADDRDB_CACHE_SIZE);
+    } catch (const leveldb_error& e) {
+        LogPrintf("Error opening the address database: %s; recreating\n", e.what());
+        try {
+            paddrdb = new CAddrDB(ADDRDB_CACHE_SIZE, false, true);
+        } catch (const leveldb_error& e) {
+            // the node can do without, the addresses just aren't kept after it stops
+            LogPrintf("Error recreating the address database: %s; keeping the addresses in memory\n", e.what());
+            paddrdb = new CAddrDB(ADDRDB_CACHE_SIZE, true);
+        }
+    }
+
+    uint256 nAddrKey;
+    if (paddrdb->ReadKey(nAddrKey)) {
+        // the entries are added as they are read, the node doesn't wait for them
+        addrman.SetBucketKey(nAddrKey);
+        addrman.TrackChanges(false);
+        threadGroup.create_thread(boost::bind(&TraceThread<void (*)()>, "addrload", &ThreadLoadAddresses));
+    } else {
+        // take over the addresses of peers.dat, if any
+        int64_t nStart = GetTimeMillis();
+        boost::filesystem::path pathAddr = GetDataDir() / "peers.dat";
+        if (boost::filesystem::exists(pathAddr)) {
+            if (ReadPeersFile(pathAddr, addrman))
+                LogPrintf("Imported %i addresses from peers.dat  %dms\n", addrman.size(), GetTimeMillis() - nStart);
+            else
+                LogPrintf("Invalid peers.dat; ignoring\n");
+        }
+
+        // the key goes last, a database without it is imported again
+        std::vector<CAddrManEntry> vChanged;
+        std::vector<CNetAddr> vErased;
+        addrman.TrackChanges(true);
+        addrman.GetChanges(vChanged, vErased);
+        if (paddrdb->WriteChanges(vChanged, vErased) && paddrdb->WriteKey(addrman.GetBucketKey())) {
+            boost::filesystem::remove(pathAddr);
+        } else {
+            LogPrintf("Failed to write the address database\n");
+            addrman.TrackChanges(true);
+        }
+        fAddressesLoaded = true;
     }
-    LogPrintf("Loaded %i addresses from peers.dat  %dms\n",
-           addrman.size(), GetTimeMillis() - nStart);
     fAddressesInitialized = true;
 
     if (semOutbound == NULL) {
@@ -2051,6 +2618,25 @@ void StartNode(boost::thread_group& threadGroup, CScheduler& scheduler)
     LogPrintf("TLS is not used!\n");
 #endif
 
+#ifdef HAVE_SYS_EPOLL_H
+    // before any node is created, they register with it
+    if (socketEventsMode == SocketEventsMode::EPOLL && hEpoll == -1)
+    {
+        hEpoll = epoll_create1(EPOLL_CLOEXEC);
+        if (hEpoll == -1)
+        {
+            LogPrintf("epoll_create1 failed: %s, using select() instead\n", NetworkErrorString(errno));
+            socketEventsMode = SocketEventsMode::SELECT;
+        }
+        else
+        {
+            // level triggered, one connection is accepted per round
+            BOOST_FOREACH(ListenSocket& hListenSocket, vhListenSocket)
+                EpollAdd(hListenSocket.socket, &hListenSocket, EPOLLIN);
+        }
+    }
+#endif
+
     //
     // Start threads
     //
@@ -2069,7 +2655,9 @@ void StartNode(boost::thread_group& threadGroup, CScheduler& scheduler)
     // Initiate outbound connections
 
     // Process messages
-    threadGroup.create_thread(boost::bind(&TraceThread<void (*)()>, "msghand", &ThreadMessageHandler));
+    LogPrintf("Using %d message handler threads\n", nMessageHandlerThreads);
+    for (int i = 0; i < nMessageHandlerThreads; i++)
+        threadGroup.create_thread(boost::bind(&TraceThread<boost::function<void()> >, "msghand", boost::function<void()>(boost::bind(&ThreadMessageHandler, i))));
 
 #if defined(USE_TLS)
     if (CNode::GetTlsFallbackNonTls())
@@ -2095,6 +2683,8 @@ bool StopNode()
         DumpAddresses();
         fAddressesInitialized = false;
     }
+    delete paddrdb;
+    paddrdb = NULL;
 
     return true;
 }
@@ -2108,6 +2698,13 @@ void CNode::NetCleanup()
         if (hListenSocket.socket != INVALID_SOCKET)
             if (!CloseSocket(hListenSocket.socket))
                 LogPrintf("CloseSocket(hListenSocket) failed with error %s\n", NetworkErrorString(WSAGetLastError()));
+#ifdef HAVE_SYS_EPOLL_H
+    if (hEpoll != -1)
+    {
+        close(hEpoll);
+        hEpoll = -1;
+    }
+#endif
 
     // clean up some globals (to help leak detection)
     BOOST_FOREACH(CNode *pnode, vNodes)
@@ -2193,140 +2790,55 @@ uint64_t CNode::GetTotalBytesSent()
     return nTotalBytesSent;
 }
 
-void CNode::Fuzz(int nChance)
-{
-    if (!fSuccessfullyConnected) return; // Don't fuzz initial handshake
-    if (GetRand(nChance) != 0) return; // Fuzz 1 of every nChance messages
+// The commands sent or handled by ProcessMessage, the ones with stats of their own
+static const char* const pszNetMsgStatsCommands[] = {
+    "addr", "alert", "block", "blocktxn", "cmpctblock", "filteradd", "filterclear",
+    "filterload", "getaddr", "getblocks", "getblocktxn", "getdata", "getheaders",
+    "headers", "inv", "mempool", "merkleblock", "notfound", "ping", "pong",
+    "reconcildiff", "reject", "reqrecon", "sendcmpct", "sendrecon", "sketch", "tx",
+    "verack", "version",
+};
 
-    switch (GetRand(3))
-    {
-    case 0:
-        // xor a random byte with a random value:
-        if (!ssSend.empty()) {
-            CDataStream::size_type pos = GetRand(ssSend.size());
-            ssSend[pos] ^= (unsigned char)(GetRand(256));
-        }
-        break;
-    case 1:
-        // delete a random byte:
-        if (!ssSend.empty()) {
-            CDataStream::size_type pos = GetRand(ssSend.size());
-            ssSend.erase(ssSend.begin()+pos);
-        }
-        break;
-    case 2:
-        // insert a random byte at a random position
-        {
-            CDataStream::size_type pos = GetRand(ssSend.size());
-            char ch = (char)GetRand(256);
-            ssSend.insert(ssSend.begin()+pos, ch);
-        }
-        break;
-    }
-    // Chance of more than one change half the time:
-    // (more changes exponentially less likely):
-    Fuzz(2);
+CNetMsgStats& CNode::GetMsgStats(const std::string& strCommand)
+{
+    // a peer can make up as many commands as it likes, they all end up in one entry
+    static const std::set<std::string> setCommands(pszNetMsgStatsCommands, pszNetMsgStatsCommands + ARRAYLEN(pszNetMsgStatsCommands));
+    if (setCommands.count(strCommand))
+        return mapMsgStats[strCommand];
+    return mapMsgStats[NET_MSG_STATS_OTHER];
 }
 
-//
-// CAddrDB
-//
-
-CAddrDB::CAddrDB()
+void CNode::RecordMsgSent(const std::string& strCommand, uint64_t nBytes)
 {
-    pathAddr = GetDataDir() / "peers.dat";
+    LOCK(cs_msgStats);
+    CNetMsgStats& stats = GetMsgStats(strCommand);
+    stats.nSendBytes += nBytes;
+    stats.nSendMsgs++;
 }
 
-bool CAddrDB::Write(const CAddrMan& addr)
+void CNode::RecordMsgRecv(const std::string& strCommand, uint64_t nBytes, int64_t nProcessTime)
 {
-    // Generate random temporary filename
-    unsigned short randv = 0;
-    GetRandBytes((unsigned char*)&randv, sizeof(randv));
-    std::string tmpfn = strprintf("peers.dat.%04x", randv);
-
-    // serialize addresses, checksum data up to that point, then append csum
-    CDataStream ssPeers(SER_DISK, CLIENT_VERSION);
-    ssPeers << FLATDATA(Params().MessageStart());
-    ssPeers << addr;
-    uint256 hash = Hash(ssPeers.begin(), ssPeers.end());
-    ssPeers << hash;
-
-    // open temp output file, and associate with CAutoFile
-    boost::filesystem::path pathTmp = GetDataDir() / tmpfn;
-    FILE *file = fopen(pathTmp.string().c_str(), "wb");
-    CAutoFile fileout(file, SER_DISK, CLIENT_VERSION);
-    if (fileout.IsNull())
-        return error("%s: Failed to open file %s", __func__, pathTmp.string());
-
-    // Write and commit header, data
-    try {
-        fileout << ssPeers;
-    }
-    catch (const std::exception& e) {
-        return error("%s: Serialize or I/O error - %s", __func__, e.what());
-    }
-    FileCommit(fileout.Get());
-    fileout.fclose();
-
-    // replace existing peers.dat, if any, with new peers.dat.XXXX
-    if (!RenameOver(pathTmp, pathAddr))
-        return error("%s: Rename-into-place failed", __func__);
-
-    return true;
+    LOCK(cs_msgStats);
+    CNetMsgStats& stats = GetMsgStats(strCommand);
+    stats.nRecvBytes += nBytes;
+    stats.nRecvMsgs++;
+    stats.nProcessTime += nProcessTime;
 }
 
-bool CAddrDB::Read(CAddrMan& addr)
+void GetNetMsgStats(NetMsgStatsMap& mapStats)
 {
-    // open input file, and associate with CAutoFile
-    FILE *file = fopen(pathAddr.string().c_str(), "rb");
-    CAutoFile filein(file, SER_DISK, CLIENT_VERSION);
-    if (filein.IsNull())
-        return error("%s: Failed to open file %s", __func__, pathAddr.string());
-
-    // use file size to size memory buffer
-    int fileSize = boost::filesystem::file_size(pathAddr);
-    int dataSize = fileSize - sizeof(uint256);
-    // Don't try to resize to a negative number if file is small
-    if (dataSize < 0)
-        dataSize = 0;
-    vector<unsigned char> vchData;
-    vchData.resize(dataSize);
-    uint256 hashIn;
-
-    // read data and checksum from file
-    try {
-        filein.read((char *)&vchData[0], dataSize);
-        filein >> hashIn;
-    }
-    catch (const std::exception& e) {
-        return error("%s: Deserialize or I/O error - %s", __func__, e.what());
-    }
-    filein.fclose();
-
-    CDataStream ssPeers(vchData, SER_DISK, CLIENT_VERSION);
-
-    // verify stored checksum matches input data
-    uint256 hashTmp = Hash(ssPeers.begin(), ssPeers.end());
-    if (hashIn != hashTmp)
-        return error("%s: Checksum mismatch, data corrupted", __func__);
-
-    unsigned char pchMsgTmp[4];
-    try {
-        // de-serialize file header (network specific magic number) and ..
-        ssPeers >> FLATDATA(pchMsgTmp);
-
-        // ... verify the network matches ours
-        if (memcmp(pchMsgTmp, Params().MessageStart(), sizeof(pchMsgTmp)))
-            return error("%s: Invalid network magic number", __func__);
-
-        // de-serialize address data into one CAddrMan object
-        ssPeers >> addr;
+    {
+        LOCK(CNode::cs_msgStatsDisconnected);
+        mapStats = CNode::mapMsgStatsDisconnected;
     }
-    catch (const std::exception& e) {
-        return error("%s: Deserialize or I/O error - %s", __func__, e.what());
+    // the peers being disconnected are missing until they are destroyed
+    LOCK(cs_vNodes);
+    BOOST_FOREACH(CNode* pnode, vNodes)
+    {
+        LOCK(pnode->cs_msgStats);
+        for (const auto& item : pnode->mapMsgStats)
+            mapStats[item.first] += item.second;
     }
-
-    return true;
 }
 
 unsigned int ReceiveFloodSize() { return 1000*GetArg("-maxreceivebuffer", 5*1000); }
@@ -2335,9 +2847,13 @@ unsigned int SendBufferSize() { return 1000*GetArg("-maxsendbuffer", 1*1000); }
 CNode::CNode(SOCKET hSocketIn, const CAddress& addrIn, const std::string& addrNameIn, bool fInboundIn, SSL *sslIn) :
     ssSend(SER_NETWORK, INIT_PROTO_VERSION),
     addrKnown(5000, 0.001),
-    setInventoryKnown(SendBufferSize() / 1000)
+    filterInventoryKnown(INVENTORY_KNOWN_ELEMENTS, 0.000001)
 {
     ssl = sslIn;
+    // the handshake of a TLS connection is done by the socket thread
+    fTLSHandshake = (ssl != NULL);
+    fTLSHandshakeWantWrite = false;
+    nTLSHandshakeDeadline = GetTimeMillis() + DEFAULT_CONNECT_TIMEOUT;
     nServices = 0;
     hSocket = hSocketIn;
     nRecvVersion = INIT_PROTO_VERSION;
@@ -2345,6 +2861,8 @@ CNode::CNode(SOCKET hSocketIn, const CAddress& addrIn, const std::string& addrNa
     nLastRecv = 0;
     nSendBytes = 0;
     nRecvBytes = 0;
+    pcaptureFile = NULL;
+    nLastCaptureTime = 0;
     nTimeConnected = GetTime();
     nTimeOffset = 0;
     addr = addrIn;
@@ -2361,6 +2879,12 @@ CNode::CNode(SOCKET hSocketIn, const CAddress& addrIn, const std::string& addrNa
     nRefCount = 0;
     nSendSize = 0;
     nSendOffset = 0;
+    fSendRetry = false;
+    fOrphanWork = false;
+    // TLS may already hold data received during the handshake
+    fSocketRecvReady = true;
+    fSocketSendReady = true;
+    fSocketError = false;
     hashContinue = uint256();
     nStartingHeight = -1;
     fGetAddr = false;
@@ -2372,6 +2896,8 @@ CNode::CNode(SOCKET hSocketIn, const CAddress& addrIn, const std::string& addrNa
     nPingUsecTime = 0;
     fPingQueued = false;
     nMinPingUsecTime = std::numeric_limits<int64_t>::max();
+    nLastBlockTime = 0;
+    nLastTxTime = 0;
 
     {
         LOCK(cs_nLastNodeId);
@@ -2383,6 +2909,15 @@ CNode::CNode(SOCKET hSocketIn, const CAddress& addrIn, const std::string& addrNa
     else
         LogPrint("net", "Added connection peer=%d\n", id);
 
+    if (hSocket != INVALID_SOCKET && !pathCaptureMessages.empty())
+        OpenCaptureFile();
+
+#ifdef HAVE_SYS_EPOLL_H
+    // registered once for good, the events are latched in fSocket*
+    if (hSocket != INVALID_SOCKET && hEpoll != -1 && !EpollAdd(hSocket, this, EPOLLIN | EPOLLOUT | EPOLLRDHUP | EPOLLET))
+        fDisconnect = true;
+#endif
+
     // Be shy and don't send version until we hear
     if (hSocket != INVALID_SOCKET && !fInbound)
         PushVersion();
@@ -2442,18 +2977,32 @@ CNode::~CNode()
         if (ssl)
         {
             unsigned long err_code = 0;
-            tlsmanager.waitFor(SSL_SHUTDOWN, hSocket, ssl, (DEFAULT_CONNECT_TIMEOUT / 1000), err_code);
+            if (!fTLSHandshake)
+                tlsmanager.waitFor(SSL_SHUTDOWN, hSocket, ssl, (DEFAULT_CONNECT_TIMEOUT / 1000), err_code);
             
             SSL_free(ssl);
             ssl = NULL;
         }
         
+#ifdef HAVE_SYS_EPOLL_H
+        if (hEpoll != -1)
+            EpollDel(hSocket);
+#endif
         CloseSocket(hSocket);
     }
 
     if (pfilter)
         delete pfilter;
 
+    if (pcaptureFile)
+        CloseCaptureFile();
+
+    {
+        LOCK(cs_msgStatsDisconnected);
+        for (const auto& item : mapMsgStats)
+            mapMsgStatsDisconnected[item.first] += item.second;
+    }
+
     GetNodeSignals().FinalizeNode(GetId());
 }
 
@@ -2519,8 +3068,6 @@ void CNode::EndMessage() UNLOCK_FUNCTION(cs_vSend)
         AbortMessage();
         return;
     }
-    if (mapArgs.count("-fuzzmessagestest"))
-        Fuzz(GetArg("-fuzzmessagestest", 10));
 
     if (ssSend.size() == 0)
     {
@@ -2540,8 +3087,12 @@ void CNode::EndMessage() UNLOCK_FUNCTION(cs_vSend)
 
     LogPrint("net", "(%d bytes) peer=%d\n", nSize, id);
 
+    const char* pszCommand = &ssSend[MESSAGE_START_SIZE];
+    RecordMsgSent(std::string(pszCommand, strnlen(pszCommand, CMessageHeader::COMMAND_SIZE)), ssSend.size());
+
+    // the message is moved to the queue, not copied
     std::deque<CSerializeData>::iterator it = vSendMsg.insert(vSendMsg.end(), CSerializeData());
-    ssSend.GetAndClear(*it);
+    ssSend.SwapData(*it);
     nSendSize += (*it).size();
 
     // If write queue empty, attempt "optimistic write"
@@ -10,15 +10,16 @@
 #include "compat.h"
 #include "hash.h"
 #include "limitedmap.h"
-#include "mruset.h"
 #include "netbase.h"
 #include "protocol.h"
 #include "random.h"
 #include "streams.h"
 #include "sync.h"
+#include "txreconciliation.h"
 #include "uint256.h"
 #include "utilstrencodings.h"
 
+#include <atomic>
 #include <deque>
 #include <stdint.h>
 
@@ -53,6 +54,8 @@ static const int PING_INTERVAL = 2 * 60;
 static const int TIMEOUT_INTERVAL = 20 * 60;
 /** The maximum number of entries in an 'inv' protocol message */
 static const unsigned int MAX_INV_SZ = 50000;
+/** Number of the latest announcements a peer is remembered to know about (filterInventoryKnown) */
+static const unsigned int INVENTORY_KNOWN_ELEMENTS = 5000;
 /** The maximum number of new addresses to accumulate before announcing. */
 static const unsigned int MAX_ADDR_TO_SEND = 1000;
 /** Maximum length of incoming protocol messages (no message over 4 MiB is currently acceptable). */
@@ -60,6 +63,16 @@ static const unsigned int MAX_PROTOCOL_MESSAGE_LENGTH = 4 * 1024 * 1024;
 static_assert((MAX_PROTOCOL_MESSAGE_LENGTH >= MAX_BLOCK_SIZE),
     "net.h MAX_PROTOCOL_MESSAGE_LENGTH must be greater or equal than max block size!");
 
+/** Receive buffers of messages from this size up are recycled, see CRecvBufferPool */
+static const size_t RECV_BUFFER_POOL_MIN_SIZE = 1024;
+/** Number of size classes of the receive buffers, in powers of two up to MAX_PROTOCOL_MESSAGE_LENGTH */
+static const int RECV_BUFFER_POOL_CLASSES = 13;
+static_assert((RECV_BUFFER_POOL_MIN_SIZE << (RECV_BUFFER_POOL_CLASSES - 1)) == MAX_PROTOCOL_MESSAGE_LENGTH,
+    "net.h the largest receive buffer class must take the largest message!");
+/** Free receive buffers kept in each size class, in bytes (at least two buffers are kept) */
+static const size_t RECV_BUFFER_POOL_CLASS_BYTES = 8 * 1024 * 1024;
+/** Receive buffer allocated ahead of the data of a message */
+static const size_t RECV_BUFFER_AHEAD = 256 * 1024;
 /** -listen default */
 static const bool DEFAULT_LISTEN = true;
 /** The maximum number of entries in mapAskFor */
@@ -68,6 +81,37 @@ static const size_t MAPASKFOR_MAX_SZ = MAX_INV_SZ;
 static const size_t SETASKFOR_MAX_SZ = 2 * MAX_INV_SZ;
 /** The maximum number of peer connections to maintain. */
 static const unsigned int DEFAULT_MAX_PEER_CONNECTIONS = 125;
+/** Message stats of the commands we don't know are counted under this name */
+static const char NET_MSG_STATS_OTHER[] = "*other*";
+
+/**
+ * Received messages capture (-capturemessages=<dir>): one append-only file per
+ * connection, made of
+ *   CAPTURE_FILE_MAGIC, CAPTURE_FILE_VERSION, message start, peer address
+ *   (string), inbound flag (bool)
+ * followed by one record per complete message received:
+ *   VARINT time since the previous record (usec, the first one is absolute),
+ *   message header, payload
+ * The header and the payload are exactly as they came from the wire. See
+ * fuzz_capture for turning captures into fuzzer inputs.
+ */
+static const char CAPTURE_FILE_MAGIC[4] = { 'Z', 'C', 'A', 'P' };
+static const unsigned char CAPTURE_FILE_VERSION = 1;
+/** Size of the stdio buffer of a capture file, records are written on the receive path */
+static const size_t CAPTURE_FILE_BUFFER_SIZE = 64 * 1024;
+
+/** How ThreadSocketHandler waits for the sockets to be ready (-socketevents) */
+enum class SocketEventsMode { SELECT, EPOLL };
+#ifdef HAVE_SYS_EPOLL_H
+static const char * const DEFAULT_SOCKETEVENTS = "epoll";
+#else
+static const char * const DEFAULT_SOCKETEVENTS = "select";
+#endif
+
+/** Maximum number of message handler threads (-msghandthreads) */
+static const int MAX_MSGHAND_THREADS = 16;
+/** -msghandthreads default, 0 = one per core */
+static const int DEFAULT_MSGHAND_THREADS = 0;
 
 unsigned int ReceiveFloodSize();
 unsigned int SendBufferSize();
@@ -84,7 +128,8 @@ unsigned short GetListenPort();
 bool BindListenPort(const CService &bindAddr, std::string& strError, bool fWhitelisted = false);
 void StartNode(boost::thread_group& threadGroup, CScheduler& scheduler);
 bool StopNode();
-void SocketSendData(CNode *pnode);
+/** Send as much of the queue as the socket takes. Returns false if it stopped because the socket would block. */
+bool SocketSendData(CNode *pnode);
 SSL_CTX* create_context(bool server_side);
 EVP_PKEY *generate_key();
 X509 *generate_x509(EVP_PKEY *pkey);
@@ -162,6 +207,9 @@ extern uint64_t nLocalHostNonce;
 extern CAddrMan addrman;
 /** Maximum number of connections to simultaneously allow (aka connection slots) */
 extern int nMaxConnections;
+extern SocketEventsMode socketEventsMode;
+/** Peers are sharded across the message handler threads by node id */
+extern int nMessageHandlerThreads;
 
 extern std::vector<CNode*> vNodes;
 extern CCriticalSection cs_vNodes;
@@ -188,6 +236,33 @@ struct LocalServiceInfo {
 extern CCriticalSection cs_mapLocalHost;
 extern std::map<CNetAddr, LocalServiceInfo> mapLocalHost;
 
+/** Messages of one command exchanged with a peer, headers included. */
+struct CNetMsgStats
+{
+    uint64_t nSendBytes;
+    uint64_t nSendMsgs;
+    uint64_t nRecvBytes;
+    uint64_t nRecvMsgs;
+    int64_t nProcessTime; // microseconds spent handling the messages received
+
+    CNetMsgStats() : nSendBytes(0), nSendMsgs(0), nRecvBytes(0), nRecvMsgs(0), nProcessTime(0) {}
+
+    CNetMsgStats& operator+=(const CNetMsgStats& other)
+    {
+        nSendBytes += other.nSendBytes;
+        nSendMsgs += other.nSendMsgs;
+        nRecvBytes += other.nRecvBytes;
+        nRecvMsgs += other.nRecvMsgs;
+        nProcessTime += other.nProcessTime;
+        return *this;
+    }
+};
+
+typedef std::map<std::string, CNetMsgStats> NetMsgStatsMap;
+
+/** Message stats by command of all the peers since startup, disconnected ones included. */
+void GetNetMsgStats(NetMsgStatsMap& mapStats);
+
 class CNodeStats
 {
 public:
@@ -210,11 +285,30 @@ public:
     double dPingTime;
     double dPingWait;
     std::string addrLocal;
+    NetMsgStatsMap mapMsgStats;
 };
 
 
 
 
+/**
+ * Receive buffers, recycled in power of two size classes. A message takes a buffer when
+ * its first data comes, sized from the header, and gives it back when it is destroyed
+ * after it was processed, so that the receive path neither allocates nor grows a buffer
+ * for each message.
+ */
+class CRecvBufferPool
+{
+public:
+    /** Size of the buffers for a message of nSize bytes */
+    static size_t ClassSize(size_t nSize);
+    /** Give an empty buffer for a message of nSize bytes to s, which has none: a
+     *  recycled one, or a new one with capacity for up to RECV_BUFFER_AHEAD bytes */
+    static void Get(CDataStream& s, size_t nSize);
+    /** Take the buffer of s back */
+    static void Put(CDataStream& s);
+};
+
 class CNetMessage {
 public:
     bool in_data;                   // parsing header (false) or data (true)
@@ -236,6 +330,11 @@ public:
         nTime = 0;
     }
 
+    ~CNetMessage()
+    {
+        CRecvBufferPool::Put(vRecv);
+    }
+
     bool complete() const
     {
         if (!in_data)
@@ -263,23 +362,40 @@ class CNode
 public:
     // OpenSSL
     SSL *ssl;
+    // The TLS handshake on ssl is still going on. It is driven by the socket thread,
+    // which neither sends nor receives messages before it is done
+    bool fTLSHandshake;
+    bool fTLSHandshakeWantWrite; // the handshake waits for hSocket to be writable rather than readable
+    int64_t nTLSHandshakeDeadline; // time in msec
 
     // socket
     uint64_t nServices;
     SOCKET hSocket;
     CCriticalSection cs_hSocket;
+    // Readiness of hSocket with -socketevents=epoll, which is edge triggered: set by
+    // the events, cleared by the socket thread once a read or a write would block
+    bool fSocketRecvReady;
+    bool fSocketSendReady;
+    bool fSocketError;
     CDataStream ssSend;
     size_t nSendSize; // total size of all vSendMsg entries
     size_t nSendOffset; // offset inside the first vSendMsg already sent
+    bool fSendRetry; // an SSL_write() of the first vSendMsg entry has to be repeated with the same buffer
     uint64_t nSendBytes;
     std::deque<CSerializeData> vSendMsg;
     CCriticalSection cs_vSend;
 
     std::deque<CInv> vRecvGetData;
+    // orphan transactions to reconsider since their parents arrived from this peer, requires cs_main
+    std::set<uint256> setOrphanWork;
+    // setOrphanWork isn't empty, to be checked without cs_main
+    std::atomic<bool> fOrphanWork;
     std::deque<CNetMessage> vRecvMsg;
     CCriticalSection cs_vRecvMsg;
     uint64_t nRecvBytes;
     int nRecvVersion;
+    CAutoFile *pcaptureFile; // -capturemessages output, NULL if not capturing
+    int64_t nLastCaptureTime;
 
     int64_t nLastSend;
     int64_t nLastRecv;
@@ -325,8 +441,12 @@ protected:
     static std::vector<CSubNet> vWhitelistedRange;
     static CCriticalSection cs_vWhitelistedRange;
 
-    // Basic fuzz-testing
-    void Fuzz(int nChance); // modifies ssSend
+    // Directory where received messages are captured, empty if disabled
+    static boost::filesystem::path pathCaptureMessages;
+
+    void OpenCaptureFile();
+    void CaptureMessage(const CNetMessage &msg);
+    void CloseCaptureFile();
 
     enum class eTlsOption {
         FALLBACK_UNSET = 0,
@@ -340,18 +460,22 @@ public:
     uint256 hashContinue;
     int nStartingHeight;
 
-    // flood relay
+    // flood relay, addresses are pushed by the message handler threads of other peers
     std::vector<CAddress> vAddrToSend;
     CRollingBloomFilter addrKnown;
+    CCriticalSection cs_vAddrToSend;
     bool fGetAddr;
+    // alerts, requires cs_inventory
     std::set<uint256> setKnown;
 
-    // inventory based relay
-    mruset<CInv> setInventoryKnown;
+    // inventory based relay, keyed by hash: blocks, transactions and certificates never share one
+    CRollingBloomFilter filterInventoryKnown;
     std::vector<CInv> vInventoryToSend;
     CCriticalSection cs_inventory;
     std::set<uint256> setAskFor;
     std::multimap<int64_t, CInv> mapAskFor;
+    // transactions announced by set reconciliation instead of invs, requires cs_inventory
+    CTxReconciliationState recon;
 
     // Ping time measurement:
     // The pong reply we're expecting, or 0 if no pong expected.
@@ -365,6 +489,11 @@ public:
     // Whether a ping is requested.
     bool fPingQueued;
 
+    // Last time the peer sent us a block, or a transaction or certificate, we
+    // didn't have. Inbound peers which do are kept when making room for new ones.
+    std::atomic<int64_t> nLastBlockTime;
+    std::atomic<int64_t> nLastTxTime;
+
     CNode(SOCKET hSocketIn, const CAddress &addrIn, const std::string &addrNameIn = "", bool fInboundIn = false, SSL *sslIn = NULL);
     ~CNode();
 
@@ -375,6 +504,17 @@ private:
     static uint64_t nTotalBytesRecv;
     static uint64_t nTotalBytesSent;
 
+    // Message stats by command, only touched once per message
+    NetMsgStatsMap mapMsgStats;
+    CCriticalSection cs_msgStats;
+    // of the peers gone, added up when they are destroyed
+    static NetMsgStatsMap mapMsgStatsDisconnected;
+    static CCriticalSection cs_msgStatsDisconnected;
+
+    CNetMsgStats& GetMsgStats(const std::string& strCommand);
+
+    friend void GetNetMsgStats(NetMsgStatsMap& mapStats);
+
     CNode(const CNode&);
     void operator=(const CNode&);
 
@@ -425,6 +565,7 @@ public:
 
     void AddAddressKnown(const CAddress& addr)
     {
+        LOCK(cs_vAddrToSend);
         addrKnown.insert(addr.GetKey());
     }
 
@@ -433,6 +574,7 @@ public:
         // Known checking here is only to save space from duplicates.
         // SendMessages will filter it again for knowns that were added
         // after addresses were pushed.
+        LOCK(cs_vAddrToSend);
         if (addr.IsValid() && !addrKnown.contains(addr.GetKey())) {
             if (vAddrToSend.size() >= MAX_ADDR_TO_SEND) {
                 vAddrToSend[insecure_rand() % vAddrToSend.size()] = addr;
@@ -447,7 +589,7 @@ public:
     {
         {
             LOCK(cs_inventory);
-            setInventoryKnown.insert(inv);
+            filterInventoryKnown.insert(inv.hash);
         }
     }
 
@@ -455,7 +597,7 @@ public:
     {
         {
             LOCK(cs_inventory);
-            if (!setInventoryKnown.count(inv))
+            if (!filterInventoryKnown.contains(inv.hash))
                 vInventoryToSend.push_back(inv);
         }
     }
@@ -668,6 +810,9 @@ public:
     static bool IsWhitelistedRange(const CNetAddr &ip);
     static void AddWhitelistedRange(const CSubNet &subnet);
 
+    // Capture the messages received by the connections opened from now on to files in the given directory
+    static void SetCaptureMessagesDir(const boost::filesystem::path &path);
+
     // Network stats
     static void RecordBytesRecv(uint64_t bytes);
     static void RecordBytesSent(uint64_t bytes);
@@ -675,6 +820,9 @@ public:
     static uint64_t GetTotalBytesRecv();
     static uint64_t GetTotalBytesSent();
 
+    void RecordMsgSent(const std::string& strCommand, uint64_t nBytes);
+    void RecordMsgRecv(const std::string& strCommand, uint64_t nBytes, int64_t nProcessTime);
+
     // resource deallocation on cleanup, called at node shutdown
     static void NetCleanup();
 
@@ -691,15 +839,4 @@ void Relay(const CTransaction& tx);
 void Relay(const CScCertificate& cert);
 void Relay(const CTransactionBase& tx, const CDataStream& ss);
 
-/** Access to the (IP) address database (peers.dat) */
-class CAddrDB
-{
-private:
-    boost::filesystem::path pathAddr;
-public:
-    CAddrDB();
-    bool Write(const CAddrMan& addr);
-    bool Read(CAddrMan& addr);
-};
-
 #endif // BITCOIN_NET_H
@@ -207,5 +207,11 @@ bool SetSocketNonBlocking(SOCKET& hSocket, bool fNonBlocking);
  * Convert milliseconds to a struct timeval for e.g. select.
  */
 struct timeval MillisToTimeval(int64_t nTimeout);
+/**
+ * Wait at most nTimeout milliseconds for a socket to become readable (or
+ * writable if fWrite). Unlike select(), works with any socket number.
+ * Returns > 0 if the socket is ready, 0 on timeout and SOCKET_ERROR on error.
+ */
+int WaitForSocket(SOCKET hSocket, bool fWrite, int64_t nTimeout);
 
 #endif // BITCOIN_NETBASE_H
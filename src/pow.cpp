@@ -12,12 +12,17 @@
 #include "chainparams.h"
 #include "crypto/equihash.h"
 #include "primitives/block.h"
+#include "random.h"
 #include "streams.h"
 #include "uint256.h"
 #include "util.h"
 #include <metrics.h>
 #include "sodium.h"
 
+#include <map>
+
+#include <boost/thread/shared_mutex.hpp>
+
 unsigned int GetNextWorkRequired(const CBlockIndex* pindexLast, const CBlockHeader *pblock, const Consensus::Params& params)
 {
     unsigned int nProofOfWorkLimit = UintToArith256(params.powLimit).GetCompact();
@@ -106,6 +111,72 @@ bool CheckEquihashSolution(const CBlockHeader *pblock, const CChainParams& param
     return true;
 }
 
+namespace {
+
+/** Maximum number of verdicts kept by CEquihashCache, at about 100 bytes each */
+static const size_t MAX_EQUIHASH_CACHE_SIZE = 50000;
+
+/**
+ * Verdicts on Equihash solutions by header hash, which commits to the solution.
+ * A header is checked when its headers message comes in and again when the
+ * block does, in both cases possibly by several peers.
+ */
+class CEquihashCache
+{
+private:
+    std::map<uint256, bool> mapVerdicts;
+    boost::shared_mutex cs_equihashcache;
+
+public:
+    bool Get(const uint256& hash, bool& fValid)
+    {
+        boost::shared_lock<boost::shared_mutex> lock(cs_equihashcache);
+
+        std::map<uint256, bool>::const_iterator it = mapVerdicts.find(hash);
+        if (it == mapVerdicts.end())
+            return false;
+        fValid = it->second;
+        return true;
+    }
+
+    void Set(const uint256& hash, bool fValid)
+    {
+        boost::unique_lock<boost::shared_mutex> lock(cs_equihashcache);
+
+        while (mapVerdicts.size() >= MAX_EQUIHASH_CACHE_SIZE)
+        {
+            // Evict a random entry, so that the cache cannot be flushed of
+            // given headers on purpose
+            std::map<uint256, bool>::iterator it = mapVerdicts.lower_bound(GetRandHash());
+            if (it == mapVerdicts.end())
+                it = mapVerdicts.begin();
+            mapVerdicts.erase(it);
+        }
+        mapVerdicts[hash] = fValid;
+    }
+};
+
+CEquihashCache equihashCache;
+
+}
+
+bool CheckEquihashSolutionCached(const CBlockHeader *pblock, const uint256& hash, const CChainParams& params)
+{
+    bool fValid;
+    if (equihashCache.Get(hash, fValid))
+        return fValid || error("CheckEquihashSolution(): invalid solution");
+
+    fValid = CheckEquihashSolution(pblock, params);
+    equihashCache.Set(hash, fValid);
+    return fValid;
+}
+
+bool IsEquihashSolutionCached(const uint256& hash)
+{
+    bool fValid;
+    return equihashCache.Get(hash, fValid);
+}
+
 /** extracted from rpc command generate and reused in UTs **/
 void generateEquihash(CBlock& block)
 {
@@ -25,6 +25,13 @@ unsigned int CalculateNextWorkRequired(arith_uint256 bnAvg,
 
 /** Check whether the Equihash solution in a block header is valid */
 bool CheckEquihashSolution(const CBlockHeader *pblock, const CChainParams&);
+/**
+ * Same as CheckEquihashSolution, with the verdicts kept by header hash: a header
+ * checked ahead of time, outside cs_main, is not checked again.
+ */
+bool CheckEquihashSolutionCached(const CBlockHeader *pblock, const uint256& hash, const CChainParams&);
+/** Whether the verdict on the Equihash solution of a header is cached */
+bool IsEquihashSolutionCached(const uint256& hash);
 
 /** extracted from rpc command generate and reused in UTs **/
 void generateEquihash(CBlock& block);
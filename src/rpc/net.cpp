@@ -81,6 +81,23 @@ static void CopyNodeStats(std::vector<CNodeStats>& vstats)
     }
 }
 
+static UniValue NetMsgStatsToJSON(const NetMsgStatsMap& mapStats)
+{
+    UniValue ret(UniValue::VOBJ);
+    for (const auto& item : mapStats) {
+        const CNetMsgStats& stats = item.second;
+        UniValue obj(UniValue::VOBJ);
+        obj.pushKV("bytessent", stats.nSendBytes);
+        obj.pushKV("msgssent", stats.nSendMsgs);
+        obj.pushKV("bytesrecv", stats.nRecvBytes);
+        obj.pushKV("msgsrecv", stats.nRecvMsgs);
+        obj.pushKV("processtime", stats.nProcessTime * 0.000001);
+        // commands are whatever the peers sent
+        ret.pushKV(SanitizeString(item.first), obj);
+    }
+    return ret;
+}
+
 UniValue getpeerinfo(const UniValue& params, bool fHelp)
 {
     if (fHelp || params.size() != 0)
@@ -116,7 +133,19 @@ UniValue getpeerinfo(const UniValue& params, bool fHelp)
             "       n,                                   (numeric) the heights of blocks we're currently asking from this peer\n"
             "       ...\n"
             "    ],\n"
-            "    \"whitelisted\": true|false             (boolean) whether the peer is whitelisted\n"
+            "    \"blockservicetime\": n,                (numeric) the average time in seconds between two blocks coming from this peer, 0 if unknown\n"
+            "    \"blocklatency\": n,                    (numeric) the average time in seconds a block requested from this peer takes to arrive, 0 if unknown\n"
+            "    \"whitelisted\": true|false,            (boolean) whether the peer is whitelisted\n"
+            "    \"msgstats\": {                         (json object) the messages exchanged with the peer by command\n"
+            "      \"command\": {\n"
+            "        \"bytessent\": n,                   (numeric) the bytes sent, headers included\n"
+            "        \"msgssent\": n,                    (numeric) the number of messages sent\n"
+            "        \"bytesrecv\": n,                   (numeric) the bytes received, headers included\n"
+            "        \"msgsrecv\": n,                    (numeric) the number of messages received\n"
+            "        \"processtime\": n                  (numeric) the time in seconds spent processing the messages received\n"
+            "      },\n"
+            "      ...\n"
+            "    }\n"
             "  }\n"
             "  ,...\n"
             "]\n"
@@ -169,8 +198,11 @@ UniValue getpeerinfo(const UniValue& params, bool fHelp)
                 heights.push_back(height);
             }
             obj.pushKV("inflight", heights);
+            obj.pushKV("blockservicetime", statestats.nBlockServiceTime * 0.000001);
+            obj.pushKV("blocklatency", statestats.nBlockLatency * 0.000001);
         }
         obj.pushKV("whitelisted", stats.fWhitelisted);
+        obj.pushKV("msgstats", NetMsgStatsToJSON(stats.mapMsgStats));
 
         ret.push_back(obj);
     }
@@ -405,6 +437,37 @@ UniValue getnettotals(const UniValue& params, bool fHelp)
     return obj;
 }
 
+UniValue getnetmsgstats(const UniValue& params, bool fHelp)
+{
+    if (fHelp || params.size() > 0)
+        throw runtime_error(
+            "getnetmsgstats\n"
+            "\nReturns the messages exchanged with all the peers since startup by command,\n"
+            "the peers already disconnected included. The commands this node doesn't know\n"
+            "are counted as \"" + std::string(NET_MSG_STATS_OTHER) + "\".\n"
+
+            "\nResult:\n"
+            "{\n"
+            "  \"command\": {\n"
+            "    \"bytessent\": n,      (numeric) the bytes sent, headers included\n"
+            "    \"msgssent\": n,       (numeric) the number of messages sent\n"
+            "    \"bytesrecv\": n,      (numeric) the bytes received, headers included\n"
+            "    \"msgsrecv\": n,       (numeric) the number of messages received\n"
+            "    \"processtime\": n     (numeric) the time in seconds spent processing the messages received\n"
+            "  },\n"
+            "  ...\n"
+            "}\n"
+
+            "\nExamples:\n"
+            + HelpExampleCli("getnetmsgstats", "")
+            + HelpExampleRpc("getnetmsgstats", "")
+       );
+
+    NetMsgStatsMap mapStats;
+    GetNetMsgStats(mapStats);
+    return NetMsgStatsToJSON(mapStats);
+}
+
 static UniValue GetNetworksInfo()
 {
     UniValue networks(UniValue::VARR);
@@ -165,6 +165,7 @@ public:
     bool empty() const                               { return vch.size() == nReadPos; }
     void resize(size_type n, value_type c=0)         { vch.resize(n + nReadPos, c); }
     void reserve(size_type n)                        { vch.reserve(n + nReadPos); }
+    size_type capacity() const                       { return vch.capacity() - nReadPos; }
     const_reference operator[](size_type pos) const  { return vch[pos + nReadPos]; }
     reference operator[](size_type pos)              { return vch[pos + nReadPos]; }
     void clear()                                     { vch.clear(); nReadPos = 0; }
@@ -347,6 +348,12 @@ public:
         d.insert(d.end(), begin(), end());
         clear();
     }
+
+    /** Exchange the data with d, which keeps the buffers, and read from the start */
+    void SwapData(CSerializeData &d) {
+        vch.swap(d);
+        nReadPos = 0;
+    }
 };
 
 class CDataStream : public CBaseDataStream<CSerializeData>
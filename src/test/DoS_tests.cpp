@@ -18,6 +18,7 @@
 
 #include "test/test_bitcoin.h"
 
+#include <limits>
 #include <stdint.h>
 
 #include <boost/assign/list_of.hpp> // for 'map_list_of()'
@@ -26,12 +27,15 @@
 #include <boost/test/unit_test.hpp>
 
 // Tests this internal-to-main.cpp method:
-extern bool AddOrphanTx(const CTransactionBase& tx, NodeId peer);
+extern bool AddOrphanTx(const CTransactionBase& tx, NodeId peer, size_t nMaxPeerSize);
 extern void EraseOrphansFor(NodeId peer);
-extern unsigned int LimitOrphanTxSize(unsigned int nMaxOrphans);
+extern unsigned int LimitOrphanTxSize(unsigned int nMaxOrphans, size_t nMaxOrphansSize);
 
 extern std::map<uint256, COrphanTx> mapOrphanTransactions;
-extern std::map<uint256, std::set<uint256> > mapOrphanTransactionsByPrev;
+extern std::map<COutPoint, std::set<uint256> > mapOrphanTransactionsByPrev;
+extern std::list<uint256> lOrphanTransactionsExpiry;
+extern size_t nOrphanTransactionsSize;
+extern std::map<NodeId, size_t> mapOrphanTransactionsSizeByPeer;
 
 CService ip(uint32_t i)
 {
@@ -132,7 +136,7 @@ BOOST_AUTO_TEST_CASE(DoS_mapOrphans)
         tx.getOut(0).nValue = 1*CENT;
         tx.getOut(0).scriptPubKey = GetScriptForDestination(key.GetPubKey().GetID());
 
-        AddOrphanTx(tx, i);
+        AddOrphanTx(tx, i, std::numeric_limits<size_t>::max());
     }
 
     // ... and 50 that depend on other orphans:
@@ -157,7 +161,7 @@ BOOST_AUTO_TEST_CASE(DoS_mapOrphans)
             SignSignature(keystore, *dynamic_cast<const CScCertificate*>(txPrev), tx, 0);
         }
 
-        AddOrphanTx(tx, i);
+        AddOrphanTx(tx, i, std::numeric_limits<size_t>::max());
     }
 
 
@@ -190,7 +194,7 @@ BOOST_AUTO_TEST_CASE(DoS_mapOrphans)
         for (unsigned int j = 1; j < tx.vin.size(); j++)
             tx.vin[j].scriptSig = tx.vin[0].scriptSig;
 
-        BOOST_CHECK(!AddOrphanTx(tx, i));
+        BOOST_CHECK(!AddOrphanTx(tx, i, std::numeric_limits<size_t>::max()));
     }
 
     // Test EraseOrphansFor:
@@ -202,13 +206,73 @@ BOOST_AUTO_TEST_CASE(DoS_mapOrphans)
     }
 
     // Test LimitOrphanTxSize() function:
-    LimitOrphanTxSize(40);
+    LimitOrphanTxSize(40, std::numeric_limits<size_t>::max());
     BOOST_CHECK(mapOrphanTransactions.size() <= 40);
-    LimitOrphanTxSize(10);
+    LimitOrphanTxSize(10, std::numeric_limits<size_t>::max());
     BOOST_CHECK(mapOrphanTransactions.size() <= 10);
-    LimitOrphanTxSize(0);
+    LimitOrphanTxSize(0, std::numeric_limits<size_t>::max());
     BOOST_CHECK(mapOrphanTransactions.empty());
     BOOST_CHECK(mapOrphanTransactionsByPrev.empty());
+    BOOST_CHECK(lOrphanTransactionsExpiry.empty());
+    BOOST_CHECK_EQUAL(nOrphanTransactionsSize, 0U);
+    BOOST_CHECK(mapOrphanTransactionsSizeByPeer.empty());
+}
+
+CMutableTransaction OrphanSpending(const COutPoint& prevout)
+{
+    CMutableTransaction tx;
+    tx.vin.resize(1);
+    tx.vin[0].prevout = prevout;
+    tx.vin[0].scriptSig << OP_1;
+    tx.resizeOut(1);
+    tx.getOut(0).nValue = 1*CENT;
+    tx.getOut(0).scriptPubKey = CScript() << OP_TRUE;
+    return tx;
+}
+
+BOOST_AUTO_TEST_CASE(DoS_mapOrphansLimits)
+{
+    const size_t nTxSize = CTransaction(OrphanSpending(COutPoint(uint256(), 0))).GetSerializeSize(SER_NETWORK, PROTOCOL_VERSION);
+
+    // orphans are indexed by the outpoints they spend
+    uint256 hashParent = GetRandHash();
+    CTransaction tx0(OrphanSpending(COutPoint(hashParent, 0)));
+    CTransaction tx1(OrphanSpending(COutPoint(hashParent, 1)));
+    BOOST_CHECK(AddOrphanTx(tx0, 0, std::numeric_limits<size_t>::max()));
+    BOOST_CHECK(AddOrphanTx(tx1, 0, std::numeric_limits<size_t>::max()));
+    BOOST_CHECK_EQUAL(mapOrphanTransactionsByPrev.size(), 2U);
+    BOOST_CHECK(mapOrphanTransactionsByPrev[COutPoint(hashParent, 1)].count(tx1.GetHash()));
+    BOOST_CHECK_EQUAL(nOrphanTransactionsSize, 2 * nTxSize);
+
+    // a peer can't go over its quota, the others still can add theirs
+    BOOST_CHECK(!AddOrphanTx(CTransaction(OrphanSpending(COutPoint(GetRandHash(), 0))), 0, 2 * nTxSize));
+    BOOST_CHECK(AddOrphanTx(CTransaction(OrphanSpending(COutPoint(GetRandHash(), 0))), 1, 2 * nTxSize));
+    BOOST_CHECK_EQUAL(mapOrphanTransactionsSizeByPeer[0], 2 * nTxSize);
+    BOOST_CHECK_EQUAL(mapOrphanTransactionsSizeByPeer[1], nTxSize);
+
+    // the pool is bounded by its size
+    LimitOrphanTxSize(std::numeric_limits<unsigned int>::max(), 2 * nTxSize);
+    BOOST_CHECK_EQUAL(mapOrphanTransactions.size(), 2U);
+    BOOST_CHECK_EQUAL(nOrphanTransactionsSize, 2 * nTxSize);
+
+    // and the orphans expire in the order they came in
+    LimitOrphanTxSize(0, 0);
+    int64_t nStartTime = GetTime();
+    SetMockTime(nStartTime);
+    BOOST_CHECK(AddOrphanTx(tx0, 0, std::numeric_limits<size_t>::max()));
+    SetMockTime(nStartTime + ORPHAN_TX_EXPIRE_TIME / 2);
+    BOOST_CHECK(AddOrphanTx(tx1, 1, std::numeric_limits<size_t>::max()));
+    SetMockTime(nStartTime + ORPHAN_TX_EXPIRE_TIME);
+    LimitOrphanTxSize(std::numeric_limits<unsigned int>::max(), std::numeric_limits<size_t>::max());
+    BOOST_CHECK(!mapOrphanTransactions.count(tx0.GetHash()));
+    BOOST_CHECK(mapOrphanTransactions.count(tx1.GetHash()));
+    BOOST_CHECK(!mapOrphanTransactionsSizeByPeer.count(0));
+    SetMockTime(nStartTime + ORPHAN_TX_EXPIRE_TIME * 3 / 2);
+    LimitOrphanTxSize(std::numeric_limits<unsigned int>::max(), std::numeric_limits<size_t>::max());
+    BOOST_CHECK(mapOrphanTransactions.empty());
+    BOOST_CHECK(mapOrphanTransactionsByPrev.empty());
+    BOOST_CHECK(mapOrphanTransactionsSizeByPeer.empty());
+    SetMockTime(0);
 }
 
 BOOST_AUTO_TEST_SUITE_END()
@@ -331,6 +331,96 @@ BOOST_AUTO_TEST_CASE(addrman_delete)
     BOOST_CHECK(info2 == NULL);
 }
 
+BOOST_AUTO_TEST_CASE(addrman_changes)
+{
+    CAddrManTest addrman;
+
+    // Set addrman addr placement to be deterministic.
+    addrman.MakeDeterministic();
+    addrman.TrackChanges(false);
+
+    CAddress addr1 = CAddress(CService("250.1.2.1", 8333));
+    CAddress addr2 = CAddress(CService("250.1.2.2", 8333));
+    CAddress addr3 = CAddress(CService("251.4.1.1", 8333));
+    CNetAddr source = CNetAddr("252.2.2.2");
+    addrman.Add(addr1, source);
+    addrman.Add(addr2, source);
+    addrman.Add(addr3, source);
+    addrman.Good(addr2);
+
+    std::vector<CAddrManEntry> vChanged;
+    std::vector<CNetAddr> vErased;
+    addrman.GetChanges(vChanged, vErased);
+    BOOST_CHECK_EQUAL(vChanged.size(), 3);
+    BOOST_CHECK(vErased.empty());
+    BOOST_CHECK(!vChanged[0].fInTried && vChanged[0].vNewBuckets.size() == 1);
+    BOOST_CHECK(vChanged[1].fInTried && vChanged[1].vNewBuckets.empty());
+
+    // the changes are taken once
+    addrman.GetChanges(vChanged, vErased);
+    BOOST_CHECK(vChanged.empty());
+
+    addrman.Attempt(addr3);
+    int nId;
+    CAddress addr4 = CAddress(CService("250.1.2.4", 8333));
+    addrman.Create(addr4, source, &nId);
+    addrman.Delete(nId);
+    addrman.GetChanges(vChanged, vErased);
+    BOOST_CHECK_EQUAL(vChanged.size(), 1);
+    BOOST_CHECK(vChanged[0].info.ToString() == "251.4.1.1:8333");
+    BOOST_CHECK_EQUAL(vChanged[0].info.nLastTry, addrman.Find(addr3)->nLastTry);
+    BOOST_CHECK_EQUAL(vErased.size(), 1);
+    BOOST_CHECK(vErased[0] == CNetAddr(addr4));
+
+    // the deletions not written are taken again, unless the address came back
+    CAddress addr5 = CAddress(CService("250.1.2.5", 8333));
+    vErased.push_back(addr5);
+    addrman.Create(addr5, source, &nId);
+    addrman.RestoreErased(vErased);
+    addrman.GetChanges(vChanged, vErased);
+    BOOST_CHECK_EQUAL(vErased.size(), 1);
+    BOOST_CHECK(vErased[0] == CNetAddr(addr4));
+    addrman.Delete(nId);
+    addrman.GetChanges(vChanged, vErased);
+
+    // the entries come back in the same tables
+    addrman.TrackChanges(true);
+    addrman.GetChanges(vChanged, vErased);
+    BOOST_CHECK_EQUAL(vChanged.size(), 3);
+
+    CAddrManTest addrman2;
+    addrman2.SetBucketKey(addrman.GetBucketKey());
+    addrman2.TrackChanges(false);
+    BOOST_CHECK_EQUAL(addrman2.Load(vChanged), 3);
+    BOOST_CHECK_EQUAL(addrman2.size(), 3);
+    BOOST_CHECK_EQUAL(addrman2.Load(vChanged), 0);
+
+    std::vector<CAddrManEntry> vChanged2;
+    addrman2.GetChanges(vChanged2, vErased);
+    BOOST_CHECK(vChanged2.empty());
+    addrman2.TrackChanges(true);
+    addrman2.GetChanges(vChanged2, vErased);
+    BOOST_CHECK_EQUAL(vChanged2.size(), 3);
+    for (size_t i = 0; i < vChanged.size() && i < vChanged2.size(); i++) {
+        BOOST_CHECK(vChanged2[i].info.ToString() == vChanged[i].info.ToString());
+        BOOST_CHECK_EQUAL(vChanged2[i].fInTried, vChanged[i].fInTried);
+        BOOST_CHECK(vChanged2[i].vNewBuckets == vChanged[i].vNewBuckets);
+    }
+
+    // an entry left without a place is dropped, and erased from the database
+    CAddrManTest addrman3;
+    addrman3.SetBucketKey(addrman.GetBucketKey());
+    addrman3.TrackChanges(false);
+    vChanged2.assign(1, vChanged[0]);
+    vChanged2[0].info = CAddrInfo(CAddress(CService("250.1.2.9", 8333)), source);
+    BOOST_CHECK_EQUAL(addrman3.Load(vChanged2), 1);
+    vChanged2[0].vNewBuckets.clear();
+    vChanged2[0].info = CAddrInfo(CAddress(CService("250.1.2.10", 8333)), source);
+    BOOST_CHECK_EQUAL(addrman3.Load(vChanged2), 0);
+    addrman3.GetChanges(vChanged2, vErased);
+    BOOST_CHECK_EQUAL(vErased.size(), 1);
+}
+
 BOOST_AUTO_TEST_CASE(addrman_getaddr)
 {
     CAddrManTest addrman;
@@ -0,0 +1,238 @@
+// Copyright (c) 2011-2016 The Bitcoin Core developers
+// Distributed under the MIT software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#include "blockencodings.h"
+#include "consensus/consensus.h"
+#include "random.h"
+#include "streams.h"
+#include "txmempool.h"
+#include "version.h"
+
+#include "test/test_bitcoin.h"
+
+#include <boost/test/unit_test.hpp>
+
+BOOST_FIXTURE_TEST_SUITE(blockencodings_tests, BasicTestingSetup)
+
+// A block with a coinbase, three transactions and a certificate
+static CBlock BuildBlockTestCase() {
+    CBlock block;
+    CMutableTransaction tx;
+    tx.nVersion = TRANSPARENT_TX_VERSION;
+    tx.vin.resize(1);
+    tx.vin[0].scriptSig.resize(10);
+    tx.resizeOut(1);
+    tx.getOut(0).scriptPubKey = CScript() << OP_TRUE;
+    tx.getOut(0).nValue = 42;
+
+    block.vtx.resize(4);
+    block.nVersion = BLOCK_VERSION_SC_SUPPORT;
+    block.hashPrevBlock = GetRandHash();
+    block.nBits = 0x207fffff;
+
+    tx.vin[0].prevout.hash = GetRandHash();
+    tx.vin[0].prevout.n = 0;
+    block.vtx[1] = tx;
+
+    tx.vin.resize(10);
+    for (size_t i = 0; i < tx.vin.size(); i++) {
+        tx.vin[i].prevout.hash = GetRandHash();
+        tx.vin[i].prevout.n = 0;
+    }
+    block.vtx[2] = tx;
+
+    tx.vin.resize(1);
+    tx.vin[0].prevout.hash = GetRandHash();
+    tx.vin[0].prevout.n = 0;
+    block.vtx[3] = tx;
+
+    // the coinbase
+    tx.vin[0].prevout.SetNull();
+    block.vtx[0] = tx;
+
+    CMutableScCertificate cert;
+    cert.nVersion = SC_CERT_VERSION;
+    cert.scId = GetRandHash();
+    cert.epochNumber = 0;
+    cert.quality = 1;
+    cert.vin.resize(1);
+    cert.vin[0].prevout.hash = GetRandHash();
+    cert.vin[0].prevout.n = 0;
+    block.vcert.push_back(cert);
+
+    block.hashMerkleRoot = block.BuildMerkleTree();
+    return block;
+}
+
+BOOST_AUTO_TEST_CASE(SimpleRoundTripTest)
+{
+    CTxMemPool pool(CFeeRate(0));
+    CBlock block(BuildBlockTestCase());
+
+    pool.addUnchecked(block.vtx[2].GetHash(), CTxMemPoolEntry(block.vtx[2], 0, 0, 0.0, 1));
+    pool.addUnchecked(block.vcert[0].GetHash(), CCertificateMemPoolEntry(block.vcert[0], 0, 0, 0.0, 1));
+
+    // Do a simple ShortTxIDs RT
+    {
+        CBlockHeaderAndShortTxIDs shortIDs(block);
+
+        CDataStream stream(SER_NETWORK, PROTOCOL_VERSION);
+        stream << shortIDs;
+
+        CBlockHeaderAndShortTxIDs shortIDs2;
+        stream >> shortIDs2;
+        BOOST_CHECK_EQUAL(shortIDs2.BlockTxCount(), 4);
+        BOOST_CHECK_EQUAL(shortIDs2.BlockCertCount(), 1);
+
+        PartiallyDownloadedBlock partialBlock(&pool);
+        BOOST_CHECK(partialBlock.InitData(shortIDs2) == READ_STATUS_OK);
+        BOOST_CHECK( partialBlock.IsTxAvailable(0));
+        BOOST_CHECK(!partialBlock.IsTxAvailable(1));
+        BOOST_CHECK( partialBlock.IsTxAvailable(2));
+        BOOST_CHECK(!partialBlock.IsTxAvailable(3));
+        BOOST_CHECK( partialBlock.IsTxAvailable(4));
+
+        // the missing transactions are asked for by their index in the block
+        BlockTransactionsRequest req;
+        req.blockhash = block.GetHash();
+        req.indexes.push_back(1);
+        req.indexes.push_back(3);
+        stream << req;
+
+        BlockTransactionsRequest req2;
+        stream >> req2;
+        BOOST_CHECK(req2.blockhash == req.blockhash);
+        BOOST_CHECK(req2.indexes == req.indexes);
+
+        std::vector<CTransaction> vtx_missing;
+        vtx_missing.push_back(block.vtx[1]);
+
+        CBlock block2;
+        BOOST_CHECK(partialBlock.FillBlock(block2, vtx_missing, std::vector<CScCertificate>()) == READ_STATUS_INVALID);
+    }
+
+    {
+        CBlockHeaderAndShortTxIDs shortIDs(block);
+        PartiallyDownloadedBlock partialBlock(&pool);
+        BOOST_CHECK(partialBlock.InitData(shortIDs) == READ_STATUS_OK);
+
+        std::vector<CTransaction> vtx_missing;
+        vtx_missing.push_back(block.vtx[1]);
+        vtx_missing.push_back(block.vtx[3]);
+
+        CBlock block2;
+        BOOST_CHECK(partialBlock.FillBlock(block2, vtx_missing, std::vector<CScCertificate>()) == READ_STATUS_OK);
+        BOOST_CHECK_EQUAL(block.GetHash().ToString(), block2.GetHash().ToString());
+        BOOST_CHECK_EQUAL(block.BuildMerkleTree().ToString(), block2.BuildMerkleTree().ToString());
+        BOOST_CHECK_EQUAL(block2.vtx.size(), 4);
+        BOOST_CHECK_EQUAL(block2.vcert.size(), 1);
+    }
+}
+
+BOOST_AUTO_TEST_CASE(MissingCertificateTest)
+{
+    CTxMemPool pool(CFeeRate(0));
+    CBlock block(BuildBlockTestCase());
+
+    for (size_t i = 1; i < block.vtx.size(); i++)
+        pool.addUnchecked(block.vtx[i].GetHash(), CTxMemPoolEntry(block.vtx[i], 0, 0, 0.0, 1));
+
+    CBlockHeaderAndShortTxIDs shortIDs(block);
+    PartiallyDownloadedBlock partialBlock(&pool);
+    BOOST_CHECK(partialBlock.InitData(shortIDs) == READ_STATUS_OK);
+    for (size_t i = 0; i < block.vtx.size(); i++)
+        BOOST_CHECK(partialBlock.IsTxAvailable(i));
+    BOOST_CHECK(!partialBlock.IsTxAvailable(block.vtx.size()));
+
+    // the wrong certificate makes for a different merkle root
+    CMutableScCertificate wrongCert(block.vcert[0]);
+    wrongCert.quality++;
+    PartiallyDownloadedBlock partialBlock2(&pool);
+    BOOST_CHECK(partialBlock2.InitData(shortIDs) == READ_STATUS_OK);
+    CBlock block2;
+    BOOST_CHECK(partialBlock2.FillBlock(block2, std::vector<CTransaction>(),
+                                        std::vector<CScCertificate>(1, CScCertificate(wrongCert))) == READ_STATUS_FAILED);
+
+    CBlock block3;
+    BOOST_CHECK(partialBlock.FillBlock(block3, std::vector<CTransaction>(), block.vcert) == READ_STATUS_OK);
+    BOOST_CHECK_EQUAL(block.GetHash().ToString(), block3.GetHash().ToString());
+    BOOST_CHECK_EQUAL(block.BuildMerkleTree().ToString(), block3.BuildMerkleTree().ToString());
+}
+
+class TestHeaderAndShortIDs : public CBlockHeaderAndShortTxIDs {
+public:
+    TestHeaderAndShortIDs(const CBlock& block) : CBlockHeaderAndShortTxIDs(block) {}
+
+    void SetShortTxID(size_t i, uint64_t shortID) { shorttxids[i] = shortID; }
+    uint64_t GetShortTxID(size_t i) const { return shorttxids[i]; }
+};
+
+BOOST_AUTO_TEST_CASE(ShortIDCollisionTest)
+{
+    CTxMemPool pool(CFeeRate(0));
+    CBlock block(BuildBlockTestCase());
+
+    for (size_t i = 1; i < block.vtx.size(); i++)
+        pool.addUnchecked(block.vtx[i].GetHash(), CTxMemPoolEntry(block.vtx[i], 0, 0, 0.0, 1));
+    pool.addUnchecked(block.vcert[0].GetHash(), CCertificateMemPoolEntry(block.vcert[0], 0, 0, 0.0, 1));
+
+    // the second and the third transactions share a short id, only they are requested
+    TestHeaderAndShortIDs shortIDs(block);
+    shortIDs.SetShortTxID(1, shortIDs.GetShortTxID(0));
+    PartiallyDownloadedBlock partialBlock(&pool);
+    BOOST_CHECK(partialBlock.InitData(shortIDs) == READ_STATUS_OK);
+    BOOST_CHECK( partialBlock.IsTxAvailable(0));
+    BOOST_CHECK(!partialBlock.IsTxAvailable(1));
+    BOOST_CHECK(!partialBlock.IsTxAvailable(2));
+    BOOST_CHECK( partialBlock.IsTxAvailable(3));
+    BOOST_CHECK( partialBlock.IsTxAvailable(4));
+
+    std::vector<CTransaction> vtx_missing;
+    vtx_missing.push_back(block.vtx[1]);
+    vtx_missing.push_back(block.vtx[2]);
+
+    CBlock block2;
+    BOOST_CHECK(partialBlock.FillBlock(block2, vtx_missing, std::vector<CScCertificate>()) == READ_STATUS_OK);
+    BOOST_CHECK_EQUAL(block.GetHash().ToString(), block2.GetHash().ToString());
+    BOOST_CHECK_EQUAL(block.BuildMerkleTree().ToString(), block2.BuildMerkleTree().ToString());
+}
+
+BOOST_AUTO_TEST_CASE(EmptyBlockRoundTripTest)
+{
+    CTxMemPool pool(CFeeRate(0));
+    CMutableTransaction coinbase;
+    coinbase.nVersion = TRANSPARENT_TX_VERSION;
+    coinbase.vin.resize(1);
+    coinbase.vin[0].scriptSig.resize(10);
+    coinbase.resizeOut(1);
+    coinbase.getOut(0).scriptPubKey = CScript() << OP_TRUE;
+    coinbase.getOut(0).nValue = 42;
+
+    CBlock block;
+    block.vtx.resize(1);
+    block.vtx[0] = coinbase;
+    block.nVersion = BLOCK_VERSION_SC_SUPPORT;
+    block.hashPrevBlock = GetRandHash();
+    block.nBits = 0x207fffff;
+    block.hashMerkleRoot = block.BuildMerkleTree();
+
+    CBlockHeaderAndShortTxIDs shortIDs(block);
+
+    CDataStream stream(SER_NETWORK, PROTOCOL_VERSION);
+    stream << shortIDs;
+
+    CBlockHeaderAndShortTxIDs shortIDs2;
+    stream >> shortIDs2;
+
+    PartiallyDownloadedBlock partialBlock(&pool);
+    BOOST_CHECK(partialBlock.InitData(shortIDs2) == READ_STATUS_OK);
+    BOOST_CHECK(partialBlock.IsTxAvailable(0));
+
+    CBlock block2;
+    BOOST_CHECK(partialBlock.FillBlock(block2, std::vector<CTransaction>(), std::vector<CScCertificate>()) == READ_STATUS_OK);
+    BOOST_CHECK_EQUAL(block.GetHash().ToString(), block2.GetHash().ToString());
+    BOOST_CHECK_EQUAL(block.BuildMerkleTree().ToString(), block2.BuildMerkleTree().ToString());
+}
+
+BOOST_AUTO_TEST_SUITE_END()
@@ -101,4 +101,41 @@ BOOST_AUTO_TEST_CASE(test_combiner_all)
     BOOST_CHECK(Test());
 }
 
+BOOST_AUTO_TEST_CASE(blocks_in_transit_limit)
+{
+    // until the download rate is known
+    BOOST_CHECK_EQUAL(GetBlocksInTransitLimit(0), MAX_BLOCKS_IN_TRANSIT_PER_PEER);
+    // as many blocks as delivered in BLOCK_DOWNLOAD_TARGET_TIME
+    BOOST_CHECK_EQUAL(GetBlocksInTransitLimit(1000000LL * BLOCK_DOWNLOAD_TARGET_TIME / 10), 10);
+    BOOST_CHECK_EQUAL(GetBlocksInTransitLimit(1000000LL * BLOCK_DOWNLOAD_TARGET_TIME / 10 + 1), 9);
+    // within the bounds
+    BOOST_CHECK_EQUAL(GetBlocksInTransitLimit(1), MAX_BLOCKS_IN_TRANSIT_PER_FAST_PEER);
+    BOOST_CHECK_EQUAL(GetBlocksInTransitLimit(-1), MAX_BLOCKS_IN_TRANSIT_PER_FAST_PEER);
+    BOOST_CHECK_EQUAL(GetBlocksInTransitLimit(1000000LL * BLOCK_DOWNLOAD_TARGET_TIME), MIN_BLOCKS_IN_TRANSIT_PER_PEER);
+    BOOST_CHECK_EQUAL(GetBlocksInTransitLimit(std::numeric_limits<int64_t>::max()), MIN_BLOCKS_IN_TRANSIT_PER_PEER);
+}
+
+BOOST_AUTO_TEST_CASE(stalled_block_takeover)
+{
+    const int64_t nMinTime = 1000000LL * BLOCK_REREQUEST_MIN_TIME;
+
+    // a peer whose latency isn't known takes over nothing
+    BOOST_CHECK(!IsBlockStalled(100 * nMinTime, 1000000, 0));
+    // nor from a peer at least as fast
+    BOOST_CHECK(!IsBlockStalled(100 * nMinTime, 100000, 100000));
+    BOOST_CHECK(!IsBlockStalled(100 * nMinTime, 100000, 200000));
+
+    // a fast peer waits for BLOCK_REREQUEST_MIN_TIME at least
+    BOOST_CHECK(!IsBlockStalled(nMinTime - 1, 1000, 100));
+    BOOST_CHECK( IsBlockStalled(nMinTime, 1000, 100));
+    // a peer whose latency isn't known as well
+    BOOST_CHECK(!IsBlockStalled(nMinTime - 1, 0, 100));
+    BOOST_CHECK( IsBlockStalled(nMinTime, 0, 100));
+
+    // a slow peer for BLOCK_REREQUEST_LATENCY_FACTOR times its latency
+    const int64_t nLatency = nMinTime;
+    BOOST_CHECK(!IsBlockStalled(BLOCK_REREQUEST_LATENCY_FACTOR * nLatency - 1, nLatency, 100));
+    BOOST_CHECK( IsBlockStalled(BLOCK_REREQUEST_LATENCY_FACTOR * nLatency, nLatency, 100));
+}
+
 BOOST_AUTO_TEST_SUITE_END()
@@ -0,0 +1,148 @@
+// Copyright (c) 2017 The Zen Core developers
+// Distributed under the MIT software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#include "arith_uint256.h"
+#include "streams.h"
+#include "txreconciliation.h"
+#include "version.h"
+
+#include "test/test_bitcoin.h"
+
+#include <algorithm>
+
+#include <boost/test/unit_test.hpp>
+
+BOOST_FIXTURE_TEST_SUITE(txreconciliation_tests, BasicTestingSetup)
+
+// The sketches fail now and then by design, the tests use fixed data
+static uint32_t TestShortID(uint32_t n)
+{
+    return n * 0x9e3779b1 + 0x7f4a7c15;
+}
+
+static uint256 TestHash(uint32_t n)
+{
+    return ArithToUint256(arith_uint256(n) * 0x9e3779b1 + 1);
+}
+
+static std::vector<uint32_t> Sorted(std::vector<uint32_t> v)
+{
+    std::sort(v.begin(), v.end());
+    return v;
+}
+
+BOOST_AUTO_TEST_CASE(sketch_difference)
+{
+    std::vector<uint32_t> vCommon, vOnlyA, vOnlyB;
+    for (uint32_t i = 0; i < 1000; i++)
+        vCommon.push_back(TestShortID(i));
+    for (uint32_t i = 1000; i < 1030; i++)
+        vOnlyA.push_back(TestShortID(i));
+    for (uint32_t i = 1030; i < 1050; i++)
+        vOnlyB.push_back(TestShortID(i));
+
+    uint32_t nCells = CShortIdSketch::CellsForDifference(vOnlyA.size() + vOnlyB.size());
+    CShortIdSketch sketchA(nCells), sketchB(nCells);
+    for (uint32_t n : vCommon) {
+        sketchA.Add(n);
+        sketchB.Add(n);
+    }
+    for (uint32_t n : vOnlyA)
+        sketchA.Add(n);
+    for (uint32_t n : vOnlyB)
+        sketchB.Add(n);
+
+    // the sketch goes over the wire
+    CDataStream ss(SER_NETWORK, PROTOCOL_VERSION);
+    ss << sketchB;
+    CShortIdSketch sketchB2;
+    ss >> sketchB2;
+    BOOST_CHECK(sketchB2.IsValid());
+    BOOST_CHECK_EQUAL(sketchB2.GetCells(), nCells);
+
+    sketchA.Subtract(sketchB2);
+    std::vector<uint32_t> vHere, vThere;
+    BOOST_CHECK(sketchA.Decode(vHere, vThere));
+    BOOST_CHECK(Sorted(vHere) == Sorted(vOnlyA));
+    BOOST_CHECK(Sorted(vThere) == Sorted(vOnlyB));
+
+    // a difference much larger than the sketch doesn't decode
+    CShortIdSketch sketchSmall(CShortIdSketch::CellsForDifference(5));
+    for (uint32_t n : vCommon)
+        sketchSmall.Add(n);
+    BOOST_CHECK(!sketchSmall.Decode(vHere, vThere));
+
+    BOOST_CHECK(!CShortIdSketch().IsValid());
+    BOOST_CHECK(!CShortIdSketch(MAX_SKETCH_CELLS + 3).IsValid());
+}
+
+BOOST_AUTO_TEST_CASE(reconciliation_round)
+{
+    CTxReconciliationState initiator, responder;
+    initiator.nLocalSalt = responder.nRemoteSalt = 1234;
+    initiator.nRemoteSalt = responder.nLocalSalt = 5678;
+    initiator.Enable(true, false, 0);
+    responder.Enable(false, false, 0);
+    BOOST_CHECK_EQUAL(initiator.GetShortID(uint256S("1")), responder.GetShortID(uint256S("1")));
+
+    std::set<uint256> setOnlyInitiator, setOnlyResponder;
+    uint32_t n = 0;
+    for (int i = 0; i < 200; i++) {
+        uint256 hash = TestHash(n++);
+        initiator.setToAnnounce.insert(hash);
+        responder.setToAnnounce.insert(hash);
+    }
+    for (int i = 0; i < 10; i++) {
+        uint256 hash = TestHash(n++);
+        initiator.setToAnnounce.insert(hash);
+        setOnlyInitiator.insert(hash);
+    }
+    for (int i = 0; i < 15; i++) {
+        uint256 hash = TestHash(n++);
+        responder.setToAnnounce.insert(hash);
+        setOnlyResponder.insert(hash);
+    }
+
+    size_t nInitiatorSize = initiator.setToAnnounce.size();
+    size_t nResponderSize = responder.setToAnnounce.size();
+    // a q large enough for this difference
+    initiator.nQ = RECON_Q_PRECISION;
+    initiator.StartRequest(0);
+    BOOST_CHECK(initiator.setToAnnounce.empty());
+    BOOST_CHECK_EQUAL(initiator.nNextRequest, RECON_REQUEST_INTERVAL);
+
+    CShortIdSketch sketch = responder.Respond(nInitiatorSize, initiator.nQ);
+    BOOST_CHECK(sketch.IsValid());
+
+    std::vector<uint256> vAnnounce;
+    std::vector<uint32_t> vAsk;
+    BOOST_CHECK(initiator.FinishRequest(sketch, nResponderSize, vAnnounce, vAsk));
+    BOOST_CHECK(std::set<uint256>(vAnnounce.begin(), vAnnounce.end()) == setOnlyInitiator);
+    BOOST_CHECK_EQUAL(vAsk.size(), setOnlyResponder.size());
+    BOOST_CHECK(!initiator.fReconciling);
+    // q follows the difference observed
+    BOOST_CHECK(initiator.nQ < RECON_Q_PRECISION);
+
+    responder.FinishResponse(true, vAsk, vAnnounce);
+    BOOST_CHECK(std::set<uint256>(vAnnounce.begin(), vAnnounce.end()) == setOnlyResponder);
+    BOOST_CHECK(!responder.fReconciling);
+    BOOST_CHECK(responder.setReconciling.empty());
+
+    // on failure both sides announce everything
+    for (int i = 0; i < 50; i++) {
+        initiator.setToAnnounce.insert(TestHash(n++));
+        responder.setToAnnounce.insert(TestHash(n++));
+    }
+    initiator.nQ = 0;
+    initiator.StartRequest(RECON_REQUEST_INTERVAL);
+    sketch = responder.Respond(50, initiator.nQ);
+    BOOST_CHECK(!initiator.FinishRequest(sketch, 50, vAnnounce, vAsk));
+    BOOST_CHECK_EQUAL(vAnnounce.size(), 50U);
+    BOOST_CHECK(vAsk.empty());
+    BOOST_CHECK(initiator.nQ > 0);
+    responder.FinishResponse(false, vAsk, vAnnounce);
+    BOOST_CHECK_EQUAL(vAnnounce.size(), 50U);
+}
+
+BOOST_AUTO_TEST_SUITE_END()
@@ -0,0 +1,251 @@
+// Copyright (c) 2017 The Zen Core developers
+// Distributed under the MIT software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#include "txreconciliation.h"
+#include "crypto/common.h"
+#include "hash.h"
+
+#include <algorithm>
+#include <assert.h>
+
+// Finalizer of MurmurHash3, the short ids are already uniform so mixing them
+// is enough to place them in the cells.
+static inline uint32_t MixShortID(uint32_t n)
+{
+    n ^= n >> 16;
+    n *= 0x85ebca6b;
+    n ^= n >> 13;
+    n *= 0xc2b2ae35;
+    n ^= n >> 16;
+    return n;
+}
+
+static inline uint32_t CheckSum(uint32_t nShortID)
+{
+    return MixShortID(nShortID ^ 0x5bd1e995);
+}
+
+static inline size_t CellIndex(uint32_t nShortID, unsigned int nTable, size_t nTableSize)
+{
+    return nTable * nTableSize + MixShortID(nShortID + 0x9e3779b9 * (nTable + 1)) % nTableSize;
+}
+
+uint32_t CShortIdSketch::CellsForDifference(size_t nDifference)
+{
+    // Peeling a table of three hashes succeeds from about 1.25 cells per id
+    // for large differences, small ones need room against collisions: this
+    // fails about once in fifty.
+    size_t nCells = nDifference + nDifference / 2 + 30;
+    nCells += (3 - nCells % 3) % 3;
+    return nCells;
+}
+
+CShortIdSketch::CShortIdSketch(uint32_t nCells) : vCells(nCells)
+{
+    assert(nCells % 3 == 0);
+}
+
+bool CShortIdSketch::IsValid() const
+{
+    return !vCells.empty() && vCells.size() % 3 == 0 && vCells.size() <= MAX_SKETCH_CELLS;
+}
+
+void CShortIdSketch::Toggle(uint32_t nShortID, int32_t nCount)
+{
+    const size_t nTableSize = vCells.size() / 3;
+    const uint32_t nCheckSum = CheckSum(nShortID);
+    for (unsigned int i = 0; i < 3; i++) {
+        Cell& cell = vCells[CellIndex(nShortID, i, nTableSize)];
+        cell.nCount += nCount;
+        cell.nIdSum ^= nShortID;
+        cell.nCheckSum ^= nCheckSum;
+    }
+}
+
+bool CShortIdSketch::IsPure(const Cell& cell) const
+{
+    return (cell.nCount == 1 || cell.nCount == -1) && cell.nCheckSum == CheckSum(cell.nIdSum);
+}
+
+void CShortIdSketch::Subtract(const CShortIdSketch& other)
+{
+    assert(vCells.size() == other.vCells.size());
+    for (size_t i = 0; i < vCells.size(); i++) {
+        vCells[i].nCount -= other.vCells[i].nCount;
+        vCells[i].nIdSum ^= other.vCells[i].nIdSum;
+        vCells[i].nCheckSum ^= other.vCells[i].nCheckSum;
+    }
+}
+
+bool CShortIdSketch::Decode(std::vector<uint32_t>& vOnlyHere, std::vector<uint32_t>& vOnlyThere) const
+{
+    vOnlyHere.clear();
+    vOnlyThere.clear();
+    if (vCells.empty() || vCells.size() % 3 != 0)
+        return false;
+
+    // Peel the cells holding a single id, which may free others
+    CShortIdSketch sketch(*this);
+    const size_t nTableSize = vCells.size() / 3;
+    std::vector<size_t> vPure;
+    for (size_t i = 0; i < sketch.vCells.size(); i++) {
+        if (sketch.IsPure(sketch.vCells[i]))
+            vPure.push_back(i);
+    }
+
+    // a checksum collision could make it go round in circles
+    size_t nPeeled = 0;
+    while (!vPure.empty() && nPeeled <= vCells.size()) {
+        const Cell cell = sketch.vCells[vPure.back()];
+        vPure.pop_back();
+        if (!sketch.IsPure(cell))
+            continue;
+
+        (cell.nCount > 0 ? vOnlyHere : vOnlyThere).push_back(cell.nIdSum);
+        sketch.Toggle(cell.nIdSum, -cell.nCount);
+        nPeeled++;
+        for (unsigned int i = 0; i < 3; i++) {
+            size_t nIndex = CellIndex(cell.nIdSum, i, nTableSize);
+            if (sketch.IsPure(sketch.vCells[nIndex]))
+                vPure.push_back(nIndex);
+        }
+    }
+
+    for (size_t i = 0; i < sketch.vCells.size(); i++) {
+        const Cell& cell = sketch.vCells[i];
+        if (cell.nCount != 0 || cell.nIdSum != 0 || cell.nCheckSum != 0)
+            return false;
+    }
+    return true;
+}
+
+size_t EstimateReconDifference(size_t nLocal, size_t nRemote, uint16_t nQ)
+{
+    size_t nMin = std::min(nLocal, nRemote);
+    size_t nMax = std::max(nLocal, nRemote);
+    return nMax - nMin + (nMin * nQ) / RECON_Q_PRECISION + 1;
+}
+
+CTxReconciliationState::CTxReconciliationState() :
+    nLocalSalt(0), nRemoteSalt(0), fEnabled(false), fInitiator(false), fFlood(false),
+    fReconciling(false), nNextRequest(0), nRequestTime(0), nQ(DEFAULT_RECON_Q), k0(0), k1(0)
+{
+}
+
+void CTxReconciliationState::Enable(bool fInitiatorIn, bool fFloodIn, int64_t nNow)
+{
+    // both ends get the same keys whatever the order of the salts
+    uint256 hashSalt = (CHashWriter(SER_GETHASH, 0) << std::min(nLocalSalt, nRemoteSalt)
+                                                    << std::max(nLocalSalt, nRemoteSalt)).GetHash();
+    k0 = ReadLE64(hashSalt.begin());
+    k1 = ReadLE64(hashSalt.begin() + 8);
+
+    fEnabled = true;
+    fInitiator = fInitiatorIn;
+    fFlood = fFloodIn;
+    nNextRequest = nNow + RECON_REQUEST_INTERVAL;
+}
+
+uint32_t CTxReconciliationState::GetShortID(const uint256& hash) const
+{
+    return SipHashUint256(k0, k1, hash) & 0xffffffff;
+}
+
+CShortIdSketch CTxReconciliationState::GetSketch(const std::set<uint256>& setHashes, uint32_t nCells) const
+{
+    CShortIdSketch sketch(nCells);
+    for (const uint256& hash : setHashes)
+        sketch.Add(GetShortID(hash));
+    return sketch;
+}
+
+void CTxReconciliationState::StartRequest(int64_t nNow)
+{
+    assert(fInitiator && !fReconciling);
+    setReconciling.swap(setToAnnounce);
+    setToAnnounce.clear();
+    fReconciling = true;
+    nRequestTime = nNow;
+    nNextRequest = nNow + RECON_REQUEST_INTERVAL;
+}
+
+bool CTxReconciliationState::FinishRequest(const CShortIdSketch& sketchRemote, size_t nRemoteSize,
+                                           std::vector<uint256>& vAnnounce, std::vector<uint32_t>& vAsk)
+{
+    assert(fInitiator && fReconciling);
+    vAnnounce.clear();
+    vAsk.clear();
+
+    std::vector<uint32_t> vOnlyHere;
+    bool fSuccess = false;
+    if (sketchRemote.IsValid()) {
+        CShortIdSketch sketch = GetSketch(setReconciling, sketchRemote.GetCells());
+        sketch.Subtract(sketchRemote);
+        fSuccess = sketch.Decode(vOnlyHere, vAsk);
+    }
+
+    if (fSuccess) {
+        std::set<uint32_t> setOnlyHere(vOnlyHere.begin(), vOnlyHere.end());
+        for (const uint256& hash : setReconciling) {
+            if (setOnlyHere.count(GetShortID(hash)))
+                vAnnounce.push_back(hash);
+        }
+
+        // q is what the difference was on top of the difference in size
+        size_t nMin = std::min(setReconciling.size(), nRemoteSize);
+        size_t nSizeDifference = std::max(setReconciling.size(), nRemoteSize) - nMin;
+        size_t nDifference = vOnlyHere.size() + vAsk.size();
+        if (nMin > 0 && nDifference >= nSizeDifference)
+            nQ = std::min<size_t>((nDifference - nSizeDifference) * RECON_Q_PRECISION / nMin, RECON_Q_PRECISION);
+    } else {
+        vAsk.clear();
+        vAnnounce.assign(setReconciling.begin(), setReconciling.end());
+        nQ = std::min<int>(nQ * 2 + 1, RECON_Q_PRECISION);
+    }
+
+    setReconciling.clear();
+    fReconciling = false;
+    return fSuccess;
+}
+
+void CTxReconciliationState::AbortRequest(std::vector<uint256>& vAnnounce)
+{
+    vAnnounce.assign(setReconciling.begin(), setReconciling.end());
+    setReconciling.clear();
+    fReconciling = false;
+}
+
+CShortIdSketch CTxReconciliationState::Respond(size_t nRemoteSize, uint16_t nRemoteQ)
+{
+    assert(!fInitiator && !fReconciling);
+    setReconciling.swap(setToAnnounce);
+    setToAnnounce.clear();
+    fReconciling = true;
+
+    uint32_t nCells = CShortIdSketch::CellsForDifference(
+        EstimateReconDifference(setReconciling.size(), nRemoteSize, std::min(nRemoteQ, RECON_Q_PRECISION)));
+    if (nCells > MAX_SKETCH_CELLS)
+        return CShortIdSketch();
+    return GetSketch(setReconciling, nCells);
+}
+
+void CTxReconciliationState::FinishResponse(bool fSuccess, const std::vector<uint32_t>& vAsk, std::vector<uint256>& vAnnounce)
+{
+    vAnnounce.clear();
+    if (!fReconciling)
+        return;
+
+    if (fSuccess) {
+        std::set<uint32_t> setAsk(vAsk.begin(), vAsk.end());
+        for (const uint256& hash : setReconciling) {
+            if (setAsk.count(GetShortID(hash)))
+                vAnnounce.push_back(hash);
+        }
+    } else {
+        vAnnounce.assign(setReconciling.begin(), setReconciling.end());
+    }
+
+    setReconciling.clear();
+    fReconciling = false;
+}
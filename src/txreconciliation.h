@@ -0,0 +1,172 @@
+// Copyright (c) 2017 The Zen Core developers
+// Distributed under the MIT software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#ifndef BITCOIN_TXRECONCILIATION_H
+#define BITCOIN_TXRECONCILIATION_H
+
+#include "serialize.h"
+#include "uint256.h"
+
+#include <set>
+#include <stdint.h>
+#include <vector>
+
+/**
+ * Set reconciliation of transaction announcements, after BIP 330 (Erlay).
+ *
+ * Instead of an inv for every transaction, the two ends of a connection
+ * reconcile the sets of transactions each would have announced to the other
+ * since the last time. Peers supporting it send "sendrecon" before "verack";
+ * the side which opened the connection then asks for a reconciliation every
+ * RECON_REQUEST_INTERVAL seconds with "reqrecon", the other side replies
+ * with a "sketch" of its set and the initiator, having found the difference,
+ * announces what the responder is missing and asks with "reconcildiff" for
+ * what it is missing. If the difference can't be found both sides announce
+ * their whole set. Transactions are still flooded to a few outbound peers,
+ * so that they spread quickly.
+ *
+ * The sketches are invertible bloom lookup tables over 32 bits short ids,
+ * salted per connection: the difference of the sketches of two sets decodes
+ * to the difference of the sets, as long as it isn't much larger than the
+ * number of cells.
+ */
+
+/** Default for -txreconciliation */
+static const bool DEFAULT_TXRECONCILIATION = true;
+/** Version of the reconciliation protocol sent in sendrecon */
+static const uint32_t TXRECONCILIATION_VERSION = 1;
+/** Number of outbound peers transactions are still flooded to */
+static const int MAX_TX_FLOOD_OUTBOUND_PEERS = 2;
+/** Interval between two reconciliations asked to the same peer, in seconds */
+static const int64_t RECON_REQUEST_INTERVAL = 8;
+/** Time after which a reconciliation left without reply is given up, in seconds */
+static const int64_t RECON_RESPONSE_TIMEOUT = 60;
+/** Transactions waiting for a reconciliation at most, past that they are flooded */
+static const size_t MAX_RECON_SET_SIZE = 4000;
+/** Largest sketch sent, a larger difference is announced with invs */
+static const uint32_t MAX_SKETCH_CELLS = 3 * 1000;
+/** Fixed point precision of q, the part of the smaller set expected to differ */
+static const uint16_t RECON_Q_PRECISION = 1 << 14;
+/** Initial q, one in four transactions */
+static const uint16_t DEFAULT_RECON_Q = RECON_Q_PRECISION / 4;
+
+/** A set of short ids which can be subtracted from another one of the same size. */
+class CShortIdSketch
+{
+private:
+    struct Cell {
+        int32_t nCount;
+        uint32_t nIdSum;
+        uint32_t nCheckSum;
+
+        Cell() : nCount(0), nIdSum(0), nCheckSum(0) {}
+
+        ADD_SERIALIZE_METHODS;
+
+        template <typename Stream, typename Operation>
+        inline void SerializationOp(Stream& s, Operation ser_action, int nType, int nVersion) {
+            READWRITE(nCount);
+            READWRITE(nIdSum);
+            READWRITE(nCheckSum);
+        }
+    };
+
+    /** Three subtables of equal size, every id lands in one cell of each */
+    std::vector<Cell> vCells;
+
+    void Toggle(uint32_t nShortID, int32_t nCount);
+    bool IsPure(const Cell& cell) const;
+
+public:
+    /** Number of cells needed to decode a difference of nDifference ids. */
+    static uint32_t CellsForDifference(size_t nDifference);
+
+    CShortIdSketch() {}
+    CShortIdSketch(uint32_t nCells);
+
+    size_t GetCells() const { return vCells.size(); }
+    /** Whether it can be used at all: a multiple of 3 cells, up to MAX_SKETCH_CELLS. */
+    bool IsValid() const;
+
+    void Add(uint32_t nShortID) { Toggle(nShortID, 1); }
+    /** Subtract a sketch of the same size, the ids in both cancel out. */
+    void Subtract(const CShortIdSketch& other);
+    /**
+     * Split the ids left after Subtract() into the ones only added to this
+     * sketch and the ones only added to the other. Returns false if the
+     * difference was too large for the sketch.
+     */
+    bool Decode(std::vector<uint32_t>& vOnlyHere, std::vector<uint32_t>& vOnlyThere) const;
+
+    ADD_SERIALIZE_METHODS;
+
+    template <typename Stream, typename Operation>
+    inline void SerializationOp(Stream& s, Operation ser_action, int nType, int nVersion) {
+        READWRITE(vCells);
+    }
+};
+
+/** Capacity needed for the difference between sets of nLocal and nRemote transactions. */
+size_t EstimateReconDifference(size_t nLocal, size_t nRemote, uint16_t nQ);
+
+/**
+ * Reconciliation with one peer, guarded by cs_inventory of its CNode. The
+ * initiator goes through StartRequest() and FinishRequest(), the responder
+ * through Respond() and FinishResponse().
+ */
+class CTxReconciliationState
+{
+public:
+    /** Salt sent in sendrecon, 0 if it wasn't */
+    uint64_t nLocalSalt;
+    /** Salt received in sendrecon, 0 if it wasn't */
+    uint64_t nRemoteSalt;
+    /** Both sides sent sendrecon */
+    bool fEnabled;
+    /** We ask for the reconciliations, on outbound connections */
+    bool fInitiator;
+    /** Transactions are still flooded to this peer */
+    bool fFlood;
+
+    /** Transactions to announce with the next reconciliation */
+    std::set<uint256> setToAnnounce;
+    /** Transactions of the reconciliation in progress */
+    std::set<uint256> setReconciling;
+    bool fReconciling;
+    int64_t nNextRequest;
+    int64_t nRequestTime;
+    uint16_t nQ;
+
+    CTxReconciliationState();
+
+    void Enable(bool fInitiatorIn, bool fFloodIn, int64_t nNow);
+    uint32_t GetShortID(const uint256& hash) const;
+
+    /** Initiator: move the transactions to announce to the reconciliation. */
+    void StartRequest(int64_t nNow);
+    /**
+     * Initiator: find the difference with the sketch of the responder. On
+     * success vAnnounce are the transactions the peer is missing and vAsk
+     * the short ids we are missing, otherwise vAnnounce is the whole set.
+     */
+    bool FinishRequest(const CShortIdSketch& sketchRemote, size_t nRemoteSize,
+                       std::vector<uint256>& vAnnounce, std::vector<uint32_t>& vAsk);
+    /** Initiator: give up the reconciliation in progress, vAnnounce is the whole set. */
+    void AbortRequest(std::vector<uint256>& vAnnounce);
+
+    /**
+     * Responder: sketch the transactions to announce for a request. An empty
+     * sketch if the difference is expected to be too large.
+     */
+    CShortIdSketch Respond(size_t nRemoteSize, uint16_t nRemoteQ);
+    /** Responder: the transactions the initiator asked for, all of them if it failed. */
+    void FinishResponse(bool fSuccess, const std::vector<uint32_t>& vAsk, std::vector<uint256>& vAnnounce);
+
+private:
+    uint64_t k0, k1;
+
+    CShortIdSketch GetSketch(const std::set<uint256>& setHashes, uint32_t nCells) const;
+};
+
+#endif // BITCOIN_TXRECONCILIATION_H
@@ -1,11 +1,20 @@
 #include <openssl/conf.h>
 #include <openssl/ssl.h>
 #include <openssl/err.h>
+#include <openssl/rand.h>
+#if OPENSSL_VERSION_NUMBER >= 0x30000000L
+#include <openssl/core_names.h>
+#else
+#include <openssl/hmac.h>
+#endif
 
 #ifndef HEADER_DH_H
 #include <openssl/dh.h>
 #endif
 
+#include <list>
+#include <map>
+
 #include <boost/filesystem.hpp>
 #include <boost/thread.hpp>
 
@@ -156,6 +165,171 @@ static void dumpCertificateDebugInfo(int preverify_ok, X509_STORE_CTX* chainCont
     }
 }
 
+/** Maximum number of client sessions kept for resumption, one per peer address */
+static const size_t MAX_TLS_CLIENT_SESSIONS = 1000;
+/** Time in seconds a session ticket key is used to issue tickets; they are accepted for as long again */
+static const int64_t TLS_TICKET_KEY_LIFETIME = 3600;
+
+// Client side sessions by peer address, each to be resumed once by the next connection to the peer
+static std::map<std::string, SSL_SESSION*> mapClientSessions;
+static std::list<std::string> listClientSessions; // oldest first
+static CCriticalSection cs_clientSessions;
+// index of the peer address of an outgoing connection in the ex_data of its SSL
+static int nSessionAddrIndex = -1;
+
+static void freeSessionAddr(void* parent, void* ptr, CRYPTO_EX_DATA* ad, int idx, long argl, void* argp)
+{
+    delete static_cast<std::string*>(ptr);
+}
+
+/** Take the session to resume for a peer address out of the cache, NULL if there is none */
+static SSL_SESSION* takeClientSession(const std::string& strAddr)
+{
+    LOCK(cs_clientSessions);
+
+    std::map<std::string, SSL_SESSION*>::iterator it = mapClientSessions.find(strAddr);
+    if (it == mapClientSessions.end())
+        return NULL;
+
+    SSL_SESSION* session = it->second;
+    mapClientSessions.erase(it);
+    listClientSessions.remove(strAddr);
+
+    if (SSL_SESSION_get_time(session) + SSL_SESSION_get_timeout(session) < GetTime()) {
+        SSL_SESSION_free(session);
+        return NULL;
+    }
+    return session;
+}
+
+/**
+ * @brief Called by OpenSSL for every new session of an outgoing connection, during the handshake
+ * with TLS 1.2, when a ticket comes in afterwards with TLS 1.3.
+ * 
+ * @return int 1 when the session is kept, 0 otherwise.
+ */
+static int tlsNewSessionCallback(SSL* ssl, SSL_SESSION* session)
+{
+    const std::string* pstrAddr = static_cast<const std::string*>(SSL_get_ex_data(ssl, nSessionAddrIndex));
+    if (pstrAddr == NULL || !SSL_SESSION_is_resumable(session))
+        return 0;
+
+    LOCK(cs_clientSessions);
+
+    std::map<std::string, SSL_SESSION*>::iterator it = mapClientSessions.find(*pstrAddr);
+    if (it != mapClientSessions.end()) {
+        // a later ticket of the same connection
+        SSL_SESSION_free(it->second);
+        it->second = session;
+        return 1;
+    }
+
+    while (mapClientSessions.size() >= MAX_TLS_CLIENT_SESSIONS) {
+        it = mapClientSessions.find(listClientSessions.front());
+        SSL_SESSION_free(it->second);
+        mapClientSessions.erase(it);
+        listClientSessions.pop_front();
+    }
+    mapClientSessions[*pstrAddr] = session;
+    listClientSessions.push_back(*pstrAddr);
+    return 1;
+}
+
+typedef struct _TLS_TICKET_KEY {
+    unsigned char name[16];
+    unsigned char aesKey[32];
+    unsigned char hmacKey[32];
+    int64_t nTime; // time in sec the key was made, 0 for none
+} TLS_TICKET_KEY;
+
+// Keys of the session tickets issued by the server: the current one and the one it replaced
+static TLS_TICKET_KEY ticketKeyCurrent = {};
+static TLS_TICKET_KEY ticketKeyPrevious = {};
+static CCriticalSection cs_ticketKeys;
+
+static bool newTicketKey(TLS_TICKET_KEY& key)
+{
+    if (RAND_bytes(key.name, sizeof(key.name)) != 1 ||
+        RAND_bytes(key.aesKey, sizeof(key.aesKey)) != 1 ||
+        RAND_bytes(key.hmacKey, sizeof(key.hmacKey)) != 1)
+        return false;
+    key.nTime = GetTime();
+    return true;
+}
+
+// HMAC_Init_ex() is deprecated since OpenSSL 3.0, the tickets are authenticated through EVP_MAC then
+#if OPENSSL_VERSION_NUMBER >= 0x30000000L
+typedef EVP_MAC_CTX TLS_TICKET_MAC_CTX;
+
+static bool initTicketMac(EVP_MAC_CTX* hctx, const TLS_TICKET_KEY& key)
+{
+    OSSL_PARAM params[2];
+    params[0] = OSSL_PARAM_construct_utf8_string(OSSL_MAC_PARAM_DIGEST, const_cast<char*>("SHA256"), 0);
+    params[1] = OSSL_PARAM_construct_end();
+    return EVP_MAC_init(hctx, key.hmacKey, sizeof(key.hmacKey), params) == 1;
+}
+#else
+typedef HMAC_CTX TLS_TICKET_MAC_CTX;
+
+static bool initTicketMac(HMAC_CTX* hctx, const TLS_TICKET_KEY& key)
+{
+    return HMAC_Init_ex(hctx, key.hmacKey, sizeof(key.hmacKey), EVP_sha256(), NULL) == 1;
+}
+#endif
+
+/**
+ * @brief Encrypts the session tickets issued by the server and decrypts the ones
+ * presented by clients. The key is replaced every TLS_TICKET_KEY_LIFETIME,
+ * tickets of the previous key are still accepted and renewed.
+ * 
+ * @param enc 1 to issue a ticket, 0 to open one.
+ * @return int 1 on success, 2 if the ticket should be renewed, 0 when a ticket
+ * can't be opened (then a full handshake is done) and -1 on error.
+ */
+static int tlsTicketKeyCallback(SSL* ssl, unsigned char* key_name, unsigned char* iv,
+                                EVP_CIPHER_CTX* ctx, TLS_TICKET_MAC_CTX* hctx, int enc)
+{
+    LOCK(cs_ticketKeys);
+
+    int64_t nNow = GetTime();
+
+    if (enc) {
+        if (nNow - ticketKeyCurrent.nTime >= TLS_TICKET_KEY_LIFETIME) {
+            TLS_TICKET_KEY key;
+            if (!newTicketKey(key)) {
+                LogPrintf("TLS: ERROR: %s: %s():%d - failed to make a session ticket key\n", __FILE__, __func__, __LINE__);
+                return -1;
+            }
+            ticketKeyPrevious = ticketKeyCurrent;
+            ticketKeyCurrent = key;
+            LogPrint("tls", "TLS: session ticket key replaced\n");
+        }
+
+        if (RAND_bytes(iv, EVP_MAX_IV_LENGTH) != 1)
+            return -1;
+        memcpy(key_name, ticketKeyCurrent.name, sizeof(ticketKeyCurrent.name));
+        if (!EVP_EncryptInit_ex(ctx, EVP_aes_256_cbc(), NULL, ticketKeyCurrent.aesKey, iv) ||
+            !initTicketMac(hctx, ticketKeyCurrent))
+            return -1;
+        return 1;
+    }
+
+    const TLS_TICKET_KEY* pkey = NULL;
+    if (ticketKeyCurrent.nTime != 0 && memcmp(key_name, ticketKeyCurrent.name, sizeof(ticketKeyCurrent.name)) == 0)
+        pkey = &ticketKeyCurrent;
+    else if (ticketKeyPrevious.nTime != 0 && nNow - ticketKeyPrevious.nTime < 2 * TLS_TICKET_KEY_LIFETIME &&
+             memcmp(key_name, ticketKeyPrevious.name, sizeof(ticketKeyPrevious.name)) == 0)
+        pkey = &ticketKeyPrevious;
+
+    if (pkey == NULL)
+        return 0;
+
+    if (!initTicketMac(hctx, *pkey) ||
+        !EVP_DecryptInit_ex(ctx, EVP_aes_256_cbc(), NULL, pkey->aesKey, iv))
+        return -1;
+    return pkey == &ticketKeyCurrent ? 1 : 2;
+}
+
 /**
 * @brief If verify_callback always returns 1, the TLS/SSL handshake will not be terminated with respect to verification failures and the connection will be established.
 * 
@@ -286,14 +460,8 @@ int TLSManager::waitFor(SSLConnectionRoutine eRoutine, SOCKET hSocket, SSL* ssl,
             break;
         }
 
-        fd_set socketSet;
-        FD_ZERO(&socketSet);
-        FD_SET(hSocket, &socketSet);
-
-        struct timeval timeout = {timeoutSec, 0};
-
         if (sslErr == SSL_ERROR_WANT_READ) {
-            int result = select(hSocket + 1, &socketSet, NULL, NULL, &timeout);
+            int result = WaitForSocket(hSocket, false, timeoutSec * 1000);
             if (result == 0) {
                 LogPrint("tls", "TLS: ERROR: %s: %s():%d - WANT_READ timeout on %s\n", __FILE__, __func__, __LINE__,
                     (eRoutine == SSL_CONNECT ? "SSL_CONNECT" : 
@@ -308,7 +476,7 @@ int TLSManager::waitFor(SSLConnectionRoutine eRoutine, SOCKET hSocket, SSL* ssl,
                 break;
             }
         } else {
-            int result = select(hSocket + 1, NULL, &socketSet, NULL, &timeout);
+            int result = WaitForSocket(hSocket, true, timeoutSec * 1000);
             if (result == 0) {
                 LogPrint("tls", "TLS: ERROR: %s: %s():%d - WANT_WRITE timeout on %s\n", __FILE__, __func__, __LINE__,
                     (eRoutine == SSL_CONNECT ? "SSL_CONNECT" : 
@@ -329,7 +497,8 @@ int TLSManager::waitFor(SSLConnectionRoutine eRoutine, SOCKET hSocket, SSL* ssl,
 }
 
 /**
- * @brief establish TLS connection to an address
+ * @brief start a TLS connection to an address. The handshake is not waited
+ * for, the socket thread goes on with it (see handshake()).
  * 
  * @param hSocket socket
  * @param addrConnect the outgoing address
@@ -342,38 +511,31 @@ SSL* TLSManager::connect(SOCKET hSocket, const CAddress& addrConnect, unsigned l
 
     err_code = 0;
     SSL* ssl = NULL;
-    bool bConnectedTLS = false;
 
     if ((ssl = SSL_new(tls_ctx_client))) {
         if (SSL_set_fd(ssl, hSocket)) {
-            int ret = TLSManager::waitFor(SSL_CONNECT, hSocket, ssl, (DEFAULT_CONNECT_TIMEOUT / 1000), err_code);
-            if (ret == 1)
-            {
-                bConnectedTLS = true;
+            SSL_set_connect_state(ssl);
+
+            // resume the last session with the peer, which skips the certificates
+            std::string strAddr = addrConnect.ToStringIPPort();
+            SSL_SESSION* session = takeClientSession(strAddr);
+            if (session) {
+                if (SSL_set_session(ssl, session))
+                    LogPrint("tls", "TLS: resuming session with %s\n", strAddr);
+                SSL_SESSION_free(session);
             }
+            SSL_set_ex_data(ssl, nSessionAddrIndex, new std::string(strAddr));
+            return ssl;
         }
-    }
-    else
-    {
-        err_code = ERR_get_error();
-        const char* error_str = ERR_error_string(err_code, NULL);
-        LogPrint("tls", "TLS: %s: %s():%d - SSL_new failed err: %s\n",
-            __FILE__, __func__, __LINE__, error_str);
+        SSL_free(ssl);
+        ssl = NULL;
     }
 
+    err_code = ERR_get_error();
+    const char* error_str = ERR_error_string(err_code, NULL);
+    LogPrintf("TLS: %s: %s():%d - TLS connection to %s failed, err: %s\n",
+        __FILE__, __func__, __LINE__, addrConnect.ToString(), error_str);
 
-    if (bConnectedTLS) {
-        LogPrintf("TLS: connection to %s has been established (tlsv = %s 0x%04x / ssl = %s 0x%x ). Using cipher: %s\n",
-            addrConnect.ToString(), SSL_get_version(ssl), SSL_version(ssl), OpenSSL_version(OPENSSL_VERSION), OpenSSL_version_num(), SSL_get_cipher(ssl));
-    } else {
-        LogPrintf("TLS: %s: %s():%d - TLS connection to %s failed (err_code 0x%X)\n",
-            __FILE__, __func__, __LINE__, addrConnect.ToString(), err_code);
-
-        if (ssl) {
-            SSL_free(ssl);
-            ssl = NULL;
-        }
-    }
     return ssl;
 }
 /**
@@ -434,6 +596,25 @@ SSL_CTX* TLSManager::initCtx(
 
             LogPrintf("TLS: %s: %s():%d - setting dh callback\n", __FILE__, __func__, __LINE__);
             SSL_CTX_set_tmp_dh_callback(tlsCtx, tmp_dh_callback);
+
+            // sessions are resumed from the tickets held by the clients only, with keys of our own
+            // which are replaced over time, nothing is kept on our side
+            static const unsigned char sid_ctx[] = "zend";
+            SSL_CTX_set_session_id_context(tlsCtx, sid_ctx, sizeof(sid_ctx) - 1);
+            SSL_CTX_set_session_cache_mode(tlsCtx, SSL_SESS_CACHE_OFF);
+#if OPENSSL_VERSION_NUMBER >= 0x30000000L
+            SSL_CTX_set_tlsext_ticket_key_evp_cb(tlsCtx, tlsTicketKeyCallback);
+#else
+            SSL_CTX_set_tlsext_ticket_key_cb(tlsCtx, tlsTicketKeyCallback);
+#endif
+            SSL_CTX_set_timeout(tlsCtx, 2 * TLS_TICKET_KEY_LIFETIME);
+            SSL_CTX_set_num_tickets(tlsCtx, 1);
+        }
+        else
+        {
+            // the sessions are kept by peer address, see connect()
+            SSL_CTX_set_session_cache_mode(tlsCtx, SSL_SESS_CACHE_CLIENT | SSL_SESS_CACHE_NO_INTERNAL_STORE);
+            SSL_CTX_sess_set_new_cb(tlsCtx, tlsNewSessionCallback);
         }
 
         // Fix for Secure Client-Initiated Renegotiation DoS threat
@@ -520,7 +701,8 @@ bool TLSManager::prepareCredentials()
     return bPrepared;
 }
 /**
- * @brief accept a TLS connection
+ * @brief accept a TLS connection. The handshake is not waited for, the
+ * socket thread goes on with it (see handshake()).
  * 
  * @param hSocket the TLS socket.
  * @param addr incoming address.
@@ -533,45 +715,91 @@ SSL* TLSManager::accept(SOCKET hSocket, const CAddress& addr, unsigned long& err
 
     err_code = 0; 
     SSL* ssl = NULL;
-    bool bAcceptedTLS = false;
 
     if ((ssl = SSL_new(tls_ctx_server))) {
         if (SSL_set_fd(ssl, hSocket)) {
-            int ret = TLSManager::waitFor(SSL_ACCEPT, hSocket, ssl, (DEFAULT_CONNECT_TIMEOUT / 1000), err_code);
-            if (ret == 1)
-            {
-                bAcceptedTLS = true;
-            }
+            SSL_set_accept_state(ssl);
+            return ssl;
         }
-    }
-    else
-    {
-        err_code = ERR_get_error();
-        const char* error_str = ERR_error_string(err_code, NULL);
-        LogPrint("tls", "TLS: %s: %s():%d - SSL_new failed err: %s\n",
-            __FILE__, __func__, __LINE__, error_str);
+        SSL_free(ssl);
+        ssl = NULL;
     }
 
-    if (bAcceptedTLS) {
-        LogPrintf("TLS: connection from %s has been accepted (tlsv = %s 0x%04x / ssl = %s 0x%x ). Using cipher: %s\n",
-            addr.ToString(), SSL_get_version(ssl), SSL_version(ssl), OpenSSL_version(OPENSSL_VERSION), OpenSSL_version_num(), SSL_get_cipher(ssl));
+    err_code = ERR_get_error();
+    const char* error_str = ERR_error_string(err_code, NULL);
+    LogPrintf("TLS: %s: %s():%d - TLS connection from %s failed, err: %s\n",
+        __FILE__, __func__, __LINE__, addr.ToString(), error_str);
 
-        STACK_OF(SSL_CIPHER) *sk = SSL_get_ciphers(ssl); 
-        for (int i = 0; i < sk_SSL_CIPHER_num(sk); i++) {
-            const SSL_CIPHER *c = sk_SSL_CIPHER_value(sk, i);
-            LogPrint("tls", "TLS: supporting cipher: %s\n", SSL_CIPHER_get_name(c));
-        }
-    } else {
-        LogPrintf("TLS: %s: %s():%d - TLS connection from %s failed (err_code 0x%X)\n",
-            __FILE__, __func__, __LINE__, addr.ToString(), err_code);
+    return ssl;
+}
+/**
+ * @brief Goes on with the TLS handshake of a node as far as its socket allows,
+ * without blocking. Called by the socket thread whenever the socket is ready in
+ * the direction the last step asked for (pnode->fTLSHandshakeWantWrite).
+ * 
+ * @param pnode the node, with pnode->fTLSHandshake set.
+ * @param err_code set to the OpenSSL error on failure.
+ * @return int returns 1 once the handshake is done, 0 while it goes on and -1 on failure.
+ */
+int TLSManager::handshake(CNode* pnode, unsigned long& err_code)
+{
+    err_code = 0;
 
-        if (ssl) {
-            SSL_free(ssl);
-            ssl = NULL;
+    LOCK(pnode->cs_hSocket);
+
+    if (pnode->hSocket == INVALID_SOCKET || pnode->ssl == NULL)
+        return -1;
+
+    SSL* ssl = pnode->ssl;
+
+    // clear the current thread's error queue
+    ERR_clear_error();
+
+    int retOp = pnode->fInbound ? SSL_accept(ssl) : SSL_connect(ssl);
+    if (retOp == 1) {
+        pnode->fTLSHandshake = false;
+        // the last records of the handshake may have come along with the first message
+        pnode->fSocketRecvReady = pnode->fSocketSendReady = true;
+
+        if (pnode->fInbound) {
+            LogPrintf("TLS: connection from %s has been accepted (tlsv = %s 0x%04x / ssl = %s 0x%x ). Using cipher: %s\n",
+                pnode->addr.ToString(), SSL_get_version(ssl), SSL_version(ssl), OpenSSL_version(OPENSSL_VERSION), OpenSSL_version_num(), SSL_get_cipher(ssl));
+
+            STACK_OF(SSL_CIPHER) *sk = SSL_get_ciphers(ssl); 
+            for (int i = 0; i < sk_SSL_CIPHER_num(sk); i++) {
+                const SSL_CIPHER *c = sk_SSL_CIPHER_value(sk, i);
+                LogPrint("tls", "TLS: supporting cipher: %s\n", SSL_CIPHER_get_name(c));
+            }
+        } else {
+            LogPrintf("TLS: connection to %s has been established (tlsv = %s 0x%04x / ssl = %s 0x%x ). Using cipher: %s\n",
+                pnode->addr.ToString(), SSL_get_version(ssl), SSL_version(ssl), OpenSSL_version(OPENSSL_VERSION), OpenSSL_version_num(), SSL_get_cipher(ssl));
         }
+        if (SSL_session_reused(ssl))
+            LogPrint("tls", "TLS: session with %s has been resumed\n", pnode->addr.ToString());
+        return 1;
     }
 
-    return ssl;
+    int sslErr = SSL_get_error(ssl, retOp);
+
+    if (retOp == 0 || (sslErr != SSL_ERROR_WANT_READ && sslErr != SSL_ERROR_WANT_WRITE)) {
+        err_code = ERR_get_error();
+        const char* error_str = ERR_error_string(err_code, NULL);
+        LogPrint("tls", "TLS: WARNING: %s: %s():%d - %s, sslErr[0x%x], retOp[%d], errno[0x%x], lib[0x%x], func[0x%x], reas[0x%x]-> err: %s\n",
+            __FILE__, __func__, __LINE__, pnode->fInbound ? "SSL_ACCEPT" : "SSL_CONNECT",
+            sslErr, retOp, errno, ERR_GET_LIB(err_code), ERR_GET_FUNC(err_code), ERR_GET_REASON(err_code), error_str);
+        LogPrintf("TLS: %s: %s():%d - TLS connection %s %s failed (err_code 0x%X)\n",
+            __FILE__, __func__, __LINE__, pnode->fInbound ? "from" : "to", pnode->addr.ToString(), err_code);
+        return -1;
+    }
+
+    // with -socketevents=epoll the socket is reported again once it is ready
+    pnode->fTLSHandshakeWantWrite = (sslErr == SSL_ERROR_WANT_WRITE);
+    if (pnode->fTLSHandshakeWantWrite)
+        pnode->fSocketSendReady = false;
+    else
+        pnode->fSocketRecvReady = false;
+
+    return 0;
 }
 /**
  * @brief Determines whether a string exists in the non-TLS address pool.
@@ -623,13 +851,10 @@ void TLSManager::cleanNonTLSPool(std::vector<NODE_ADDR>& vPool, CCriticalSection
  * @param fdsetRecv 
  * @param fdsetSend 
  * @param fdsetError 
- * @return int returns -1 when socket is invalid. returns 0 otherwise.
+ * @return int returns -1 when socket is invalid, 1 when data was received or sent, 0 otherwise.
  */
 int TLSManager::threadSocketHandler(CNode* pnode, fd_set& fdsetRecv, fd_set& fdsetSend, fd_set& fdsetError)
 {
-    //
-    // Receive
-    //
     bool recvSet = false, sendSet = false, errorSet = false;
 
     {
@@ -638,11 +863,36 @@ int TLSManager::threadSocketHandler(CNode* pnode, fd_set& fdsetRecv, fd_set& fds
         if (pnode->hSocket == INVALID_SOCKET)
             return -1;
 
-        recvSet = FD_ISSET(pnode->hSocket, &fdsetRecv);
+        // decrypted data kept by OpenSSL does not make the socket readable
+        recvSet = FD_ISSET(pnode->hSocket, &fdsetRecv) || (pnode->ssl && SSL_pending(pnode->ssl) > 0);
         sendSet = FD_ISSET(pnode->hSocket, &fdsetSend);
         errorSet = FD_ISSET(pnode->hSocket, &fdsetError);
     }
 
+    return threadSocketHandler(pnode, recvSet, sendSet, errorSet);
+}
+
+/**
+ * @brief Receive from and send to the socket of a node, as far as it is ready.
+ * With -socketevents=epoll, pnode->fSocketRecvReady and pnode->fSocketSendReady
+ * are cleared when the socket would block.
+ * 
+ * @return int -1 if the socket is closed, 1 if data was received or sent, 0 otherwise
+ * (nothing to do, or the buffers of the node are in use by another thread).
+ */
+int TLSManager::threadSocketHandler(CNode* pnode, bool recvSet, bool sendSet, bool errorSet)
+{
+    bool fProgress = false;
+    {
+        LOCK(pnode->cs_hSocket);
+
+        if (pnode->hSocket == INVALID_SOCKET)
+            return -1;
+    }
+
+    //
+    // Receive
+    //
     if (recvSet || errorSet) {
         TRY_LOCK(pnode->cs_vRecvMsg, lockRecv);
         if (lockRecv) {
@@ -673,7 +923,12 @@ int TLSManager::threadSocketHandler(CNode* pnode, fd_set& fdsetRecv, fd_set& fds
                     }
                 }
 
+                fProgress = nBytes >= 0;
                 if (nBytes > 0) {
+                    // a short read drains a stream socket; TLS reads one record at a time, so
+                    // the socket is only known to be drained once SSL_read() wants more
+                    if (!bIsSSL && nBytes < (int)sizeof(pchBuf))
+                        pnode->fSocketRecvReady = false;
                     if (!pnode->ReceiveMsgBytes(pchBuf, nBytes))
                         pnode->CloseSocketDisconnect();
                     pnode->nLastRecv = GetTime();
@@ -710,15 +965,20 @@ int TLSManager::threadSocketHandler(CNode* pnode, fd_set& fdsetRecv, fd_set& fds
                                 __FILE__, __func__, __LINE__, nRet, error_str);
 
                         } else {
-                            // preventive measure from exhausting CPU usage
+                            // the socket gets ready again with EPOLLOUT too, for SSL_ERROR_WANT_WRITE
+                            pnode->fSocketRecvReady = false;
+                            // preventive measure from exhausting CPU usage, epoll waits for the socket instead
                             //
-                            MilliSleep(1); // 1 msec
+                            if (socketEventsMode == SocketEventsMode::SELECT)
+                                MilliSleep(1); // 1 msec
                         }
                     } else {
                         if (nRet != WSAEWOULDBLOCK && nRet != WSAEMSGSIZE && nRet != WSAEINTR && nRet != WSAEINPROGRESS) {
                             if (!pnode->fDisconnect)
                                 LogPrintf("TSL: ERROR: socket recv %s\n", NetworkErrorString(nRet));
                             pnode->CloseSocketDisconnect();
+                        } else if (nRet == WSAEWOULDBLOCK) {
+                            pnode->fSocketRecvReady = false;
                         }
                     }
                 }
@@ -731,10 +991,14 @@ int TLSManager::threadSocketHandler(CNode* pnode, fd_set& fdsetRecv, fd_set& fds
     //
     if (sendSet) {
         TRY_LOCK(pnode->cs_vSend, lockSend);
-        if (lockSend)
-            SocketSendData(pnode);
+        if (lockSend) {
+            uint64_t nSendBytes = pnode->nSendBytes;
+            if (!SocketSendData(pnode))
+                pnode->fSocketSendReady = false;
+            fProgress = fProgress || pnode->nSendBytes != nSendBytes;
+        }
     }
-    return 0;
+    return fProgress ? 1 : 0;
 }
 /**
  * @brief Initialization of the server and client contexts
@@ -773,6 +1037,13 @@ bool TLSManager::initialize()
     for (fs::path dir : trustedDirs)
         LogPrintf("TLS: trusted directory '%s' will be used\n", dir.string().c_str());
 
+    nSessionAddrIndex = SSL_get_ex_new_index(0, NULL, NULL, NULL, freeSessionAddr);
+    {
+        LOCK(cs_ticketKeys);
+        if (!newTicketKey(ticketKeyCurrent))
+            LogPrintf("TLS: WARNING: %s: %s: failed to make a session ticket key\n", __FILE__, __func__);
+    }
+
     // Initialization of the server and client contexts
     //
     if ((tls_ctx_server = TLSManager::initCtx(SERVER_CONTEXT, privKeyFile, certFile, trustedDirs)))
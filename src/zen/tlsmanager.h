@@ -54,9 +54,11 @@ public:
 
      bool prepareCredentials();
      SSL* accept(SOCKET hSocket, const CAddress& addr, unsigned long& err_code);
+     int handshake(CNode* pnode, unsigned long& err_code);
      bool isNonTLSAddr(const string& strAddr, const vector<NODE_ADDR>& vPool, CCriticalSection& cs);
      void cleanNonTLSPool(std::vector<NODE_ADDR>& vPool, CCriticalSection& cs);
      int threadSocketHandler(CNode* pnode, fd_set& fdsetRecv, fd_set& fdsetSend, fd_set& fdsetError);
+     int threadSocketHandler(CNode* pnode, bool recvSet, bool sendSet, bool errorSet);
      bool initialize();
 };
 }
@@ -688,12 +688,10 @@ private:
         LogPrint("ws", "%s():%d - write thread exit (this=%p)\n", __func__, __LINE__, this);
     }
 
-    int parseClientMessage(WsEvent::WsRequestType& reqType, std::string& clientRequestId, std::string& outMsg) 
+    int readClientMessage(std::string& msg)
     {
         try
         {
-            std::string msgType;
-            std::string requestType;
             boost::beast::multi_buffer buffer;
             boost::beast::error_code ec;
 
@@ -714,7 +712,23 @@ private:
             }
             LogPrint("ws", "%s():%d - client message received of size=%d\n", __func__, __LINE__, buffer.size());
 
-            std::string msg = boost::beast::buffers_to_string(buffer.data());
+            msg = boost::beast::buffers_to_string(buffer.data());
+            return OK;
+        }
+        catch (std::exception const& e)
+        {
+            LogPrint("ws", "%s():%d - %s\n", __func__, __LINE__, e.what());
+            return READ_ERROR;
+        }
+    }
+
+    int parseClientMessage(const std::string& msg, WsEvent::WsRequestType& reqType, std::string& clientRequestId, std::string& outMsg)
+    {
+        try
+        {
+            std::string msgType;
+            std::string requestType;
+
             UniValue request;
             if (!request.read(msg)) {
                 LogPrint("ws", "%s():%d - error parsing message from websocket: [%s]\n", __func__, __LINE__, msg);
@@ -1097,52 +1111,12 @@ private:
     {
         while (!exit_rwhandler_thread_flag)
         {
-            WsEvent::WsRequestType reqType = WsEvent::REQ_UNDEFINED;
-            std::string clientRequestId = "";
-            std::string outMsg;
-            int res = parseClientMessage(reqType, clientRequestId, outMsg);
-            if (res == READ_ERROR)
+            std::string msg;
+            if (readClientMessage(msg) != OK || !processClientMessage(msg))
             {
                 LogPrint("ws", "%s():%d - websocket closed exit reading loop\n", __func__, __LINE__);
                 break;
             }
-
-            if (res != OK)
-            {
-                std::string msgError = "On requestType[" + std::to_string(reqType) + "]: ";
-                switch (res)
-                {
-                case INVALID_PARAMETER:
-                    msgError += "Invalid parameter";
-                    break;
-                case MISSING_PARAMETER:
-                    msgError += "Missing parameter";
-                    break;
-                case MISSING_REQID:
-                    msgError += "Missing requestId";
-                    break;
-                case INVALID_COMMAND:
-                    msgError += "Invalid command";
-                    break;
-                case INVALID_JSON_FORMAT:
-                    msgError += "Invalid JSON format";
-                    break;
-                default:
-                    msgError += "Generic error";
-                }
-                if (!outMsg.empty())
-                    msgError += " - Details: " + outMsg;
-
-                // Send a message error to the client:  type = -1
-                WsEvent* wse = new WsEvent(WsEvent::MSG_ERROR);
-                LogPrint("ws", "%s():%d - allocated %p\n", __func__, __LINE__, wse);
-                UniValue* rv = wse->getPayload();
-                if (!clientRequestId.empty())
-                    rv->pushKV("requestId", clientRequestId);
-                rv->pushKV("errorCode", res);
-                rv->pushKV("message", msgError);
-                write(wse);
-            }
         }
         LogPrint("ws", "%s():%d - exit reading loop\n", __func__, __LINE__);
     }
@@ -1169,6 +1143,76 @@ public:
     WsHandler & operator=(const WsHandler& wsh) = delete;
     WsHandler(const WsHandler& wsh) = delete;
 
+    /**
+     * Handle a message received from the client: dispatch the request and queue the response
+     * (or an error message) for the writer.
+     * Returns false if the session has to be closed.
+     */
+    bool processClientMessage(const std::string& msg)
+    {
+        WsEvent::WsRequestType reqType = WsEvent::REQ_UNDEFINED;
+        std::string clientRequestId = "";
+        std::string outMsg;
+        int res = parseClientMessage(msg, reqType, clientRequestId, outMsg);
+        if (res == READ_ERROR)
+        {
+            return false;
+        }
+
+        if (res != OK)
+        {
+            std::string msgError = "On requestType[" + std::to_string(reqType) + "]: ";
+            switch (res)
+            {
+            case INVALID_PARAMETER:
+                msgError += "Invalid parameter";
+                break;
+            case MISSING_PARAMETER:
+                msgError += "Missing parameter";
+                break;
+            case MISSING_REQID:
+                msgError += "Missing requestId";
+                break;
+            case INVALID_COMMAND:
+                msgError += "Invalid command";
+                break;
+            case INVALID_JSON_FORMAT:
+                msgError += "Invalid JSON format";
+                break;
+            default:
+                msgError += "Generic error";
+            }
+            if (!outMsg.empty())
+                msgError += " - Details: " + outMsg;
+
+            // Send a message error to the client:  type = -1
+            WsEvent* wse = new WsEvent(WsEvent::MSG_ERROR);
+            LogPrint("ws", "%s():%d - allocated %p\n", __func__, __LINE__, wse);
+            UniValue* rv = wse->getPayload();
+            if (!clientRequestId.empty())
+                rv->pushKV("requestId", clientRequestId);
+            rv->pushKV("errorCode", res);
+            rv->pushKV("message", msgError);
+            write(wse);
+        }
+        return true;
+    }
+
+    /**
+     * Take the messages queued for the client out of the write queue, without a socket.
+     * If vMsg is null the messages are just discarded.
+     */
+    void popMessages(std::vector<std::string>* vMsg)
+    {
+        WsEvent* wse;
+        while (wsq.pop(wse) && wse != NULL)
+        {
+            if (vMsg != nullptr)
+                vMsg->push_back(wse->getPayload()->write());
+            delete wse;
+        }
+    }
+
     static void getPeerIdentity(const tcp::socket& socket, std::string& id)
     { 
         auto peer = socket.remote_endpoint();
@@ -1406,6 +1450,16 @@ static void shutdown()
     }
 }
 
+bool WsProcessClientMessage(const std::string& msg, std::vector<std::string>& vReplies)
+{
+    // a handler with no socket: nothing reads its queue but us
+    static WsHandler handler;
+
+    bool fKeepOpen = handler.processClientMessage(msg);
+    handler.popMessages(&vReplies);
+    return fKeepOpen;
+}
+
 bool StartWsServer()
 {
     try
@@ -15,5 +15,15 @@
 
 
 
+#include <string>
+#include <vector>
+
 bool StartWsServer();
 bool StopWsServer();
+
+/**
+ * Handle a message as if it had been received by a websocket session, without any socket or thread.
+ * The messages the session would have written back to the client are appended to vReplies.
+ * Returns false if the session would have been closed.
+ */
+bool WsProcessClientMessage(const std::string& msg, std::vector<std::string>& vReplies);